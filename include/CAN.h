@@ -23,9 +23,10 @@ namespace CAN {
   void init();
   void handleInbox();
   void wipeMessage();
-  boolean write(CAN_message_t msg);
+  boolean write(CAN_message_t msg, uint8_t link = 0);
   void _printCAN(CAN_message_t txmsg);
-  void write(uint8_t deviceID, uint8_t commandID, uint8_t payloadLength, uint8_t buffer[]);
+  boolean write(uint8_t deviceID, uint8_t commandID, uint8_t payloadLength, uint8_t buffer[],
+                uint8_t link = 0);
 
 }
 
@@ -0,0 +1,54 @@
+//******************************************************************************
+// FXCRC.H -- CRC32 of firmware images, with the fastest backend for each Teensy
+//******************************************************************************
+// fxcrc32_update() computes the standard (zlib, Ethernet) CRC32: reflected
+// polynomial 0xEDB88320, initial value and final XOR 0xFFFFFFFF. It is
+// stateless, so CRCs of different data can be computed in any interleaving,
+// and is continued by passing the previous result (0 to start):
+//
+//   crc = fxcrc32_update( 0, a, n );  crc = fxcrc32_update( crc, b, m );
+//
+// gives the CRC32 of a followed by b. The backend is chosen by target:
+//
+//   T3.x  (KINETISK)    the Kinetis CRC peripheral, 4 bytes per write
+//   TLC   (KINETISL)    bitwise, no table (the LC has 8KB of RAM)
+//   T4.x  and others    slicing-by-8, 8 bytes per step with an 8KB RAM table
+//
+// Define FXCRC_BACKEND to one of FXCRC_BACKEND_xxx to override the choice.
+// All software backends are available by name (see tools/crcbench.c), and
+// are removed by the linker when unused.
+//
+// fxcrc32_combine() gives the CRC32 of a followed by b from the CRC32 of each
+// and the length of b, without the data. CRCs of sectors or blocks received
+// out of order can be combined into the CRC32 of the whole image.
+//******************************************************************************
+#ifndef FXCRC_H_
+#define FXCRC_H_
+
+#include <stdint.h>
+
+#define FXCRC_BACKEND_BITWISE	(0)	// 1 bit per step, no table
+#define FXCRC_BACKEND_SLICE8	(1)	// 8 bytes per step, 8KB table
+#define FXCRC_BACKEND_KINETIS	(2)	// Kinetis CRC peripheral (T3.x)
+
+#if !defined(FXCRC_BACKEND)
+  #if defined(KINETISK)
+    #define FXCRC_BACKEND	FXCRC_BACKEND_KINETIS
+  #elif defined(KINETISL)
+    #define FXCRC_BACKEND	FXCRC_BACKEND_BITWISE
+  #else
+    #define FXCRC_BACKEND	FXCRC_BACKEND_SLICE8
+  #endif
+#endif
+
+uint32_t fxcrc32_update( uint32_t crc, const void *data, uint32_t count );
+uint32_t fxcrc32_combine( uint32_t crc1, uint32_t crc2, uint32_t len2 );
+
+// individual backends
+uint32_t fxcrc32_bitwise( uint32_t crc, const void *data, uint32_t count );
+uint32_t fxcrc32_slice8( uint32_t crc, const void *data, uint32_t count );
+#if defined(KINETISK)
+uint32_t fxcrc32_kinetis( uint32_t crc, const void *data, uint32_t count );
+#endif
+
+#endif // FXCRC_H_
@@ -0,0 +1,83 @@
+//******************************************************************************
+// FXDELTA.H -- binary delta (patch) images against the running firmware
+//******************************************************************************
+// An FXDP patch is made on the host (tools/fxdelta.py) from the image the
+// device is running, identified by its build ID (see firmware_build_id), and
+// the new image. It is sent in place of the new image, at the same addresses
+// (FLASH_BASE_ADDR up), and applied as it arrives: delta_feed() reads old bytes
+// from FLASH_BASE_ADDR and writes the new image into the buffer, so only a few
+// bytes of state are needed no matter how large the image is. After
+// delta_finish() the buffer holds the plain new image, ready for flash_move().
+//
+// Header (little-endian):
+//   0  "FXDP"         magic
+//   4  old_size        size of the image the patch applies to
+//   8  old_crc32       CRC32 of that image (its build ID)
+//  12  new_size        size of the image the patch produces
+//  16  new_crc32       CRC32 of that image
+//  20  patch_size      size of the whole patch, including this header
+//
+// Commands (after the header), lengths and offsets are LEB128 varints:
+//   0x01 delta len     COPY:   cursor += zigzag(delta), copy len old bytes
+//                              from cursor, cursor += len
+//   0x02 len bytes...  INSERT: copy len bytes from the patch
+//   0x03 len byte      RUN:    len copies of byte
+//******************************************************************************
+#ifndef FXDELTA_H_
+#define FXDELTA_H_
+
+#include <stdint.h>
+#include "FlashTxx.h"
+
+#define FXDP_MAGIC		(0x50445846)	// "FXDP" as little-endian uint32
+#define FXDP_HEADER_SIZE	(24)		// bytes before first command
+
+#define FXDP_COPY		(0x01)
+#define FXDP_INSERT		(0x02)
+#define FXDP_RUN		(0x03)
+
+// delta_feed()/delta_finish() return values
+#define DELTA_OK		(0)
+#define DELTA_ERR_HEADER	(1)	// bad header
+#define DELTA_ERR_OLD		(2)	// running image is not the patch's old image
+#define DELTA_ERR_STREAM	(3)	// bad command or out-of-order data
+#define DELTA_ERR_SIZE		(4)	// new image too large for buffer or header
+#define DELTA_ERR_WRITE		(5)	// error in flash_write_block()
+#define DELTA_ERR_CRC		(6)	// new image CRC32 does not match header
+
+typedef struct {
+  uint32_t old_size;	// size of image the patch applies to
+  uint32_t old_crc32;	// CRC32 (build ID) of that image
+  uint32_t new_size;	// size of image the patch produces
+  uint32_t new_crc32;	// CRC32 of that image
+  uint32_t patch_size;	// size of patch including header
+} delta_info_t;
+
+typedef struct {
+  delta_info_t info;	// patch header
+  uint32_t buffer_addr;	// where the new image is written
+  uint32_t buffer_size;	//   and how much room there is
+  uint32_t erase_addr;	//   and where it is erased to (0 = all erased)
+  uint32_t in;		// patch bytes consumed
+  uint32_t out;		// new image bytes produced
+  uint32_t cursor;	// offset of next old byte to copy
+  uint32_t state;	// decoder state (DELTA_STATE_xxx in FXDelta.c)
+  uint32_t op;		// current command
+  uint32_t arg;		// varint being decoded
+  uint32_t shift;	//   and its bit position
+  uint32_t len;		// bytes left in current command
+  int      error;	// first error, sticky
+  uint32_t written;	// new image bytes written to buffer
+  uint32_t staged;	// bytes in stage[]
+  char stage[32] __attribute__ ((aligned (8)));	// output not yet written
+  uint8_t header[FXDP_HEADER_SIZE];		// header as received
+} delta_t;
+
+int      delta_is_patch( const char *data, uint32_t count );
+void     delta_begin( delta_t *d, uint32_t buffer_addr, uint32_t buffer_size );
+int      delta_feed( delta_t *d, const char *data, uint32_t count );
+int      delta_finish( delta_t *d );
+
+uint32_t firmware_build_id( uint32_t *size );
+
+#endif // FXDELTA_H_
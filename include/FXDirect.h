@@ -0,0 +1,61 @@
+//******************************************************************************
+// FXDIRECT.H -- direct update: stream the new image straight to FLASH_BASE_ADDR
+//******************************************************************************
+// With DIRECT_MODE, the application can hand Serial1 to direct_update(), an
+// updater that runs from RAM (RAMFUNC, like flash_move) with interrupts
+// disabled, and never returns. It receives the image in frames (FXFrame.h,
+// the same protocol tools/fxserial.py speaks) and writes each sector of it to
+// FLASH_BASE_ADDR as soon as the sector is complete, erasing the old code as
+// it goes. There is no buffer: each byte is programmed once instead of twice,
+// and the image can use all of flash below FLASH_RESERVE (DIRECT_MAX_SIZE).
+//
+// The updater polls the UART itself, since the core's serial drivers and
+// interrupt handlers run from flash it overwrites. It keeps one sector in
+// RAM, and grants the host credits for no more frames than fit in it, so no
+// frame is in flight while a sector is erased and written.
+//
+//   FRAME_START    size and CRC32; rejected if larger than DIRECT_MAX_SIZE
+//   FRAME_DATA     written a sector at a time (sectors that match are skipped)
+//   FRAME_END      CRC32 of flash and FLASH_ID checked, FRAME_RESULT sent
+//   FRAME_COMMIT   or FRAME_ABORT, after a good image: erase the rest of the
+//                  old code, and reboot
+//
+// Until the first sector is written, an error ends the updater with a reboot
+// into the old code. After that, the old code is gone, so the updater stays
+// and waits for FRAME_START to receive the image again: a failed check, or a
+// lost link, is repaired by sending it again (fxserial.py --direct). Power
+// must not fail during a direct update; if it does, the image must be loaded
+// again with TeensyDuino.
+//
+// The UART is Serial1 (LPUART6 on T4.x, UART0 on T3.x/TLC), already set up
+// by Serial1.begin(). Only plain images can be sent, not FXLZ or FXDP, as
+// those need the old code or a buffer.
+//******************************************************************************
+#ifndef FXDIRECT_H_
+#define FXDIRECT_H_
+
+#include <stdint.h>
+extern "C" {
+  #include "FlashTxx.h"		// RAMFUNC, FLASH_xxx
+  #include "FXSwap.h"		// SWAP_MODE, SWAP_SIZE
+  #include "FXSlot.h"		// SLOT_MODE
+}
+
+#if !defined(DIRECT_MODE)
+  #define DIRECT_MODE		(0)
+#endif
+
+#if (DIRECT_MODE) && (SLOT_MODE)
+  #error "DIRECT_MODE would overwrite the SLOT_MODE selector"
+#endif
+
+// largest image; with SWAP_MODE, the buffer holding the previous image stays
+#if (SWAP_MODE)
+  #define DIRECT_MAX_SIZE	(SWAP_SIZE)
+#else
+  #define DIRECT_MAX_SIZE	(FLASH_SIZE - FLASH_RESERVE)
+#endif
+
+RAMFUNC void direct_update( uint32_t code_end );
+
+#endif // FXDIRECT_H_
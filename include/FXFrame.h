@@ -0,0 +1,145 @@
+//******************************************************************************
+// FXFRAME.H -- windowed binary update protocol for USB or UART Serial
+//******************************************************************************
+// The host sends the new code as a raw binary image (plain, FXLZ or FXDP, as
+// it would be placed at FLASH_BASE_ADDR, or at its slot with SLOT_MODE) in
+// frames. Every frame is:
+//
+//   offset  size  field
+//        0     1  FRAME_SOF (0xA5)
+//        1     1  type (FRAME_START, FRAME_ACK, etc.)
+//        2     2  seq (little endian)
+//        4     2  len, size of payload (0 to FRAME_MAX_PAYLOAD)
+//        6   len  payload
+//    6+len     4  CRC32 (FXCRC) of bytes 1 to 6+len-1 (little endian)
+//
+// Host frames are numbered from 0 (FRAME_START) and are processed in order:
+//
+//   FRAME_START    payload = image size (4), image CRC32 (4), and for a data
+//                  partition (FXPart.h), its name (1 to PART_NAME_MAX)
+//   FRAME_DATA     payload = next bytes of the image
+//   FRAME_END      no payload -- device checks the image, answers FRAME_RESULT
+//   FRAME_COMMIT   no payload -- move new code to flash and reboot
+//   FRAME_ABORT    no payload -- free the buffer and reboot
+//
+// The device holds up to FRAME_WINDOW received frames and writes one of them
+// to the buffer per frame_poll(). Each FRAME_ACK and FRAME_NAK carries seq =
+// the next frame it expects (all before it were received) and a payload of
+// credits (2), the number of frames from seq it has room for. Credits are
+// returned only as frames are written, so the host can never send faster than
+// the buffer drains. A frame with a bad CRC, out of order or without room is
+// dropped and answered with one FRAME_NAK; the host then sends again from seq
+// (go-back-N), as it does when no FRAME_ACK arrives for a while.
+//
+// FRAME_RESULT answers FRAME_END with seq of FRAME_END and a payload of status
+// (1), INGEST_EOF if the image can be committed, else the error. Text the
+// device prints (ingest_check) is sent between frames; the host skips it while
+// looking for FRAME_SOF. See tools/fxserial.py for the host side.
+//
+// If the session has the image of FRAME_START in its cache (session_offer),
+// the device answers FRAME_START with FRAME_CACHED and loads the image itself.
+// The host then sends nothing until FRAME_RESULT, which follows once the image
+// is checked, and numbers its next frame 1. FRAME_DATA is ignored from then
+// on, and FRAME_END is answered with FRAME_RESULT again.
+//
+// A data partition is sent the same way, its data from the partition's start,
+// and FRAME_COMMIT calls its updated() instead of rebooting (session_commit).
+// FRAME_START with a name no partition has is answered by FRAME_RESULT with
+// FRAME_ERR_PART after FRAME_END. A partition is never loaded from the cache.
+//
+// The link is a transport of the update session (FXSession.h): frames write
+// the image with session_deliver_block(), and the session ends the link if
+// no data arrives for FRAME_TIMEOUT_MS before FRAME_END.
+//******************************************************************************
+#ifndef FXFRAME_H_
+#define FXFRAME_H_
+
+#include <Arduino.h>
+#include "FXSession.h"		// transport_t, session_xxx()
+
+#define FRAME_SOF		(0xA5)	// start of frame (not ASCII)
+#define FRAME_HEADER_SIZE	(6)	// SOF, type, seq, len
+#define FRAME_CRC_SIZE		(4)
+#define FRAME_MAX_PAYLOAD	(512)
+
+// frames held between receive and write to buffer (RAM for window*payload)
+#if !defined(FRAME_WINDOW)
+  #if defined(__IMXRT1062__)
+    #define FRAME_WINDOW	(32)
+  #elif defined(KINETISL)
+    #define FRAME_WINDOW	(2)
+  #else
+    #define FRAME_WINDOW	(8)
+  #endif
+#endif
+
+// bytes read from the stream per frame_poll()
+#define FRAME_BYTES_PER_POLL	(2048)
+
+// session ends if no data arrives for this long before FRAME_END
+#define FRAME_TIMEOUT_MS	(15000)
+
+// host frames
+#define FRAME_START		(0x01)
+#define FRAME_DATA		(0x02)
+#define FRAME_END		(0x03)
+#define FRAME_COMMIT		(0x04)
+#define FRAME_ABORT		(0x05)
+// device frames
+#define FRAME_ACK		(0x81)
+#define FRAME_NAK		(0x82)
+#define FRAME_RESULT		(0x83)
+#define FRAME_CACHED		(0x84)	// image of FRAME_START is loaded from cache
+
+// FRAME_RESULT status beyond INGEST_xxx
+#define FRAME_ERR_IMAGE_SIZE	(16)	// image size differs from FRAME_START
+#define FRAME_ERR_IMAGE_CRC	(17)	// image CRC32 differs from FRAME_START
+#define FRAME_ERR_SEQUENCE	(18)	// FRAME_DATA before FRAME_START, etc.
+#define FRAME_ERR_PART		(19)	// FRAME_START names no (usable) partition
+
+// frame_poll() return values
+#define FRAME_MORE		(0)	// session continues
+#define FRAME_COMMITTED		(1)	// host sent FRAME_COMMIT after good image
+#define FRAME_ABORTED		(2)	// host sent FRAME_ABORT
+
+//******************************************************************************
+// frame_slot_t	one received frame, waiting to be written
+//******************************************************************************
+typedef struct {
+  uint8_t type;
+  uint16_t seq;
+  uint16_t len;
+  char data[FRAME_MAX_PAYLOAD] __attribute__ ((aligned (8)));
+} frame_slot_t;
+
+//******************************************************************************
+// frame_link_t	state of a framed update session
+//******************************************************************************
+typedef struct {
+  transport_t transport;		// first, see frame_respond()
+  Stream *stream;			// USB or UART Serial
+  frame_slot_t slot[FRAME_WINDOW];	// received frames (ring)
+  int head;				//   next to write
+  int count;				//   number held
+  uint8_t header[FRAME_HEADER_SIZE];	// frame being received
+  uint8_t crc[FRAME_CRC_SIZE];
+  uint32_t rx;				//   bytes of it so far
+  frame_slot_t *rx_slot;		//   its slot (NULL if no room)
+  int rx_state;
+  uint16_t expected;			// seq of next frame to accept
+  int nak_sent;				// NAK sent for expected
+  int started;				// FRAME_START processed
+  int cached;				//   and image loaded from cache
+  uint32_t image_size;			// from FRAME_START
+  uint32_t image_crc;
+  uint32_t offset;			// image bytes written so far
+  uint32_t crc_so_far;			//   and their CRC32
+  int result;				// FRAME_RESULT status (-1 until END)
+  uint16_t end_seq;			// seq of FRAME_END
+  int timed_out;			// session timed out
+} frame_link_t;
+
+int  frame_begin( frame_link_t *link, Stream *stream );
+int  frame_poll( frame_link_t *link );
+
+#endif // FXFRAME_H_
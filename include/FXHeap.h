@@ -0,0 +1,24 @@
+//******************************************************************************
+// FXHEAP.H -- count heap calls, to check that an update does not use the heap
+//******************************************************************************
+// With HEAP_ACCOUNTING = 1 and the linker options
+//   -Wl,--wrap=malloc,--wrap=free,--wrap=realloc,--wrap=calloc
+//   -Wl,--wrap=_malloc_r,--wrap=_free_r,--wrap=_realloc_r,--wrap=_calloc_r
+// (see env:teensy35_heapcheck in platformio.ini), calls to these functions
+// are counted, including those made by new and delete, and the reentrant
+// ones newlib itself makes (printf, strdup, etc.). A malloc() that goes on
+// to _malloc_r() counts once. Other allocators (memalign, extmem_malloc)
+// are not counted. Otherwise heap_call_count() always returns 0.
+//******************************************************************************
+#ifndef FXHEAP_H_
+#define FXHEAP_H_
+
+#include <stdint.h>
+
+#if !defined(HEAP_ACCOUNTING)
+  #define HEAP_ACCOUNTING	(0)
+#endif
+
+uint32_t heap_call_count( void );
+
+#endif // FXHEAP_H_
@@ -0,0 +1,66 @@
+//******************************************************************************
+// FXLZ.H -- compressed firmware images, decompressed by flash_move_lz()
+//******************************************************************************
+// An FXLZ image is the new firmware compressed on the host (tools/fxlz.py) and
+// sent in place of the plain image, at the same addresses (FLASH_BASE_ADDR up).
+// It stays compressed in the buffer, and flash_move_lz() decompresses it while
+// programming the destination, so a single-step update only needs buffer space
+// for the compressed size.
+//
+// The compressed stream is placed at the TOP of the buffer (see lz_buffer_offset)
+// so the destination writes, which start at FLASH_BASE_ADDR, stay below the
+// unread part of the stream. lz_image_check() proves this before the move.
+//
+// Header (little-endian):
+//   0  "FXLZ"         magic
+//   4  window_bits     log2 of the back-reference window (<= FXLZ_MAX_WINDOW_BITS)
+//   5  reserved[3]
+//   8  raw_size        size of the decompressed image
+//  12  packed_size     size of the whole stream, including this header
+//  16  raw_crc32       CRC32 of the decompressed image
+//
+// Stream tokens (after the header):
+//   0LLLLLLL                     literal run, L+1 bytes follow (1-128)
+//   1NNNDDDD DDDDDDDD [EEEEEEEE] match, distance D+1 (1-4096), length N+3,
+//                                and if N == 7, length 10+E (10-265)
+//******************************************************************************
+#ifndef FXLZ_H_
+#define FXLZ_H_
+
+#include <stdint.h>
+#include "FlashTxx.h"
+
+#define FXLZ_MAGIC		(0x5A4C5846)	// "FXLZ" as little-endian uint32
+#define FXLZ_HEADER_SIZE	(20)		// bytes before first token
+
+#if defined(__MKL26Z64__)
+  #define FXLZ_MAX_WINDOW_BITS	(10)		// 1KB window (TLC has 8KB RAM)
+#else
+  #define FXLZ_MAX_WINDOW_BITS	(12)		// 4KB window
+#endif
+
+// lz_image_check() return values
+#define LZ_OK			(0)
+#define LZ_ERR_HEADER		(1)	// not an FXLZ image or bad header
+#define LZ_ERR_STREAM		(2)	// truncated or corrupt token stream
+#define LZ_ERR_CRC		(3)	// decompressed CRC32 does not match header
+#define LZ_ERR_SIZE		(4)	// image too large for program flash
+#define LZ_ERR_FSEC		(5)	// FSEC value in new code incorrect (T3.x)
+#define LZ_ERR_FLASH_ID		(6)	// new code missing string FLASH_ID
+#define LZ_ERR_OVERLAP		(7)	// destination would overrun unread stream
+
+typedef struct {
+  uint32_t window_bits;	// log2 of back-reference window
+  uint32_t raw_size;	// decompressed image size
+  uint32_t packed_size;	// stream size including header
+  uint32_t raw_crc32;	// CRC32 of decompressed image
+} lz_info_t;
+
+int      lz_read_header( uint32_t src, lz_info_t *info );
+uint32_t lz_buffer_offset( const char *data, uint32_t count, uint32_t buffer_size );
+int      lz_image_check( uint32_t dst, uint32_t src, lz_info_t *info );
+
+// decompress from buffer to program flash, erase buffer and reboot (in RAM)
+RAMFUNC void flash_move_lz( uint32_t dst, uint32_t src );
+
+#endif // FXLZ_H_
@@ -0,0 +1,60 @@
+//******************************************************************************
+// FXPART.H -- data partitions: named flash regions updated in place
+//******************************************************************************
+// Besides the application, an update can target a data partition, such as a
+// constant table or calibration blob in flash. The application adds its
+// partitions with part_add() at startup. A transport selects one before the
+// data (session_target, FXSession.h): FXFrame by name in FRAME_START, CAN
+// with ControlCode::SELECT_PARTITION by number (1 = first added).
+//
+// A partition is written in place, erased a sector at a time ahead of the
+// data, like a slot (ingest_part, FXUtil.h): no buffer, no flash_move() and
+// no reboot. Its data is addressed at the partition's flash addresses, and
+// what remains of it after the data is erased when the transfer ends. There
+// is no FSEC/FLASH_ID check, only the transport's own (CRC32, hex checksum).
+// Commit only ends the session and calls the partition's updated(), and the
+// application keeps running throughout.
+//
+// Until updated() is called, the partition holds part old, part new data, or
+// none if the transfer failed, so the application should not use it while an
+// update targets it (session_ingest()->part), and may want a check of its own.
+//
+// A partition is whole sectors below FLASH_RESERVE, and must not hold FSEC
+// (T3.x/TLC) or overlap another partition or the firmware buffer, so add it
+// after session_init() has found the buffer. One in the application, such as
+// a PROGMEM array aligned to FLASH_SECTOR_SIZE and a multiple of it in size,
+// is replaced in the running code; it must be read through a pointer the
+// compiler cannot fold to the values it was built with. It keeps its new data
+// until the next application update writes it over.
+//******************************************************************************
+#ifndef FXPART_H_
+#define FXPART_H_
+
+#include <stdint.h>
+#include "FlashTxx.h"		// FLASH_BASE_ADDR, FLASH_SECTOR_SIZE, etc.
+
+#if !defined(PART_MAX)
+  #define PART_MAX		(4)	// data partitions
+#endif
+#define PART_NAME_MAX		(15)	// name length, without the NUL
+
+//******************************************************************************
+// part_t	a data partition
+//******************************************************************************
+typedef struct part_s part_t;
+struct part_s {
+  const char *name;			// selects it in FRAME_START
+  uint32_t addr;			// flash address, sector aligned
+  uint32_t size;			// whole sectors
+  void (*updated)( const part_t *part );  // after commit, or NULL
+};
+
+void part_buffer( uint32_t addr, uint32_t size );
+int part_add( const char *name, uint32_t addr, uint32_t size,
+		void (*updated)( const part_t *part ) );
+const part_t *part_find( const char *name );
+const part_t *part_get( int number );
+int part_number( const part_t *part );
+int part_count( void );
+
+#endif // FXPART_H_
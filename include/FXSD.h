@@ -0,0 +1,129 @@
+//******************************************************************************
+// FXSD.H -- new code from an SD card file: hex, raw binary or UF2
+//******************************************************************************
+// The file is read in SD_READ_SIZE blocks (a multiple of the 512-byte card
+// sector, from aligned file positions, so SdFat reads whole sectors straight
+// into the buffer) into two buffers used in turn. While the decoder works
+// through one, a later sd_reader_poll() fills the other, so reading the card
+// and writing the firmware buffer alternate in bounded steps from loop().
+//
+// The format is chosen by file name extension:
+//
+//   .hex   Intel hex, decoded by ingest_feed() like a serial transfer
+//   .bin   raw image at FLASH_BASE_ADDR (plain, FXLZ or FXDP), or at the slot
+//          it is linked for (SLOT_MODE, FXSlot.h), no parsing
+//   .uf2   UF2 blocks, each 256-476 bytes of the image at its target address
+//
+// .bin and .uf2 need no hex decoding at all, so the update is limited by the
+// card and the firmware buffer, not the CPU.
+//
+// The reader delivers to the update session (FXSession.h) of its transport,
+// and calls session_finish() once the file is read or an error stops it.
+//
+// An sd_stage_t is a file the session can move an image to if it is too large
+// for the buffer (ingest_overflow), whichever transport is receiving it. The
+// image is checked by reading it back, and sd_stage_commit() then programs
+// flash from the file, a sector at a time through a RAM copy. That needs the
+// SD driver to keep running while program flash is rewritten, which it does
+// only where all code runs from RAM and the SD card is on SDIO (T4.1), so
+// SD_STAGING is only available there.
+//
+// An sd_cache_t keeps the last SD_CACHE_SLOTS images committed in a directory,
+// one file each, named by CRC32, with an index of their sizes and CRC32s most
+// recently used first. It is the session's image_cache_t (session_cache), so
+// an image sent again (a reflash, or a rollback to an earlier build) is
+// loaded from the card instead of the bus. The oldest image is deleted when a
+// new one is stored.
+//******************************************************************************
+#ifndef FXSD_H_
+#define FXSD_H_
+
+#include <Arduino.h>
+#include <SD.h>
+#include "FXSession.h"		// transport_t, session_xxx()
+
+#define SD_READ_SIZE		(4096)	// bytes per card read (multiple of 512)
+#define SD_BYTES_PER_POLL	(512)	// decoded per sd_reader_poll()
+
+#if !defined(SD_STAGING)
+  #if defined(ARDUINO_TEENSY41)
+    #define SD_STAGING		(1)
+  #else
+    #define SD_STAGING		(0)
+  #endif
+#endif
+
+// images kept by sd_cache_t (0 = no cache)
+#if !defined(SD_CACHE_SLOTS)
+  #define SD_CACHE_SLOTS	(4)
+#endif
+
+#define SD_FORMAT_HEX		(0)
+#define SD_FORMAT_BIN		(1)
+#define SD_FORMAT_UF2		(2)
+
+// UF2 block (see https://github.com/microsoft/uf2)
+#define UF2_BLOCK_SIZE		(512)
+#define UF2_MAGIC_START0	(0x0A324655)
+#define UF2_MAGIC_START1	(0x9E5D5157)
+#define UF2_MAGIC_END		(0x0AB16F30)
+#define UF2_FLAG_NOT_MAIN_FLASH	(0x00000001)	// block is not for program flash
+#define UF2_MAX_PAYLOAD		(476)
+
+//******************************************************************************
+// sd_reader_t	state of a file being read into the buffer
+//******************************************************************************
+typedef struct {
+  File *file;
+  transport_t *transport;		// session delivered to
+  int format;				// SD_FORMAT_xxx
+  char block[2][SD_READ_SIZE] __attribute__ ((aligned (32)));
+  uint32_t count[2];			// bytes in each block (0 = empty)
+  int cur;				// block being decoded
+  uint32_t pos;				//   and bytes of it done
+  int eof;				// file read to the end
+  uint32_t bin_addr;			// .bin: flash address of next byte
+  uint32_t uf2_blocks;			// .uf2: blocks seen
+  uint32_t uf2_total;			//   and numBlocks of the first one
+  int finished;				// session_finish() called
+} sd_reader_t;
+
+//******************************************************************************
+// sd_stage_t	file on SD an image too large for the buffer moves to
+//******************************************************************************
+typedef struct {
+  ingest_stage_t stage;			// must be first
+  const char *name;			// file name
+  File file;
+  uint32_t size;			// bytes in file (written or filled)
+} sd_stage_t;
+
+//******************************************************************************
+// sd_cache_t	directory on SD holding the images committed most recently
+//******************************************************************************
+#if (SD_CACHE_SLOTS > 0)
+typedef struct {
+  uint32_t size;			// 0 = empty slot
+  uint32_t crc;
+} sd_cache_entry_t;
+
+typedef struct {
+  image_cache_t cache;			// must be first
+  const char *dir;			// directory name
+  sd_cache_entry_t entry[SD_CACHE_SLOTS];	// most recent first
+  File file;				// image being loaded
+  uint32_t size;			//   its size and CRC32
+  uint32_t crc;
+  char path[32];			// dir/XXXXXXXX.BIN
+} sd_cache_t;
+#endif
+
+int  sd_image_format( const char *name );
+void sd_reader_begin( sd_reader_t *r, File *file, int format, transport_t *t );
+int  sd_reader_poll( sd_reader_t *r );
+void sd_stage_init( sd_stage_t *s, const char *name );
+#if (SD_CACHE_SLOTS > 0)
+int  sd_cache_init( sd_cache_t *c, const char *dir );
+#endif
+
+#endif // FXSD_H_
@@ -0,0 +1,97 @@
+//******************************************************************************
+// FXSESSION.H -- update session core shared by every transport
+//******************************************************************************
+// An update is received by one transport at a time (serial hex, SD file,
+// FXFrame binary, CAN). Each one only moves bytes: it describes itself with a
+// transport_t and hands what it receives to the session, which owns the buffer
+// and the ingest_t. The decoder, the buffer writes and the image checks are
+// then the same for all of them:
+//
+//   session_begin( &t, echo )                  take the buffer
+//   session_deliver( &t, bytes, count )        hex text, or
+//   session_deliver_block( &t, addr, data, n ) binary image at flash address
+//   session_finish( &t )                       check image, t.respond() result
+//   session_commit( &t ) or session_end( &t )  flash it, or free the buffer
+//
+// session_poll() from loop() ends a session whose transport has gone quiet
+// for t.timeout_ms (0 = the transport times itself out). session_finish()
+// prints the bytes received and the time taken, so transports can be compared
+// on the same image.
+//
+// With an image_cache_t (session_cache), each image committed is kept, keyed
+// by its size and CRC32. A transport that learns the size and CRC32 of the
+// image before its data (FXFrame START, CAN OFFER_IMAGE) offers them with
+// session_offer(). If the image is cached, session_poll() loads it into the
+// buffer, checks its CRC32 and calls session_finish(), and t.respond() gets
+// the result as if the image had been received.
+//
+// A transport can instead send a data partition (FXPart.h), selected with
+// session_target() before its data. It is written in place, and
+// session_commit() calls the partition's updated() and ends the session,
+// with no reboot.
+//******************************************************************************
+#ifndef FXSESSION_H_
+#define FXSESSION_H_
+
+#include <Arduino.h>
+#include "FXUtil.h"		// ingest_t, INGEST_xxx
+
+// session_begin() return values
+#define SESSION_OK		(0)
+#define SESSION_BUSY		(1)	// another transport holds the buffer
+#define SESSION_NO_BUFFER	(2)	// firmware_buffer_init() found no buffer
+
+// transport_t.respond() events
+#define SESSION_EVENT_RESULT	(1)	// image checked, status INGEST_EOF or error
+#define SESSION_EVENT_TIMEOUT	(2)	// nothing delivered for timeout_ms
+
+// session_result() status beyond INGEST_xxx
+#define SESSION_ERR_CACHE	(7)	// cached image failed its size or CRC32
+
+// bytes loaded from the cache per session_poll()
+#define SESSION_CACHE_READ_SIZE	(512)
+
+//******************************************************************************
+// transport_t	what a transport tells the session about itself
+//******************************************************************************
+typedef struct transport_s transport_t;
+struct transport_s {
+  const char *name;			// for messages
+  Stream *out;				// progress and error messages
+  void (*respond)( transport_t *t, int event, int status );  // or NULL
+  uint32_t (*clock)( void );		// time in ms (NULL = millis)
+  uint32_t timeout_ms;			// 0 = no session timeout
+};
+
+//******************************************************************************
+// image_cache_t	images kept from earlier updates (e.g. sd_cache_t, FXSD.h)
+//******************************************************************************
+// open() finds the image of size and crc and returns 0, then read() returns
+// its next bytes (0 at the end, -1 on error) until close(), which drops the
+// image unless good is set. store() keeps the plain image in the buffer.
+typedef struct image_cache_s image_cache_t;
+struct image_cache_s {
+  int  (*open)( image_cache_t *c, uint32_t size, uint32_t crc );
+  int  (*read)( image_cache_t *c, char *data, uint32_t num );
+  void (*close)( image_cache_t *c, int good );
+  int  (*store)( image_cache_t *c, ingest_t *in );
+};
+
+int      session_init( void );
+void     session_stage( ingest_stage_t *stage );
+void     session_cache( image_cache_t *cache );
+int      session_offer( transport_t *t, uint32_t size, uint32_t crc );
+int      session_target( transport_t *t, const part_t *part );
+int      session_begin( transport_t *t, int echo );
+int      session_deliver( transport_t *t, const char *bytes, uint32_t count );
+int      session_deliver_block( transport_t *t, uint32_t flash_addr,
+			const char *data, uint32_t num );
+int      session_result( transport_t *t, int status );
+int      session_finish( transport_t *t );
+void     session_commit( transport_t *t );
+void     session_end( transport_t *t );
+void     session_poll( void );
+ingest_t *session_ingest( void );
+transport_t *session_owner( void );
+
+#endif // FXSESSION_H_
@@ -0,0 +1,24 @@
+//******************************************************************************
+// FXSIPHASH.H -- SipHash-2-4 message authentication for update commands
+//******************************************************************************
+// fxsiphash24() computes SipHash-2-4 (Aumasson and Bernstein) of len bytes of
+// data with a 128-bit key, as the 64-bit value of the reference code. It is a
+// short-input MAC: a CAN command tagged with it under a key shared with the
+// host cannot be forged without the key (see FirmwareUpdater.h), and it is
+// cheap enough for the TLC.
+//
+// The key is 16 bytes, read as two little-endian 64-bit words, as in the
+// reference implementation, so the test vectors of the paper apply: key 00 01
+// ... 0F and data 00 01 ... 0E (15 bytes) give 0xA129CA6149BE45E5.
+//******************************************************************************
+#ifndef FXSIPHASH_H_
+#define FXSIPHASH_H_
+
+#include <stdint.h>
+
+#define FXSIPHASH_KEY_SIZE	(16)
+
+uint64_t fxsiphash24( const uint8_t key[FXSIPHASH_KEY_SIZE], const void *data,
+			uint32_t len );
+
+#endif // FXSIPHASH_H_
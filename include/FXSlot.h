@@ -0,0 +1,83 @@
+//******************************************************************************
+// FXSLOT.H -- A/B firmware slots with a resident selector (T4.1/MicroMod)
+//******************************************************************************
+// With SLOT_MODE, program flash is split into a small selector, which stays
+// at FLASH_BASE_ADDR and is never updated, and two slots of SLOT_SIZE:
+//
+// [selector][records][<--- slot A --->][<--- slot B --->][<-- FLASH_RESERVE -->]
+// ^FLASH_BASE_ADDR    ^SLOT_A_ADDR     ^SLOT_B_ADDR
+//
+// The application runs in one slot, and an update is received straight into
+// the other (slot_buffer_init makes it the firmware buffer), so there is no
+// flash_move(): the commit is one record written to the record sectors, and
+// a reboot. The slot being written is never the one running, and a record is
+// written only once its image is complete and checked, so power can fail at
+// any point and the device still boots the image it had.
+//
+// Records are 32 bytes, appended to two sectors used in turn, and the one
+// with the highest seq is the newest. slot_boot(), in the selector, checks
+// the newest record's image (IVT and CRC32) and jumps to it, or else to the
+// newest image in the other slot, so an image that does not check falls back
+// to the one before it.
+//
+// The i.MX RT executes in place from FlexSPI without address remapping, so an
+// image must be linked for the slot it runs in: its FlexSPI config block and
+// IVT at the slot address instead of FLASH_BASE_ADDR (a copy of the core's
+// linker script with the FLASH origin and length changed). The host sends the
+// build for the slot FlasherX reports as inactive, and slot_image_check()
+// rejects an image linked anywhere else.
+//
+// The selector is a sketch built from FXSlot.c and FXCRC.c with SLOT_MODE and
+// SLOT_SELECTOR defined, which makes slot_boot() the core's
+// startup_early_hook(), so it runs before USB and the clocks are started and
+// the image starts as if from reset. It must fit in SLOT_SELECTOR_SIZE.
+//******************************************************************************
+#ifndef FXSLOT_H_
+#define FXSLOT_H_
+
+#include <stdint.h>
+#include "FlashTxx.h"		// FLASH_BASE_ADDR, FLASH_SECTOR_SIZE, etc.
+
+#if !defined(SLOT_MODE)
+  #define SLOT_MODE		(0)
+#endif
+
+#if (SLOT_MODE) && !defined(ARDUINO_TEENSY41) && !defined(ARDUINO_TEENSY_MICROMOD)
+  #error "SLOT_MODE is only for T4.1 and MicroMod"
+#endif
+
+#define SLOT_BUFFER_TYPE	(4)	// firmware_buffer_init(): the inactive slot
+
+#define SLOT_SELECTOR_SIZE	(0x20000)	// 128KB for the selector
+#define SLOT_RECORD_ADDR	(FLASH_BASE_ADDR + SLOT_SELECTOR_SIZE)
+#define SLOT_RECORD_SECTORS	(2)		// used in turn
+#define SLOT_A_ADDR		(SLOT_RECORD_ADDR + 0x10000)	// 64KB aligned
+#define SLOT_SIZE		(((FLASH_BASE_ADDR + FLASH_SIZE - FLASH_RESERVE \
+				- SLOT_A_ADDR) / 2) & ~0xFFFF)
+#define SLOT_B_ADDR		(SLOT_A_ADDR + SLOT_SIZE)
+
+#define SLOT_IVT_OFFSET		(0x1000)	// IVT after the FlexSPI config
+#define SLOT_MAGIC		(0x544F4C53)	// "SLOT" as little-endian uint32
+
+//******************************************************************************
+// slot_record_t	an image committed to a slot
+//******************************************************************************
+typedef struct {
+  uint32_t magic;			// SLOT_MAGIC (0xFFFFFFFF = erased)
+  uint32_t seq;				// higher is newer
+  uint32_t addr;			// SLOT_A_ADDR or SLOT_B_ADDR
+  uint32_t size;			// image size
+  uint32_t crc;				//   and CRC32
+  uint32_t reserved[3];			// 0xFFFFFFFF
+} slot_record_t;
+
+#define SLOT_RECORDS_PER_SECTOR	(FLASH_SECTOR_SIZE / sizeof(slot_record_t))
+
+uint32_t slot_running( void );
+int      slot_buffer_init( uint32_t *buffer_addr, uint32_t *buffer_size );
+int      slot_image_check( uint32_t addr, const uint32_t *ivt );
+int      slot_commit( uint32_t addr, uint32_t size );
+const slot_record_t *slot_newest( uint32_t addr );
+void     slot_boot( void );
+
+#endif // FXSLOT_H_
@@ -0,0 +1,89 @@
+//******************************************************************************
+// FXSWAP.H -- swap commit: keep the previous image in the buffer for rollback
+//******************************************************************************
+// With SWAP_MODE, the buffer is at a fixed place, the upper half of program
+// flash, and flash_swap() exchanges it with the running image sector by sector
+// instead of flash_move() copying over it:
+//
+// [<-- image (SWAP_SIZE) -->][<-- buffer (SWAP_SIZE) -->][journal][RESERVE]
+// ^FLASH_BASE_ADDR          ^SWAP_BUFFER_ADDR
+//
+// Each sector of the running image is copied to a RAM scratch sector, the new
+// sector is written over it from the buffer, and the old one is written from
+// the scratch sector to the buffer. After the reboot the buffer holds the
+// previous image, and swap_rollback() swaps it back the same way, locally,
+// with no transfer. Sectors that are the same in both images are skipped.
+//
+// The journal records each swap before it starts: the number of sectors, and
+// the size and CRC32 of the image that ends up in each place. As each sector
+// is exchanged, its progress entry (one write unit) is cleared, and a last
+// entry marks the swap complete. swap_status() uses it to tell whether the
+// buffer holds the previous image: the swap completed, and both images still
+// have their CRC32s (a new update is received into the buffer over it).
+//
+// Like flash_move(), a swap runs from RAM with interrupts disabled, and power
+// must not fail while it runs: the image at FLASH_BASE_ADDR is then partly
+// swapped and does not start, so nothing can resume it. See FXSlot.h for
+// updates that survive that.
+//
+// Only a plain image (or the one a patch produced) can be swapped. The image
+// loaded by TeensyDuino must be smaller than SWAP_SIZE: if it reaches the
+// buffer, swap_buffer_init() finds no buffer, and there are no updates.
+//******************************************************************************
+#ifndef FXSWAP_H_
+#define FXSWAP_H_
+
+#include <stdint.h>
+#include "FlashTxx.h"		// FLASH_BASE_ADDR, FLASH_SECTOR_SIZE, etc.
+
+#if !defined(SWAP_MODE)
+  #define SWAP_MODE		(0)
+#endif
+
+#if (SWAP_MODE) && defined(SLOT_MODE) && (SLOT_MODE)
+  #error "SWAP_MODE and SLOT_MODE cannot both be set"
+#endif
+
+#define SWAP_BUFFER_TYPE	(5)	// firmware_buffer_init(): SWAP_BUFFER_ADDR
+
+#define SWAP_JOURNAL_SECTORS	(2)
+#define SWAP_JOURNAL_ADDR	(FLASH_BASE_ADDR + FLASH_SIZE - FLASH_RESERVE \
+				- SWAP_JOURNAL_SECTORS * FLASH_SECTOR_SIZE)
+#define SWAP_SIZE		(((SWAP_JOURNAL_ADDR - FLASH_BASE_ADDR) / 2) \
+				& ~(FLASH_SECTOR_SIZE - 1))
+#define SWAP_BUFFER_ADDR	(FLASH_BASE_ADDR + SWAP_SIZE)
+#define SWAP_MAGIC		(0x50415753)	// "SWAP" as little-endian uint32
+
+// swap_status() return values
+#define SWAP_NONE		(0)	// no rollback: no swap, or an image changed
+#define SWAP_DONE		(1)	// buffer holds the previous image
+#define SWAP_PARTIAL		(2)	// last swap did not complete
+
+//******************************************************************************
+// swap_journal_t	header of the journal, followed by the progress entries
+//******************************************************************************
+typedef struct {
+  uint32_t magic;			// SWAP_MAGIC (0xFFFFFFFF = erased)
+  uint32_t sectors;			// sectors exchanged
+  uint32_t base_size;			// image at FLASH_BASE_ADDR after the swap
+  uint32_t base_crc;
+  uint32_t buffer_size;			// image in the buffer after the swap
+  uint32_t buffer_crc;
+  uint32_t reserved[2];			// 0xFFFFFFFF
+} swap_journal_t;
+
+// progress entry i (sector i exchanged), and after the last, swap complete
+#define SWAP_PROGRESS_ADDR(i)	(SWAP_JOURNAL_ADDR + sizeof(swap_journal_t) \
+				+ (i) * FLASH_WRITE_SIZE)
+#define SWAP_MAX_SECTORS	((SWAP_JOURNAL_SECTORS * FLASH_SECTOR_SIZE \
+				- sizeof(swap_journal_t)) / FLASH_WRITE_SIZE - 1)
+
+uint32_t swap_code_end( void );
+int  swap_buffer_init( uint32_t *buffer_addr, uint32_t *buffer_size );
+const swap_journal_t *swap_journal( void );
+int  swap_status( void );
+int  swap_commit( uint32_t size );
+int  swap_rollback( void );
+RAMFUNC void flash_swap( uint32_t base, uint32_t buffer, uint32_t sectors );
+
+#endif // FXSWAP_H_
@@ -1,10 +1,146 @@
 //******************************************************************************
 // FXUTIL.H -- FlasherX utility functions
 //******************************************************************************
+// A hex file is ingested incrementally: ingest_feed() takes bytes as they
+// arrive (from loop(), a USB callback or a DMA completion) and does bounded
+// work per call, so an update can run alongside CAN and the application:
+//
+//   ingest_begin( &in, buffer_addr, buffer_size, serial, 0 );
+//   ...each loop: if (ingest_poll( &in, stream, 256 ) != INGEST_MORE) ...
+//   if (in.status == INGEST_EOF && ingest_check( &in ) == 0)
+//     ingest_commit( &in );
+//
+// update_firmware() does the same, blocking, with a user prompt to confirm.
+// Binary transports deliver the image with ingest_block() and ingest_end()
+// instead of ingest_feed().
+//
+// The buffer can have a RAM tier (ingest_ram_tier) ahead of the flash buffer:
+// a plain image is placed across both, its first bytes in RAM. Compressed
+// (FXLZ) streams and patch (FXDP) output are read in place, so they use only
+// the flash buffer. On T3.5/T3.6 a third tier in FlexNVM data flash
+// (ingest_nvm_tier) takes what does not fit in the other two. ingest_addr()
+// maps a position in the image to the tiers. If a plain image outgrows them
+// all, it can move to an ingest_stage_t (ingest_overflow), such as an SD file,
+// and ingest_read() reads it back from wherever it is.
+//
+// The image is at FLASH_BASE_ADDR, unless the buffer is a slot it will run in
+// (ingest_slot, FXSlot.h): then it is at the slot address, the origin, and it
+// is already in place once received. With ingest_swap (FXSwap.h) it is
+// exchanged with the running code, which stays in the buffer for rollback.
+// A data partition (ingest_part, FXPart.h) is written in place the same way,
+// but is not an image: it is not checked as one, and commit does not reboot.
+//
+// The transports in FlasherX (CAN, serial, SD, FXFrame) use these through the
+// update session in FXSession.h.
+//******************************************************************************
 #ifndef FXUTIL_H_
 #define FXUTIL_H_
 
+#include <Arduino.h>
+extern "C" {
+  #include "FlashTxx.h"		// TLC/T3x/T4x/TMM flash primitives
+  #include "FXLZ.h"		// compressed (FXLZ) images
+  #include "FXDelta.h"		// delta (FXDP) patches
+  #include "FXPart.h"		// data partitions
+}
+
+//******************************************************************************
+// hex_info_t	struct for hex record and hex file info
+//******************************************************************************
+typedef struct {	// 
+  char *data;		// pointer to array allocated elsewhere
+  unsigned int addr;	// address in intel hex record
+  unsigned int code;	// intel hex record type (0=data, etc.)
+  unsigned int num;	// number of data bytes in intel hex record
+ 
+  uint32_t base;	// base address to be added to intel hex 16-bit addr
+  uint32_t min;		// min address in hex file
+  uint32_t max;		// max address in hex file
+  
+  int eof;		// set true on intel hex EOF (code = 1)
+  int lines;		// number of hex records received  
+} hex_info_t;
+
+// ingest_t.status and return values of ingest_feed(), ingest_poll(), etc.
+#define INGEST_MORE		(0)	// waiting for more bytes
+#define INGEST_EOF		(1)	// hex EOF record processed
+#define INGEST_ERR_RECORD	(2)	// invalid hex record type
+#define INGEST_ERR_SIZE		(3)	// max address too large for buffer
+#define INGEST_ERR_WRITE	(4)	// error in flash_write_block()
+#define INGEST_ERR_PATCH	(5)	// patch out of order or failed
+#define INGEST_ERR_IMAGE	(6)	// new code failed ingest_check()
+
+//******************************************************************************
+// ingest_stage_t	storage a plain image moves to if it outgrows the tiers
+//******************************************************************************
+// e.g. a file on SD (see sd_stage_t in FXSD.h). Offsets are from the start of
+// the image. begin() empties it, write() leaves bytes skipped over as 0xFF.
+// commit() programs flash from it and reboots, or returns, with flash
+// unchanged, if it cannot read it. Each other returns 0 if OK.
+typedef struct ingest_stage_s ingest_stage_t;
+struct ingest_stage_s {
+  const char *name;			// for messages
+  int  (*begin)( ingest_stage_t *s );
+  int  (*write)( ingest_stage_t *s, uint32_t offset, const char *data, uint32_t num );
+  int  (*read)( ingest_stage_t *s, uint32_t offset, char *data, uint32_t num );
+  void (*commit)( ingest_stage_t *s, uint32_t size );
+};
+
+//******************************************************************************
+// ingest_t	state of a hex file being ingested into the buffer
+//******************************************************************************
+typedef struct {
+  hex_info_t hex;			// intel hex info
+  char data[32] __attribute__ ((aligned (8)));	// hex record data
+  char line[96];			// hex line being assembled
+  int nchar;				//   and its length so far
+  uint32_t buffer_addr;			// buffer for new code (flash tier)
+  uint32_t buffer_size;
+  uint32_t ram_addr;			// RAM tier, holds first ram_size bytes
+  uint32_t ram_size;			//   (0 = none, or FXLZ/FXDP image)
+  uint32_t ram_used;			//   bytes of it written or filled
+  uint32_t nvm_addr;			// FlexNVM tier, after the flash tier
+  uint32_t nvm_size;			//   (0 = none, or FXLZ/FXDP image)
+  uint32_t nvm_erase_addr;		//   erased below (see flash_erase_ahead)
+  ingest_stage_t *stage;		// overflow storage (NULL = none)
+  int staged;				//   set once image has moved there
+  uint32_t buffer_offset;		// FXLZ stream offset
+  uint32_t origin;			// flash address of image offset 0
+  uint32_t erase_addr;			// flash tier erased below (0 = all)
+  int swap;				// commit with swap_commit() (ingest_swap)
+  const part_t *part;			// data partition (ingest_part), or NULL
+  uint32_t image_size;			// size of new code (set by ingest_check)
+  int patch;				// set if FXDP patch
+  delta_t delta;			// FXDP patch decoder
+  int status;				// INGEST_xxx
+  Stream *out;				// progress and error messages
+  int echo;				// echo each line to out
+} ingest_t;
+
+void ingest_begin( ingest_t *in, uint32_t buffer_addr, uint32_t buffer_size,
+			Stream *out, int echo );
+void ingest_ram_tier( ingest_t *in, uint32_t ram_addr, uint32_t ram_size );
+void ingest_nvm_tier( ingest_t *in, uint32_t nvm_addr, uint32_t nvm_size );
+void ingest_slot( ingest_t *in );
+void ingest_swap( ingest_t *in );
+void ingest_part( ingest_t *in, const part_t *part );
+uint32_t ingest_addr( ingest_t *in, uint32_t offset );
+uint32_t ingest_span( ingest_t *in, uint32_t offset );
+void ingest_overflow( ingest_t *in, ingest_stage_t *stage );
+int  ingest_read( ingest_t *in, uint32_t offset, char *data, uint32_t num );
+int  ingest_feed( ingest_t *in, const char *bytes, uint32_t count );
+int  ingest_poll( ingest_t *in, Stream *stream, uint32_t max_bytes );
+int  ingest_block( ingest_t *in, uint32_t flash_addr, const char *data, uint32_t num );
+int  ingest_end( ingest_t *in );
+int  ingest_flush( ingest_t *in );
+int  ingest_check( ingest_t *in );
+void ingest_commit( ingest_t *in );
+
 void read_ascii_line( Stream *serial, char *line, int maxbytes );
+int  poll_ascii_line( Stream *serial, char *line, int maxbytes, int *nchar );
+int  parse_hex_line( const char *theline, char *bytes,
+	unsigned int *addr, unsigned int *num, unsigned int *code );
+int  process_hex_record( hex_info_t *hex );
 void update_firmware( Stream *in, Stream *out,
 			uint32_t buffer_addr, uint32_t buffer_size );
 
@@ -3,12 +3,187 @@
 
 #include "Arduino.h"
 #include "HexTransfer.h"
+extern "C" {
+  #include "FXSipHash.h"	// SipHash-2-4 command tags
+}
+
+// FirmwareUpdater takes an image received by HexTransfer from the buffer into
+// flash, without a person at a Serial prompt. It is a state machine, stepped
+// by update() from loop():
+//
+//   IDLE -> RECEIVING -> RECEIVED -> VALIDATED -> ARMED -> COMMITTING
+//
+// RECEIVED once HexTransfer has the whole image, and the session has checked
+// it (FSEC, FLASH_ID, patch, compressed image). The updater then computes the
+// CRC32 of the image in the buffer (its digest), a few KB per update, and is
+// VALIDATED. ARM and then COMMIT, each a CAN command tagged with SipHash-2-4
+// under a key shared with the PC, move it on to flash_move() and the reboot.
+// A policy can take either step without a command: with AUTO_ARM it arms once
+// validated, with AUTO_COMMIT it commits once validated, so the image is in
+// flash within a few updates of the last line. Any other session on the
+// buffer (a new transfer init, an abort, Serial or SD) returns it to IDLE.
+//
+// Each change of state is sent to the PC as an event, and while receiving,
+// the line count every UPDATER_PROGRESS_MS. A data partition (FXPart.h) is
+// committed by HexTransfer itself, so the updater leaves it alone.
+//
+// Nodes on one bus can commit together, so the system is never left running
+// mixed versions. Each node receives and validates its image on its own, and
+// is armed with a commit group and a 24-bit commit token (SET_TOKEN, then ARM).
+// It then reports READINESS: whether the application lets it commit now (see
+// set_commit_gate). Once every node is ready, the PC broadcasts one
+// GROUP_COMMIT frame, which all nodes receive at the same moment. Each node
+// armed with that group is SCHEDULED to commit a delay after it, so all of
+// them reboot within one loop time of each other. A node whose application
+// is still busy waits up to UPDATER_COMMIT_WINDOW_MS for its gate to open,
+// then reports MISSED and stays armed, rather than commit late. Its token
+// was used, so the PC arms it again with a new one before it retries.
 
 namespace FirmwareUpdater
 {
-    void update();
+  #define UPDATER_CAN_COMMAND_ID 0x2  // PC CAN message ID for CommandMsg
+  #define UPDATER_CAN_EVENT_ID 0x2    // CAN message ID this node sends EventMsg with
+
+  #define UPDATER_DIGEST_BYTES_PER_UPDATE 4096 // Image bytes read into the digest per update
+  #define UPDATER_PROGRESS_MS 500     // Interval of progress events while receiving, in ms
+  #define UPDATER_AUTH_HOLDOFF_MS 250 // Commands ignored for this long after a bad tag
+  #define UPDATER_COMMIT_DELAY_MS 5   // Time for the COMMITTING event to go out, in ms
+  #define UPDATER_COMMIT_WINDOW_MS 50 // Time a scheduled commit waits for the gate, in ms
+  #define UPDATER_NODE_ANY 0xFF       // CommandMsg node for QUERY_STATUS to every node
+  #define UPDATER_GROUP_NONE 0        // Armed for COMMIT, not GROUP_COMMIT
+
+  // Key shared with the PC, e.g. with a -D in platformio.ini: anyone who
+  // knows it can commit firmware, so there is no default. Without it, every
+  // command but QUERY_STATUS is REFUSED, and only UPDATER_POLICY commits.
+  // #define UPDATER_KEY { 0x.., ... 16 bytes ... }
+
+  // EEPROM address of the boot count that seeds the nonce on a board with
+  // no random number generator (Teensy LC and 3.x before 3.5), 4 bytes
+  #if !defined(UPDATER_NONCE_EEPROM_ADDR)
+    #define UPDATER_NONCE_EEPROM_ADDR (E2END - 3)
+  #endif
+
+  // Policy at boot, see Policy
+  #if !defined(UPDATER_POLICY)
+    #define UPDATER_POLICY 0 // Policy::MANUAL
+  #endif
+
+  // -----------------------------------------------------------------
+  // Firmware Updater Enums
+  // -----------------------------------------------------------------
+  enum class State {
+    IDLE = 0,       // No image, or the session belongs to another transport
+    RECEIVING = 1,  // HexTransfer is receiving an image
+    RECEIVED = 2,   // Image received and checked, digest being computed
+    VALIDATED = 3,  // Digest known, waiting for ARM (or policy)
+    ARMED = 4,      // Waiting for COMMIT (or policy)
+    COMMITTING = 5, // flash_move() once the application is idle, then the reboot
+    SCHEDULED = 6,  // GROUP_COMMIT received, commit at its time
+  };
+
+  enum class Policy {
+    MANUAL = 0,      // ARM and COMMIT commands
+    AUTO_ARM = 1,    // Armed once validated, COMMIT command
+    AUTO_COMMIT = 2, // Committed once validated
+  };
+
+  // CommandCode is the first byte of a CommandMsg
+  enum class CommandCode {
+    NONE = 0,
+    QUERY_STATUS = 1, // Respond with a STATE and a NONCE event (no tag needed)
+    ARM = 2,          // VALIDATED or ARMED -> ARMED, commit group in data[0], token bits 0-7 in data[1]
+    COMMIT = 3,       // ARMED -> COMMITTING
+    DISARM = 4,       // ARMED, SCHEDULED or COMMITTING -> VALIDATED
+    SET_POLICY = 5,   // Policy in data[0], and for AUTO_ARM the group in data[1]
+    DISCARD = 6,      // End the session, the image is dropped
+    GROUP_COMMIT = 7, // To every node: ARMED with group data[0] -> SCHEDULED
+    SET_TOKEN = 8,    // VALIDATED or ARMED: token bits 8-23 for the next ARM in data[0-1], not 0
+  };
+
+  // EventCode is the second byte of an EventMsg
+  enum class EventCode {
+    NONE = 0,
+    STATE = 1,      // State changed or queried: value is the digest, aux the lines received
+    NONCE = 2,      // value is the nonce the next command is tagged with, aux the policy
+    AUTH_ERROR = 3, // Bad tag: value is the nonce, commands ignored for a while
+    REFUSED = 4,    // Command not valid in this state, or sent before the last was acted on:
+                    // value is the nonce, aux the command code
+    READINESS = 5,  // While armed: value is 1 if the application lets it commit now, aux the group
+    MISSED = 6,     // The gate stayed closed for the commit window: aux is the group, still ARMED
+  };
+
+  // ----------------------------------------------------------------------------
+  // Firmware Updater Structs
+  // ----------------------------------------------------------------------------
+
+  // CommandMsg is sent by the PC with UPDATER_CAN_COMMAND_ID, packed into 8
+  // bytes: code (1), data (3), then tag (4), the low 32 bits of
+  // SipHash-2-4(UPDATER_KEY, nonce (4) | digest (4) | code | data), all
+  // little endian. The digest is the one in the last STATE event (0 before
+  // VALIDATED), so ARM and COMMIT are for that image only, and the nonce
+  // goes up by one with each command acted on, so no command can be sent
+  // again. The node acts on one command per update(): the PC waits for the
+  // event it causes (STATE, NONCE or REFUSED) before it tags the next one,
+  // and a command that arrives before then is REFUSED. data[2] is the node the command is for (NODE_CAN_DEVICE_ID);
+  // other nodes ignore it. QUERY_STATUS has no tag, and can be for
+  // UPDATER_NODE_ANY.
+  //
+  // GROUP_COMMIT is for every node, so it has no node and is tagged with
+  // the commit token in place of the nonce, and digest 0: data[0] is the
+  // group, data[1-2] the delay in ms from the frame to the commit. The
+  // nodes of a group may hold different images, so the one frame cannot
+  // cover each digest. The PC picks a new random 24-bit token for each
+  // rollout instead, and gives it to every node with SET_TOKEN (bits 8-23)
+  // and then ARM (bits 0-7), both tagged with that node's digest. A node
+  // only keeps the token for the image it was armed with: it forgets it
+  // once it takes a GROUP_COMMIT, or leaves ARMED (SET_TOKEN's half once
+  // it leaves VALIDATED and ARMED), so a recorded GROUP_COMMIT cannot
+  // commit a later rollout. ARM with a group and no SET_TOKEN is refused,
+  // and a node armed by AUTO_ARM has no token until an ARM gives it one.
+  struct CommandMsg
+  {
+    CommandCode code;   // Bits 0-7: CommandCode (1 byte)
+    uint8_t data[3];    // Bits 8-31: arguments, depending on code
+    uint32_t tag;       // Bits 32-63: SipHash-2-4 tag, low 32 bits
+  };
+
+  // EventMsg is sent by this node with UPDATER_CAN_EVENT_ID, packed into 8
+  // bytes: state (1), event (1), value (4), aux (2), little endian.
+  struct EventMsg
+  {
+    State state;        // Bits 0-7: State (1 byte)
+    EventCode event;    // Bits 8-15: EventCode (1 byte)
+    uint32_t value;     // Bits 16-47: depending on event
+    uint16_t aux;       // Bits 48-63: depending on event
+  };
+
+  // --------------------------------------------------------------------------
+  // Can Bus Message Handlers
+  // --------------------------------------------------------------------------
+  void handle_command_msg(uint8_t (&buf)[8]);
+  CommandMsg unpack_command_msg(uint8_t (&buf)[8]);
+  bool is_tag_valid(uint8_t (&buf)[8], uint32_t tag_nonce, uint32_t tag_digest);
+  uint32_t nonce_seed();
+
+  // --------------------------------------------------------------------------
+  // Event Functions
+  // --------------------------------------------------------------------------
+  void send_event(EventCode event, uint32_t value, uint16_t aux);
+  void send_state();
+  void send_readiness();
+  void set_state(State next);
+
+  // ----------------------------------------------------------------------------
+  // Main Functions
+  // ----------------------------------------------------------------------------
+  void init();
+  void update();
+  State get_state();
+  void set_commit_gate(bool (*is_idle)());
+  bool is_gate_open();
+  void commit();
 } // namespace FirmwareUpdater
 
 
 
-#endif
\ No newline at end of file
+#endif
@@ -75,11 +75,64 @@
   #error MCU NOT SUPPORTED
 #endif
 
+// The buffer has tiers: RAM for the first bytes of a plain image, so they are
+// programmed once (by flash_move), flash above the code for the rest, and on
+// T3.5/T3.6 FlexNVM data flash for what does not fit (see below).
+// RAM_BUFFER_SIZE > 0 reserves a static RAM tier in RAM2 (T4.x only). With 0,
+// ram_buffer_claim() takes the RAM free when an update begins, less
+// RAM_BUFFER_RESERVE left for the heap and stack, in whole sectors.
 #if defined(FLASH_ID)
   #define RAM_BUFFER_SIZE	(0 * 1024)
+  #if !defined(RAM_BUFFER_RESERVE)
+    #if defined(__IMXRT1062__)
+      #define RAM_BUFFER_RESERVE	(64 * 1024)	// RAM2 left for the heap
+    #else
+      #define RAM_BUFFER_RESERVE	(16 * 1024)	// RAM left for heap and stack
+    #endif
+  #endif
   #define IN_FLASH(a) ((a) >= FLASH_BASE_ADDR && (a) < FLASH_BASE_ADDR+FLASH_SIZE)
 #endif
 
+// T4.1 only: with PSRAM on the bottom pads, and EXTMEM_BUFFER > 0, the buffer
+// is in PSRAM (EXTMEM) instead of flash. it needs no erase, and it can hold an
+// image as large as program flash, so there are no tiers and no size limit
+// from the existing code.
+#if !defined(EXTMEM_BUFFER)
+  #define EXTMEM_BUFFER		(1)
+#endif
+#if defined(ARDUINO_TEENSY41)
+  #define IN_EXTMEM(a) ((a) >= 0x70000000 && (a) < 0x71000000)
+#else
+  #define IN_EXTMEM(a) (0)
+#endif
+
+// T3.5/T3.6 only: with FLEXNVM_BUFFER > 0, FlexNVM that is not partitioned
+// for EEPROM is a third tier of the buffer, after the flash buffer (see
+// nvm_buffer_claim). its sectors are the size of program flash's. It is off
+// by default, as the application may keep its own data there.
+#if defined(__MK64FX512__) || defined(__MK66FX1M0__)
+  #if !defined(FLEXNVM_BUFFER)
+    #define FLEXNVM_BUFFER	(0)
+  #endif
+  #define FLEXNVM_ADDR		(0x10000000)		// data flash starts here
+  #if defined(__MK64FX512__)
+    #define FLEXNVM_SIZE	(0x20000)		// 128KB FlexNVM
+  #else
+    #define FLEXNVM_SIZE	(0x40000)		// 256KB FlexNVM
+  #endif
+  #define FLEXNVM_SECTOR_SIZE	(0x1000)		// 4KB sector size
+  #define IN_FLEXNVM(a) ((a) >= FLEXNVM_ADDR && (a) < FLEXNVM_ADDR+FLEXNVM_SIZE)
+#else
+  #define IN_FLEXNVM(a) (0)
+#endif
+
+// flash_move() programs T4.x flash a page (one command) at a time
+#if defined(__IMXRT1062__)
+  #define FLASH_PAGE_SIZE	(256)			// QSPI page program
+#else
+  #define FLASH_PAGE_SIZE	(FLASH_WRITE_SIZE)	// one write command
+#endif
+
 // reboot is the same for all ARM devices
 #define CPU_RESTART_ADDR	((uint32_t *)0xE000ED0C)
 #define CPU_RESTART_VAL		(0x5FA0004)
@@ -88,6 +141,7 @@
 #define NO_BUFFER_TYPE		(0)
 #define FLASH_BUFFER_TYPE	(1)
 #define RAM_BUFFER_TYPE		(2)
+#define EXTMEM_BUFFER_TYPE	(3)
 
 // apparently better - thanks to Frank Boesing
 #define RAMFUNC __attribute__ ((section(".fastrun"), noinline, noclone, optimize("Os") ))
@@ -124,15 +178,35 @@ void eepromemu_flash_erase_64K_block(void *addr);
 
 #endif // __IMXRT1062__
 
+// one part of the buffer, for flash_move_tiers()
+typedef struct {
+  uint32_t addr;
+  uint32_t size;
+} flash_tier_t;
+
 // functions used to move code from buffer to program flash (must be in RAM)
 RAMFUNC void flash_move( uint32_t dst, uint32_t src, uint32_t size );
+RAMFUNC void flash_move_tiers( uint32_t dst, const flash_tier_t *tier,
+				int count, uint32_t size );
+RAMFUNC void flash_move_begin( void );
+RAMFUNC int  flash_move_erase( uint32_t addr );
+RAMFUNC int  flash_move_write( uint32_t addr, const void *data );
+RAMFUNC int  flash_move_page( uint32_t addr, const void *data, uint32_t count );
+RAMFUNC int  flash_move_sector_matches( uint32_t addr, uint32_t src, uint32_t count );
+RAMFUNC void flash_move_end( uint32_t addr, int erase_buffer );
 
 // functions that can be in flash
 int  flash_write_block( uint32_t addr, char *data, uint32_t count );
+int  flash_write_flush( void );
 int  flash_erase_block( uint32_t address, uint32_t size );
+int  flash_erase_ahead( uint32_t *erase_addr, uint32_t addr, uint32_t count );
 
 int  check_flash_id( uint32_t buffer, uint32_t size );
 int  firmware_buffer_init( uint32_t *buffer_addr, uint32_t *buffer_size );
+uint32_t firmware_code_end( void );
 void firmware_buffer_free( uint32_t buffer_addr, uint32_t buffer_size );
+uint32_t ram_buffer_claim( uint32_t *ram_addr );
+void ram_buffer_release( void );
+uint32_t nvm_buffer_claim( uint32_t *nvm_addr );
 
 #endif // _FLASHTXX_H_
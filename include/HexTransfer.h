@@ -2,10 +2,15 @@
 #define HEXTRANSFER_H
 
 #include "Arduino.h"
-#include <FastCRC.h>
 extern "C" {
   #include "FlashTxx.h"		// TLC/T3x/T4x/TMM flash primitives
+  #include "FXCRC.h"		// CRC32 backends
+  #include "FXHeap.h"		// heap call accounting
+  #include "FXLZ.h"		// compressed (FXLZ) images
+  #include "FXDelta.h"		// delta (FXDP) patches
+  #include "FXSwap.h"		// swap commit and rollback (SWAP_MODE)
 }
+#include "FXSession.h"		// update session shared with Serial and SD
 
 #define DEBUG 1
 #define DRYRUN 1
@@ -15,13 +20,58 @@ namespace HexTransfer {
   #define MAX_HEX_LINE_SIZE 45      // Max size of hex line data, in bytes
   #define MAX_HEX_CHUNK_SIZE 5      // Max size of hex data in a segment, in bytes
   #define MAX_CHUNKS_PER_HEX_LINE 9 // 45/5 = 9
+  #define MIN_FEC_GROUP_SIZE 2      // Segments per parity frame, at least
+  #define MAX_FEC_PARITY_FRAMES 5   // Parity frames per line, at most: 9 segments in groups of 2
   #define PAD 0xFF 
   
+  // Sectors a manifest can cover, at most: it takes 6 bytes of RAM each, so
+  // it covers all of flash only on the smaller boards. A larger image is
+  // checked with the file checksum instead.
+  #if !defined(MANIFEST_SECTORS_LIMIT)
+    #define MANIFEST_SECTORS_LIMIT 512
+  #endif
+  #define FLASH_SECTORS ((FLASH_SIZE - FLASH_RESERVE) / FLASH_SECTOR_SIZE)
+  #define MAX_MANIFEST_SECTORS \
+    (FLASH_SECTORS < MANIFEST_SECTORS_LIMIT ? FLASH_SECTORS : MANIFEST_SECTORS_LIMIT)
+  #define MANIFEST_NO_LINE 0xFFFF       // Sector has not been written by any line
+  #define MAX_SECTOR_REPAIRS 16         // Sectors received again per transfer, at most
+  
   #define HEX_LINE_TIMEOUT_LEN 5000     // Timeout for receiving hex line segments, in ms
   #define INACTIVITY_TIMEOUT_LEN 15000  // Timeout for inactivity, in ms
 
   #define PC_CAN_DEVICE_ID 0x0 // PC CAN ID
   #define PC_CAN_COMMAND_ID 0x0 // PC CAN message ID
+  #define CONTROL_CAN_COMMAND_ID 0x1 // PC CAN message ID for ControlMsg
+  #if !defined(NODE_CAN_DEVICE_ID)
+    #define NODE_CAN_DEVICE_ID 0x1 // CAN ID this node sends responses with
+  #endif
+
+  // Nodes of one multicast group receive the same image from one stream of
+  // init and segment messages, sent with MULTICAST_CAN_COMMAND_ID + group.
+  // They do not request lines: the PC sends them in order, and then asks each
+  // node of the group which line it needs next (QUERY_MULTICAST). It sends
+  // the stream again from the lowest of those lines, and a node that already
+  // has a line ignores it, until every node is complete. So the bus carries
+  // the image once, plus the lines any node lost, whatever the group's size.
+  // Give each node its own NODE_CAN_DEVICE_ID, so the answers can be told
+  // apart.
+  #define MULTICAST_CAN_COMMAND_ID 0x10 // PC CAN message ID of group 0, add the group
+  #if !defined(MULTICAST_GROUP)
+    #define MULTICAST_GROUP 1 // Group this node is a member of, 1-15
+  #endif
+
+  // A T3.6 has two FlexCAN controllers, CAN0 and CAN1. With both wired to
+  // the PC, after SET_LINKS the lines of a transfer are striped across them:
+  // line n is requested on link n % links, and the PC sends it there. Each
+  // link has one line in flight, as a single link does, so the lines come up
+  // to links times as fast. A line is taken from whichever link it comes on,
+  // and lines are written in order.
+  #if !defined(CAN_LINKS)
+    #define CAN_LINKS 1 // FlexCAN controllers wired to the PC, 1 or 2 (T3.6)
+  #endif
+  #if CAN_LINKS < 1 || CAN_LINKS > 2 || (CAN_LINKS > 1 && !defined(__MK66FX1M0__))
+    #error "CAN_LINKS must be 1, or 2 on a T3.6"
+  #endif
   // -----------------------------------------------------------------
   // Hex Transfer Enums
   // -----------------------------------------------------------------
@@ -30,6 +80,14 @@ namespace HexTransfer {
     SEND_LINE = 1, // 
     TRANSFER_COMPLETE = 2,
     ERROR = 3,
+    BUILD_ID = 4, // Build ID of the running firmware, for delta patches
+    SECTOR_DIGEST = 5, // CRC32 of one sector of the running firmware
+    SECTORS_COPIED = 6, // Requested sectors were copied into the buffer
+    IMAGE_OFFER = 7, // Reply to OFFER_IMAGE: data[0] is 1 if the image is loaded from the SD cache
+    ROLLBACK = 8, // Reply to ROLLBACK: data[0-3] is the build ID being restored, then reboot
+    PARTITION = 9, // Reply to SELECT_PARTITION: data[0-3] is its address, data[4-5] its sectors
+    FEC = 10, // Reply to SET_FEC: data[0] is the group size in use, 0 if none
+    LINKS = 11, // Reply to SET_LINKS: data[0] is the number of links the lines are striped across
   };
   
   enum class ErrorCode {
@@ -38,7 +96,30 @@ namespace HexTransfer {
     TRANSFER_INIT_CHECKSUM_ERROR,
     TRANSFER_RETRY_LIMIT_EXCEEDED,
     INACTIVITY_TIMEOUT,
-    FILE_CHECKSUM_ERROR
+    FILE_CHECKSUM_ERROR,
+    PATCH_ERROR, // Patch is for another build, or applying it failed
+    COPY_ERROR, // Sectors requested with COPY_SECTORS could not be copied (or a slot image)
+    SECTOR_CRC_ERROR, // A sector failed its manifest CRC and cannot be received again
+    BUFFER_BUSY, // The buffer is in use by a Serial or SD update
+    IMAGE_ERROR, // The image is too large, or failed its FSEC/FLASH_ID/compressed check
+    CACHE_ERROR, // The cached image failed its CRC32 check and was dropped, send the image
+    ROLLBACK_ERROR, // No previous image to roll back to (SWAP_MODE), or an update holds the buffer
+    PARTITION_ERROR // No data partition of that number, or it overlaps the buffer
+  };
+
+  // ControlCode is the first byte of a ControlMsg
+  enum class ControlCode {
+    NONE = 0,
+    QUERY_BUILD_ID = 1, // Respond with ResponseCode::BUILD_ID
+    QUERY_SECTOR_DIGESTS = 2, // Respond with a SECTOR_DIGEST per sector
+    COPY_SECTORS = 3, // Copy unchanged sectors from the running firmware
+    SECTOR_CRC = 4, // CRC32 of one sector of the new image (manifest entry)
+    OFFER_IMAGE = 5, // Size and CRC32 of the image, before its lines (SD cache)
+    ROLLBACK = 6, // Swap the previous image back into place and reboot (SWAP_MODE)
+    SELECT_PARTITION = 7, // Send a data partition instead of the firmware (FXPart.h)
+    QUERY_MULTICAST = 8, // Each node of group data[0] answers with the line it needs next
+    SET_FEC = 9, // Parity frames follow each group of data[0] segments (0 = none)
+    SET_LINKS = 10, // Stripe the lines across data[0] links (CAN_LINKS)
   };
   
   // ----------------------------------------------------------------------------
@@ -52,13 +133,21 @@ namespace HexTransfer {
     bool msg_type;              // Bit 0: message type (1 bit)
     uint16_t line_count;        // Bits 1–15: total number of lines in the hex file (15 bits)
     uint32_t file_checksum;     // Bits 16–47: total file checksum (32 bits)
-    uint16_t init_msg_checksum; // Bits 48–63: checksum of the init message (16 bits)
+    uint16_t init_msg_checksum; // Bits 48–63: low 16 bits of the CRC32 of bytes 0-5 (16 bits)
     uint16_t calculated_msg_checksum; // Not included in the packed message, but used for validation
   };
 
   // TransferSegmentMsg holds a single segment of a hex line and the information about it.
   // TransferSegmentMsg is meant to be packed into an 8 byte for CAN message.
   // The bit numbers on the right describe how it is packed into the 8 bytes
+  //
+  // After SET_FEC, the segments of each line are taken in groups of the size
+  // set, and each group is followed by a parity frame: segment number
+  // MAX_CHUNKS_PER_HEX_LINE + group, holding the XOR of the group's hex data
+  // (the last segment padded with PAD, as sent). A node that loses one
+  // segment of a group rebuilds it from the others and the parity, with no
+  // request. This costs one frame in size+1, and saves a timeout and a line
+  // sent again, which a multicast stream cannot afford for each node.
   struct TransferSegmentMsg {
     bool msg_type;                      // Bit 0: message type (1 bit)   
     uint16_t line_num;                  // Bits 1-15: line number (15 bits)
@@ -84,11 +173,52 @@ namespace HexTransfer {
   struct AckMsg
   {
     ResponseCode ack_msg_type;  // Bits 0-7: ResponseCode Code (1 byte)
-    uint8_t data[6];            // Bits 8-47: data (6 bytes)
-    // The last byte (bits 48-63) is used for checksum calculated at message send time
+    uint8_t data[6];            // Bits 8-55: data (6 bytes)
+    // The last byte (bits 56-63) is used for checksum calculated at message send time
+  };
+
+  // ControlMsg is a request outside of the hex line transfer, such as a query.
+  // It is sent with CONTROL_CAN_COMMAND_ID and is packed into 8 bytes.
+  // QUERY_SECTOR_DIGESTS and COPY_SECTORS take the first sector in data[0-1]
+  // and the number of sectors in data[2-3] (little endian). A count of 0
+  // means all sectors of the running firmware. SECTOR_CRC takes the sector in
+  // data[0-1] and its CRC32 in data[2-5] (little endian). OFFER_IMAGE takes
+  // the CRC32 of the plain image, padded with 0xFF to a multiple of 8 bytes,
+  // in data[0-3] and that size in data[4-6] (little endian). ROLLBACK takes
+  // no arguments. SELECT_PARTITION takes the partition number (1 = first
+  // added) in data[0], after the init message and before the first line.
+  // QUERY_MULTICAST takes the group in data[0]. A node in a transfer answers
+  // with SEND_LINE, one that has the image with TRANSFER_COMPLETE, and one
+  // that missed the init message with TRANSFER_NOT_IN_PROGRESS. SET_FEC takes
+  // the group size in data[0], MIN_FEC_GROUP_SIZE to MAX_CHUNKS_PER_HEX_LINE,
+  // after the init message; any other size turns parity off. SET_LINKS takes
+  // the number of links the PC sends on in data[0], after the init message
+  // and before the first line, and the node uses up to CAN_LINKS of them.
+  struct ControlMsg
+  {
+    ControlCode code;           // Bits 0-7: ControlCode (1 byte)
+    uint8_t data[7];            // Bits 8-63: arguments, depending on code
+  };
+  
+  // LineSlot holds a line while its segments are received. There is one per
+  // link, and line n is received into slot n % links, so each link can have
+  // a line in flight while the lines before it are still coming.
+  struct LineSlot
+  {
+    uint16_t line_num;          // Line being received into the slot
+    int segment_count;          // Segments the line is split into, -1 before the first
+    uint16_t segments_received; // Bit n set once segment n is received
+    char buf[MAX_HEX_LINE_SIZE]; // The buffer the segments are copied into
+    char fec_parity[MAX_FEC_PARITY_FRAMES][MAX_HEX_CHUNK_SIZE]; // Parity frames (SET_FEC)
+    uint8_t fec_parity_received; // Bit n set once parity frame n is received
+    bool requested;             // The line has been requested since the slot was reset
+    uint32_t request_ts;        // Time the line was last requested, in ms
   };
   
 
+  // Transport of the session a transfer holds (see FXSession.h)
+  extern transport_t can_transport;
+
   // --------------------------------------------------------------------------
   // Can Bus Message Handlers
   // --------------------------------------------------------------------------
@@ -100,6 +230,12 @@ namespace HexTransfer {
   TransferInitMsg unpack_transfer_init_msg(uint8_t (&buf)[8]);
   bool process_transfer_init_msg(TransferInitMsg &msg);
   
+  void handle_multicast_msg(uint8_t (&buf)[8]);
+  
+  ControlMsg unpack_control_msg(uint8_t (&buf)[8]);
+  void handle_control_msg(uint8_t (&buf)[8]);
+  bool process_control_msg(ControlMsg &msg);
+  
   
  
   // --------------------------------------------------------------------------
@@ -109,6 +245,7 @@ namespace HexTransfer {
   ResponseCode handle_received_hex_line();
   ParsedHexLine parse_and_validate_hex_line(const char (&buf)[MAX_HEX_LINE_SIZE]);
   bool process_hex_line(ParsedHexLine &hex_line);
+  ResponseCode handle_received_eof(ErrorCode &err);
   // Hex Record Processing Helper Functions
   bool process_hex_data_record(ParsedHexLine &hex_line);
   bool process_hex_eof_record(ParsedHexLine &hex_line);
@@ -120,21 +257,30 @@ namespace HexTransfer {
   // --------------------------------------------------------------------------
   // Response Functions
   // --------------------------------------------------------------------------
-  bool send_response(ResponseCode res, ErrorCode err = ErrorCode::NONE);
-  bool pack_response(ResponseCode res, uint8_t (&buf)[8]);
+  bool send_response(ResponseCode res, ErrorCode err = ErrorCode::NONE, int link = 0);
+  bool pack_response(AckMsg &msg, uint8_t (&buf)[8]);
   
   
   // --------------------------------------------------------------------------
   // Helper Functions
   // --------------------------------------------------------------------------
-  bool are_all_segments_received();
+  bool copy_running_sector(uint16_t sector);
+  bool is_manifest_complete(uint32_t sectors);
+  int find_bad_sector(uint16_t first);
+  bool begin_sector_repair(uint16_t sector);
+  void recover_lost_segments(LineSlot &slot);
+  LineSlot &get_line_slot(uint16_t line_num);
+  int find_slot_to_request();
+  bool are_all_segments_received(LineSlot &slot);
   void add_hex_line_to_checksum();
   bool is_file_checksum_valid();
-  void reset_cur_hex_line_buff();
+  void reset_line_slot(LineSlot &slot, uint16_t line_num);
+  void reset_line_slots();
   void clear_transfer_state();
   bool is_transfer_in_progress();
   bool is_file_transfer_complete();
-  bool has_segment_timed_out();
+  uint16_t get_hex_line_num();
+  bool has_segment_timed_out(LineSlot &slot);
   bool has_transfer_timed_out();
   void print_transfer_segment_msg(TransferSegmentMsg &msg);
   void print_transfer_init_msg(TransferInitMsg &msg);
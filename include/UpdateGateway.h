@@ -0,0 +1,142 @@
+#ifndef UPDATEGATEWAY_H
+#define UPDATEGATEWAY_H
+
+#include "Arduino.h"
+#include "HexTransfer.h"
+
+// UpdateGateway lets one node pass an image on to the other nodes of its CAN
+// bus. The image reaches the gateway at USB or SD speed, as any Serial, SD
+// or frame update does, and is checked by its session. Then, instead of
+// flashing it, the gateway takes the PC's place on the bus and sends it to
+// the nodes of GATEWAY_GROUP as a multicast stream (see HexTransfer.h). The
+// host can disconnect as soon as the gateway has the image. It is a state
+// machine, stepped by update() from loop():
+//
+//   IDLE -> PREPARING -> JOINING -> STREAMING <-> QUERYING -> IDLE
+//
+// PREPARING makes the hex file again from the buffer, a few lines per update,
+// for the line count and file checksum of the init message. JOINING sends
+// the init message and SET_FEC, and each node that answers is tracked.
+// STREAMING sends the lines, as fast as the bus takes the frames but no
+// faster than GATEWAY_LINE_US per line, so the nodes keep up. Every
+// GATEWAY_QUERY_LINES lines, and after the last, QUERYING asks the group for
+// the line each node needs next. A node that lost a line ignores the lines
+// after it, so the stream goes on from the lowest of them, after the init
+// message if a node missed it, and a loss costs at most one window of lines.
+// This repeats until every node has the image or has failed, or no node has
+// got further for GATEWAY_STALL_MS. The gateway then reports each node and
+// ends the session.
+//
+// The gateway sends with PC_CAN_DEVICE_ID, so no PC may send a transfer on
+// the bus at the same time. It does not commit: the nodes do, by their
+// FirmwareUpdater policy, or by command from the PC later.
+
+namespace UpdateGateway
+{
+  #if !defined(GATEWAY_MODE)
+    #define GATEWAY_MODE 0 // 1 = images received over Serial or SD are sent on over CAN
+  #endif
+  #if !defined(GATEWAY_GROUP)
+    #define GATEWAY_GROUP MULTICAST_GROUP // Multicast group the image is sent to
+  #endif
+  #if !defined(GATEWAY_FEC_GROUP_SIZE)
+    #define GATEWAY_FEC_GROUP_SIZE 3 // Segments per parity frame (SET_FEC), 0 = none
+  #endif
+  #if GATEWAY_FEC_GROUP_SIZE != 0 && (GATEWAY_FEC_GROUP_SIZE < MIN_FEC_GROUP_SIZE \
+      || GATEWAY_FEC_GROUP_SIZE > MAX_CHUNKS_PER_HEX_LINE)
+    #error "GATEWAY_FEC_GROUP_SIZE must be 0, or MIN_FEC_GROUP_SIZE to MAX_CHUNKS_PER_HEX_LINE"
+  #endif
+
+  #define GATEWAY_MAX_NODES 32          // Nodes tracked, others are sent the image but not reported
+  #define GATEWAY_LINE_US 1000          // Time from one line to the next, at least, in us
+  #define GATEWAY_REPLY_MS 100          // Time the nodes have to answer the init message or a query, in ms
+  #define GATEWAY_QUERY_LINES 128       // Lines sent between queries
+  #define GATEWAY_STALL_MS 10000        // Time without progress before the gateway gives up, in ms
+  #define GATEWAY_LINES_PER_UPDATE 64   // Lines made into the file checksum per update
+  #define GATEWAY_HEX_LINE_BYTES 16     // Data bytes per hex line, as TeensyDuino writes them
+  #define GATEWAY_OUTBOX_FRAMES (MAX_CHUNKS_PER_HEX_LINE + MAX_FEC_PARITY_FRAMES) // One line
+
+  // -----------------------------------------------------------------
+  // Update Gateway Enums
+  // -----------------------------------------------------------------
+  enum class State {
+    IDLE = 0,       // No image to send
+    PREPARING = 1,  // Making the file checksum of the image's hex file
+    JOINING = 2,    // Init message sent, waiting for the nodes to answer
+    STREAMING = 3,  // Sending a window of lines, from the lowest any node needs
+    QUERYING = 4,   // QUERY_MULTICAST sent, waiting for the nodes to answer
+  };
+
+  enum class NodeState {
+    NONE = 0,
+    JOINED = 1,     // In the transfer, needs next_line
+    NEEDS_INIT = 2, // Answered TRANSFER_NOT_IN_PROGRESS: missed the init message
+    COMPLETE = 3,   // Answered TRANSFER_COMPLETE
+    FAILED = 4,     // Answered another error, or went quiet
+  };
+
+  // ----------------------------------------------------------------------------
+  // Update Gateway Structs
+  // ----------------------------------------------------------------------------
+
+  // Node is a node of the group that has answered, by its CAN device ID
+  struct Node
+  {
+    uint8_t id;             // NODE_CAN_DEVICE_ID of the node
+    NodeState state;
+    uint16_t next_line;     // Line it needs next, while JOINED
+    uint8_t error;          // ErrorCode it answered, once FAILED
+    uint32_t last_heard_ts; // Time of its last answer, in ms
+  };
+
+  // LineCursor is a place in the hex file made from the image: the next line,
+  // and where it starts in the image
+  struct LineCursor
+  {
+    uint16_t line;          // Number of the next line
+    uint32_t offset;        // Image offset of the next data record
+    uint32_t base;          // Address of the last 04 record
+    bool done;              // EOF record made
+  };
+
+  // --------------------------------------------------------------------------
+  // Can Bus Message Handlers
+  // --------------------------------------------------------------------------
+  void handle_response(uint8_t node_id, uint8_t (&buf)[8]);
+  Node *find_node(uint8_t node_id);
+
+  // --------------------------------------------------------------------------
+  // Hex Line Functions
+  // --------------------------------------------------------------------------
+  void rewind(LineCursor &cursor, uint16_t line);
+  int next_line(LineCursor &cursor, char (&line)[MAX_HEX_LINE_SIZE + 1], bool format);
+
+  // --------------------------------------------------------------------------
+  // Frame Functions
+  // --------------------------------------------------------------------------
+  bool queue_frame(uint8_t msg_id, const uint8_t (&buf)[8]);
+  void queue_segment(uint16_t line_num, uint8_t segment_num, uint8_t total_segments,
+                     const char *data);
+  void queue_line(const char *line, int len, uint16_t line_num);
+  void queue_init();
+  void queue_control(HexTransfer::ControlCode code, uint8_t arg);
+  bool send_outbox();
+
+  // --------------------------------------------------------------------------
+  // Helper Functions
+  // --------------------------------------------------------------------------
+  void end_query();
+  void finish();
+
+  // ----------------------------------------------------------------------------
+  // Main Functions
+  // ----------------------------------------------------------------------------
+  void init();
+  bool begin(transport_t *t);
+  void update();
+  bool is_active();
+} // namespace UpdateGateway
+
+
+
+#endif
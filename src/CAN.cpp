@@ -2,31 +2,61 @@
  * CAN.cpp - Helper for constructing and sending CAN bus messages.
  */
 #include "CAN.h"
+#include "FirmwareUpdater.h"
+#include "UpdateGateway.h"
 
 FlexCAN CANbus(500000);
+#if CAN_LINKS > 1
+FlexCAN CANbus1(500000, 1);  // CAN1, a second link to the PC (see CAN_LINKS)
+#endif
 
 namespace CAN {
   static CAN_message_t rxmsg;  // Used to store incoming messages
+  
+  // Controller of each link. Messages from the PC are taken from any of
+  // them, and the transfer answers on the link a line is striped to.
+  static FlexCAN *const links[CAN_LINKS] = {
+    &CANbus,
+#if CAN_LINKS > 1
+    &CANbus1,
+#endif
+  };
 }
 
 void CAN::init() {
-  CANbus.begin();
+  for (int link = 0; link < CAN_LINKS; link++) {
+    links[link]->begin();
+  }
 }
 
 void CAN::handleInbox() {
-  while (CANbus.read(rxmsg)) {
-    uint8_t deviceID = (uint8_t) (rxmsg.id & 0xFFu);
-    // uint8_t msgID = (uint8_t) (rxmsg.id / 256);
-    
-    if (deviceID == 0x0) {
-      HexTransfer::handle_can_msg(rxmsg.buf);
-    }
-    else {
-      Serial.print("CAN message from device: ");
-      Serial.println(deviceID);
+  for (int link = 0; link < CAN_LINKS; link++) {
+    while (links[link]->read(rxmsg)) {
+      uint8_t deviceID = (uint8_t) (rxmsg.id & 0xFFu);
+      uint8_t msgID = (uint8_t) (rxmsg.id / 256);
+      
+      if (deviceID == 0x0 && msgID == CONTROL_CAN_COMMAND_ID) {
+        HexTransfer::handle_control_msg(rxmsg.buf);
+      }
+      else if (deviceID == 0x0 && msgID == UPDATER_CAN_COMMAND_ID) {
+        FirmwareUpdater::handle_command_msg(rxmsg.buf);
+      }
+      else if (deviceID == 0x0 && msgID == MULTICAST_CAN_COMMAND_ID + MULTICAST_GROUP) {
+        HexTransfer::handle_multicast_msg(rxmsg.buf);
+      }
+      else if (deviceID == 0x0) {
+        HexTransfer::handle_can_msg(rxmsg.buf);
+      }
+      else if (msgID == PC_CAN_COMMAND_ID && UpdateGateway::is_active()) {
+        UpdateGateway::handle_response(deviceID, rxmsg.buf);
+      }
+      else {
+        Serial.print("CAN message from device: ");
+        Serial.println(deviceID);
+      }
+      
+      CAN::wipeMessage();
     }
-    
-    CAN::wipeMessage();
   }
 }
 
@@ -40,20 +70,21 @@ void CAN::wipeMessage() {
   }
 }
 
-boolean CAN::write(CAN_message_t msg) {
-  if (CANbus.write(msg))
+boolean CAN::write(CAN_message_t msg, uint8_t link) {
+  if (links[link]->write(msg))
     return true;
   else
     return false;
 }
 
-void CAN::write(uint8_t deviceID, uint8_t commandID, uint8_t payloadLength, uint8_t buffer[]) {
+boolean CAN::write(uint8_t deviceID, uint8_t commandID, uint8_t payloadLength, uint8_t buffer[],
+                   uint8_t link) {
   uint16_t fullID = (uint16_t) deviceID + (((uint16_t) commandID) << 8);
   uint8_t ext = 1;  // Extend ID by 1 byte
   uint16_t timeout = 0;
   CAN_message_t txmsg = {fullID, ext, payloadLength, timeout};
   memcpy(txmsg.buf, buffer, payloadLength);
-  CAN::write(txmsg);
+  return CAN::write(txmsg, link);
 //  CAN::_printCAN(txmsg);
 }
 
@@ -0,0 +1,177 @@
+//******************************************************************************
+// FXCRC.C -- CRC32 of firmware images, with the fastest backend for each Teensy
+//******************************************************************************
+// See FXCRC.h. Every backend computes the same CRC32 and takes and returns the
+// finished (final XOR applied) value, so they can be mixed and combined.
+//******************************************************************************
+#include <string.h>		// memcpy()
+#include "FXCRC.h"		// FXCRC_BACKEND, etc.
+#if defined(KINETISK)
+#include <kinetis.h>		// CRC_CRC, CRC_CTRL, CRC_GPOLY, SIM_SCGC6
+#endif
+
+#define FXCRC_POLY		(0xEDB88320)	// reflected 0x04C11DB7
+
+//******************************************************************************
+// fxcrc32_update()	continue crc (0 to start) with count bytes of data
+//******************************************************************************
+uint32_t fxcrc32_update( uint32_t crc, const void *data, uint32_t count )
+{
+#if (FXCRC_BACKEND == FXCRC_BACKEND_KINETIS)
+  return fxcrc32_kinetis( crc, data, count );
+#elif (FXCRC_BACKEND == FXCRC_BACKEND_SLICE8)
+  return fxcrc32_slice8( crc, data, count );
+#else
+  return fxcrc32_bitwise( crc, data, count );
+#endif
+}
+
+//******************************************************************************
+// fxcrc32_bitwise()	one bit per step, no table
+//******************************************************************************
+uint32_t fxcrc32_bitwise( uint32_t crc, const void *data, uint32_t count )
+{
+  const uint8_t *p = (const uint8_t *)data;
+  crc = ~crc;
+  while (count--) {
+    crc ^= *p++;
+    for (int i=0; i<8; i++)
+      crc = (crc >> 1) ^ (FXCRC_POLY & -(crc & 1));
+  }
+  return ~crc;
+}
+
+//******************************************************************************
+// fxcrc32_slice8()	eight bytes per step, table built in RAM on first use
+//******************************************************************************
+static uint32_t fxcrc_table[8][256];
+static int fxcrc_table_ready = 0;
+
+static void fxcrc_make_table( void )
+{
+  uint32_t c;
+  for (int n=0; n<256; n++) {
+    c = n;
+    for (int i=0; i<8; i++)
+      c = (c >> 1) ^ (FXCRC_POLY & -(c & 1));
+    fxcrc_table[0][n] = c;
+  }
+  for (int n=0; n<256; n++) {
+    c = fxcrc_table[0][n];
+    for (int k=1; k<8; k++) {
+      c = fxcrc_table[0][c & 0xFF] ^ (c >> 8);
+      fxcrc_table[k][n] = c;
+    }
+  }
+  fxcrc_table_ready = 1;
+}
+
+uint32_t fxcrc32_slice8( uint32_t crc, const void *data, uint32_t count )
+{
+  const uint8_t *p = (const uint8_t *)data;
+  uint32_t (*t)[256] = fxcrc_table;
+  uint32_t a, b;
+
+  if (!fxcrc_table_ready)
+    fxcrc_make_table();
+
+  crc = ~crc;
+  while (count > 0 && ((uintptr_t)p & 3)) {		// align to 4 bytes
+    crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    count--;
+  }
+  while (count >= 8) {					// little-endian words
+    memcpy( &a, p, 4 );
+    memcpy( &b, p + 4, 4 );
+    a ^= crc;
+    crc = t[7][a & 0xFF] ^ t[6][(a >> 8) & 0xFF]
+	^ t[5][(a >> 16) & 0xFF] ^ t[4][a >> 24]
+	^ t[3][b & 0xFF] ^ t[2][(b >> 8) & 0xFF]
+	^ t[1][(b >> 16) & 0xFF] ^ t[0][b >> 24];
+    p += 8;
+    count -= 8;
+  }
+  while (count-- > 0)
+    crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+#if defined(KINETISK)
+//******************************************************************************
+// fxcrc32_kinetis()	Kinetis CRC peripheral, one 32-bit write per 4 bytes
+//******************************************************************************
+// The peripheral computes the non-reflected CRC, so writes and reads are
+// transposed (bits and bytes) to get the reflected one, and FXOR applies the
+// final XOR. Writes are also transposed while WAS is set, so the seed that
+// continues crc is simply ~crc. The peripheral holds no state between calls.
+#define FXCRC_CTRL_TOT_BB	(2 << 30)	// transpose writes, bits and bytes
+#define FXCRC_CTRL_TOTR_BB	(2 << 28)	// transpose reads, bits and bytes
+#define FXCRC_CTRL_FXOR		(1 << 26)	// complement reads
+#define FXCRC_CTRL_WAS		(1 << 25)	// writes are the seed
+#define FXCRC_CTRL_TCRC		(1 << 24)	// 32-bit CRC
+
+uint32_t fxcrc32_kinetis( uint32_t crc, const void *data, uint32_t count )
+{
+  const uint8_t *p = (const uint8_t *)data;
+  const uint32_t ctrl = FXCRC_CTRL_TOT_BB | FXCRC_CTRL_TOTR_BB
+			| FXCRC_CTRL_FXOR | FXCRC_CTRL_TCRC;
+  uint32_t w;
+
+  SIM_SCGC6 |= SIM_SCGC6_CRC;				// clock the peripheral
+  CRC_CTRL  = ctrl | FXCRC_CTRL_WAS;
+  CRC_GPOLY = 0x04C11DB7;
+  CRC_CRC   = ~crc;					// seed
+  CRC_CTRL  = ctrl;
+
+  while (count > 0 && ((uintptr_t)p & 3)) {		// align to 4 bytes
+    *(volatile uint8_t *)&CRC_CRC = *p++;
+    count--;
+  }
+  while (count >= 4) {
+    memcpy( &w, p, 4 );
+    CRC_CRC = w;
+    p += 4;
+    count -= 4;
+  }
+  while (count-- > 0)
+    *(volatile uint8_t *)&CRC_CRC = *p++;
+  return CRC_CRC;
+}
+#endif // KINETISK
+
+//******************************************************************************
+// fxcrc_multmodp()	a * b modulo the CRC polynomial (reflected bit order)
+//******************************************************************************
+static uint32_t fxcrc_multmodp( uint32_t a, uint32_t b )
+{
+  uint32_t m = (uint32_t)1 << 31, p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0)
+        break;
+    }
+    m >>= 1;
+    b = (b >> 1) ^ (FXCRC_POLY & -(b & 1));
+  }
+  return p;
+}
+
+//******************************************************************************
+// fxcrc32_combine()	CRC32 of a followed by b, from crc1 = CRC32(a),
+//			crc2 = CRC32(b) and len2 = length of b
+//******************************************************************************
+// crc1 is shifted over len2 bytes by multiplying with x^(8*len2), which is
+// built from repeated squares of x^8, so no table is needed.
+uint32_t fxcrc32_combine( uint32_t crc1, uint32_t crc2, uint32_t len2 )
+{
+  uint32_t p = (uint32_t)1 << 31;			// x^0
+  uint32_t sq = (uint32_t)1 << 23;			// x^8 (one byte)
+  while (len2 > 0) {
+    if (len2 & 1)
+      p = fxcrc_multmodp( sq, p );
+    sq = fxcrc_multmodp( sq, sq );
+    len2 >>= 1;
+  }
+  return fxcrc_multmodp( p, crc1 ) ^ crc2;
+}
@@ -0,0 +1,246 @@
+//******************************************************************************
+// FXDELTA.C -- binary delta (patch) images against the running firmware
+//******************************************************************************
+// See FXDelta.h for the patch format. delta_feed() is a byte-at-a-time state
+// machine, so the patch can arrive in records of any size (hex lines, CAN
+// segments). Output is collected in a small stage buffer and written to the
+// buffer in multiples of FLASH_WRITE_SIZE, as flash_write_block() requires.
+//******************************************************************************
+#include <Arduino.h>		// Serial, etc. (if used)
+#include <string.h>		// memcpy()
+#include "FXDelta.h"		// delta_t, FLASH_BASE_ADDR, etc.
+#include "FXCRC.h"		// fxcrc32_update()
+
+#define DELTA_STATE_HEADER	(0)	// collecting header bytes
+#define DELTA_STATE_OP		(1)	// expecting a command byte
+#define DELTA_STATE_DELTA	(2)	// decoding COPY offset varint
+#define DELTA_STATE_LEN		(3)	// decoding command length varint
+#define DELTA_STATE_DATA	(4)	// INSERT bytes or RUN byte follow
+#define DELTA_STATE_DONE	(5)	// all of patch_size consumed
+
+//******************************************************************************
+// delta_le32()	read little-endian uint32 from (possibly unaligned) address
+//******************************************************************************
+static uint32_t delta_le32( const uint8_t *p )
+{
+  return (p[0] << 0) | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+//******************************************************************************
+// firmware_build_id()	CRC32 of running code, identifies it to the host
+//******************************************************************************
+// must be called while the buffer is empty (firmware_code_end)
+uint32_t firmware_build_id( uint32_t *size )
+{
+  *size = firmware_code_end() - FLASH_BASE_ADDR;
+  return fxcrc32_update( 0, (const void *)FLASH_BASE_ADDR, *size );
+}
+
+//******************************************************************************
+// delta_is_patch()	return 1 if data (first record of image) is an FXDP header
+//******************************************************************************
+int delta_is_patch( const char *data, uint32_t count )
+{
+  return (count >= 4 && delta_le32( (const uint8_t *)data ) == FXDP_MAGIC);
+}
+
+//******************************************************************************
+// delta_begin()	init decoder to write new image at buffer_addr
+//******************************************************************************
+// The buffer must be erased, or else d->erase_addr set to where erasing
+// continues (see flash_erase_ahead).
+void delta_begin( delta_t *d, uint32_t buffer_addr, uint32_t buffer_size )
+{
+  memset( d, 0, sizeof(delta_t) );
+  d->buffer_addr = buffer_addr;
+  d->buffer_size = buffer_size;
+  d->state = DELTA_STATE_HEADER;
+}
+
+//******************************************************************************
+// delta_flush()	write staged output to buffer (multiple of FLASH_WRITE_SIZE)
+//******************************************************************************
+static int delta_flush( delta_t *d )
+{
+  uint32_t addr = d->buffer_addr + d->written;
+  if (d->staged == 0)
+    return( DELTA_OK );
+  if (IN_FLASH(d->buffer_addr)) {
+    if (flash_erase_ahead( &d->erase_addr, addr, d->staged )
+	|| flash_write_block( addr, d->stage, d->staged ))
+      return( DELTA_ERR_WRITE );
+  }
+  else {
+    memcpy( (void*)addr, d->stage, d->staged );
+  }
+  d->written += d->staged;
+  d->staged = 0;
+  return( DELTA_OK );
+}
+
+//******************************************************************************
+// delta_put()		append one byte of the new image
+//******************************************************************************
+static int delta_put( delta_t *d, uint8_t c )
+{
+  if (d->out >= d->info.new_size)
+    return( DELTA_ERR_STREAM );
+  d->stage[d->staged++] = c;
+  d->out++;
+  if (d->staged == sizeof(d->stage))
+    return( delta_flush( d ) );
+  return( DELTA_OK );
+}
+
+//******************************************************************************
+// delta_header()	validate header and the running image it refers to
+//******************************************************************************
+static int delta_header( delta_t *d )
+{
+  const uint8_t *p = d->header;
+  if (delta_le32( p ) != FXDP_MAGIC)
+    return( DELTA_ERR_HEADER );
+  d->info.old_size   = delta_le32( p + 4 );
+  d->info.old_crc32  = delta_le32( p + 8 );
+  d->info.new_size   = delta_le32( p + 12 );
+  d->info.new_crc32  = delta_le32( p + 16 );
+  d->info.patch_size = delta_le32( p + 20 );
+  if (d->info.patch_size < FXDP_HEADER_SIZE)
+    return( DELTA_ERR_HEADER );
+  if (d->info.new_size > d->buffer_size)
+    return( DELTA_ERR_SIZE );
+  // old image must be below the buffer we are about to write
+  if (IN_FLASH(d->buffer_addr) && FLASH_BASE_ADDR + d->info.old_size > d->buffer_addr)
+    return( DELTA_ERR_OLD );
+  if (d->info.old_size > FLASH_SIZE - FLASH_RESERVE)
+    return( DELTA_ERR_OLD );
+  // the patch can only be applied to the image it was made from
+  uint32_t crc = fxcrc32_update( 0, (const void *)FLASH_BASE_ADDR, d->info.old_size );
+  if (crc != d->info.old_crc32)
+    return( DELTA_ERR_OLD );
+  return( DELTA_OK );
+}
+
+//******************************************************************************
+// delta_command()	start (or for COPY, execute) the decoded command
+//******************************************************************************
+static int delta_command( delta_t *d )
+{
+  int error = DELTA_OK;
+  if (d->op == FXDP_COPY) {
+    if (d->cursor > d->info.old_size || d->len > d->info.old_size - d->cursor)
+      return( DELTA_ERR_STREAM );
+    const uint8_t *old = (const uint8_t *)(FLASH_BASE_ADDR + d->cursor);
+    d->cursor += d->len;
+    while (d->len > 0 && error == DELTA_OK) {
+      error = delta_put( d, *old++ );
+      d->len--;
+    }
+    d->state = DELTA_STATE_OP;
+  }
+  else {
+    d->state = (d->len > 0) ? DELTA_STATE_DATA : DELTA_STATE_OP;
+  }
+  return( error );
+}
+
+//******************************************************************************
+// delta_byte()		advance decoder by one patch byte
+//******************************************************************************
+static int delta_byte( delta_t *d, uint8_t c )
+{
+  switch (d->state) {
+    case DELTA_STATE_HEADER:
+      d->header[d->in] = c;
+      if (d->in + 1 == FXDP_HEADER_SIZE) {
+        d->state = DELTA_STATE_OP;
+        return( delta_header( d ) );
+      }
+      return( DELTA_OK );
+
+    case DELTA_STATE_OP:
+      if (c != FXDP_COPY && c != FXDP_INSERT && c != FXDP_RUN)
+        return( DELTA_ERR_STREAM );
+      d->op = c;
+      d->arg = d->shift = 0;
+      d->state = (c == FXDP_COPY) ? DELTA_STATE_DELTA : DELTA_STATE_LEN;
+      return( DELTA_OK );
+
+    case DELTA_STATE_DELTA:
+    case DELTA_STATE_LEN:
+      if (d->shift > 28)
+        return( DELTA_ERR_STREAM );
+      d->arg |= (uint32_t)(c & 0x7F) << d->shift;
+      d->shift += 7;
+      if (c & 0x80)					// more varint bytes
+        return( DELTA_OK );
+      if (d->state == DELTA_STATE_DELTA) {		// zigzag offset
+        d->cursor += (d->arg >> 1) ^ -(d->arg & 1);
+        d->arg = d->shift = 0;
+        d->state = DELTA_STATE_LEN;
+        return( DELTA_OK );
+      }
+      d->len = d->arg;
+      return( delta_command( d ) );
+
+    case DELTA_STATE_DATA:
+      if (d->op == FXDP_INSERT) {
+        d->len--;
+        if (d->len == 0)
+          d->state = DELTA_STATE_OP;
+        return( delta_put( d, c ) );
+      }
+      else {						// RUN
+        int error = DELTA_OK;
+        while (d->len > 0 && error == DELTA_OK) {
+          error = delta_put( d, c );
+          d->len--;
+        }
+        d->state = DELTA_STATE_OP;
+        return( error );
+      }
+
+    default:						// DONE
+      return( DELTA_ERR_STREAM );
+  }
+}
+
+//******************************************************************************
+// delta_feed()		apply the next count bytes of the patch (in order)
+//******************************************************************************
+int delta_feed( delta_t *d, const char *data, uint32_t count )
+{
+  while (count-- > 0 && d->error == DELTA_OK) {
+    d->error = delta_byte( d, (uint8_t)*data++ );
+    d->in++;
+    if (d->error == DELTA_OK && d->state != DELTA_STATE_HEADER
+	&& d->in == d->info.patch_size) {
+      if (d->state != DELTA_STATE_OP)			// last command cut short
+        d->error = DELTA_ERR_STREAM;
+      d->state = DELTA_STATE_DONE;
+    }
+  }
+  return( d->error );
+}
+
+//******************************************************************************
+// delta_finish()	write remaining output and check new image size and CRC32
+//******************************************************************************
+int delta_finish( delta_t *d )
+{
+  if (d->error != DELTA_OK)
+    return( d->error );
+  if (d->state != DELTA_STATE_DONE || d->out != d->info.new_size)
+    return( d->error = DELTA_ERR_STREAM );
+
+  // pad the last write to a full flash write unit, like erased flash
+  while (d->staged % FLASH_WRITE_SIZE)
+    d->stage[d->staged++] = 0xFF;
+  if ((d->error = delta_flush( d )) != DELTA_OK)
+    return( d->error );
+
+  uint32_t crc = fxcrc32_update( 0, (const void *)d->buffer_addr, d->info.new_size );
+  if (crc != d->info.new_crc32)
+    d->error = DELTA_ERR_CRC;
+  return( d->error );
+}
@@ -0,0 +1,363 @@
+//******************************************************************************
+// FXDIRECT.CPP -- direct update: stream the new image straight to FLASH_BASE_ADDR
+//******************************************************************************
+// See FXDirect.h. Everything here is RAMFUNC and calls nothing in flash but
+// the RAMFUNC flash_move_xxx() primitives: no library functions (memcpy, the
+// FXCRC table, etc.), and no constant data, which T3.x keeps in flash. Loops
+// are written so the compiler does not turn them into memcpy() or memset().
+//******************************************************************************
+#include <Arduino.h>		// LPUART6_xxx, UART0_xxx, __disable_irq()
+#include "FXDirect.h"		// DIRECT_MAX_SIZE
+#include "FXFrame.h"		// FRAME_xxx
+#include "FXUtil.h"		// INGEST_xxx
+extern "C" {
+  #include "FXLZ.h"		// FXLZ_MAGIC
+  #include "FXDelta.h"		// FXDP_MAGIC
+}
+
+#if (DIRECT_MODE)
+
+//******************************************************************************
+// state of the direct update (RAM)
+//******************************************************************************
+static uint8_t direct_sector[FLASH_SECTOR_SIZE] __attribute__ ((aligned (8)));
+static uint8_t direct_frame[FRAME_MAX_PAYLOAD];	// payload of frame received
+static char direct_id[] = FLASH_ID;		// not const: in RAM on T3.x
+
+static struct {
+  uint32_t image_size;			// from FRAME_START
+  uint32_t image_crc;
+  uint32_t offset;			// image bytes received
+  uint32_t addr;			// flash address of direct_sector
+  uint32_t fill;			//   and bytes in it
+  uint16_t expected;			// seq of next frame to accept
+  int nak_sent;				// NAK sent for expected
+  int started;				// FRAME_START accepted
+  int status;				// INGEST_MORE, or the first error
+  int result;				// FRAME_RESULT status (-1 until END)
+  int erased;				// old code erased (a sector written)
+} direct;
+
+//******************************************************************************
+// direct_rx()		wait for and return a byte from Serial1
+//******************************************************************************
+RAMFUNC static uint8_t direct_rx( void )
+{
+  #if defined(__IMXRT1062__)
+    while (((LPUART6_WATER >> 24) & 0x7) == 0) {	// RXCOUNT
+      if (LPUART6_STAT & LPUART_STAT_OR)		// overrun stops receiver
+        LPUART6_STAT |= LPUART_STAT_OR;
+    }
+    return( LPUART6_DATA & 0xFF );
+  #elif defined(KINETISK)
+    while (UART0_RCFIFO == 0) {}
+    (void)UART0_S1;				// S1 then D clears RDRF and OR
+    return( UART0_D );
+  #else
+    while (!(UART0_S1 & UART_S1_RDRF)) {
+      if (UART0_S1 & UART_S1_OR)		// TLC UART0: write 1 to clear
+        UART0_S1 = UART_S1_OR;
+    }
+    return( UART0_D );
+  #endif
+}
+
+//******************************************************************************
+// direct_tx()		send a byte on Serial1
+//******************************************************************************
+RAMFUNC static void direct_tx( uint8_t b )
+{
+  #if defined(__IMXRT1062__)
+    while (!(LPUART6_STAT & LPUART_STAT_TDRE)) {}
+    LPUART6_DATA = b;
+  #else
+    while (!(UART0_S1 & UART_S1_TDRE)) {}
+    UART0_D = b;
+  #endif
+}
+
+//******************************************************************************
+// direct_crc()		fxcrc32_update() of one byte, bitwise (no table)
+//******************************************************************************
+RAMFUNC static uint32_t direct_crc( uint32_t crc, uint8_t b )
+{
+  crc = ~crc ^ b;
+  for (int i=0; i < 8; i++)
+    crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  return( ~crc );
+}
+
+//******************************************************************************
+// direct_send()	send a device frame, payload = len bytes of value (LE)
+//******************************************************************************
+RAMFUNC static void direct_send( uint8_t type, uint16_t seq, uint32_t value, uint16_t len )
+{
+  uint8_t h[FRAME_HEADER_SIZE - 1];
+  uint32_t crc = 0;
+
+  h[0] = type;
+  h[1] = seq;
+  h[2] = seq >> 8;
+  h[3] = len;
+  h[4] = len >> 8;
+  direct_tx( FRAME_SOF );
+  for (int i=0; i < FRAME_HEADER_SIZE - 1; i++) {
+    direct_tx( h[i] );
+    crc = direct_crc( crc, h[i] );
+  }
+  for (int i=0; i < len; i++) {
+    direct_tx( value >> (8 * i) );
+    crc = direct_crc( crc, value >> (8 * i) );
+  }
+  for (int i=0; i < FRAME_CRC_SIZE; i++)
+    direct_tx( crc >> (8 * i) );
+}
+
+//******************************************************************************
+// direct_ack()		FRAME_ACK or FRAME_NAK, with credits for the sector left
+//******************************************************************************
+// Credits cover only the frames that fit in direct_sector, so the frame that
+// fills it is the last in flight, and the sector is written while the host
+// waits. Past the end of the image, one credit is for FRAME_END.
+RAMFUNC static void direct_ack( uint8_t type )
+{
+  uint16_t credits = (FLASH_SECTOR_SIZE - direct.fill) / FRAME_MAX_PAYLOAD;
+  direct_send( type, direct.expected, credits ? credits : 1, 2 );
+}
+
+//******************************************************************************
+// direct_receive()	next frame into direct_frame -- 1 if intact, 0 if not
+//******************************************************************************
+// -1 if the header is not a frame (payload too long): look for FRAME_SOF again
+RAMFUNC static int direct_receive( uint8_t *type, uint16_t *seq, uint16_t *len )
+{
+  uint8_t h[FRAME_HEADER_SIZE - 1];
+  uint32_t crc = 0, frame_crc = 0;
+
+  while (direct_rx() != FRAME_SOF) {}
+  for (int i=0; i < FRAME_HEADER_SIZE - 1; i++) {
+    h[i] = direct_rx();
+    crc = direct_crc( crc, h[i] );
+  }
+  *type = h[0];
+  *seq = h[1] | (h[2] << 8);
+  *len = h[3] | (h[4] << 8);
+  if (*len > FRAME_MAX_PAYLOAD)
+    return( -1 );
+  for (int i=0; i < *len; i++) {
+    direct_frame[i] = direct_rx();
+    crc = direct_crc( crc, direct_frame[i] );
+  }
+  for (int i=0; i < FRAME_CRC_SIZE; i++)
+    frame_crc |= (uint32_t)direct_rx() << (8 * i);
+  return( frame_crc == crc );
+}
+
+//******************************************************************************
+// direct_reboot()	erase the old code from addr to code_end, and REBOOT
+//******************************************************************************
+RAMFUNC static void direct_reboot( uint32_t addr, uint32_t code_end )
+{
+  for ( ; addr < code_end; addr += FLASH_SECTOR_SIZE)
+    flash_move_erase( addr );
+
+  // let the last frame go out
+  #if defined(__IMXRT1062__)
+    while (!(LPUART6_STAT & LPUART_STAT_TC)) {}
+  #else
+    while (!(UART0_S1 & UART_S1_TC)) {}
+  #endif
+  REBOOT;
+  for (;;) {}
+}
+
+//******************************************************************************
+// direct_flush()	write direct_sector to flash, unless it already holds it
+//******************************************************************************
+RAMFUNC static void direct_flush( void )
+{
+  uint32_t *w = (uint32_t *)direct_sector;
+  uint32_t end = (direct.fill + 3) & ~3;
+  int error = 0;
+
+  // a compressed image or patch cannot be written in place
+  if (direct.addr == FLASH_BASE_ADDR && (w[0] == FXLZ_MAGIC || w[0] == FXDP_MAGIC)) {
+    direct.status = INGEST_ERR_IMAGE;
+    return;
+  }
+
+  // check FSEC value in new code (as ingest_check) before its sector is written
+  #if defined(KINETISK) || defined(KINETISL)
+  if (direct.addr == (0x40C & ~(FLASH_SECTOR_SIZE - 1))
+	&& (direct.addr + direct.fill < 0x410 || w[(0x40C - direct.addr) / 4] != 0xfffff9de)) {
+    direct.status = INGEST_ERR_IMAGE;
+    return;
+  }
+  #endif
+
+  // the last write unit of the image is padded like erased flash
+  if (direct.fill & 3)
+    w[direct.fill / 4] |= 0xFFFFFFFF << (8 * (direct.fill & 3));
+  if (end % FLASH_WRITE_SIZE)
+    w[end / 4] = 0xFFFFFFFF;
+
+  if (!flash_move_sector_matches( direct.addr, (uint32_t)(uintptr_t)direct_sector, direct.fill )) {
+    direct.erased = 1;
+    error |= flash_move_erase( direct.addr );
+    for (uint32_t i=0; i < direct.fill; i += FLASH_PAGE_SIZE)
+      error |= flash_move_page( direct.addr + i, direct_sector + i, direct.fill - i );
+  }
+  if (error)
+    direct.status = INGEST_ERR_WRITE;
+  direct.addr += FLASH_SECTOR_SIZE;
+  direct.fill = 0;
+}
+
+//******************************************************************************
+// direct_start()	FRAME_START: size and CRC32 of the image, from its start
+//******************************************************************************
+RAMFUNC static void direct_start( uint16_t len, uint32_t code_end )
+{
+  direct.image_size = 0;
+  direct.image_crc = 0;
+  for (int i=0; i < 4 && len >= 8; i++) {
+    direct.image_size |= (uint32_t)direct_frame[i] << (8 * i);
+    direct.image_crc |= (uint32_t)direct_frame[4 + i] << (8 * i);
+  }
+  direct.offset = 0;
+  direct.addr = FLASH_BASE_ADDR;
+  direct.fill = 0;
+  direct.expected = 1;
+  direct.nak_sent = 0;
+  direct.status = INGEST_MORE;
+  direct.result = -1;
+  direct.started = (direct.image_size > 0 && direct.image_size <= DIRECT_MAX_SIZE);
+  if (!direct.started) {
+    direct_send( FRAME_RESULT, 0, len < 8 ? FRAME_ERR_SEQUENCE : INGEST_ERR_SIZE, 1 );
+    if (!direct.erased)				// old code is still there
+      direct_reboot( code_end, code_end );
+  }
+  direct_ack( FRAME_ACK );
+}
+
+//******************************************************************************
+// direct_data()	FRAME_DATA: next bytes of the image, sectors written as full
+//******************************************************************************
+RAMFUNC static void direct_data( uint16_t len )
+{
+  if (direct.status != INGEST_MORE)			// rest ignored until FRAME_END
+    return;
+  if (!direct.started || direct.result >= 0) {
+    direct.status = FRAME_ERR_SEQUENCE;
+    return;
+  }
+  if (direct.offset + len > direct.image_size) {
+    direct.status = FRAME_ERR_IMAGE_SIZE;
+    return;
+  }
+  for (uint32_t i=0; i < len && direct.status == INGEST_MORE; i++) {
+    direct_sector[direct.fill++] = direct_frame[i];
+    if (direct.fill == FLASH_SECTOR_SIZE)
+      direct_flush();
+  }
+  direct.offset += len;
+  if (direct.offset == direct.image_size && direct.fill > 0 && direct.status == INGEST_MORE)
+    direct_flush();
+}
+
+//******************************************************************************
+// direct_check()	FRAME_END: read back the image -- INGEST_EOF if good
+//******************************************************************************
+RAMFUNC static int direct_check( void )
+{
+  const uint8_t *p = (const uint8_t *)FLASH_BASE_ADDR;
+  uint32_t crc = 0, n;
+
+  if (direct.status != INGEST_MORE)
+    return( direct.status );
+  if (!direct.started)
+    return( FRAME_ERR_SEQUENCE );
+  if (direct.offset != direct.image_size)
+    return( FRAME_ERR_IMAGE_SIZE );
+  for (uint32_t i=0; i < direct.image_size; i++)
+    crc = direct_crc( crc, p[i] );
+  if (crc != direct.image_crc)
+    return( FRAME_ERR_IMAGE_CRC );
+
+  // check FLASH_ID in new code
+  for (uint32_t i=0; i + sizeof(direct_id) - 1 <= direct.image_size; i++) {
+    for (n=0; direct_id[n] != 0 && p[i + n] == (uint8_t)direct_id[n]; n++) {}
+    if (direct_id[n] == 0)
+      return( INGEST_EOF );
+  }
+  return( INGEST_ERR_IMAGE );
+}
+
+//******************************************************************************
+// direct_update()	receive the image into FLASH_BASE_ADDR, then REBOOT
+//******************************************************************************
+// code_end is the end of the old code (firmware_code_end), erased above the
+// new code before the reboot. Never returns.
+RAMFUNC void direct_update( uint32_t code_end )
+{
+  uint8_t type;
+  uint16_t seq, len;
+
+  __disable_irq();
+  flash_move_begin();
+  direct.expected = 0;
+  direct.nak_sent = 0;
+  direct.started = 0;
+  direct.status = INGEST_MORE;
+  direct.result = -1;
+  direct.erased = 0;
+
+  for (;;) {
+    int intact = direct_receive( &type, &seq, &len );
+    if (intact < 0)
+      continue;
+
+    // FRAME_START begins the image again, whatever came before
+    if (intact && type == FRAME_START && seq == 0) {
+      direct_start( len, code_end );
+      continue;
+    }
+    int16_t ahead = (int16_t)(seq - direct.expected);
+    if (!intact || ahead > 0) {			// bad, or a frame was lost
+      if (!direct.nak_sent)
+        direct_ack( FRAME_NAK );
+      direct.nak_sent = 1;
+      continue;
+    }
+    if (ahead < 0) {				// sent again, ACK was lost
+      direct_ack( FRAME_ACK );
+      continue;
+    }
+    direct.expected++;
+    direct.nak_sent = 0;
+
+    switch (type) {
+      case FRAME_DATA:
+        direct_data( len );
+        break;
+
+      case FRAME_END:
+        if (direct.result < 0)
+          direct.result = direct_check();
+        direct_send( FRAME_RESULT, seq, direct.result, 1 );
+        if (direct.result != INGEST_EOF && !direct.erased)
+          direct_reboot( code_end, code_end );
+        break;
+
+      case FRAME_COMMIT:
+      case FRAME_ABORT:
+        // the new code is in place either way, so only a good one reboots
+        if (direct.result == INGEST_EOF)
+          direct_reboot( direct.addr, code_end );
+        break;
+    }
+    direct_ack( FRAME_ACK );
+  }
+}
+
+#endif // DIRECT_MODE
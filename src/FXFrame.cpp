@@ -0,0 +1,352 @@
+//******************************************************************************
+// FXFRAME.CPP -- windowed binary update protocol for USB or UART Serial
+//******************************************************************************
+// See FXFrame.h for the frame format and flow control. Frames are decoded
+// byte by byte straight into a free slot, so a frame is copied once; the slot
+// is written to the buffer by a later frame_poll(). Each call does bounded
+// work: at most FRAME_BYTES_PER_POLL bytes decoded and one frame written.
+//******************************************************************************
+#include <Arduino.h>
+#include "FXFrame.h"		// frame_link_t, FRAME_xxx, etc.
+extern "C" {
+  #include "FXCRC.h"		// fxcrc32_update()
+}
+
+#define FRAME_RX_SYNC		(0)	// looking for FRAME_SOF
+#define FRAME_RX_HEADER		(1)	// collecting header bytes
+#define FRAME_RX_PAYLOAD	(2)	// collecting payload
+#define FRAME_RX_CRC		(3)	// collecting CRC32
+
+static uint16_t frame_le16( const uint8_t *p )
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t frame_le32( const uint8_t *p )
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void frame_put_le32( uint8_t *p, uint32_t value )
+{
+  for (int i=0; i<4; i++)
+    p[i] = value >> (8 * i);
+}
+
+static void frame_send( frame_link_t *link, uint8_t type, uint16_t seq,
+			const uint8_t *payload, uint16_t len );
+
+//******************************************************************************
+// frame_respond()	session event -- send FRAME_RESULT, or end on timeout
+//******************************************************************************
+static void frame_respond( transport_t *t, int event, int status )
+{
+  frame_link_t *link = (frame_link_t *)t;
+
+  if (event == SESSION_EVENT_RESULT) {
+    uint8_t result = status;
+    if (link->cached)				// no frame_result()
+      link->result = status;
+    frame_send( link, FRAME_RESULT, link->end_seq, &result, 1 );
+  }
+  else if (event == SESSION_EVENT_TIMEOUT) {
+    link->timed_out = 1;
+  }
+}
+
+//******************************************************************************
+// frame_begin()	start a session on stream -- SESSION_OK if buffer is free
+//******************************************************************************
+int frame_begin( frame_link_t *link, Stream *stream )
+{
+  memset( link, 0, sizeof(frame_link_t) );
+  link->transport.name = "frames";
+  link->transport.out = stream;
+  link->transport.respond = frame_respond;
+  link->transport.timeout_ms = FRAME_TIMEOUT_MS;
+  link->stream = stream;
+  link->rx_state = FRAME_RX_SYNC;
+  link->result = -1;
+  return( session_begin( &link->transport, 0 ) );
+}
+
+//******************************************************************************
+// frame_send()		send a device frame with a short payload
+//******************************************************************************
+static void frame_send( frame_link_t *link, uint8_t type, uint16_t seq,
+			const uint8_t *payload, uint16_t len )
+{
+  uint8_t buf[FRAME_HEADER_SIZE + 8 + FRAME_CRC_SIZE];
+  buf[0] = FRAME_SOF;
+  buf[1] = type;
+  buf[2] = seq;
+  buf[3] = seq >> 8;
+  buf[4] = len;
+  buf[5] = len >> 8;
+  memcpy( buf + FRAME_HEADER_SIZE, payload, len );
+  frame_put_le32( buf + FRAME_HEADER_SIZE + len,
+		fxcrc32_update( 0, buf + 1, FRAME_HEADER_SIZE - 1 + len ) );
+  link->stream->write( buf, FRAME_HEADER_SIZE + len + FRAME_CRC_SIZE );
+  link->stream->flush();
+}
+
+//******************************************************************************
+// frame_ack()		send FRAME_ACK or FRAME_NAK with expected seq and credits
+//******************************************************************************
+static void frame_ack( frame_link_t *link, uint8_t type )
+{
+  uint16_t credits = FRAME_WINDOW - link->count;
+  uint8_t payload[2] = { (uint8_t)credits, (uint8_t)(credits >> 8) };
+  frame_send( link, type, link->expected, payload, sizeof(payload) );
+}
+
+// only one NAK per expected seq, the host goes back to it once
+static void frame_nak( frame_link_t *link )
+{
+  if (!link->nak_sent) {
+    frame_ack( link, FRAME_NAK );
+    link->nak_sent = 1;
+  }
+}
+
+//******************************************************************************
+// frame_received()	accept a complete frame if intact, in order and held
+//******************************************************************************
+static void frame_received( frame_link_t *link )
+{
+  frame_slot_t *slot = link->rx_slot;
+  uint16_t seq = frame_le16( link->header + 2 );
+
+  if (slot == NULL) {					// no room
+    frame_nak( link );
+    return;
+  }
+  uint32_t crc = fxcrc32_update( 0, link->header + 1, FRAME_HEADER_SIZE - 1 );
+  crc = fxcrc32_update( crc, slot->data, slot->len );
+  if (crc != frame_le32( link->crc )) {
+    frame_nak( link );
+    return;
+  }
+  int16_t ahead = (int16_t)(seq - link->expected);
+  if (ahead < 0) {					// sent again, ACK was lost
+    frame_ack( link, FRAME_ACK );
+    return;
+  }
+  if (ahead > 0) {					// a frame was lost
+    frame_nak( link );
+    return;
+  }
+  slot->type = link->header[1];
+  slot->seq = seq;
+  link->count++;
+  link->expected++;
+  link->nak_sent = 0;
+}
+
+//******************************************************************************
+// frame_rx()		decode count received bytes
+//******************************************************************************
+static void frame_rx( frame_link_t *link, const uint8_t *p, uint32_t count )
+{
+  while (count > 0) {
+    switch (link->rx_state) {
+      case FRAME_RX_SYNC:
+        if (*p == FRAME_SOF) {
+          link->header[0] = FRAME_SOF;
+          link->rx = 1;
+          link->rx_state = FRAME_RX_HEADER;
+        }
+        p++;
+        count--;
+        break;
+
+      case FRAME_RX_HEADER: {
+        link->header[link->rx++] = *p++;
+        count--;
+        if (link->rx < FRAME_HEADER_SIZE)
+          break;
+        uint16_t len = frame_le16( link->header + 4 );
+        if (len > FRAME_MAX_PAYLOAD) {			// not a frame
+          link->rx_state = FRAME_RX_SYNC;
+          break;
+        }
+        link->rx_slot = NULL;
+        if (link->count < FRAME_WINDOW) {
+          link->rx_slot = &link->slot[(link->head + link->count) % FRAME_WINDOW];
+          link->rx_slot->len = len;
+        }
+        link->rx = 0;
+        link->rx_state = (len > 0) ? FRAME_RX_PAYLOAD : FRAME_RX_CRC;
+        break;
+      }
+
+      case FRAME_RX_PAYLOAD: {
+        uint32_t n = frame_le16( link->header + 4 ) - link->rx;
+        if (n > count)
+          n = count;
+        if (link->rx_slot)
+          memcpy( link->rx_slot->data + link->rx, p, n );
+        link->rx += n;
+        p += n;
+        count -= n;
+        if (link->rx == frame_le16( link->header + 4 )) {
+          link->rx = 0;
+          link->rx_state = FRAME_RX_CRC;
+        }
+        break;
+      }
+
+      case FRAME_RX_CRC:
+        link->crc[link->rx++] = *p++;
+        count--;
+        if (link->rx == FRAME_CRC_SIZE) {
+          frame_received( link );
+          link->rx_state = FRAME_RX_SYNC;
+        }
+        break;
+    }
+  }
+}
+
+//******************************************************************************
+// frame_result()	check image after FRAME_END -- INGEST_EOF if good
+//******************************************************************************
+// The session sends FRAME_RESULT (see frame_respond)
+static int frame_result( frame_link_t *link )
+{
+  transport_t *t = &link->transport;
+  ingest_t *in = session_ingest();
+
+  if (!link->started)
+    return( session_result( t, FRAME_ERR_SEQUENCE ) );
+  if (in->status != INGEST_MORE)
+    return( session_result( t, in->status ) );
+  if (link->offset != link->image_size)
+    return( session_result( t, FRAME_ERR_IMAGE_SIZE ) );
+
+  // read back what was written, from each tier (or the stage), unless it was
+  // a patch (buffer holds output)
+  uint32_t crc = link->crc_so_far;
+  if (!in->patch) {
+    static char chunk[512] __attribute__ ((aligned (4)));
+    crc = 0;
+    for (uint32_t offset = 0; offset < link->image_size; ) {
+      uint32_t n = link->image_size - offset;
+      if (n > sizeof(chunk))
+        n = sizeof(chunk);
+      if (ingest_read( in, offset, chunk, n ))
+        break;
+      crc = fxcrc32_update( crc, chunk, n );
+      offset += n;
+    }
+  }
+  if (crc != link->image_crc)
+    return( session_result( t, FRAME_ERR_IMAGE_CRC ) );
+
+  return( session_finish( t ) );
+}
+
+//******************************************************************************
+// frame_process()	act on the next received frame, in order
+//******************************************************************************
+static int frame_process( frame_link_t *link, frame_slot_t *slot )
+{
+  switch (slot->type) {
+    case FRAME_START:
+      if (link->started || slot->len < 8) {
+        session_ingest()->status = FRAME_ERR_SEQUENCE;
+        break;
+      }
+      link->image_size = frame_le32( (uint8_t *)slot->data );
+      link->image_crc = frame_le32( (uint8_t *)slot->data + 4 );
+      link->started = 1;
+      if (slot->len > 8) {			// data partition, by name
+        char name[PART_NAME_MAX + 1];
+        const part_t *part = NULL;
+        uint32_t n = slot->len - 8;
+        if (n <= PART_NAME_MAX) {
+          memcpy( name, slot->data + 8, n );
+          name[n] = 0;
+          part = part_find( name );
+        }
+        if (part == NULL || session_target( &link->transport, part ))
+          session_ingest()->status = FRAME_ERR_PART;
+      }
+      else if (session_offer( &link->transport, link->image_size, link->image_crc )) {
+        link->cached = 1;
+        frame_send( link, FRAME_CACHED, slot->seq, (const uint8_t *)"", 0 );
+      }
+      break;
+
+    case FRAME_DATA:
+      if (link->cached)				// sent before FRAME_CACHED arrived
+        break;
+      if (!link->started || link->result >= 0) {
+        session_ingest()->status = FRAME_ERR_SEQUENCE;
+        break;
+      }
+      if (session_deliver_block( &link->transport, session_ingest()->origin + link->offset,
+			slot->data, slot->len ) == INGEST_MORE)
+        link->crc_so_far = fxcrc32_update( link->crc_so_far, slot->data, slot->len );
+      link->offset += slot->len;
+      break;
+
+    case FRAME_END: {
+      link->end_seq = slot->seq;
+      if (link->result < 0) {
+        if (!link->cached)			// else the session sends it
+          link->result = frame_result( link );
+        break;
+      }
+      uint8_t status = link->result;			// END sent again
+      frame_send( link, FRAME_RESULT, slot->seq, &status, 1 );
+      break;
+    }
+
+    case FRAME_COMMIT:
+      if (link->result == INGEST_EOF)
+        return( FRAME_COMMITTED );
+      break;
+
+    case FRAME_ABORT:
+      return( FRAME_ABORTED );
+  }
+  return( FRAME_MORE );
+}
+
+//******************************************************************************
+// frame_poll()		receive what is available and write one frame
+//******************************************************************************
+int frame_poll( frame_link_t *link )
+{
+  uint8_t chunk[256];
+  uint32_t budget = FRAME_BYTES_PER_POLL;
+
+  while (budget > 0) {
+    int avail = link->stream->available();
+    if (avail <= 0)
+      break;
+    uint32_t n = sizeof(chunk);
+    if (n > budget)
+      n = budget;
+    if (n > (uint32_t)avail)
+      n = avail;
+    n = link->stream->readBytes( (char *)chunk, n );
+    frame_rx( link, chunk, n );
+    budget -= n;
+  }
+
+  // host gone before FRAME_END (see session_poll)
+  if (link->timed_out)
+    return( FRAME_ABORTED );
+  if (link->count == 0)
+    return( FRAME_MORE );
+
+  // write one frame, then return its slot to the host as a credit
+  frame_slot_t *slot = &link->slot[link->head];
+  int ret = frame_process( link, slot );
+  link->head = (link->head + 1) % FRAME_WINDOW;
+  link->count--;
+  frame_ack( link, FRAME_ACK );
+  return( ret );
+}
@@ -0,0 +1,103 @@
+//******************************************************************************
+// FXHEAP.C -- count heap calls, to check that an update does not use the heap
+//******************************************************************************
+// See FXHeap.h. The __wrap_xxx functions replace the heap functions at link
+// time and call the originals (__real_xxx) after counting. newlib's malloc()
+// etc. call the reentrant _malloc_r() etc., so those only count a call that
+// did not come through a wrapped malloc() etc.
+//******************************************************************************
+#include <stddef.h>		// size_t
+#include "FXHeap.h"		// HEAP_ACCOUNTING
+
+#if (HEAP_ACCOUNTING)
+
+static volatile uint32_t heap_calls = 0;
+static volatile int heap_depth = 0;	// in a wrapped malloc() etc.
+
+struct _reent;
+
+void *__real_malloc( size_t size );
+void  __real_free( void *ptr );
+void *__real_realloc( void *ptr, size_t size );
+void *__real_calloc( size_t count, size_t size );
+void *__real__malloc_r( struct _reent *r, size_t size );
+void  __real__free_r( struct _reent *r, void *ptr );
+void *__real__realloc_r( struct _reent *r, void *ptr, size_t size );
+void *__real__calloc_r( struct _reent *r, size_t count, size_t size );
+
+void *__wrap_malloc( size_t size )
+{
+  heap_calls++;
+  heap_depth++;
+  void *p = __real_malloc( size );
+  heap_depth--;
+  return p;
+}
+
+void __wrap_free( void *ptr )
+{
+  heap_calls++;
+  heap_depth++;
+  __real_free( ptr );
+  heap_depth--;
+}
+
+void *__wrap_realloc( void *ptr, size_t size )
+{
+  heap_calls++;
+  heap_depth++;
+  void *p = __real_realloc( ptr, size );
+  heap_depth--;
+  return p;
+}
+
+void *__wrap_calloc( size_t count, size_t size )
+{
+  heap_calls++;
+  heap_depth++;
+  void *p = __real_calloc( count, size );
+  heap_depth--;
+  return p;
+}
+
+void *__wrap__malloc_r( struct _reent *r, size_t size )
+{
+  if (heap_depth == 0)
+    heap_calls++;
+  return __real__malloc_r( r, size );
+}
+
+void __wrap__free_r( struct _reent *r, void *ptr )
+{
+  if (heap_depth == 0)
+    heap_calls++;
+  __real__free_r( r, ptr );
+}
+
+void *__wrap__realloc_r( struct _reent *r, void *ptr, size_t size )
+{
+  if (heap_depth == 0)
+    heap_calls++;
+  return __real__realloc_r( r, ptr, size );
+}
+
+void *__wrap__calloc_r( struct _reent *r, size_t count, size_t size )
+{
+  if (heap_depth == 0)
+    heap_calls++;
+  return __real__calloc_r( r, count, size );
+}
+
+#endif // HEAP_ACCOUNTING
+
+//******************************************************************************
+// heap_call_count()	number of heap calls so far (0 if not counted)
+//******************************************************************************
+uint32_t heap_call_count( void )
+{
+  #if (HEAP_ACCOUNTING)
+  return heap_calls;
+  #else
+  return 0;
+  #endif
+}
@@ -0,0 +1,292 @@
+//******************************************************************************
+// FXLZ.C -- compressed firmware images, decompressed by flash_move_lz()
+//******************************************************************************
+// See FXLZ.h for the stream format. The same decoder, lz_decode(), is used to
+// check the image before the move (lz_check_put) and to program the flash in
+// flash_move_lz() (lz_move_put). It runs from RAM and only touches the packed
+// stream, a RAM window and its put() function, so it is safe while the code
+// in flash is being erased.
+//******************************************************************************
+#include <Arduino.h>		// Serial, etc. (if used)
+#include <string.h>		// strlen()
+#include "FXLZ.h"		// lz_info_t, FLASH_BASE_ADDR, etc.
+
+//******************************************************************************
+// lz_state_t	decoder state, embedded as first member of each put() context
+//******************************************************************************
+typedef struct lz_state {
+  const uint8_t *in;		// next byte of packed stream
+  const uint8_t *in_end;	// end of packed stream
+  uint8_t  *ring;		// window of most recent output bytes
+  uint32_t  mask;		// window size - 1
+  uint32_t  out;		// number of bytes output so far
+  uint32_t  out_size;		// expected number of output bytes
+  int (*put)( struct lz_state *s, uint8_t c );	// consume byte c at s->out
+} lz_state_t;
+
+typedef struct {
+  lz_state_t s;			// decoder state (must be first)
+  uint32_t dst;			// destination address of output
+  uint32_t src;			// address of packed stream (incl. header)
+  uint32_t src_end;		// end of packed stream
+  uint32_t crc;			// running CRC32 of output
+  uint32_t fsec;		// output bytes at 0x40C-0x40F (T3.x)
+  uint32_t id_len;		// strlen(FLASH_ID)
+  int      id_found;		// FLASH_ID found in output
+} lz_check_t;
+
+typedef struct {
+  lz_state_t s;			// decoder state (must be first)
+  uint32_t dst;			// destination address of output
+  uint32_t error;		// accumulated flash error bits
+  union {			// one flash write unit of output
+    uint8_t  b[FLASH_WRITE_SIZE];
+    uint32_t w;
+    uint64_t p;
+  } unit;
+} lz_move_t;
+
+//******************************************************************************
+// lz_le32()	read little-endian uint32 from (possibly unaligned) address
+//******************************************************************************
+RAMFUNC static uint32_t lz_le32( const uint8_t *p )
+{
+  return (p[0] << 0) | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+//******************************************************************************
+// lz_crc32()	update reflected CRC32 (0xEDB88320) with one byte
+//******************************************************************************
+static uint32_t lz_crc32( uint32_t crc, uint8_t c )
+{
+  crc ^= c;
+  for (int i=0; i<8; i++)
+    crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  return crc;
+}
+
+//******************************************************************************
+// lz_decode()	decode stream from s->in, passing each output byte to s->put()
+//******************************************************************************
+RAMFUNC static int lz_decode( lz_state_t *s )
+{
+  uint32_t n, dist;
+  uint8_t t, c;
+  int error;
+
+  while (s->out < s->out_size) {
+    if (s->in >= s->in_end)
+      return( LZ_ERR_STREAM );
+    t = *s->in++;
+    if (t < 0x80) {					// literal run
+      n = t + 1;
+      dist = 0;
+    }
+    else {						// match
+      if (s->in >= s->in_end)
+        return( LZ_ERR_STREAM );
+      dist = (((t & 0x0F) << 8) | *s->in++) + 1;
+      n = ((t >> 4) & 0x07) + 3;
+      if (n == 10) {					//   extended length
+        if (s->in >= s->in_end)
+          return( LZ_ERR_STREAM );
+        n += *s->in++;
+      }
+      if (dist > s->out || dist > s->mask + 1)		//   outside window
+        return( LZ_ERR_STREAM );
+    }
+    while (n--) {
+      if (s->out >= s->out_size)
+        return( LZ_ERR_STREAM );
+      if (dist == 0) {
+        if (s->in >= s->in_end)
+          return( LZ_ERR_STREAM );
+        c = *s->in++;
+      }
+      else {
+        c = s->ring[(s->out - dist) & s->mask];
+      }
+      s->ring[s->out & s->mask] = c;
+      if ((error = s->put( s, c )) != 0)
+        return( error );
+      s->out++;
+    }
+  }
+  return( LZ_OK );
+}
+
+//******************************************************************************
+// lz_read_header()	return 1 and fill info if src holds a valid FXLZ header
+//******************************************************************************
+int lz_read_header( uint32_t src, lz_info_t *info )
+{
+  const uint8_t *p = (const uint8_t *)src;
+  if (lz_le32( p ) != FXLZ_MAGIC)
+    return 0;
+  info->window_bits = p[4];
+  info->raw_size    = lz_le32( p + 8 );
+  info->packed_size = lz_le32( p + 12 );
+  info->raw_crc32   = lz_le32( p + 16 );
+  if (info->window_bits == 0 || info->window_bits > FXLZ_MAX_WINDOW_BITS)
+    return 0;
+  if (info->packed_size < FXLZ_HEADER_SIZE)
+    return 0;
+  return 1;
+}
+
+//******************************************************************************
+// lz_buffer_offset()	offset in buffer for a stream starting with data[count]
+//******************************************************************************
+// Called with the first data record of an image (address FLASH_BASE_ADDR). If
+// it holds an FXLZ header, return the sector-aligned offset that puts the end
+// of the stream at the top of the buffer, otherwise 0 (plain image).
+uint32_t lz_buffer_offset( const char *data, uint32_t count, uint32_t buffer_size )
+{
+  const uint8_t *p = (const uint8_t *)data;
+  if (count < 16 || lz_le32( p ) != FXLZ_MAGIC)
+    return 0;
+  uint32_t packed_size = lz_le32( p + 12 );
+  if (packed_size > buffer_size)	// too large -- let caller's check fail
+    return 0;
+  return (buffer_size - packed_size) & ~(FLASH_SECTOR_SIZE - 1);
+}
+
+//******************************************************************************
+// lz_check_put()	verify one output byte without writing it
+//******************************************************************************
+static int lz_check_put( lz_state_t *s, uint8_t c )
+{
+  lz_check_t *k = (lz_check_t *)s;
+  uint32_t addr = k->dst + s->out;
+
+  k->crc = lz_crc32( k->crc, c );
+
+  // flash_move_lz() erases each destination sector before writing its first
+  // byte, so the part of the stream not yet read must lie above that sector
+  if ((addr & (FLASH_SECTOR_SIZE - 1)) == 0 && IN_FLASH(k->src)) {
+    if (addr + FLASH_SECTOR_SIZE > (uint32_t)s->in && addr < k->src_end)
+      return( LZ_ERR_OVERLAP );
+  }
+
+  #if defined(KINETISK) || defined(KINETISL)
+  if (s->out >= 0x40C && s->out < 0x410)
+    k->fsec |= (uint32_t)c << (8 * (s->out - 0x40C));
+  #endif
+
+  // FLASH_ID ends with this byte if the window holds the whole string
+  if (!k->id_found && c == FLASH_ID[k->id_len - 1] && s->out + 1 >= k->id_len) {
+    uint32_t i, start = s->out + 1 - k->id_len;
+    for (i=0; i < k->id_len; i++) {
+      if (s->ring[(start + i) & s->mask] != (uint8_t)FLASH_ID[i])
+        break;
+    }
+    k->id_found = (i == k->id_len);
+  }
+  return( LZ_OK );
+}
+
+//******************************************************************************
+// lz_image_check()	decode image at src to verify CRC, FSEC, FLASH_ID, overlap
+//******************************************************************************
+// dst is the address flash_move_lz() will be called with (FLASH_BASE_ADDR)
+int lz_image_check( uint32_t dst, uint32_t src, lz_info_t *info )
+{
+  uint8_t ring[1 << FXLZ_MAX_WINDOW_BITS];
+  lz_check_t k;
+  int error;
+
+  if (!lz_read_header( src, info ))
+    return( LZ_ERR_HEADER );
+  if (info->raw_size > FLASH_SIZE - FLASH_RESERVE)
+    return( LZ_ERR_SIZE );
+
+  k.s.in       = (const uint8_t *)src + FXLZ_HEADER_SIZE;
+  k.s.in_end   = (const uint8_t *)src + info->packed_size;
+  k.s.ring     = ring;
+  k.s.mask     = (1 << info->window_bits) - 1;
+  k.s.out      = 0;
+  k.s.out_size = info->raw_size;
+  k.s.put      = lz_check_put;
+  k.dst        = dst;
+  k.src        = src;
+  k.src_end    = src + info->packed_size;
+  k.crc        = 0xFFFFFFFF;
+  k.fsec       = 0;
+  k.id_len     = strlen( FLASH_ID );
+  k.id_found   = 0;
+
+  if ((error = lz_decode( &k.s )) != LZ_OK)
+    return( error );
+  if (k.s.in != k.s.in_end)			// trailing bytes in stream
+    return( LZ_ERR_STREAM );
+  if (~k.crc != info->raw_crc32)
+    return( LZ_ERR_CRC );
+  #if defined(KINETISK) || defined(KINETISL)
+  if (k.fsec != 0xfffff9de)
+    return( LZ_ERR_FSEC );
+  #endif
+  if (!k.id_found)
+    return( LZ_ERR_FLASH_ID );
+  return( LZ_OK );
+}
+
+//******************************************************************************
+// lz_move_put()	program output to flash one write unit at a time (in RAM)
+//******************************************************************************
+RAMFUNC static int lz_move_put( lz_state_t *s, uint8_t c )
+{
+  lz_move_t *m = (lz_move_t *)s;
+  uint32_t i = s->out & (FLASH_WRITE_SIZE - 1);
+
+  m->unit.b[i] = c;
+  if (i == FLASH_WRITE_SIZE - 1) {
+    uint32_t addr = m->dst + s->out - i;
+    if ((addr & (FLASH_SECTOR_SIZE - 1)) == 0)
+      m->error |= flash_move_erase( addr );
+    m->error |= flash_move_write( addr, &m->unit );
+  }
+  return( m->error ? LZ_ERR_STREAM : LZ_OK );
+}
+
+//******************************************************************************
+// flash_move_lz()	decompress image at src to dst, erase buffer, and REBOOT
+//******************************************************************************
+// DANGER: like flash_move(), this is critical and cannot be interrupted. The
+// image at src must have passed lz_image_check() with the same dst.
+RAMFUNC void flash_move_lz( uint32_t dst, uint32_t src )
+{
+  uint8_t ring[1 << FXLZ_MAX_WINDOW_BITS];
+  const uint8_t *p = (const uint8_t *)src;
+  lz_move_t m;
+  uint32_t i;
+
+  // header was validated by lz_image_check(), so just read the fields
+  m.s.in       = p + FXLZ_HEADER_SIZE;
+  m.s.in_end   = p + lz_le32( p + 12 );
+  m.s.ring     = ring;
+  m.s.mask     = (1 << p[4]) - 1;
+  m.s.out      = 0;
+  m.s.out_size = lz_le32( p + 8 );
+  m.s.put      = lz_move_put;
+  m.dst        = dst;
+  m.error      = 0;
+
+  flash_move_begin();
+
+  lz_decode( &m.s );
+
+  // pad and write the last partial write unit, if any
+  i = m.s.out & (FLASH_WRITE_SIZE - 1);
+  if (i > 0 && m.error == 0) {
+    uint32_t addr = dst + m.s.out - i;
+    while (i < FLASH_WRITE_SIZE)
+      m.unit.b[i++] = 0xFF;
+    if ((addr & (FLASH_SECTOR_SIZE - 1)) == 0)
+      m.error |= flash_move_erase( addr );
+    m.error |= flash_move_write( addr, &m.unit );
+  }
+
+  // erase from top of new program (which includes the stream) and REBOOT
+  i = (m.s.out + FLASH_WRITE_SIZE - 1) & ~(FLASH_WRITE_SIZE - 1);
+  flash_move_end( dst + i, IN_FLASH(src) && m.error == 0 );
+}
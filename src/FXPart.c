@@ -0,0 +1,92 @@
+//******************************************************************************
+// FXPART.C -- data partitions: named flash regions updated in place
+//******************************************************************************
+// See FXPart.h. The table is only added to, at startup, so a part_t pointer
+// stays valid, and the number of a partition is its place in the table.
+//******************************************************************************
+#include <Arduino.h>		// for FlashTxx.h
+#include <string.h>		// strcmp(), strlen()
+#include "FXPart.h"		// part_t, PART_xxx
+
+static part_t part_table[PART_MAX];
+static int part_n;
+static uint32_t buffer_addr, buffer_size;	// firmware buffer (part_buffer)
+
+//******************************************************************************
+// part_buffer()	firmware buffer that partitions must not overlap
+//******************************************************************************
+// session_init() calls this with the buffer it found, before any part_add().
+void part_buffer( uint32_t addr, uint32_t size )
+{
+  buffer_addr = addr;
+  buffer_size = size;
+}
+
+//******************************************************************************
+// part_add()		add data partition name at addr -- 0 if OK
+//******************************************************************************
+// Refused if the table is full, the name is taken or too long, or the region
+// is not whole sectors of program flash below FLASH_RESERVE, holds FSEC, or
+// overlaps another or the firmware buffer.
+int part_add( const char *name, uint32_t addr, uint32_t size,
+		void (*updated)( const part_t *part ) )
+{
+  if (part_n >= PART_MAX || name == NULL || strlen( name ) == 0
+	|| strlen( name ) > PART_NAME_MAX || part_find( name ) != NULL)
+    return( 1 );
+  if (size == 0 || (addr | size) & (FLASH_SECTOR_SIZE - 1) || !IN_FLASH(addr)
+	|| size > FLASH_SIZE - FLASH_RESERVE
+	|| addr - FLASH_BASE_ADDR > FLASH_SIZE - FLASH_RESERVE - size)
+    return( 1 );
+  if (addr < buffer_addr + buffer_size && buffer_addr < addr + size)
+    return( 1 );
+  #if defined(KINETISK) || defined(KINETISL)
+  if (addr <= 0x40C && addr + size > 0x40C)
+    return( 1 );
+  #endif
+  for (int i=0; i < part_n; i++)
+    if (addr < part_table[i].addr + part_table[i].size
+	&& part_table[i].addr < addr + size)
+      return( 1 );
+
+  part_table[part_n].name = name;
+  part_table[part_n].addr = addr;
+  part_table[part_n].size = size;
+  part_table[part_n].updated = updated;
+  part_n++;
+  return( 0 );
+}
+
+//******************************************************************************
+// part_find()		partition named name, or NULL
+//******************************************************************************
+const part_t *part_find( const char *name )
+{
+  for (int i=0; i < part_n; i++)
+    if (strcmp( part_table[i].name, name ) == 0)
+      return( &part_table[i] );
+  return( NULL );
+}
+
+//******************************************************************************
+// part_get()		partition number (1 to part_count), or NULL
+//******************************************************************************
+const part_t *part_get( int number )
+{
+  if (number < 1 || number > part_n)
+    return( NULL );
+  return( &part_table[number - 1] );
+}
+
+//******************************************************************************
+// part_number()	number of part, for messages and CAN replies
+//******************************************************************************
+int part_number( const part_t *part )
+{
+  return( (int)(part - part_table) + 1 );
+}
+
+int part_count( void )
+{
+  return( part_n );
+}
@@ -0,0 +1,520 @@
+//******************************************************************************
+// FXSD.CPP -- new code from an SD card file: hex, raw binary or UF2
+//******************************************************************************
+// See FXSD.h. Each sd_reader_poll() does at most one card read and decodes at
+// most SD_BYTES_PER_POLL bytes (one UF2 block), and returns the ingest status.
+//******************************************************************************
+#include <Arduino.h>
+#include <SD.h>
+#include "FXSD.h"		// sd_reader_t, SD_FORMAT_xxx, etc.
+extern "C" {
+  #include "FXCRC.h"		// fxcrc32_update()
+}
+
+static uint32_t sd_le32( const char *p )
+{
+  const uint8_t *u = (const uint8_t *)p;
+  return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+//******************************************************************************
+// sd_image_format()	SD_FORMAT_xxx from file name extension (.hex by default)
+//******************************************************************************
+int sd_image_format( const char *name )
+{
+  const char *ext = strrchr( name, '.' );
+  if (ext && strcasecmp( ext, ".bin" ) == 0)
+    return( SD_FORMAT_BIN );
+  if (ext && strcasecmp( ext, ".uf2" ) == 0)
+    return( SD_FORMAT_UF2 );
+  return( SD_FORMAT_HEX );
+}
+
+//******************************************************************************
+// sd_reader_begin()	start reading file -- t must have had session_begin()
+//******************************************************************************
+void sd_reader_begin( sd_reader_t *r, File *file, int format, transport_t *t )
+{
+  r->file = file;
+  r->transport = t;
+  r->format = format;
+  r->count[0] = r->count[1] = 0;
+  r->cur = 0;
+  r->pos = 0;
+  r->eof = 0;
+  r->bin_addr = session_ingest()->origin;
+  r->uf2_blocks = 0;
+  r->uf2_total = 0;
+  r->finished = 0;
+}
+
+//******************************************************************************
+// sd_fill()		read the next SD_READ_SIZE bytes into an empty block
+//******************************************************************************
+static void sd_fill( sd_reader_t *r, int b )
+{
+  int n = r->file->read( r->block[b], SD_READ_SIZE );
+  if (n <= 0) {
+    r->eof = 1;
+    return;
+  }
+  r->count[b] = n;
+  if (n < SD_READ_SIZE)
+    r->eof = 1;
+}
+
+//******************************************************************************
+// sd_uf2_block()	write the payload of one UF2 block
+//******************************************************************************
+static int sd_uf2_block( sd_reader_t *r, const char *p )
+{
+  ingest_t *in = session_ingest();
+
+  if (sd_le32( p ) != UF2_MAGIC_START0 || sd_le32( p + 4 ) != UF2_MAGIC_START1
+	|| sd_le32( p + UF2_BLOCK_SIZE - 4 ) != UF2_MAGIC_END) {
+    in->out->printf( "abort - bad UF2 block %lu\n", r->uf2_blocks );
+    return( in->status = INGEST_ERR_RECORD );
+  }
+  uint32_t flags = sd_le32( p + 8 );
+  uint32_t addr  = sd_le32( p + 12 );
+  uint32_t size  = sd_le32( p + 16 );
+  uint32_t total = sd_le32( p + 24 );
+  if (r->uf2_blocks++ == 0)
+    r->uf2_total = total;
+  if (flags & UF2_FLAG_NOT_MAIN_FLASH)
+    return( in->status );
+  if (size > UF2_MAX_PAYLOAD || total != r->uf2_total) {
+    in->out->printf( "abort - bad UF2 block %lu\n", r->uf2_blocks - 1 );
+    return( in->status = INGEST_ERR_RECORD );
+  }
+  return( session_deliver_block( r->transport, addr, p + 32, size ) );
+}
+
+//******************************************************************************
+// sd_end()		whole file decoded
+//******************************************************************************
+static int sd_end( sd_reader_t *r )
+{
+  ingest_t *in = session_ingest();
+
+  if (r->format == SD_FORMAT_HEX) {
+    in->out->printf( "abort - no EOF record\n" );
+    return( in->status = INGEST_ERR_RECORD );
+  }
+  if (r->format == SD_FORMAT_UF2 && r->uf2_blocks != r->uf2_total) {
+    in->out->printf( "abort - %lu of %lu UF2 blocks\n", r->uf2_blocks, r->uf2_total );
+    return( in->status = INGEST_ERR_RECORD );
+  }
+  return( ingest_end( in ) );
+}
+
+//******************************************************************************
+// sd_decode()		read one block and decode part of the current one
+//******************************************************************************
+static int sd_decode( sd_reader_t *r )
+{
+  ingest_t *in = session_ingest();
+  int next = r->cur ^ 1;
+
+  if (in->status != INGEST_MORE)
+    return( in->status );
+
+  // keep the block after the current one full
+  if (!r->eof) {
+    if (r->count[r->cur] == 0)
+      sd_fill( r, r->cur );
+    else if (r->count[next] == 0)
+      sd_fill( r, next );
+  }
+
+  uint32_t avail = r->count[r->cur] - r->pos;
+  if (avail == 0)
+    return( r->eof ? sd_end( r ) : in->status );
+
+  const char *p = r->block[r->cur] + r->pos;
+  uint32_t n = (avail < SD_BYTES_PER_POLL) ? avail : SD_BYTES_PER_POLL;
+  switch (r->format) {
+    case SD_FORMAT_HEX:
+      session_deliver( r->transport, p, n );
+      break;
+    case SD_FORMAT_BIN: {
+      // flash_write_block() writes whole 8-byte units, so pad the end of a
+      // plain or FXLZ image like erased flash (a patch is consumed exactly)
+      uint32_t pad = 0;
+      int patch = (r->bin_addr == in->origin) ? delta_is_patch( p, n ) : in->patch;
+      if (r->eof && r->count[next] == 0 && n == avail && !patch) {
+        pad = -n & 7;
+        memset( r->block[r->cur] + r->pos + n, 0xFF, pad );
+      }
+      session_deliver_block( r->transport, r->bin_addr, p, n + pad );
+      r->bin_addr += n;
+      break;
+    }
+    case SD_FORMAT_UF2:
+      // blocks never straddle a read, SD_READ_SIZE is a multiple of them
+      if (avail < UF2_BLOCK_SIZE) {
+        in->out->printf( "abort - partial UF2 block\n" );
+        return( in->status = INGEST_ERR_RECORD );
+      }
+      n = UF2_BLOCK_SIZE;
+      sd_uf2_block( r, p );
+      break;
+  }
+
+  // block done, decode the other one (filled meanwhile) next time
+  r->pos += n;
+  if (r->pos == r->count[r->cur]) {
+    r->count[r->cur] = 0;
+    r->pos = 0;
+    r->cur = next;
+  }
+  return( in->status );
+}
+
+//******************************************************************************
+// sd_reader_poll()	decode the next part of the file -- return ingest status
+//******************************************************************************
+// Once the file is done (INGEST_EOF) or failed, the session checks the image
+// and tells the transport, and the final status is returned from then on.
+int sd_reader_poll( sd_reader_t *r )
+{
+  if (r->finished)
+    return( session_ingest()->status );
+  int status = sd_decode( r );
+  if (status != INGEST_MORE) {
+    r->finished = 1;
+    status = session_finish( r->transport );
+  }
+  return( status );
+}
+
+//******************************************************************************
+// sd_stage_begin()	create (or empty) the stage file
+//******************************************************************************
+static int sd_stage_begin( ingest_stage_t *stage )
+{
+  sd_stage_t *s = (sd_stage_t *)stage;
+
+  if (s->file)
+    s->file.close();
+  SD.remove( s->name );
+  s->file = SD.open( s->name, FILE_WRITE );
+  s->size = 0;
+  return( s->file ? 0 : 1 );
+}
+
+//******************************************************************************
+// sd_stage_write()	write num bytes at offset, 0xFF over any gap before it
+//******************************************************************************
+static int sd_stage_write( ingest_stage_t *stage, uint32_t offset,
+			const char *data, uint32_t num )
+{
+  sd_stage_t *s = (sd_stage_t *)stage;
+  static char erased[64];
+
+  if (offset > s->size) {
+    memset( erased, 0xFF, sizeof(erased) );
+    if (!s->file.seek( s->size ))
+      return( 1 );
+    while (s->size < offset) {
+      uint32_t n = offset - s->size;
+      if (n > sizeof(erased))
+        n = sizeof(erased);
+      if (s->file.write( erased, n ) != n)
+        return( 1 );
+      s->size += n;
+    }
+  }
+  else if (!s->file.seek( offset ))
+    return( 1 );
+  if (s->file.write( data, num ) != num)
+    return( 1 );
+  if (offset + num > s->size)
+    s->size = offset + num;
+  return( 0 );
+}
+
+//******************************************************************************
+// sd_stage_read()	read num bytes at offset (0xFF past what was written)
+//******************************************************************************
+static int sd_stage_read( ingest_stage_t *stage, uint32_t offset,
+			char *data, uint32_t num )
+{
+  sd_stage_t *s = (sd_stage_t *)stage;
+  uint32_t n = (offset < s->size) ? s->size - offset : 0;
+
+  if (n > num)
+    n = num;
+  memset( data + n, 0xFF, num - n );
+  if (n > 0 && (!s->file.seek( offset ) || s->file.read( data, n ) != (int)n))
+    return( 1 );
+  return( 0 );
+}
+
+//******************************************************************************
+// sd_stage_commit()	program flash from the stage file, then reboot
+//			-- returns, with flash untouched, if the file can't be read
+//******************************************************************************
+// The whole file is read first, for its CRC32, so a card that fails stops the
+// commit before anything is erased. Then a streaming flash_move(): each
+// sector is read from the file into RAM, then skipped if flash already holds
+// it, else erased and written a page at a time. The old code is gone once a
+// sector is erased, so from then on a failed read is retried until it works,
+// and if the CRC32 of the sectors read is not that of the first pass, the
+// copy is done again (sectors already written are skipped). Never is a
+// partial image booted. Then the flash buffer, which may hold the start of
+// the image, is erased.
+void sd_stage_commit( ingest_stage_t *stage, uint32_t size )
+{
+  sd_stage_t *s = (sd_stage_t *)stage;
+  static uint32_t sector[FLASH_SECTOR_SIZE/4];
+  uint32_t offset, n, crc = 0, copied, error = 0;
+  int tries;
+
+  s->file.flush();
+  for (offset = 0; offset < size; offset += FLASH_SECTOR_SIZE) {
+    n = (size - offset < FLASH_SECTOR_SIZE) ? size - offset : FLASH_SECTOR_SIZE;
+    for (tries = 0; tries < 3 && sd_stage_read( stage, offset, (char *)sector, n ); tries++)
+      ;
+    if (tries == 3)
+      return;
+    crc = fxcrc32_update( crc, sector, n );
+  }
+
+  flash_move_begin();
+  do {
+    copied = 0;
+    for (offset = 0; offset < size && error == 0; offset += FLASH_SECTOR_SIZE) {
+      uint32_t addr = FLASH_BASE_ADDR + offset;
+      n = (size - offset < FLASH_SECTOR_SIZE) ? size - offset : FLASH_SECTOR_SIZE;
+      while (sd_stage_read( stage, offset, (char *)sector, n ))
+        ;
+      copied = fxcrc32_update( copied, sector, n );
+      if (flash_move_sector_matches( addr, (uint32_t)(uintptr_t)sector, n ))
+        continue;
+      error |= flash_move_erase( addr );
+      for (uint32_t i = 0; i < n; i += FLASH_PAGE_SIZE)
+        error |= flash_move_page( addr + i, (char *)sector + i, n - i );
+    }
+  } while (error == 0 && copied != crc);
+  flash_move_end( FLASH_BASE_ADDR + offset, error == 0 );
+}
+
+//******************************************************************************
+// sd_stage_init()	set up s as a stage in file name (SD.begin() done)
+//******************************************************************************
+void sd_stage_init( sd_stage_t *s, const char *name )
+{
+  s->stage.name = name;
+  s->stage.begin = sd_stage_begin;
+  s->stage.write = sd_stage_write;
+  s->stage.read = sd_stage_read;
+  s->stage.commit = sd_stage_commit;
+  s->name = name;
+  s->size = 0;
+}
+
+#if (SD_CACHE_SLOTS > 0)
+//******************************************************************************
+// sd_cache_path()	file name of the image with crc, or of the index
+//******************************************************************************
+static const char *sd_cache_path( sd_cache_t *c, uint32_t crc, int index )
+{
+  if (index)
+    snprintf( c->path, sizeof(c->path), "%s/INDEX.DAT", c->dir );
+  else
+    snprintf( c->path, sizeof(c->path), "%s/%08lX.BIN", c->dir, (unsigned long)crc );
+  return( c->path );
+}
+
+//******************************************************************************
+// sd_cache_find()	slot of the image of size and crc, or -1
+//******************************************************************************
+static int sd_cache_find( sd_cache_t *c, uint32_t size, uint32_t crc )
+{
+  for (int i=0; i<SD_CACHE_SLOTS; i++)
+    if (c->entry[i].size == size && c->entry[i].crc == crc && size != 0)
+      return( i );
+  return( -1 );
+}
+
+//******************************************************************************
+// sd_cache_save()	write the index
+//******************************************************************************
+static void sd_cache_save( sd_cache_t *c )
+{
+  const char *path = sd_cache_path( c, 0, 1 );
+  SD.remove( path );
+  File f = SD.open( path, FILE_WRITE );
+  if (f) {
+    f.write( c->entry, sizeof(c->entry) );
+    f.close();
+  }
+}
+
+//******************************************************************************
+// sd_cache_use()	make the image of size and crc the most recent
+//******************************************************************************
+// A new image takes the last slot, and the image there is deleted.
+static void sd_cache_use( sd_cache_t *c, uint32_t size, uint32_t crc )
+{
+  int i = sd_cache_find( c, size, crc );
+
+  if (i < 0) {
+    i = SD_CACHE_SLOTS - 1;
+    if (c->entry[i].size != 0 && c->entry[i].crc != crc)
+      SD.remove( sd_cache_path( c, c->entry[i].crc, 0 ) );
+  }
+  memmove( &c->entry[1], &c->entry[0], i * sizeof(sd_cache_entry_t) );
+  c->entry[0].size = size;
+  c->entry[0].crc = crc;
+  sd_cache_save( c );
+}
+
+//******************************************************************************
+// sd_cache_drop()	delete the image of size and crc
+//******************************************************************************
+static void sd_cache_drop( sd_cache_t *c, uint32_t size, uint32_t crc )
+{
+  int i = sd_cache_find( c, size, crc );
+
+  if (i < 0)
+    return;
+  SD.remove( sd_cache_path( c, crc, 0 ) );
+  memmove( &c->entry[i], &c->entry[i+1], (SD_CACHE_SLOTS - 1 - i) * sizeof(sd_cache_entry_t) );
+  c->entry[SD_CACHE_SLOTS - 1].size = 0;
+  sd_cache_save( c );
+}
+
+//******************************************************************************
+// sd_cache_open()	open the image of size and crc -- 0 if cached
+//******************************************************************************
+static int sd_cache_open( image_cache_t *cache, uint32_t size, uint32_t crc )
+{
+  sd_cache_t *c = (sd_cache_t *)cache;
+
+  if (sd_cache_find( c, size, crc ) < 0)
+    return( 1 );
+  c->file = SD.open( sd_cache_path( c, crc, 0 ), FILE_READ );
+  if (!c->file) {
+    sd_cache_drop( c, size, crc );
+    return( 1 );
+  }
+  c->size = size;
+  c->crc = crc;
+  return( 0 );
+}
+
+//******************************************************************************
+// sd_cache_read()	next bytes of the open image (0 at the end, -1 on error)
+//******************************************************************************
+static int sd_cache_read( image_cache_t *cache, char *data, uint32_t num )
+{
+  sd_cache_t *c = (sd_cache_t *)cache;
+
+  return( c->file.read( data, num ) );
+}
+
+//******************************************************************************
+// sd_cache_close()	done loading -- keep the image as most recent, or drop it
+//******************************************************************************
+static void sd_cache_close( image_cache_t *cache, int good )
+{
+  sd_cache_t *c = (sd_cache_t *)cache;
+
+  c->file.close();
+  if (good)
+    sd_cache_use( c, c->size, c->crc );
+  else
+    sd_cache_drop( c, c->size, c->crc );
+}
+
+//******************************************************************************
+// sd_cache_image_read()	num bytes of the image at offset -- 0 if OK
+//******************************************************************************
+// Past image_size the bytes are 0xFF, as erased flash, not read from the tiers.
+static int sd_cache_image_read( ingest_t *in, uint32_t offset, char *data, uint32_t num )
+{
+  uint32_t n = (offset < in->image_size) ? in->image_size - offset : 0;
+
+  if (n > num)
+    n = num;
+  memset( data + n, 0xFF, num - n );
+  return( n > 0 && ingest_read( in, offset, data, n ) );
+}
+
+//******************************************************************************
+// sd_cache_store()	keep the plain image in the buffer -- 0 if OK
+//******************************************************************************
+// Its size is padded to 8 bytes with 0xFF, as it is sent (see
+// flash_write_block). The CRC32 is found first, so an image already cached
+// is not written again.
+static int sd_cache_store( image_cache_t *cache, ingest_t *in )
+{
+  sd_cache_t *c = (sd_cache_t *)cache;
+  static char chunk[512] __attribute__ ((aligned (4)));
+  uint32_t size = (in->image_size + 7) & ~7;
+  uint32_t crc = 0, offset, n;
+
+  if (size == 0)
+    return( 1 );
+  for (offset = 0; offset < size; offset += n) {
+    n = (size - offset < sizeof(chunk)) ? size - offset : sizeof(chunk);
+    if (sd_cache_image_read( in, offset, chunk, n ))
+      return( 1 );
+    crc = fxcrc32_update( crc, chunk, n );
+  }
+
+  if (sd_cache_find( c, size, crc ) < 0) {
+    const char *path = sd_cache_path( c, crc, 0 );
+    SD.remove( path );
+    File f = SD.open( path, FILE_WRITE );
+    int error = !f;
+    for (offset = 0; offset < size && !error; offset += n) {
+      n = (size - offset < sizeof(chunk)) ? size - offset : sizeof(chunk);
+      error = sd_cache_image_read( in, offset, chunk, n ) || f.write( chunk, n ) != n;
+    }
+    if (f)
+      f.close();
+    if (error) {
+      SD.remove( sd_cache_path( c, crc, 0 ) );
+      in->out->printf( "image %08lX not kept, SD write failed\n", crc );
+      return( 1 );
+    }
+  }
+  in->out->printf( "image %08lX (%1lu bytes) kept in SD cache %s\n", crc, size, c->dir );
+  sd_cache_use( c, size, crc );
+  return( 0 );
+}
+
+//******************************************************************************
+// sd_cache_init()	set up c in directory dir -- images cached, -1 if no dir
+//******************************************************************************
+// SD.begin() must be done. Index entries whose file is gone are dropped.
+int sd_cache_init( sd_cache_t *c, const char *dir )
+{
+  int count = 0;
+
+  c->cache.open = sd_cache_open;
+  c->cache.read = sd_cache_read;
+  c->cache.close = sd_cache_close;
+  c->cache.store = sd_cache_store;
+  c->dir = dir;
+  memset( c->entry, 0, sizeof(c->entry) );
+  if (!SD.exists( dir ) && !SD.mkdir( dir ))
+    return( -1 );
+
+  File f = SD.open( sd_cache_path( c, 0, 1 ), FILE_READ );
+  if (f) {
+    f.read( c->entry, sizeof(c->entry) );
+    f.close();
+  }
+  for (int i=0; i<SD_CACHE_SLOTS; i++) {
+    sd_cache_entry_t e = c->entry[i];
+    if (e.size != 0 && SD.exists( sd_cache_path( c, e.crc, 0 ) ))
+      c->entry[count++] = e;
+  }
+  memset( &c->entry[count], 0, (SD_CACHE_SLOTS - count) * sizeof(sd_cache_entry_t) );
+  return( count );
+}
+#endif // SD_CACHE_SLOTS
@@ -0,0 +1,336 @@
+//******************************************************************************
+// FXSESSION.CPP -- update session core shared by every transport
+//******************************************************************************
+// See FXSession.h. There is one firmware buffer, so there is one session: the
+// transport that began it owns it until session_end() (or the reboot after
+// session_commit()), and calls from any other transport are refused.
+//******************************************************************************
+#include <Arduino.h>
+#include "FXSession.h"		// transport_t, SESSION_xxx, etc.
+extern "C" {
+  #include "FXCRC.h"		// fxcrc32_update()
+  #include "FXSlot.h"		// SLOT_BUFFER_TYPE
+  #include "FXSwap.h"		// SWAP_BUFFER_TYPE
+}
+
+static struct {
+  int initialized;			// firmware_buffer_init() found a buffer
+  int buffer_type;			//   and its xxx_BUFFER_TYPE
+  uint32_t buffer_addr;			// buffer for new code
+  uint32_t buffer_size;
+  transport_t *owner;			// transport of current session, or NULL
+  ingest_stage_t *stage;		// where too large an image goes, or NULL
+  image_cache_t *cache;			// images kept from earlier updates, or NULL
+  int loading;				// cached image being loaded
+  uint32_t cache_size;			//   its size and CRC32
+  uint32_t cache_crc;
+  uint32_t cache_crc_so_far;		//   and CRC32 of what was loaded
+  ingest_t ingest;			// new code being received
+  uint32_t start_ms;			// time session began
+  uint32_t last_ms;			//   and bytes were last delivered
+  uint32_t bytes;			// bytes delivered
+} session;
+
+// a slot or swap buffer holds an image to fall back to until it is written
+// over, so it is erased as the new image reaches it, not up front or at the end
+static int session_keeps_buffer( void )
+{
+  return( session.buffer_type == SLOT_BUFFER_TYPE
+	|| session.buffer_type == SWAP_BUFFER_TYPE );
+}
+
+static uint32_t session_clock( transport_t *t )
+{
+  return( t->clock ? t->clock() : millis() );
+}
+
+//******************************************************************************
+// session_init()	find the buffer -- return its type (NO_BUFFER_TYPE if none)
+//******************************************************************************
+int session_init( void )
+{
+  int type = firmware_buffer_init( &session.buffer_addr, &session.buffer_size );
+  session.initialized = (type != NO_BUFFER_TYPE);
+  session.buffer_type = type;
+  session.owner = NULL;
+  session.loading = 0;
+  if (session.initialized)
+    part_buffer( session.buffer_addr, session.buffer_size );
+  return( type );
+}
+
+//******************************************************************************
+// session_stage()	where an image too large for the buffer goes (NULL = none)
+//******************************************************************************
+// e.g. an sd_stage_t (FXSD.h). It is used by the sessions begun after this.
+void session_stage( ingest_stage_t *stage )
+{
+  session.stage = stage;
+}
+
+//******************************************************************************
+// session_cache()	where committed images are kept (NULL = none)
+//******************************************************************************
+// e.g. an sd_cache_t (FXSD.h)
+void session_cache( image_cache_t *cache )
+{
+  session.cache = cache;
+}
+
+//******************************************************************************
+// session_begin()	give the buffer to transport t -- SESSION_OK if free
+//******************************************************************************
+// If echo is set, each hex line is echoed to t->out (see ingest_begin).
+int session_begin( transport_t *t, int echo )
+{
+  if (!session.initialized)
+    return( SESSION_NO_BUFFER );
+  if (session.owner != NULL)
+    return( SESSION_BUSY );
+
+  // RAM free now holds the first part of a plain image (see ram_buffer_claim),
+  // unless the buffer is RAM (EXTMEM) already
+  // and FlexNVM data flash (T3.5/T3.6) holds what does not fit in the others
+  uint32_t ram_addr = 0, nvm_addr = 0;
+  uint32_t ram_size = 0, nvm_size = 0;
+  if (IN_FLASH(session.buffer_addr) && !session_keeps_buffer()) {
+    ram_size = ram_buffer_claim( &ram_addr );
+    nvm_size = nvm_buffer_claim( &nvm_addr );
+  }
+
+  session.owner = t;
+  ingest_begin( &session.ingest, session.buffer_addr, session.buffer_size,
+			t->out, echo );
+  ingest_ram_tier( &session.ingest, ram_addr, ram_size );
+  ingest_nvm_tier( &session.ingest, nvm_addr, nvm_size );
+  ingest_overflow( &session.ingest, session.stage );
+  if (session.buffer_type == SLOT_BUFFER_TYPE)
+    ingest_slot( &session.ingest );
+  else if (session.buffer_type == SWAP_BUFFER_TYPE)
+    ingest_swap( &session.ingest );
+  session.start_ms = session.last_ms = session_clock( t );
+  session.bytes = 0;
+  return( SESSION_OK );
+}
+
+//******************************************************************************
+// session_offer()	t knows the image it will send -- 1 if loaded from cache
+//******************************************************************************
+// Only before any data is delivered. If the cache holds the image, t sends
+// nothing more: session_poll() loads it and t.respond() gets the result.
+int session_offer( transport_t *t, uint32_t size, uint32_t crc )
+{
+  if (session.owner != t || session.cache == NULL || session.loading
+	|| session.ingest.part != NULL
+	|| session.bytes > 0 || session.ingest.status != INGEST_MORE)
+    return( 0 );
+  if (session.cache->open( session.cache, size, crc ))
+    return( 0 );
+  t->out->printf( "%s: image %08lX (%1lu bytes) is cached, loading it\n",
+		t->name, crc, size );
+  session.loading = 1;
+  session.cache_size = size;
+  session.cache_crc = crc;
+  session.cache_crc_so_far = 0;
+  return( 1 );
+}
+
+//******************************************************************************
+// session_target()	t will send data partition part (NULL = firmware) -- 0 if OK
+//******************************************************************************
+// Only before any data is delivered. The partition is written in place, so the
+// RAM tier claimed by session_begin() is given back, and a partition that
+// overlaps the firmware buffer is refused.
+int session_target( transport_t *t, const part_t *part )
+{
+  ingest_t *in = &session.ingest;
+
+  if (session.owner != t || session.loading
+	|| session.bytes > 0 || in->status != INGEST_MORE)
+    return( 1 );
+  if (part == NULL)
+    return( in->part != NULL );
+  if (IN_FLASH(session.buffer_addr)
+	&& part->addr < session.buffer_addr + session.buffer_size
+	&& session.buffer_addr < part->addr + part->size) {
+    t->out->printf( "%s: partition %s overlaps the buffer\n", t->name, part->name );
+    return( 1 );
+  }
+  ram_buffer_release();
+  ingest_part( in, part );
+  t->out->printf( "%s: partition %s (%08lX - %08lX)\n", t->name, part->name,
+		part->addr, part->addr + part->size );
+  return( 0 );
+}
+
+//******************************************************************************
+// session_load()	load the next part of a cached image, finish at the end
+//******************************************************************************
+static void session_load( transport_t *t )
+{
+  static char block[SESSION_CACHE_READ_SIZE] __attribute__ ((aligned (8)));
+  image_cache_t *c = session.cache;
+
+  int n = c->read( c, block, sizeof(block) );
+  if (n > 0) {
+    session.cache_crc_so_far = fxcrc32_update( session.cache_crc_so_far, block, n );
+    if (session_deliver_block( t, session.ingest.origin + session.bytes, block, n ) == INGEST_MORE)
+      return;
+  }
+
+  // end of the image, or an error reading it or writing the buffer. A cached
+  // image that is not the one offered is dropped from the cache.
+  int status = session.ingest.status;
+  if (status == INGEST_MORE && (n < 0 || session.bytes != session.cache_size
+	|| session.cache_crc_so_far != session.cache_crc))
+    status = SESSION_ERR_CACHE;
+  session.loading = 0;
+  c->close( c, status != SESSION_ERR_CACHE );
+  if (status == INGEST_MORE)
+    session_finish( t );
+  else
+    session_result( t, status );
+}
+
+//******************************************************************************
+// session_deliver()	hex text received by t -- return ingest status
+//******************************************************************************
+int session_deliver( transport_t *t, const char *bytes, uint32_t count )
+{
+  if (session.owner != t)
+    return( INGEST_ERR_RECORD );
+  session.last_ms = session_clock( t );
+  session.bytes += count;
+  return( ingest_feed( &session.ingest, bytes, count ) );
+}
+
+//******************************************************************************
+// session_deliver_block()  binary image received by t -- return ingest status
+//******************************************************************************
+int session_deliver_block( transport_t *t, uint32_t flash_addr,
+			const char *data, uint32_t num )
+{
+  if (session.owner != t)
+    return( INGEST_ERR_RECORD );
+  session.last_ms = session_clock( t );
+  session.bytes += num;
+  return( ingest_block( &session.ingest, flash_addr, data, num ) );
+}
+
+//******************************************************************************
+// session_result()	end of transfer with status -- tell t and return status
+//******************************************************************************
+// Transports call this directly for errors of their own (image CRC, etc.).
+int session_result( transport_t *t, int status )
+{
+  if (session.owner != t)
+    return( INGEST_ERR_RECORD );
+  session.ingest.status = status;
+
+  uint32_t ms = session_clock( t ) - session.start_ms;
+  t->out->printf( "%s: %1lu bytes in %1lu ms (%1lu bytes/s)\n", t->name,
+		session.bytes, ms, ms ? (uint32_t)(session.bytes * 1000ULL / ms) : 0 );
+
+  if (t->respond)
+    t->respond( t, SESSION_EVENT_RESULT, status );
+  return( status );
+}
+
+//******************************************************************************
+// session_finish()	all new code delivered, check it -- INGEST_EOF if good
+//******************************************************************************
+int session_finish( transport_t *t )
+{
+  ingest_t *in = &session.ingest;
+
+  if (session.owner != t)
+    return( INGEST_ERR_RECORD );
+  int status = ingest_end( in );
+  if (status == INGEST_EOF) {
+    int error = ingest_check( in );
+    if (error)
+      status = error;
+  }
+  return( session_result( t, status ) );
+}
+
+//******************************************************************************
+// session_commit()	move checked new code to flash and reboot
+//******************************************************************************
+// For a data partition, which is already in place, end the session and tell
+// the application with updated(), then return.
+void session_commit( transport_t *t )
+{
+  ingest_t *in = &session.ingest;
+  lz_info_t lz;
+
+  if (session.owner != t || in->status != INGEST_EOF)
+    return;
+  if (in->part != NULL) {
+    const part_t *part = in->part;
+    t->out->printf( "%s: partition %s updated\n", t->name, part->name );
+    session_end( t );
+    if (part->updated != NULL)
+      part->updated( part );
+    return;
+  }
+  // keep a plain image (a patch's output is one) for a later session_offer()
+  if (session.cache
+	&& (in->staged || !lz_read_header( in->buffer_addr + in->buffer_offset, &lz )))
+    session.cache->store( session.cache, in );
+  ingest_commit( in );
+}
+
+//******************************************************************************
+// session_end()	end t's session and leave the buffer erased for the next
+//******************************************************************************
+// A slot or swap buffer is not erased (see session_keeps_buffer), nor one a
+// data partition was sent instead of (it is still erased)
+void session_end( transport_t *t )
+{
+  if (session.owner != t)
+    return;
+  if (session.loading) {
+    session.cache->close( session.cache, 1 );
+    session.loading = 0;
+  }
+  if (!session_keeps_buffer() && session.ingest.part == NULL)
+    firmware_buffer_free( session.buffer_addr, session.buffer_size );
+  ram_buffer_release();
+  session.owner = NULL;
+}
+
+//******************************************************************************
+// session_poll()	call from loop() -- load a cached image, or time out owner
+//******************************************************************************
+// Only while new code is being received; after session_finish() the session
+// waits for the transport to commit or end it.
+void session_poll( void )
+{
+  transport_t *t = session.owner;
+
+  if (t != NULL && session.loading) {
+    session_load( t );
+    return;
+  }
+  if (t == NULL || t->timeout_ms == 0 || session.ingest.status != INGEST_MORE)
+    return;
+  if (session_clock( t ) - session.last_ms > t->timeout_ms) {
+    session.last_ms = session_clock( t );
+    if (t->respond)
+      t->respond( t, SESSION_EVENT_TIMEOUT, INGEST_MORE );
+  }
+}
+
+//******************************************************************************
+// session_ingest()	state of new code in the buffer (for checks by owner)
+//******************************************************************************
+ingest_t *session_ingest( void )
+{
+  return( &session.ingest );
+}
+
+transport_t *session_owner( void )
+{
+  return( session.owner );
+}
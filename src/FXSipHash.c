@@ -0,0 +1,60 @@
+//******************************************************************************
+// FXSIPHASH.C -- SipHash-2-4 message authentication for update commands
+//******************************************************************************
+// See FXSipHash.h. Two compression rounds per 8-byte word, four to finish.
+//******************************************************************************
+#include "FXSipHash.h"		// fxsiphash24()
+
+#define ROTL(x,b)	(uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND				\
+  do {						\
+    v0 += v1; v1 = ROTL(v1,13); v1 ^= v0; v0 = ROTL(v0,32);	\
+    v2 += v3; v3 = ROTL(v3,16); v3 ^= v2;	\
+    v0 += v3; v3 = ROTL(v3,21); v3 ^= v0;	\
+    v2 += v1; v1 = ROTL(v1,17); v1 ^= v2; v2 = ROTL(v2,32);	\
+  } while (0)
+
+// little-endian 64-bit word at p, whatever its alignment
+static uint64_t le64( const uint8_t *p )
+{
+  uint64_t x = 0;
+  for (int i=7; i >= 0; i--)
+    x = (x << 8) | p[i];
+  return( x );
+}
+
+//******************************************************************************
+// fxsiphash24()	SipHash-2-4 of len bytes of data under key
+//******************************************************************************
+uint64_t fxsiphash24( const uint8_t key[FXSIPHASH_KEY_SIZE], const void *data,
+			uint32_t len )
+{
+  const uint8_t *p = (const uint8_t *)data;
+  uint64_t k0 = le64( key ), k1 = le64( key + 8 );
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+  // whole words
+  uint32_t n = len & ~7;
+  for (uint32_t i=0; i < n; i += 8) {
+    uint64_t m = le64( p + i );
+    v3 ^= m;
+    SIPROUND; SIPROUND;
+    v0 ^= m;
+  }
+
+  // last bytes, with the length in the top byte
+  uint64_t b = (uint64_t)len << 56;
+  for (uint32_t i=0; i < (len & 7); i++)
+    b |= (uint64_t)p[n + i] << (8 * i);
+  v3 ^= b;
+  SIPROUND; SIPROUND;
+  v0 ^= b;
+
+  v2 ^= 0xff;
+  SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+  return( v0 ^ v1 ^ v2 ^ v3 );
+}
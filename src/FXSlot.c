@@ -0,0 +1,166 @@
+//******************************************************************************
+// FXSLOT.C -- A/B firmware slots with a resident selector (T4.1/MicroMod)
+//******************************************************************************
+// See FXSlot.h. The application uses slot_buffer_init() and slot_commit(),
+// the selector only slot_boot(). Both read the records in place, through the
+// FlexSPI mapping of program flash.
+//******************************************************************************
+#include <Arduino.h>		// __disable_irq(), etc.
+#include <string.h>		// memset(), memcmp()
+#include "FXSlot.h"		// slot_record_t, SLOT_xxx
+#include "FXCRC.h"		// fxcrc32_update()
+
+#if (SLOT_MODE)
+
+// IVT of the running image (cores/teensy4/bootdata.c), at its link address
+extern const uint32_t ImageVectorTable[];
+
+#define SLOT_RECORD_COUNT	(SLOT_RECORD_SECTORS * SLOT_RECORDS_PER_SECTOR)
+
+static const slot_record_t *slot_record( uint32_t i )
+{
+  return( (const slot_record_t *)SLOT_RECORD_ADDR + i );
+}
+
+//******************************************************************************
+// slot_running()	address of the slot this image runs in (from its IVT)
+//******************************************************************************
+uint32_t slot_running( void )
+{
+  return( (uint32_t)ImageVectorTable - SLOT_IVT_OFFSET );
+}
+
+//******************************************************************************
+// slot_buffer_init()	the inactive slot is the buffer -- SLOT_BUFFER_TYPE
+//******************************************************************************
+// NO_BUFFER_TYPE if this image is not running in a slot (it was linked for
+// FLASH_BASE_ADDR), then firmware_buffer_init() finds the usual buffer. The
+// slot is not erased: it holds the previous image until an update reaches
+// each of its sectors (see ingest_slot).
+int slot_buffer_init( uint32_t *buffer_addr, uint32_t *buffer_size )
+{
+  uint32_t running = slot_running();
+
+  if (running != SLOT_A_ADDR && running != SLOT_B_ADDR)
+    return( NO_BUFFER_TYPE );
+  *buffer_addr = (running == SLOT_A_ADDR) ? SLOT_B_ADDR : SLOT_A_ADDR;
+  *buffer_size = SLOT_SIZE;
+  return( SLOT_BUFFER_TYPE );
+}
+
+//******************************************************************************
+// slot_image_check()	image with IVT ivt is linked to run at addr -- 1 if so
+//******************************************************************************
+// The IVT header tag is 0xD1, and its self pointer and entry point are where
+// the image linked for addr has them.
+int slot_image_check( uint32_t addr, const uint32_t *ivt )
+{
+  return( (ivt[0] & 0xFF) == 0xD1
+	&& ivt[5] == addr + SLOT_IVT_OFFSET
+	&& ivt[1] > addr && ivt[1] < addr + SLOT_SIZE );
+}
+
+//******************************************************************************
+// slot_newest()	newest record for slot addr (0 = any slot), or NULL
+//******************************************************************************
+const slot_record_t *slot_newest( uint32_t addr )
+{
+  const slot_record_t *newest = NULL;
+
+  for (uint32_t i = 0; i < SLOT_RECORD_COUNT; i++) {
+    const slot_record_t *r = slot_record( i );
+    if (r->magic == SLOT_MAGIC && (addr == 0 || r->addr == addr)
+	&& (newest == NULL || r->seq > newest->seq))
+      newest = r;
+  }
+  return( newest );
+}
+
+//******************************************************************************
+// slot_commit()	record the image in slot addr as the one to boot -- 0 if OK
+//******************************************************************************
+// The record after the newest is written. If that is the first of a sector,
+// the sector is erased first: it holds only older records, as the newest is
+// in the other sector, so a power failure here leaves the records as they were.
+int slot_commit( uint32_t addr, uint32_t size )
+{
+  const slot_record_t *newest = slot_newest( 0 );
+  slot_record_t r;
+
+  memset( &r, 0xFF, sizeof(r) );
+  r.magic = SLOT_MAGIC;
+  r.seq = newest ? newest->seq + 1 : 1;
+  r.addr = addr;
+  r.size = size;
+  r.crc = fxcrc32_update( 0, (const void*)addr, size );
+
+  uint32_t i = newest ? (uint32_t)(newest - slot_record( 0 ) + 1) % SLOT_RECORD_COUNT : 0;
+  const slot_record_t *next = slot_record( i );
+  if (i % SLOT_RECORDS_PER_SECTOR == 0
+	&& flash_erase_block( (uint32_t)next, FLASH_SECTOR_SIZE ))
+    return( 1 );
+  for (uint32_t w = 0; w < sizeof(r) / 4; w++)
+    if (((const uint32_t *)next)[w] != 0xFFFFFFFF)
+      return( 1 );
+  eepromemu_flash_write( (void*)next, &r, sizeof(r) );
+  return( memcmp( next, &r, sizeof(r) ) != 0 );
+}
+
+//******************************************************************************
+// slot_verify()	image of record r is complete and linked for its slot
+//******************************************************************************
+static int slot_verify( const slot_record_t *r )
+{
+  return( (r->addr == SLOT_A_ADDR || r->addr == SLOT_B_ADDR)
+	&& r->size > SLOT_IVT_OFFSET && r->size <= SLOT_SIZE
+	&& slot_image_check( r->addr, (const uint32_t *)(r->addr + SLOT_IVT_OFFSET) )
+	&& fxcrc32_update( 0, (const void*)r->addr, r->size ) == r->crc );
+}
+
+//******************************************************************************
+// slot_jump()		start the image in slot addr at its reset handler
+//******************************************************************************
+static void slot_jump( uint32_t addr )
+{
+  const uint32_t *ivt = (const uint32_t *)(addr + SLOT_IVT_OFFSET);
+
+  __disable_irq();
+  ((void (*)( void ))ivt[1])();
+}
+
+//******************************************************************************
+// slot_boot()		selector: start the newest good image -- return if none
+//******************************************************************************
+// The newest record's image, or else the newest image in the other slot. With
+// no record for it, slot A is the image loaded with the selector, and only
+// its IVT can be checked.
+void slot_boot( void )
+{
+  const slot_record_t *r = slot_newest( 0 );
+  uint32_t other = SLOT_A_ADDR;
+
+  if (r != NULL) {
+    if (slot_verify( r ))
+      slot_jump( r->addr );
+    other = (r->addr == SLOT_A_ADDR) ? SLOT_B_ADDR : SLOT_A_ADDR;
+    r = slot_newest( other );
+    if (r != NULL) {
+      if (slot_verify( r ))
+        slot_jump( r->addr );
+      return;
+    }
+  }
+  if (other == SLOT_A_ADDR
+	&& slot_image_check( SLOT_A_ADDR, (const uint32_t *)(SLOT_A_ADDR + SLOT_IVT_OFFSET) ))
+    slot_jump( SLOT_A_ADDR );
+}
+
+#if defined(SLOT_SELECTOR)
+// the selector's whole job, before the core starts USB and the clocks
+void startup_early_hook( void )
+{
+  slot_boot();
+}
+#endif
+
+#endif // SLOT_MODE
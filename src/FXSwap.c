@@ -0,0 +1,178 @@
+//******************************************************************************
+// FXSWAP.C -- swap commit: keep the previous image in the buffer for rollback
+//******************************************************************************
+// See FXSwap.h. swap_commit() and swap_rollback() check the images and write
+// the journal header from flash, then flash_swap() runs from RAM, like
+// flash_move(), and reboots.
+//******************************************************************************
+#include <Arduino.h>		// Serial, etc. (if used)
+#include <string.h>		// memset(), memcmp()
+#include "FXSwap.h"		// swap_journal_t, SWAP_xxx
+#include "FXCRC.h"		// fxcrc32_update()
+
+#if (SWAP_MODE)
+
+//******************************************************************************
+// swap_journal()	the last swap, and the sizes and CRC32s it left
+//******************************************************************************
+const swap_journal_t *swap_journal( void )
+{
+  return( (const swap_journal_t *)SWAP_JOURNAL_ADDR );
+}
+
+// progress entry i has been cleared
+static int swap_progress( uint32_t i )
+{
+  return( *(const uint32_t *)SWAP_PROGRESS_ADDR( i ) != 0xFFFFFFFF );
+}
+
+//******************************************************************************
+// swap_code_end()	first address above the running image, from the linker
+//******************************************************************************
+// Flash above the image cannot tell where it ends, as the buffer may hold the
+// previous image, or part of an update that was not committed.
+uint32_t swap_code_end( void )
+{
+  #if defined(__IMXRT1062__)
+  extern unsigned long _flashimagelen;
+  return( FLASH_BASE_ADDR + (uint32_t)&_flashimagelen );
+  #else
+  extern unsigned long _etext, _sdata, _edata;	// .data is stored after .text
+  return( (uint32_t)&_etext + ((uint32_t)&_edata - (uint32_t)&_sdata) );
+  #endif
+}
+
+//******************************************************************************
+// swap_buffer_init()	the buffer is the upper half of flash -- SWAP_BUFFER_TYPE
+//******************************************************************************
+// It is not erased: it may hold the previous image (see ingest_swap). If the
+// running image reaches into it, there is none (NO_BUFFER_TYPE): an update
+// would erase the running code's tail.
+int swap_buffer_init( uint32_t *buffer_addr, uint32_t *buffer_size )
+{
+  if (swap_code_end() > SWAP_BUFFER_ADDR)
+    return( NO_BUFFER_TYPE );
+  *buffer_addr = SWAP_BUFFER_ADDR;
+  *buffer_size = SWAP_SIZE;
+  return( SWAP_BUFFER_TYPE );
+}
+
+//******************************************************************************
+// swap_status()	can swap_rollback() restore the previous image -- SWAP_xxx
+//******************************************************************************
+int swap_status( void )
+{
+  const swap_journal_t *j = swap_journal();
+
+  if (j->magic != SWAP_MAGIC || j->sectors > SWAP_MAX_SECTORS)
+    return( SWAP_NONE );
+  if (!swap_progress( j->sectors ))
+    return( SWAP_PARTIAL );
+  if (fxcrc32_update( 0, (const void *)FLASH_BASE_ADDR, j->base_size ) != j->base_crc
+	|| fxcrc32_update( 0, (const void *)SWAP_BUFFER_ADDR, j->buffer_size ) != j->buffer_crc)
+    return( SWAP_NONE );
+  return( SWAP_DONE );
+}
+
+//******************************************************************************
+// swap_start()		journal a swap that puts the buffer's image at the base
+//******************************************************************************
+// The buffer sectors past its image are erased first, so the base is erased
+// past the image once they are exchanged. Returns only on error.
+static int swap_start( uint32_t new_size, uint32_t new_crc,
+			uint32_t old_size, uint32_t old_crc )
+{
+  uint32_t size = (new_size > old_size) ? new_size : old_size;
+  uint32_t end = (new_size + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+  swap_journal_t j __attribute__ ((aligned (8)));
+  int error = 0;
+  uint32_t i;
+
+  memset( &j, 0xFF, sizeof(j) );
+  j.magic = SWAP_MAGIC;
+  j.sectors = (size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+  j.base_size = new_size;
+  j.base_crc = new_crc;
+  j.buffer_size = old_size;
+  j.buffer_crc = old_crc;
+
+  if (j.sectors > SWAP_MAX_SECTORS
+	|| flash_erase_block( SWAP_BUFFER_ADDR + end, j.sectors * FLASH_SECTOR_SIZE - end )
+	|| flash_erase_block( SWAP_JOURNAL_ADDR, SWAP_JOURNAL_SECTORS * FLASH_SECTOR_SIZE ))
+    return( 1 );
+
+  // written a unit at a time, not by flash_write_block(), which may hold part
+  // of a unit for another address
+  for (i = 0; i < sizeof(j); i += FLASH_WRITE_SIZE)
+    error |= flash_move_write( SWAP_JOURNAL_ADDR + i, (const char *)&j + i );
+  if (error || memcmp( swap_journal(), &j, sizeof(j) ) != 0)
+    return( 1 );
+
+  flash_swap( FLASH_BASE_ADDR, SWAP_BUFFER_ADDR, j.sectors );
+  return( 1 );
+}
+
+//******************************************************************************
+// swap_commit()	swap new code of size in the buffer with the running code
+//******************************************************************************
+// Returns only on error (the journal could not be written), and then nothing
+// has changed.
+int swap_commit( uint32_t size )
+{
+  uint32_t old_size = firmware_code_end() - FLASH_BASE_ADDR;
+  return( swap_start( size, fxcrc32_update( 0, (const void *)SWAP_BUFFER_ADDR, size ),
+		old_size, fxcrc32_update( 0, (const void *)FLASH_BASE_ADDR, old_size ) ) );
+}
+
+//******************************************************************************
+// swap_rollback()	swap the previous image back -- returns only on error
+//******************************************************************************
+int swap_rollback( void )
+{
+  if (swap_status() != SWAP_DONE)
+    return( 1 );
+  const swap_journal_t *j = swap_journal();
+  return( swap_start( j->buffer_size, j->buffer_crc, j->base_size, j->base_crc ) );
+}
+
+//******************************************************************************
+// flash_swap()		exchange sectors of base and buffer, then REBOOT
+//******************************************************************************
+// DANGER: like flash_move(), this cannot be interrupted. Each sector of base
+// goes to the RAM scratch sector, the buffer's is written over it, and then
+// the scratch sector is written to the buffer. Sectors that already match are
+// skipped. The progress entries are cleared as each sector is done, and the
+// one after the last when all are.
+RAMFUNC void flash_swap( uint32_t base, uint32_t buffer, uint32_t sectors )
+{
+  static uint32_t scratch[FLASH_SECTOR_SIZE/4] __attribute__ ((aligned (8)));
+  uint32_t zero[2] __attribute__ ((aligned (8)));
+  uint32_t i, offset, error = 0;
+
+  zero[0] = zero[1] = 0;
+  flash_move_begin();
+
+  for (i = 0; i < sectors && error == 0; i++) {
+    uint32_t a = base + i * FLASH_SECTOR_SIZE;
+    uint32_t b = buffer + i * FLASH_SECTOR_SIZE;
+    if (!flash_move_sector_matches( a, b, FLASH_SECTOR_SIZE )) {
+      for (offset = 0; offset < FLASH_SECTOR_SIZE/4; offset++)
+        scratch[offset] = ((const uint32_t *)a)[offset];
+      error |= flash_move_erase( a );
+      for (offset = 0; offset < FLASH_SECTOR_SIZE; offset += FLASH_PAGE_SIZE)
+        error |= flash_move_page( a + offset, (const void *)(b + offset),
+				FLASH_SECTOR_SIZE - offset );
+      error |= flash_move_erase( b );
+      for (offset = 0; offset < FLASH_SECTOR_SIZE; offset += FLASH_PAGE_SIZE)
+        error |= flash_move_page( b + offset, (const char *)scratch + offset,
+				FLASH_SECTOR_SIZE - offset );
+    }
+    error |= flash_move_write( SWAP_PROGRESS_ADDR( i ), zero );
+  }
+  if (error == 0)
+    flash_move_write( SWAP_PROGRESS_ADDR( sectors ), zero );
+
+  flash_move_end( base, 0 );
+}
+
+#endif // SWAP_MODE
@@ -1,120 +1,624 @@
 //******************************************************************************
-// FXUTIL.H -- FlasherX utility functions
+// FXUTIL.CPP -- FlasherX utility functions
 //******************************************************************************
 #include <Arduino.h>
+#include "FXUtil.h"		// ingest_t, hex_info_t, etc.
 extern "C" {
-  #include "FlashTxx.h"		// TLC/T3x/T4x/TMM flash primitives
+  #include "FXSlot.h"		// slot_image_check(), slot_commit()
+  #include "FXSwap.h"		// swap_commit()
 }
 
 //******************************************************************************
-// hex_info_t	struct for hex record and hex file info
+// ingest_begin()	init ingestion of a hex file into buffer
 //******************************************************************************
-typedef struct {	// 
-  char *data;		// pointer to array allocated elsewhere
-  unsigned int addr;	// address in intel hex record
-  unsigned int code;	// intel hex record type (0=data, etc.)
-  unsigned int num;	// number of data bytes in intel hex record
- 
-  uint32_t base;	// base address to be added to intel hex 16-bit addr
-  uint32_t min;		// min address in hex file
-  uint32_t max;		// max address in hex file
-  
-  int eof;		// set true on intel hex EOF (code = 1)
-  int lines;		// number of hex records received  
-} hex_info_t;
+// Progress and error messages go to out. If echo is set, each line is also
+// echoed to out and flushed, which improves reliability of transfer via USB.
+void ingest_begin( ingest_t *in, uint32_t buffer_addr, uint32_t buffer_size,
+			Stream *out, int echo )
+{
+  memset( in, 0, sizeof(ingest_t) );
+  in->hex.data = in->data;
+  in->hex.min = 0xFFFFFFFF;
+  in->buffer_addr = buffer_addr;
+  in->buffer_size = buffer_size;
+  in->origin = FLASH_BASE_ADDR;
+  in->out = out;
+  in->echo = echo;
+  in->status = INGEST_MORE;
+}
 
+//******************************************************************************
+// ingest_ram_tier()	hold the first ram_size bytes of a plain image in RAM
+//******************************************************************************
+// ram_size must be a multiple of FLASH_SECTOR_SIZE. Call after ingest_begin().
+// The RAM is not cleared, see ingest_write().
+//
+// flash_move() writes program flash from the bottom up, so a flash buffer
+// holding image offset x must lie at or above address x until x is moved.
+// With ram_size bytes in RAM, the flash buffer holds offset ram_size at its
+// start, so ram_size is limited to the flash buffer's offset from the base.
+void ingest_ram_tier( ingest_t *in, uint32_t ram_addr, uint32_t ram_size )
+{
+  if (IN_FLASH(in->buffer_addr) && ram_size > in->buffer_addr - FLASH_BASE_ADDR)
+    ram_size = in->buffer_addr - FLASH_BASE_ADDR;
+  in->ram_addr = ram_addr;
+  in->ram_size = ram_size;
+  in->ram_used = 0;
+}
 
 //******************************************************************************
-// hex_info_t	struct for hex record and hex file info
+// ingest_nvm_tier()	hold the last nvm_size bytes of a plain image in FlexNVM
 //******************************************************************************
-void read_ascii_line( Stream *serial, char *line, int maxbytes );
-int  parse_hex_line( const char *theline, char *bytes,
-	unsigned int *addr, unsigned int *num, unsigned int *code );
-int  process_hex_record( hex_info_t *hex );
-void update_firmware( Stream *in, Stream *out,
-			uint32_t buffer_addr, uint32_t buffer_size );
+// The overflow tier comes after the flash buffer. It is data flash (see
+// nvm_buffer_claim), separate from program flash, so flash_move() never
+// overwrites it, and it is erased as the image reaches it, so an image that
+// fits in the other tiers leaves it as it was. Call after ingest_begin().
+void ingest_nvm_tier( ingest_t *in, uint32_t nvm_addr, uint32_t nvm_size )
+{
+  in->nvm_addr = nvm_addr;
+  in->nvm_size = nvm_size;
+  in->nvm_erase_addr = nvm_addr;
+}
 
 //******************************************************************************
-// update_firmware()	read hex file and write new firmware to program flash
+// ingest_slot()	the buffer is the slot the image will run in (FXSlot.h)
 //******************************************************************************
-void update_firmware( Stream *in, Stream *out, 
-				uint32_t buffer_addr, uint32_t buffer_size )
+// The image is linked for the buffer address, so that is its origin, and it
+// is committed in place. The slot still holds the image before, so each
+// sector is erased as the image reaches it. Only a plain image can be written
+// in place: no tiers, and no FXLZ or FXDP. Call after ingest_begin().
+void ingest_slot( ingest_t *in )
 {
-  static char line[96];					// buffer for hex lines
-  static char data[32] __attribute__ ((aligned (8)));	// buffer for hex data
-  hex_info_t hex = {					// intel hex info struct
-    data, 0, 0, 0,					//   data,addr,num,code
-    0, 0xFFFFFFFF, 0, 					//   base,min,max,
-    0, 0						//   eof,lines
-  };
+  in->origin = in->erase_addr = in->buffer_addr;
+  in->ram_size = in->nvm_size = 0;
+  in->stage = NULL;
+}
 
-  out->printf( "reading hex lines...\n" );
+//******************************************************************************
+// ingest_swap()	the buffer will be swapped with the running code (FXSwap.h)
+//******************************************************************************
+// Like a slot, the buffer may still hold an image (the one before, kept for
+// rollback), so it is erased as the image reaches it, and there are no tiers.
+// A patch's output is swapped in like a plain image, an FXLZ image cannot be.
+// Call after ingest_begin().
+void ingest_swap( ingest_t *in )
+{
+  in->erase_addr = in->buffer_addr;
+  in->ram_size = in->nvm_size = 0;
+  in->stage = NULL;
+  in->swap = 1;
+}
 
-  // read and process intel hex lines until EOF or error
-  while (!hex.eof)  {
+//******************************************************************************
+// ingest_part()	write data partition part in place, instead of an image
+//******************************************************************************
+// The partition is the buffer and the origin. Like a slot, it is erased as
+// the data reaches it, and the data is stored as it is: no tiers, and no FXLZ
+// or FXDP detection. Call after ingest_begin().
+void ingest_part( ingest_t *in, const part_t *part )
+{
+  in->buffer_addr = in->origin = in->erase_addr = part->addr;
+  in->buffer_size = part->size;
+  in->ram_size = in->nvm_size = 0;
+  in->stage = NULL;
+  in->swap = 0;
+  in->part = part;
+}
 
-    read_ascii_line( in, line, sizeof(line) );
-    // reliability of transfer via USB is improved by this printf/flush
-    if (in == out && out == (Stream*)&Serial) {
-      out->printf( "%s\n", line );
-      out->flush();
-    }
+//******************************************************************************
+// ingest_addr()	address of byte offset of the new code, in its tier
+//******************************************************************************
+uint32_t ingest_addr( ingest_t *in, uint32_t offset )
+{
+  offset += in->buffer_offset;
+  if (offset < in->ram_size)
+    return( in->ram_addr + offset );
+  offset -= in->ram_size;
+  if (offset < in->buffer_size || in->nvm_size == 0)
+    return( in->buffer_addr + offset );
+  return( in->nvm_addr + offset - in->buffer_size );
+}
+
+//******************************************************************************
+// ingest_span()	bytes from offset that are contiguous at ingest_addr()
+//******************************************************************************
+uint32_t ingest_span( ingest_t *in, uint32_t offset )
+{
+  offset += in->buffer_offset;
+  if (offset < in->ram_size)
+    return( in->ram_size - offset );
+  offset -= in->ram_size;
+  if (offset < in->buffer_size)
+    return( in->buffer_size - offset );
+  return( in->buffer_size + in->nvm_size - offset );
+}
+
+//******************************************************************************
+// ingest_overflow()	move a plain image that outgrows the tiers to stage
+//******************************************************************************
+// stage may be NULL (the default), then such an image is INGEST_ERR_SIZE.
+// Call after ingest_begin().
+void ingest_overflow( ingest_t *in, ingest_stage_t *stage )
+{
+  in->stage = stage;
+}
+
+//******************************************************************************
+// ingest_read()	copy num bytes of new code from offset -- 0 if OK
+//******************************************************************************
+// From the tiers, or from the stage once the image has moved there.
+int ingest_read( ingest_t *in, uint32_t offset, char *data, uint32_t num )
+{
+  if (in->staged)
+    return( in->stage->read( in->stage, offset, data, num ) );
+  while (num > 0) {
+    uint32_t n = ingest_span( in, offset );
+    if (n > num)
+      n = num;
+    memcpy( data, (const void*)ingest_addr( in, offset ), n );
+    offset += n;
+    data += n;
+    num -= n;
+  }
+  return( 0 );
+}
+
+//******************************************************************************
+// ingest_fill()	fill RAM tier with 0xFF (like erased flash) up to offset
+//******************************************************************************
+// Only bytes not yet written are filled, once, so the RAM tier is never
+// cleared as a whole and a gap between records reads as erased flash.
+static void ingest_fill( ingest_t *in, uint32_t offset )
+{
+  if (offset > in->ram_used) {
+    memset( (void*)(in->ram_addr + in->ram_used), 0xFF, offset - in->ram_used );
+    in->ram_used = offset;
+  }
+}
+
+//******************************************************************************
+// ingest_flush()	after EOF, complete the buffer up to the last sector
+//******************************************************************************
+// The last bytes written can be a partial unit still held by
+// flash_write_block(), and the RAM tier past them was never filled, so the
+// buffer is read sector by sector only after this. Returns the error from
+// flash_write_flush(), 0 if OK.
+int ingest_flush( ingest_t *in )
+{
+  if (in->hex.max > in->origin) {
+    uint32_t end = (in->hex.max - in->origin + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+    ingest_fill( in, (end < in->ram_size) ? end : in->ram_size );
+  }
+  return( flash_write_flush() );
+}
+
+//******************************************************************************
+// ingest_stage()	move the image written so far from the tiers to the stage
+//******************************************************************************
+// All of the tiers are copied, with what was not written as 0xFF, and the
+// image is then written only to the stage. The FlexNVM tier is copied only
+// as far as it was erased, as it holds old data past that.
+static int ingest_stage( ingest_t *in )
+{
+  static char chunk[512] __attribute__ ((aligned (8)));
+  uint32_t size = in->ram_size + in->buffer_size + in->nvm_erase_addr - in->nvm_addr;
+
+  in->out->printf( "image larger than buffer, moving it to %s\n", in->stage->name );
+  if (in->stage->begin( in->stage ))
+    return( 1 );
+  ingest_fill( in, in->ram_size );
+  for (uint32_t offset = 0; offset < size; offset += sizeof(chunk)) {
+    uint32_t n = size - offset;
+    if (n > sizeof(chunk))
+      n = sizeof(chunk);
+    ingest_read( in, offset, chunk, n );
+    if (in->stage->write( in->stage, offset, chunk, n ))
+      return( 1 );
+  }
+  in->staged = 1;
+  return( 0 );
+}
+
+//******************************************************************************
+// ingest_write()	write num bytes of new code at flash address to buffer
+//******************************************************************************
+// in->hex.max must already include this data
+static int ingest_write( ingest_t *in, uint32_t flash_addr, const char *data, uint32_t num )
+{
+  Stream *out = in->out;
 
-    if (parse_hex_line( (const char*)line, hex.data, &hex.addr, &hex.num, &hex.code ) == 0) {
-      out->printf( "abort - bad hex line %s\n", line );
+  // compressed image goes at top of buffer (see lz_buffer_offset)
+  // and a patch is applied as it arrives rather than stored. Both are read
+  // in place, so they use only the (contiguous) flash tier.
+  if (flash_addr == in->origin && in->part == NULL) {
+    in->buffer_offset = lz_buffer_offset( data, num, in->buffer_size );
+    in->patch = delta_is_patch( data, num );
+    if (in->origin != FLASH_BASE_ADDR && (in->patch || in->buffer_offset > 0)) {
+      out->printf( "abort - only a plain image can be sent to a slot\n" );
+      return( INGEST_ERR_IMAGE );
+    }
+    if (in->swap && in->buffer_offset > 0) {
+      out->printf( "abort - a compressed image cannot be swapped in\n" );
+      return( INGEST_ERR_IMAGE );
+    }
+    if (in->patch) {
+      delta_begin( &in->delta, in->buffer_addr, in->buffer_size );
+      in->delta.erase_addr = in->erase_addr;
+    }
+    if (in->patch || in->buffer_offset > 0)
+      in->ram_size = in->nvm_size = 0;
+  }
+  uint32_t offset = flash_addr - in->origin;
+  if (in->patch) {
+    if (offset != in->delta.in) {
+      out->printf( "abort - patch record %08lX out of order\n", flash_addr );
+      return( INGEST_ERR_PATCH );
     }
-    else if (process_hex_record( &hex ) != 0) { // error on bad hex code
-      out->printf( "abort - invalid hex code %d\n", hex.code );
-      return;
+    int error = delta_feed( &in->delta, data, num );
+    if (error) {
+      out->printf( "abort - error %d in delta_feed()\n", error );
+      return( INGEST_ERR_PATCH );
     }
-    else if (hex.code == 0) { // if data record
-      uint32_t addr = buffer_addr + hex.base + hex.addr - FLASH_BASE_ADDR;
-      if (hex.max > (FLASH_BASE_ADDR + buffer_size)) {
-        out->printf( "abort - max address %08lX too large\n", hex.max );
-        return;
+  }
+  else if (in->staged
+	|| (in->hex.max + in->buffer_offset
+		> (in->origin + in->ram_size + in->buffer_size + in->nvm_size))) {
+    // too large for the tiers, so write to the stage (if any) instead
+    if (in->stage == NULL || in->buffer_offset > 0
+	|| in->hex.max > FLASH_BASE_ADDR + FLASH_SIZE - FLASH_RESERVE) {
+      out->printf( "abort - max address %08lX too large\n", in->hex.max );
+      return( INGEST_ERR_SIZE );
+    }
+    if ((!in->staged && ingest_stage( in ))
+	|| in->stage->write( in->stage, offset, data, num )) {
+      out->printf( "abort - error writing %s\n", in->stage->name );
+      return( INGEST_ERR_WRITE );
+    }
+  }
+  // RAM tier, up to its end
+  else if (in->buffer_offset + offset < in->ram_size) {
+    uint32_t n = ingest_span( in, offset );
+    if (n > num)
+      n = num;
+    ingest_fill( in, offset );
+    memcpy( (void*)ingest_addr( in, offset ), (const void*)data, n );
+    if (offset + n > in->ram_used)
+      in->ram_used = offset + n;
+    if (n < num)
+      return( ingest_write( in, flash_addr + n, data + n, num - n ) );
+  }
+  // flash tier (or a RAM buffer), then FlexNVM, once the RAM tier is complete
+  else {
+    uint32_t addr = ingest_addr( in, offset );
+    uint32_t n = ingest_span( in, offset );
+    if (n > num)
+      n = num;
+    ingest_fill( in, in->ram_size );
+    if (!IN_FLASH(addr) && !IN_FLEXNVM(addr)) {
+      memcpy( (void*)addr, (const void*)data, n );
+    }
+    else {
+      // erase ahead of the image (ingest_slot, ingest_swap, FlexNVM tier)
+      uint32_t *erase_addr = IN_FLEXNVM(addr) ? &in->nvm_erase_addr : &in->erase_addr;
+      if (flash_erase_ahead( erase_addr, addr, n )) {
+        out->printf( "abort - error erasing %08lX\n", *erase_addr );
+        return( INGEST_ERR_WRITE );
       }
-      else if (!IN_FLASH(buffer_addr)) {
-        memcpy( (void*)addr, (void*)hex.data, hex.num );
+      int error = flash_write_block( addr, (char*)data, n );
+      if (error) {
+        out->printf( "abort - error %02X in flash_write_block()\n", error );
+        return( INGEST_ERR_WRITE );
       }
-      else if (IN_FLASH(buffer_addr)) {
-        int error = flash_write_block( addr, hex.data, hex.num );
-        if (error) {
-          out->printf( "abort - error %02X in flash_write_block()\n", error );
-	  return;
-        }
+    }
+    if (n < num)
+      return( ingest_write( in, flash_addr + n, data + n, num - n ) );
+  }
+  return( INGEST_MORE );
+}
+
+//******************************************************************************
+// ingest_line()	decode one complete hex line and write its data to buffer
+//******************************************************************************
+static int ingest_line( ingest_t *in )
+{
+  hex_info_t *hex = &in->hex;
+  Stream *out = in->out;
+
+  if (in->echo) {
+    out->printf( "%s\n", in->line );
+    out->flush();
+  }
+
+  if (parse_hex_line( (const char*)in->line, hex->data, &hex->addr, &hex->num, &hex->code ) == 0) {
+    out->printf( "abort - bad hex line %s\n", in->line );
+  }
+  else if (process_hex_record( hex ) != 0) { // error on bad hex code
+    out->printf( "abort - invalid hex code %d\n", hex->code );
+    return( INGEST_ERR_RECORD );
+  }
+  else if (hex->code == 0) { // if data record
+    int status = ingest_write( in, hex->base + hex->addr, hex->data, hex->num );
+    if (status != INGEST_MORE)
+      return( status );
+  }
+  hex->lines++;
+  return( hex->eof ? INGEST_EOF : INGEST_MORE );
+}
+
+//******************************************************************************
+// ingest_block()	write a block of new code received in binary form
+//******************************************************************************
+// Binary transports (framed serial, .bin files) deliver the image without hex
+// records. Each block is handled like a data record at flash_addr, and counts
+// as one line.
+int ingest_block( ingest_t *in, uint32_t flash_addr, const char *data, uint32_t num )
+{
+  hex_info_t *hex = &in->hex;
+
+  if (in->status != INGEST_MORE)
+    return( in->status );
+  if (flash_addr < in->origin) {
+    in->out->printf( "abort - block address %08lX below %08lX\n", flash_addr, in->origin );
+    return( in->status = INGEST_ERR_SIZE );
+  }
+  if (flash_addr + num > hex->max)
+    hex->max = flash_addr + num;
+  if (flash_addr < hex->min)
+    hex->min = flash_addr;
+  in->status = ingest_write( in, flash_addr, data, num );
+  hex->lines++;
+  return( in->status );
+}
+
+//******************************************************************************
+// ingest_end()		end of binary image, like the hex EOF record
+//******************************************************************************
+int ingest_end( ingest_t *in )
+{
+  if (in->status == INGEST_MORE) {
+    in->hex.eof = 1;
+    in->status = INGEST_EOF;
+  }
+  return( in->status );
+}
+
+//******************************************************************************
+// ingest_feed()	assemble lines from count bytes and process each one
+//******************************************************************************
+// Work per call is bounded by count: at most count/11 hex lines (the shortest
+// valid line) are decoded and written. Bytes after the EOF record or an error
+// are ignored. Returns the (sticky) status, INGEST_MORE until EOF or error.
+int ingest_feed( ingest_t *in, const char *bytes, uint32_t count )
+{
+  while (count-- > 0 && in->status == INGEST_MORE) {
+    char c = *bytes++;
+    if (c == '\n' || c == '\r') {
+      if (in->nchar > 0) {
+        in->line[in->nchar] = 0;	// null-terminate
+        in->nchar = 0;
+        in->status = ingest_line( in );
       }
     }
-    hex.lines++;
+    else if (in->nchar < (int)sizeof(in->line) - 1) {
+      in->line[in->nchar++] = c;
+    }
+  }
+  return( in->status );
+}
+
+//******************************************************************************
+// ingest_poll()	feed up to max_bytes that stream has available (no waiting)
+//******************************************************************************
+int ingest_poll( ingest_t *in, Stream *stream, uint32_t max_bytes )
+{
+  char chunk[64];
+  while (max_bytes > 0 && in->status == INGEST_MORE) {
+    int avail = stream->available();
+    if (avail <= 0)
+      break;
+    uint32_t n = sizeof(chunk);
+    if (n > max_bytes)
+      n = max_bytes;
+    if (n > (uint32_t)avail)
+      n = avail;
+    n = stream->readBytes( chunk, n );
+    ingest_feed( in, chunk, n );
+    max_bytes -= n;
   }
-    
+  return( in->status );
+}
+
+//******************************************************************************
+// ingest_find_id()	check_flash_id() of new code, wherever it is
+//******************************************************************************
+// The image is read in chunks, each after the last len bytes of the one before,
+// so FLASH_ID is found even where it straddles two chunks (or tiers).
+static int ingest_find_id( ingest_t *in )
+{
+  const uint32_t len = sizeof(FLASH_ID) - 1;
+  static char window[len + 512];
+  uint32_t size = in->image_size;
+  uint32_t keep = 0;
+
+  for (uint32_t offset = 0; offset < size; ) {
+    uint32_t n = size - offset;
+    if (n > sizeof(window) - keep)
+      n = sizeof(window) - keep;
+    if (ingest_read( in, offset, window + keep, n ))
+      return( 0 );
+    if (keep + n > len && check_flash_id( (uint32_t)(uintptr_t)window, keep + n ))
+      return( 1 );
+    offset += n;
+    keep = (keep + n < len) ? keep + n : len;
+    memmove( window, window + sizeof(window) - keep, keep );
+  }
+  return( 0 );
+}
+
+//******************************************************************************
+// ingest_check()	after EOF, check new code in buffer -- return 0 if OK
+//******************************************************************************
+int ingest_check( ingest_t *in )
+{
+  hex_info_t *hex = &in->hex;
+  Stream *out = in->out;
+  lz_info_t lz;						// FXLZ header info
+
   out->printf( "\nhex file: %1d lines %1lu bytes (%08lX - %08lX)\n",
-			hex.lines, hex.max-hex.min, hex.min, hex.max );
+			hex->lines, hex->max-hex->min, hex->min, hex->max );
+
+  // size of new code in buffer (for a patch, the image it produced)
+  in->image_size = hex->max - hex->min;
 
-  // check FSEC value in new code -- abort if incorrect
-  #if defined(KINETISK) || defined(KINETISL)
-  uint32_t value = *(uint32_t *)(0x40C + buffer_addr);
-  if (value == 0xfffff9de) {
-    out->printf( "new code contains correct FSEC value %08lX\n", value );
+  // write what is held back before anything reads the buffer
+  int error = ingest_flush( in );
+  if (error) {
+    out->printf( "abort - error %02X in flash_write_flush()\n", error );
+    return( INGEST_ERR_WRITE );
+  }
+
+  // data partition -- erase what the data did not reach, nothing to check
+  if (in->part != NULL) {
+    if (flash_erase_ahead( &in->erase_addr, in->origin, in->buffer_size )) {
+      out->printf( "abort - error erasing %08lX\n", in->erase_addr );
+      return( INGEST_ERR_WRITE );
+    }
+    out->printf( "partition %s written (%08lX - %08lX)\n", in->part->name,
+			in->origin, in->origin + in->buffer_size );
+    return( 0 );
+  }
+  if (in->patch) {
+    error = delta_finish( &in->delta );
+    if (error) {
+      out->printf( "abort - error %d in delta_finish()\n", error );
+      return( INGEST_ERR_PATCH );
+    }
+    in->image_size = in->delta.info.new_size;
+    out->printf( "patch applied: build %08lX -> %08lX (%1lu bytes)\n",
+		in->delta.info.old_crc32, in->delta.info.new_crc32, in->image_size );
+  }
+
+  // image for a slot -- it must be linked to run there
+  #if (SLOT_MODE)
+  if (in->origin != FLASH_BASE_ADDR) {
+    uint32_t ivt[8];
+    ingest_read( in, SLOT_IVT_OFFSET, (char *)ivt, sizeof(ivt) );
+    if (in->image_size <= SLOT_IVT_OFFSET || !slot_image_check( in->origin, ivt )) {
+      out->printf( "abort - new code is not linked for slot at %08lX\n", in->origin );
+      return( INGEST_ERR_IMAGE );
+    }
+    out->printf( "new code is linked for slot at %08lX\n", in->origin );
   }
-  else {
-    out->printf( "abort - FSEC value %08lX should be FFFFF9DE\n", value );
-    return;
-  } 
   #endif
 
-  // check FLASH_ID in new code - abort if not found
-  if (check_flash_id( buffer_addr, hex.max - hex.min )) {
-    out->printf( "new code contains correct target ID %s\n", FLASH_ID );
+  // compressed image -- decode it once to check CRC, FSEC, FLASH_ID, overlap
+  if (!in->staged && lz_read_header( in->buffer_addr + in->buffer_offset, &lz )) {
+    error = lz_image_check( FLASH_BASE_ADDR, in->buffer_addr + in->buffer_offset, &lz );
+    if (error) {
+      out->printf( "abort - error %d in lz_image_check()\n", error );
+      return( INGEST_ERR_IMAGE );
+    }
+    out->printf( "compressed image OK: %1lu bytes -> %1lu bytes, target ID %s\n",
+			lz.packed_size, lz.raw_size, FLASH_ID );
   }
   else {
-    out->printf( "abort - new code missing string %s\n", FLASH_ID );
+    // check FSEC value in new code -- abort if incorrect
+    #if defined(KINETISK) || defined(KINETISL)
+    uint32_t value = 0;
+    ingest_read( in, 0x40C, (char *)&value, sizeof(value) );
+    if (value == 0xfffff9de) {
+      out->printf( "new code contains correct FSEC value %08lX\n", value );
+    }
+    else {
+      out->printf( "abort - FSEC value %08lX should be FFFFF9DE\n", value );
+      return( INGEST_ERR_IMAGE );
+    } 
+    #endif
+
+    // check FLASH_ID in new code - abort if not found
+    if (ingest_find_id( in )) {
+      out->printf( "new code contains correct target ID %s\n", FLASH_ID );
+    }
+    else {
+      out->printf( "abort - new code missing string %s\n", FLASH_ID );
+      return( INGEST_ERR_IMAGE );
+    }
+  }
+  return( 0 );
+}
+
+//******************************************************************************
+// ingest_commit()	put new code in flash (move, swap or slot record), reboot
+//			-- returns at once for a data partition
+//******************************************************************************
+void ingest_commit( ingest_t *in )
+{
+  lz_info_t lz;
+
+  if (in->part != NULL) {
+    // already in place, and the application keeps running
     return;
   }
+  else if (in->origin != FLASH_BASE_ADDR) {
+    // already in its slot, just record it as the one to boot
+    #if (SLOT_MODE)
+    if (slot_commit( in->origin, in->image_size ))
+      in->out->printf( "error recording slot at %08lX, old code kept\n", in->origin );
+    #endif
+  }
+  else if (in->swap) {
+    // exchange with the running code, which is kept for rollback
+    #if (SWAP_MODE)
+    if (swap_commit( in->image_size ))
+      in->out->printf( "error writing swap journal, old code kept\n" );
+    #endif
+  }
+  else if (in->staged) {
+    // returns only if the stage could not be read, before flash is changed
+    in->stage->commit( in->stage, in->image_size );
+    in->out->printf( "error reading %s, old code kept\n", in->stage->name );
+  }
+  else if (lz_read_header( in->buffer_addr + in->buffer_offset, &lz ))
+    flash_move_lz( FLASH_BASE_ADDR, in->buffer_addr + in->buffer_offset );
+  else
+  {
+    flash_tier_t tier[3] = {
+      { in->ram_addr, in->ram_size },
+      { in->buffer_addr, in->buffer_size },
+      { in->nvm_addr, in->nvm_size } };
+    flash_move_tiers( FLASH_BASE_ADDR, tier, 3, in->image_size );
+  }
+
+  // should not return from flash_move(), but put REBOOT here as reminder
+  REBOOT;
+}
+
+//******************************************************************************
+// update_firmware()	read hex file and write new firmware to program flash
+//******************************************************************************
+// Blocking form of ingest_begin/poll/check/commit. Returns only on error or
+// user abort.
+void update_firmware( Stream *in, Stream *out, 
+				uint32_t buffer_addr, uint32_t buffer_size )
+{
+  static ingest_t ingest;				// hex file ingestion
+  static char line[96];					// buffer for user input
+
+  // reliability of transfer via USB is improved by echo of each line
+  ingest_begin( &ingest, buffer_addr, buffer_size, out,
+			in == out && out == (Stream*)&Serial );
+
+  out->printf( "reading hex lines...\n" );
+
+  // read and process intel hex lines until EOF or error
+  while (ingest_poll( &ingest, in, sizeof(line) ) == INGEST_MORE) {}
+  if (ingest.status != INGEST_EOF || ingest_check( &ingest ) != 0)
+    return;
   
   // get user input to write to flash or abort
   int user_lines = -1;
-  while (user_lines != hex.lines && user_lines != 0) {
-    out->printf( "enter %d to flash or 0 to abort\n", hex.lines );
+  while (user_lines != ingest.hex.lines && user_lines != 0) {
+    out->printf( "enter %d to flash or 0 to abort\n", ingest.hex.lines );
     read_ascii_line( out, line, sizeof(line) );
     sscanf( line, "%d", &user_lines );
   }
@@ -129,10 +633,7 @@ void update_firmware( Stream *in, Stream *out,
   }
   
   // move new program from buffer to flash, free buffer, and reboot
-  flash_move( FLASH_BASE_ADDR, buffer_addr, hex.max-hex.min );
-
-  // should not return from flash_move(), but put REBOOT here as reminder
-  REBOOT;
+  ingest_commit( &ingest );
 }
 
 //******************************************************************************
@@ -159,6 +660,27 @@ void read_ascii_line( Stream *serial, char *line, int maxbytes )
   line[nchar-1] = 0;	// null-terminate
 }
 
+//******************************************************************************
+// poll_ascii_line()	non-blocking read_ascii_line() -- return 1 when line done
+//******************************************************************************
+// *nchar holds the partial line between calls and must be 0 to start
+int poll_ascii_line( Stream *serial, char *line, int maxbytes, int *nchar )
+{
+  while (serial->available()) {
+    int c = serial->read();
+    if (c == '\n' || c == '\r') {
+      if (*nchar == 0)
+        continue;
+      line[*nchar] = 0;	// null-terminate
+      *nchar = 0;
+      return( 1 );
+    }
+    if (*nchar < maxbytes - 1)
+      line[(*nchar)++] = c;
+  }
+  return( 0 );
+}
+
 //******************************************************************************
 // process_hex_record()		process record and return okay (0) or error (1)
 //******************************************************************************
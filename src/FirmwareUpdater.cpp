@@ -1,16 +1,499 @@
 #include "FirmwareUpdater.h"
+#include "CAN.h"
+#if !defined(__IMXRT1062__) && !defined(__MK64FX512__) && !defined(__MK66FX1M0__)
+#include <avr/eeprom.h> // boot count that seeds the nonce
+#endif
 
-
-void FirmwareUpdater::update()
+namespace FirmwareUpdater
 {
-    if (!HexTransfer::is_transfer_in_progress()) {
-        Serial.println("No transfer in progress.");
+  // --------------------------------------------------------------------------
+  // State Variables
+  // --------------------------------------------------------------------------
+  // The updater follows the update session that HexTransfer began (see
+  // FXSession.h), so it only keeps how far the image has come.
+
+  // Current state, and the policy that applies when an image is validated
+  State state;
+  Policy policy;
+
+  // CRC32 of the image in the buffer (for a patch, the image it produced),
+  // and the bytes of it read so far, while RECEIVED
+  uint32_t digest;
+  uint32_t digest_offset;
+
+  // Time the last progress event was sent, while RECEIVING
+  uint32_t last_progress_ts;
+
+  // --------------------------------------------------------------------------
+  // Command Authentication Variables
+  // --------------------------------------------------------------------------
+  // Commands other than QUERY_STATUS carry a SipHash-2-4 tag of the nonce,
+  // the digest and the command (see CommandMsg). The nonce goes up with
+  // each command acted on, so a recorded command is not accepted again.
+
+  #if defined(UPDATER_KEY)
+  const uint8_t key[FXSIPHASH_KEY_SIZE] = UPDATER_KEY;
+  #else
+  const uint8_t key[FXSIPHASH_KEY_SIZE] = {}; // only seeds the nonce, no tag is checked
+  #endif
+
+  // Nonce the next command must be tagged with
+  uint32_t nonce;
+
+  // Time of the last bad tag, and whether commands are ignored until
+  // UPDATER_AUTH_HOLDOFF_MS after it, so tags cannot be guessed at bus speed
+  uint32_t auth_error_ts;
+  bool auth_holdoff;
+
+  // Tagged command received since the last update, to be acted on in
+  // update(), and what else is answered there: a query, a bad tag, and a
+  // command refused as it arrived (no key, or one was already waiting)
+  CommandMsg pending_command;
+  bool pending_query;
+  bool pending_auth_error;
+  CommandCode pending_refused;
+
+  // --------------------------------------------------------------------------
+  // Coordinated Commit Variables
+  // --------------------------------------------------------------------------
+  // Nodes armed with the same group commit on one GROUP_COMMIT frame, a delay
+  // after it. The frame reaches every node at once, so its time of arrival is
+  // the clock they share.
+
+  // Group the image is armed with (UPDATER_GROUP_NONE = COMMIT only), and the
+  // group AUTO_ARM arms with
+  uint8_t group;
+  uint8_t auto_group;
+
+  // Token of the rollout, given with SET_TOKEN and ARM, that GROUP_COMMIT
+  // is tagged with (0 = none, GROUP_COMMIT ignored). It is only good once,
+  // while ARMED. Bits 8-23 of it from SET_TOKEN, until the ARM (0 = none).
+  uint32_t commit_token;
+  uint32_t next_token;
+
+  // Time the GROUP_COMMIT frame was received, and the delay to the commit, in us
+  uint32_t scheduled_us;
+  uint32_t schedule_delay_us;
+
+  // Application's idle point check (NULL = always idle), and its last answer,
+  // reported with READINESS when it changes
+  bool (*commit_gate)();
+  bool gate_open;
+
+} // namespace FirmwareUpdater
+
+
+
+// --------------------------------------------------------------------------
+// Main Functions
+// --------------------------------------------------------------------------
+void FirmwareUpdater::init() {
+  state = State::IDLE;
+  policy = static_cast<Policy>(UPDATER_POLICY);
+  digest = digest_offset = 0;
+  last_progress_ts = 0;
+
+  // The nonce starts where the PC cannot tell, and is read with QUERY_STATUS.
+  // It must not start in the same place after a reset, or commands recorded
+  // before it would be accepted again.
+  uint32_t seed = nonce_seed();
+  nonce = static_cast<uint32_t>(fxsiphash24(key, &seed, sizeof(seed)));
+  auth_holdoff = false;
+  pending_command = CommandMsg{};
+  pending_query = false;
+  pending_auth_error = false;
+  pending_refused = CommandCode::NONE;
+
+  group = auto_group = UPDATER_GROUP_NONE;
+  commit_token = next_token = 0;
+  commit_gate = NULL;
+  gate_open = true;
+}
+
+FirmwareUpdater::State FirmwareUpdater::get_state() {
+  return state;
+}
+
+void FirmwareUpdater::set_commit_gate(bool (*is_idle)()) {
+  // The application lets an armed image be committed only when is_idle()
+  // returns true, e.g. between control cycles (NULL = at any time)
+  commit_gate = is_idle;
+}
+
+bool FirmwareUpdater::is_gate_open() {
+  return commit_gate == NULL || commit_gate();
+}
+
+void FirmwareUpdater::update() {
+  // The session is ours while HexTransfer holds it for an image
+  ingest_t *in = session_ingest();
+  bool ours = session_owner() == &HexTransfer::can_transport && in->part == NULL;
+
+  // Act on a command, in any state. Its nonce is used up once it is acted
+  // on, whatever the outcome; GROUP_COMMIT's token was when it was received.
+  CommandCode code = pending_command.code;
+  if (code != CommandCode::NONE && code != CommandCode::GROUP_COMMIT) {
+    nonce++;
+  }
+  if (pending_auth_error) {
+    send_event(EventCode::AUTH_ERROR, nonce, 0);
+  }
+
+  if (code == CommandCode::ARM && (state == State::VALIDATED || state == State::ARMED)
+      && (pending_command.data[0] == UPDATER_GROUP_NONE || next_token != 0)) {
+    group = pending_command.data[0];
+    commit_token = (group == UPDATER_GROUP_NONE) ? 0 : (next_token << 8) | pending_command.data[1];
+    next_token = 0;
+    set_state(State::ARMED);
+  }
+  else if (code == CommandCode::SET_TOKEN && (state == State::VALIDATED || state == State::ARMED)
+           && (pending_command.data[0] | pending_command.data[1]) != 0) {
+    next_token = pending_command.data[0] | (pending_command.data[1] << 8);
+    send_event(EventCode::NONCE, nonce, static_cast<uint16_t>(policy));
+  }
+  else if (code == CommandCode::COMMIT && state == State::ARMED) {
+    set_state(State::COMMITTING);
+  }
+  else if (code == CommandCode::DISARM && (state == State::ARMED
+           || state == State::SCHEDULED || state == State::COMMITTING)) {
+    set_state(State::VALIDATED);
+  }
+  else if (code == CommandCode::SET_POLICY && pending_command.data[0] <= 2) {
+    policy = static_cast<Policy>(pending_command.data[0]);
+    auto_group = pending_command.data[1];
+    send_event(EventCode::NONCE, nonce, static_cast<uint16_t>(policy));
+  }
+  else if (code == CommandCode::GROUP_COMMIT && state == State::ARMED) {
+    // Checked against the group when received, see handle_command_msg()
+    schedule_delay_us = (pending_command.data[1] | (pending_command.data[2] << 8)) * 1000UL;
+    set_state(State::SCHEDULED);
+  }
+  else if (code == CommandCode::DISCARD && ours) {
+    // The session ends, and the updater follows it below
+    HexTransfer::abort_transfer();
+    ours = false;
+  }
+  else if (code != CommandCode::NONE) {
+    send_event(EventCode::REFUSED, nonce, static_cast<uint16_t>(code));
+  }
+  if (pending_refused != CommandCode::NONE) {
+    send_event(EventCode::REFUSED, nonce, static_cast<uint16_t>(pending_refused));
+  }
+
+  // Answer a query after the command, so it reports the state it left
+  if (pending_query) {
+    send_state();
+    send_event(EventCode::NONCE, nonce, static_cast<uint16_t>(policy));
+    if (state == State::ARMED || state == State::SCHEDULED) {
+      send_readiness();
+    }
+  }
+  pending_command = CommandMsg{};
+  pending_query = false;
+  pending_auth_error = false;
+  pending_refused = CommandCode::NONE;
+
+  // Follow the session: it ended, or a new transfer began in it
+  if (!ours) {
+    if (state != State::IDLE) {
+      set_state(State::IDLE);
+    }
+    return;
+  }
+  if (HexTransfer::is_transfer_in_progress() && state != State::RECEIVING) {
+    set_state(State::RECEIVING);
+  }
+
+  switch (state) {
+    case State::IDLE:
+      // A transfer init began the session, the first line comes next
+      set_state(State::RECEIVING);
+      break;
+
+    case State::RECEIVING:
+      // HexTransfer completes only once the session has checked the image
+      if (HexTransfer::is_file_transfer_complete()) {
+        digest = digest_offset = 0;
+        set_state(State::RECEIVED);
+      }
+      else if (millis() - last_progress_ts >= UPDATER_PROGRESS_MS) {
+        send_state();
+        last_progress_ts = millis();
+      }
+      break;
+
+    case State::RECEIVED: {
+      // Read the image back into its digest, a part per update, wherever it
+      // is (the buffer tiers, or SD when staged)
+      static char chunk[512] __attribute__ ((aligned (4)));
+      uint32_t end = digest_offset + UPDATER_DIGEST_BYTES_PER_UPDATE;
+      if (end > in->image_size) {
+        end = in->image_size;
+      }
+      while (digest_offset < end) {
+        uint32_t n = end - digest_offset;
+        if (n > sizeof(chunk)) {
+          n = sizeof(chunk);
+        }
+        if (ingest_read(in, digest_offset, chunk, n)) {
+          #if DEBUG
+          Serial.printf("Error: Cannot read image at %lu!\n", digest_offset);
+          #endif
+          HexTransfer::abort_transfer();
+          set_state(State::IDLE);
+          return;
+        }
+        digest = fxcrc32_update(digest, chunk, n);
+        digest_offset += n;
+      }
+      if (digest_offset < in->image_size) {
+        break;
+      }
+
+      // The policy applies once, as the image is validated, so a DISARM holds
+      set_state(State::VALIDATED);
+      if (policy == Policy::AUTO_ARM) {
+        group = auto_group;
+        set_state(State::ARMED);
+      }
+      else if (policy == Policy::AUTO_COMMIT) {
+        group = UPDATER_GROUP_NONE;
+        set_state(State::ARMED);
+        set_state(State::COMMITTING);
+      }
+      break;
     }
-    else {
-        Serial.println("Transfer in progress...");
+
+    case State::VALIDATED:
+      // Waiting for a command
+      break;
+
+    case State::ARMED:
+      // Waiting for a command, and telling the PC when the application
+      // becomes ready or busy
+      if (is_gate_open() != gate_open) {
+        send_readiness();
+      }
+      break;
+
+    case State::SCHEDULED: {
+      // Commit at the time, if the application is idle, or within the
+      // window after it; else stay armed for the next GROUP_COMMIT
+      uint32_t elapsed = micros() - scheduled_us;
+      if (elapsed < schedule_delay_us) {
+        break;
+      }
+      if (is_gate_open()) {
+        set_state(State::COMMITTING);
+        commit();
+      }
+      else if (elapsed >= schedule_delay_us + UPDATER_COMMIT_WINDOW_MS * 1000UL) {
+        send_event(EventCode::MISSED, digest, group);
+        set_state(State::ARMED);
+      }
+      break;
     }
-    if (HexTransfer::is_file_transfer_complete()) {
-        Serial.println("File transfer complete.");
+
+    case State::COMMITTING:
+      // A COMMIT waits for the application's idle point, however long
+      if (is_gate_open()) {
+        commit();
+      }
+      break;
+  }
+}
+
+void FirmwareUpdater::commit() {
+  // Give the event time to go out, then flash the image and reboot
+  delay(UPDATER_COMMIT_DELAY_MS);
+  #if not DRYRUN
+  session_commit(&HexTransfer::can_transport);
+  #endif
+
+  // Only a dry run, or an image the session would not commit, gets here
+  #if DEBUG
+  Serial.println("Image not committed");
+  #endif
+  HexTransfer::abort_transfer();
+  set_state(State::IDLE);
+}
+
+// --------------------------------------------------------------------------
+// Can Bus Message Handlers
+// --------------------------------------------------------------------------
+
+void FirmwareUpdater::handle_command_msg(uint8_t (&buf)[8])
+{
+  CommandMsg msg = unpack_command_msg(buf);
+  uint32_t received_us = micros();
+  bool group_commit = msg.code == CommandCode::GROUP_COMMIT;
+
+  // GROUP_COMMIT is for every node, and only taken by those armed with its
+  // group and a token. Other commands are for one node, or queries for any.
+  if (group_commit) {
+    if (state != State::ARMED || group == UPDATER_GROUP_NONE || msg.data[0] != group
+        || commit_token == 0) {
+      return;
     }
+  }
+  else if (msg.data[2] != NODE_CAN_DEVICE_ID
+           && !(msg.code == CommandCode::QUERY_STATUS && msg.data[2] == UPDATER_NODE_ANY)) {
+    return;
+  }
+
+  // Queries need no tag
+  if (msg.code == CommandCode::QUERY_STATUS) {
+    pending_query = true;
+    return;
+  }
+
+  // Without a key there is no tag to check, so the command is refused
+  #if !defined(UPDATER_KEY)
+  pending_refused = msg.code;
+  return;
+  #endif
+
+  // Ignore commands for a while after a bad tag
+  if (auth_holdoff && millis() - auth_error_ts < UPDATER_AUTH_HOLDOFF_MS) {
+    return;
+  }
+  auth_holdoff = false;
+
+  // One command at a time: the nonce only moves on once update() has acted
+  // on the one waiting, so the PC waits for its event before the next
+  if (pending_command.code != CommandCode::NONE) {
+    pending_refused = msg.code;
+    return;
+  }
+
+  // GROUP_COMMIT is the same frame for every node, so it is tagged with the
+  // token they were all armed with, not a nonce or digest of any one of them
+  bool valid = group_commit ? is_tag_valid(buf, commit_token, 0)
+                            : is_tag_valid(buf, nonce, (state >= State::VALIDATED) ? digest : 0);
+  if (!valid) {
+    #if DEBUG
+    Serial.print("Error: Bad tag on updater command! Code: ");
+    Serial.println(buf[0]);
+    #endif
+
+    auth_holdoff = true;
+    auth_error_ts = millis();
+    pending_auth_error = true;
+    return;
+  }
+
+  // Accepted. The time of a GROUP_COMMIT is the time it was received, not
+  // when update() gets to it, and its token cannot be used again.
+  if (group_commit) {
+    scheduled_us = received_us;
+    commit_token = 0;
+  }
+  pending_command = msg;
+}
+
+uint32_t FirmwareUpdater::nonce_seed() {
+  // The hardware random number generator where there is one. Elsewhere, a
+  // boot count kept in EEPROM, so the seed differs after every reset even
+  // though micros() at init does not.
+  uint32_t seed = micros();
+  #if defined(__IMXRT1062__)
+  CCM_CCGR6 |= CCM_CCGR6_TRNG(CCM_CCGR_ON);
+  TRNG_MCTL = TRNG_MCTL_RST_DEF | TRNG_MCTL_PRGM;
+  TRNG_MCTL = TRNG_MCTL_SAMP_MODE(2);
+  while ((TRNG_MCTL & (TRNG_MCTL_ENT_VAL | TRNG_MCTL_ERR)) == 0) ;
+  seed ^= TRNG_ENT0;
+  seed ^= TRNG_ENT15;   // the last entropy word read starts the next sample
+  #elif defined(__MK64FX512__) || defined(__MK66FX1M0__)
+  SIM_SCGC6 |= SIM_SCGC6_RNGA;
+  RNG_CR = RNG_CR_HA | RNG_CR_GO;
+  while ((RNG_SR & 0xFF00) == 0) ;   // OREG_LVL, words in the output register
+  seed ^= RNG_OR;
+  #else
+  uint32_t *addr = reinterpret_cast<uint32_t *>(UPDATER_NONCE_EEPROM_ADDR);
+  uint32_t boots = eeprom_read_dword(addr) + 1;
+  eeprom_write_dword(addr, boots);
+  seed ^= boots;
+  #endif
+  return seed;
+}
+
+FirmwareUpdater::CommandMsg FirmwareUpdater::unpack_command_msg(uint8_t (&buf)[8]) {
+  CommandMsg m{};
+  m.code = static_cast<CommandCode>(buf[0]);
+  for (int i = 0; i < 3; i++) {
+    m.data[i] = buf[i + 1];
+  }
+  for (int i = 0; i < 4; i++) {
+    m.tag |= static_cast<uint32_t>(buf[i + 4]) << (8 * i);
+  }
+  return m;
+}
+
+bool FirmwareUpdater::is_tag_valid(uint8_t (&buf)[8], uint32_t tag_nonce, uint32_t tag_digest) {
+  // SipHash-2-4 of nonce, digest (as in the STATE event), code and data,
+  // all little endian
+  uint8_t input[12];
+  for (int i = 0; i < 4; i++) {
+    input[i] = (tag_nonce >> (8 * i)) & 0xFF;
+    input[i + 4] = (tag_digest >> (8 * i)) & 0xFF;
+    input[i + 8] = buf[i];
+  }
+  uint32_t tag = static_cast<uint32_t>(fxsiphash24(key, input, sizeof(input)));
+
+  // Compare every byte, so the time taken does not tell how many matched
+  uint32_t diff = 0;
+  for (int i = 0; i < 4; i++) {
+    diff |= buf[i + 4] ^ ((tag >> (8 * i)) & 0xFF);
+  }
+  return diff == 0;
+}
+
+// --------------------------------------------------------------------------
+// Event Functions
+// --------------------------------------------------------------------------
+
+void FirmwareUpdater::send_event(EventCode event, uint32_t value, uint16_t aux) {
+  // State, event, value and aux, little endian
+  uint8_t buf[8];
+  buf[0] = static_cast<uint8_t>(state);
+  buf[1] = static_cast<uint8_t>(event);
+  for (int i = 0; i < 4; i++) {
+    buf[i + 2] = (value >> (8 * i)) & 0xFF;
+  }
+  buf[6] = aux & 0xFF;
+  buf[7] = (aux >> 8) & 0xFF;
+  CAN::write(NODE_CAN_DEVICE_ID, UPDATER_CAN_EVENT_ID, sizeof(buf), buf);
 }
 
+void FirmwareUpdater::send_state() {
+  // The digest once known, and the lines received so far
+  uint32_t value = (state >= State::VALIDATED) ? digest : 0;
+  send_event(EventCode::STATE, value, HexTransfer::get_hex_line_num());
+}
+
+void FirmwareUpdater::send_readiness() {
+  // Whether the application lets the image be committed now, and its group
+  gate_open = is_gate_open();
+  send_event(EventCode::READINESS, gate_open ? 1 : 0, group);
+}
+
+void FirmwareUpdater::set_state(State next) {
+  // The token is for the image armed: a later one needs a new token
+  state = next;
+  if (state != State::ARMED) {
+    commit_token = 0;
+  }
+  if (state != State::VALIDATED && state != State::ARMED) {
+    next_token = 0;
+  }
+  last_progress_ts = millis();
+
+  #if DEBUG
+  Serial.printf("Updater state %d, digest %08lX\n", static_cast<int>(state), digest);
+  #endif
+
+  send_state();
+  if (state == State::ARMED) {
+    send_readiness();
+  }
+}
@@ -15,39 +15,77 @@
 // [<------------------------------ FLASH_SIZE ------------------------------->]
 // ^FLASH_BASE_ADDR
 
-#include <Arduino.h>		// Serial, etc. (if used)
-#include <malloc.h>		// malloc(), free()
+#include <Arduino.h>		// Serial, DMAMEM, etc. (if used)
 #include <string.h>		// memset()
 #include "FlashTxx.h"		// FLASH_BASE_ADDRESS, FLASH_SECTOR_SIZE, etc.
+#include "FXSlot.h"		// slot_buffer_init() (SLOT_MODE)
+#include "FXSwap.h"		// swap_buffer_init() (SWAP_MODE)
 
 static int leave_interrupts_disabled = 0;
 
+#if defined(__IMXRT1062__) && (RAM_BUFFER_SIZE > 0)
+// RAM tier is reserved at link time in RAM2 (DMAMEM, not initialized), so
+// it cannot fail from heap fragmentation and uses no RAM1 (DTCM)
+DMAMEM static char ram_buffer[RAM_BUFFER_SIZE] __attribute__ ((aligned (32)));
+#else
+// RAM tier claimed from the heap break by ram_buffer_claim()
+extern void *_sbrk( int incr );
+static char *ram_claim_brk;		// heap break before the claim
+static uint32_t ram_claim_size;		// bytes claimed (0 = none)
+#endif
+
+#if defined(ARDUINO_TEENSY41) && (EXTMEM_BUFFER > 0)
+extern uint8_t external_psram_size;	// MB of PSRAM found by startup (0 = none)
+extern unsigned long _extram_start, _extram_end;  // EXTMEM variables
+#endif
+
 //******************************************************************************
-// compute addr/size for firmware buffer and return NO/RAM/FLASH_BUFFER_TYPE
+// compute addr/size for firmware buffer (flash tier) and return its type
 //******************************************************************************
+// the RAM tier is claimed separately, for each update (ram_buffer_claim), and
+// only for a buffer in flash
 int firmware_buffer_init( uint32_t *buffer_addr, uint32_t *buffer_size )
 {
   #if defined(__MK66FX1M0__)     // for T3.6 only
   LMEM_EnableCodeCache( false ); // disable LMEM code cache for flash operations
   #endif
 
-  #if defined(__IMXRT1062__) && (RAM_BUFFER_SIZE > 0)
-  // attempt to malloc() RAM for buffer and return success or failure
-  *buffer_addr = (uint32_t)malloc( RAM_BUFFER_SIZE );
-  if (*buffer_addr != 0) {
-    *buffer_size = RAM_BUFFER_SIZE;
-    memset( (void*)*buffer_addr, 0xFF, *buffer_size ); // 0xFF like erased flash
-    return( RAM_BUFFER_TYPE );
+  #if (SLOT_MODE)
+  // running in a slot, the new code goes straight into the other one
+  if (slot_buffer_init( buffer_addr, buffer_size ) == SLOT_BUFFER_TYPE)
+    return( SLOT_BUFFER_TYPE );
+  #endif
+
+  #if (SWAP_MODE)
+  // the buffer is always the upper half of flash, swapped with the code
+  return( swap_buffer_init( buffer_addr, buffer_size ) );
+  #endif
+
+  #if defined(ARDUINO_TEENSY41) && (EXTMEM_BUFFER > 0)
+  // use PSRAM if fitted, as much as program flash or as is free above EXTMEM
+  // variables. it is allocated once, here, and kept for every update
+  if (external_psram_size > 0) {
+    uint32_t size = external_psram_size * 0x100000
+		- ((uint32_t)&_extram_end - (uint32_t)&_extram_start);
+    if (size > FLASH_SIZE - FLASH_RESERVE)
+      size = FLASH_SIZE - FLASH_RESERVE;
+    size &= ~(FLASH_SECTOR_SIZE - 1);
+    for (; size >= 64 * FLASH_SECTOR_SIZE; size -= 16 * FLASH_SECTOR_SIZE) {
+      void *buffer = extmem_malloc( size );
+      if (buffer != NULL && IN_EXTMEM((uint32_t)buffer)) {
+        *buffer_addr = (uint32_t)buffer;
+        *buffer_size = size;
+        memset( buffer, 0xFF, size );	// 0xFF like erased flash
+        return( EXTMEM_BUFFER_TYPE );
+      }
+      if (buffer != NULL)
+        extmem_free( buffer );		// malloc() RAM, not PSRAM
+    }
   }
-  return( NO_BUFFER_TYPE );
   #endif
 
   // buffer will begin at first sector ABOVE code and below FLASH_RESERVE
-  // start at bottom of FLASH_RESERVE and work down until non-erased flash found
-  *buffer_addr = FLASH_BASE_ADDR + FLASH_SIZE - FLASH_RESERVE - 4;
-  while (*buffer_addr > 0 && *((uint32_t *)*buffer_addr) == 0xFFFFFFFF)
-    *buffer_addr -= 4;
-  *buffer_addr += 4; // first address above code
+  *buffer_addr = firmware_code_end(); // first address above code
 
   // increase buffer_addr to next sector boundary (if not on a sector boundary)
   if ((*buffer_addr % FLASH_SECTOR_SIZE) > 0)
@@ -58,14 +96,104 @@ int firmware_buffer_init( uint32_t *buffer_addr, uint32_t *buffer_size )
 }
 
 //******************************************************************************
-// compute addr/size for firmware buffer and return NO/RAM/FLASH_BUFFER_TYPE
+// return first address above existing code (only valid while buffer is empty)
+//******************************************************************************
+// with SWAP_MODE, the code is below the buffer, so it is always valid
+uint32_t firmware_code_end( void )
+{
+  // start at bottom of FLASH_RESERVE (or of the swap buffer) and work down
+  // until non-erased flash found
+  #if (SWAP_MODE)
+  uint32_t addr = SWAP_BUFFER_ADDR - 4;
+  #else
+  uint32_t addr = FLASH_BASE_ADDR + FLASH_SIZE - FLASH_RESERVE - 4;
+  #endif
+  while (addr > 0 && *((uint32_t *)addr) == 0xFFFFFFFF)
+    addr -= 4;
+  return( addr + 4 );
+}
+
+//******************************************************************************
+// ram_buffer_claim()	RAM tier of the buffer -- return its size (0 if none)
+//******************************************************************************
+// The tier is not cleared: the writer tracks which bytes it has written and
+// fills any gap with 0xFF (like erased flash) itself. Without a static tier,
+// the RAM above the heap break is claimed with _sbrk(), less RAM_BUFFER_RESERVE
+// left for later heap use (T4.x RAM2) or for the heap and stack (T3.x).
+uint32_t ram_buffer_claim( uint32_t *ram_addr )
+{
+  #if defined(__IMXRT1062__) && (RAM_BUFFER_SIZE > 0)
+  *ram_addr = (uint32_t)ram_buffer;
+  return( RAM_BUFFER_SIZE & ~(FLASH_SECTOR_SIZE - 1) );
+  #else
+  #if defined(__IMXRT1062__)
+  extern unsigned long _heap_end;
+  uint32_t end = (uint32_t)&_heap_end;			// top of RAM2
+  #else
+  uint32_t end = (uint32_t)__builtin_frame_address( 0 );	// stack grows down
+  #endif
+  char *brk = (char *)_sbrk( 0 );
+  uint32_t start = ((uint32_t)brk + 31) & ~31;
+  uint32_t size = 0;
+
+  if (ram_claim_size == 0 && end > start + RAM_BUFFER_RESERVE)
+    size = (end - start - RAM_BUFFER_RESERVE) & ~(FLASH_SECTOR_SIZE - 1);
+  if (size == 0 || _sbrk( start - (uint32_t)brk + size ) == (void *)-1)
+    return( 0 );
+  ram_claim_brk = brk;
+  ram_claim_size = start - (uint32_t)brk + size;
+  *ram_addr = start;
+  return( size );
+  #endif
+}
+
+//******************************************************************************
+// ram_buffer_release()	give the RAM tier back to the heap
+//******************************************************************************
+// only possible if the heap did not grow above the tier meanwhile
+void ram_buffer_release( void )
+{
+  #if !(defined(__IMXRT1062__) && (RAM_BUFFER_SIZE > 0))
+  if (ram_claim_size > 0 && (char *)_sbrk( 0 ) == ram_claim_brk + ram_claim_size) {
+    _sbrk( -(int)ram_claim_size );
+    ram_claim_size = 0;
+  }
+  #endif
+}
+
+//******************************************************************************
+// nvm_buffer_claim()	FlexNVM tier of the buffer -- return its size (0 if none)
+//******************************************************************************
+// T3.5/T3.6 only, with FLEXNVM_BUFFER > 0. FlexNVM is all data flash unless
+// it is partitioned for EEPROM backup (Teensyduino's EEPROM does this on its
+// first use), as SIM_FCFG1 DEPART tells: 0000 is all data flash, and so is
+// 1111, a part that was never partitioned. Any other partition holds EEPROM
+// backup, and FlexNVM is left alone. Nothing is erased here: ingest_write()
+// erases the tier ahead of the image, so only an image that spills into it
+// touches it.
+uint32_t nvm_buffer_claim( uint32_t *nvm_addr )
+{
+  #if defined(FLEXNVM_ADDR) && (FLEXNVM_BUFFER > 0)
+  uint32_t depart = (SIM_FCFG1 >> 8) & 0xF;		// SIM_FCFG1[DEPART]
+  if (depart != 0x0 && depart != 0xF)
+    return( 0 );
+  *nvm_addr = FLEXNVM_ADDR;
+  return( FLEXNVM_SIZE );
+  #else
+  (void)nvm_addr;
+  return( 0 );
+  #endif
+}
+
+//******************************************************************************
+// erase FLASH buffer or clear RAM buffer (it is static, so it is not freed)
 //******************************************************************************
 void firmware_buffer_free( uint32_t buffer_addr, uint32_t buffer_size )
 {
   if (IN_FLASH(buffer_addr))
     flash_erase_block( buffer_addr, buffer_size );
   else
-    free( (void*)buffer_addr );
+    memset( (void*)buffer_addr, 0xFF, buffer_size );
 }
 
 //******************************************************************************
@@ -114,6 +242,10 @@ RAMFUNC static void flash_init_command( uint8_t command, uint32_t address )
   // wait for ready, clear error flags, init command and address registers
   while (!(FTFL_FSTAT & FTFL_FSTAT_CCIF)) {;}
   FTFL_FSTAT  = 0x30;
+  #if defined(FLEXNVM_ADDR)
+  if (IN_FLEXNVM(address))		// FlexNVM is command address 0x800000+
+    address = (address - FLEXNVM_ADDR) | 0x800000;
+  #endif
   FTFL_FCCOB0 = command;
   FTFL_FCCOB1 = address >> 16;
   FTFL_FCCOB2 = address >> 8;
@@ -247,70 +379,179 @@ RAMFUNC int flash_sector_not_erased( uint32_t address )
 //******************************************************************************
 RAMFUNC void flash_move( uint32_t dst, uint32_t src, uint32_t size )
 {
-  uint32_t offset=0, error=0, addr;
+  flash_tier_t tier = { src, size };
+  flash_move_tiers( dst, &tier, 1, size );
+}
+
+//******************************************************************************
+// flash_move_tiers()	flash_move() from the tiers of the buffer, in order
+//******************************************************************************
+// the new code is in tier[0] (e.g. RAM), then tier[1] (e.g. the flash buffer),
+// etc. each tier size is a multiple of FLASH_SECTOR_SIZE (except the last,
+// which need not hold all of its size), so no sector straddles two tiers
+RAMFUNC void flash_move_tiers( uint32_t dst, const flash_tier_t *tier,
+				int count, uint32_t size )
+{
+  uint32_t offset=0, error=0, addr, from, skip;
+  int t, erase_buffer=0;
   
-  // set global flag leave_interrupts_disabled = 1 to prevent the T3.x flash
-  // write and erase functions from re-enabling interrupts when they complete 
-  leave_interrupts_disabled = 1;
+  for (t=0; t < count; t++)
+    if (tier[t].size > 0 && IN_FLASH(tier[t].addr))
+      erase_buffer = 1;
+
+  flash_move_begin();
   
   // move size bytes containing new program from source to destination
   while (offset < size && error == 0) {
 
     addr = dst + offset;
+    for (t=0, skip=0; t < count-1 && offset >= skip + tier[t].size; t++)
+      skip += tier[t].size;
+    from = tier[t].addr + offset - skip;
 
-    // if new sector, erase, then immediately write FSEC/FOPT if in this sector
-    // this is the ONLY place that FSEC values are written, so it's the only
-    // place where calls to KINETIS flash write functions have aFSEC = oFSEC = 1
+    // if new sector, skip it if it already holds the new code, else erase,
+    // then immediately write FSEC/FOPT if in this sector
     if ((addr & (FLASH_SECTOR_SIZE - 1)) == 0) {
-      if (flash_sector_not_erased( addr )) {
-        #if defined(__IMXRT1062__)
-          eepromemu_flash_erase_sector( (void *)addr );
-        #elif (FLASH_WRITE_SIZE==4)
-          error |= flash_erase_sector( addr, 1 );
-          if (addr == (0x40C & ~(FLASH_SECTOR_SIZE - 1)))
-            error |= flash_word( 0x40C, 0xfffff9de, 1, 1 );
-        #elif (FLASH_WRITE_SIZE==8)
-          error |= flash_erase_sector( addr, 1 );
-          if (addr == (0x408 & ~(FLASH_SECTOR_SIZE - 1)))
-            error |= flash_phrase( 0x408, 0xfffff9deffffffff, 1, 1 );
-        #endif
+      if (flash_move_sector_matches( addr, from, size - offset )) {
+        offset += FLASH_SECTOR_SIZE;
+        continue;
       }
+      error |= flash_move_erase( addr );
     }
     
-    // for KINETIS, these writes may be to the sector containing FSEC, but the
-    // FSEC location was written by the code above, so use aFSEC=1, oFSEC=0
+    error |= flash_move_page( addr, (void*)from, size - offset );
+
+    offset += FLASH_PAGE_SIZE;
+  }
+  
+  // if a tier of the buffer is in program FLASH, erase it, then REBOOT
+  flash_move_end( dst + offset, erase_buffer && error == 0 );
+}
+
+//******************************************************************************
+// flash_move_begin()	prepare for flash_move() or one of its variants
+//******************************************************************************
+RAMFUNC void flash_move_begin( void )
+{
+  // set global flag leave_interrupts_disabled = 1 to prevent the T3.x flash
+  // write and erase functions from re-enabling interrupts when they complete 
+  leave_interrupts_disabled = 1;
+}
+
+//******************************************************************************
+// flash_move_erase()	erase destination sector at addr (if not erased)
+//******************************************************************************
+// if the sector contains FSEC/FOPT, write those immediately after the erase.
+// this is the ONLY place that FSEC values are written, so it's the only
+// place where calls to KINETIS flash write functions have aFSEC = oFSEC = 1
+RAMFUNC int flash_move_erase( uint32_t addr )
+{
+  int error = 0;
+  if (flash_sector_not_erased( addr )) {
     #if defined(__IMXRT1062__)
-      // for T4.x, data address passed to flash_write() must be in RAM
-      uint32_t value = *(uint32_t *)(src + offset);     
-      eepromemu_flash_write( (void*)addr, &value, 4 );
+      eepromemu_flash_erase_sector( (void *)addr );
     #elif (FLASH_WRITE_SIZE==4)
-      error |= flash_word( addr, *(uint32_t *)(src + offset), 1, 0 );
+      error |= flash_erase_sector( addr, 1 );
+      if (addr == (0x40C & ~(FLASH_SECTOR_SIZE - 1)))
+        error |= flash_word( 0x40C, 0xfffff9de, 1, 1 );
     #elif (FLASH_WRITE_SIZE==8)
-      error |= flash_phrase( addr, *(uint64_t *)(src + offset), 1, 0 );
+      error |= flash_erase_sector( addr, 1 );
+      if (addr == (0x408 & ~(FLASH_SECTOR_SIZE - 1)))
+        error |= flash_phrase( 0x408, 0xfffff9deffffffff, 1, 1 );
     #endif
+  }
+  return( error );
+}
 
-    offset += FLASH_WRITE_SIZE;
+//******************************************************************************
+// flash_move_write()	write FLASH_WRITE_SIZE bytes from data to (erased) addr
+//******************************************************************************
+// for KINETIS, these writes may be to the sector containing FSEC, but the
+// FSEC location was written by flash_move_erase(), so use aFSEC=1, oFSEC=0
+RAMFUNC int flash_move_write( uint32_t addr, const void *data )
+{
+  int error = 0;
+  #if defined(__IMXRT1062__)
+    // for T4.x, data address passed to flash_write() must be in RAM
+    uint32_t value = *(const uint32_t *)data;     
+    eepromemu_flash_write( (void*)addr, &value, 4 );
+  #elif (FLASH_WRITE_SIZE==4)
+    error |= flash_word( addr, *(const uint32_t *)data, 1, 0 );
+  #elif (FLASH_WRITE_SIZE==8)
+    error |= flash_phrase( addr, *(const uint64_t *)data, 1, 0 );
+  #endif
+  return( error );
+}
+
+//******************************************************************************
+// flash_move_page()	write FLASH_PAGE_SIZE bytes from data to (erased) addr
+//******************************************************************************
+// count is the number of bytes of new code left at data; the rest of the page
+// is left erased. for T4.x, the page is copied to RAM (data may be in flash or
+// EXTMEM) and written with one page program command instead of 64 4-byte
+// ones, and a page that is all 0xFF is not written at all.
+RAMFUNC int flash_move_page( uint32_t addr, const void *data, uint32_t count )
+{
+  #if defined(__IMXRT1062__)
+    static uint32_t page[FLASH_PAGE_SIZE/4];
+    const uint32_t *s = (const uint32_t *)data;
+    uint32_t blank = 0xFFFFFFFF;
+    for (uint32_t i=0; i < FLASH_PAGE_SIZE/4; i++) {
+      page[i] = (i*4 < count) ? s[i] : 0xFFFFFFFF;
+      blank &= page[i];
+    }
+    if (blank != 0xFFFFFFFF)
+      eepromemu_flash_write( (void*)addr, page, FLASH_PAGE_SIZE );
+    return( 0 );
+  #else
+    (void)count;
+    return( flash_move_write( addr, data ) );
+  #endif
+}
+
+//******************************************************************************
+// flash_move_sector_matches()	return 1 if sector at addr already holds src
+//******************************************************************************
+// count is the number of bytes of new code left at src. the sector matches if
+// it is exactly what erasing and writing it would leave: the new code (in
+// whole write units), then 0xFF. unchanged sectors are then neither erased
+// nor written, which saves time and wear when most of the image is the same.
+RAMFUNC int flash_move_sector_matches( uint32_t addr, uint32_t src, uint32_t count )
+{
+  const uint32_t *d = (const uint32_t *)addr;
+  const uint32_t *s = (const uint32_t *)src;
+  if (count < FLASH_SECTOR_SIZE)
+    count = (count + FLASH_WRITE_SIZE - 1) & ~(FLASH_WRITE_SIZE - 1);
+  for (uint32_t i=0; i < FLASH_SECTOR_SIZE; i += 4) {
+    if (*d++ != ((i < count) ? *s++ : 0xFFFFFFFF))
+      return 0;
   }
-  
-  // move is complete. if the source buffer (src) is in FLASH, erase the buffer
-  // by erasing all sectors from top of new program to bottom of FLASH_RESERVE,
-  // which leaves FLASH in same state as if code was loaded using TeensyDuino.
-  // For KINETIS, this erase cannot include FSEC, so erase uses aFSEC=0.
-  if (IN_FLASH(src)) {
-    while (offset < (FLASH_SIZE - FLASH_RESERVE) && error == 0) {
-      addr = dst + offset;
-      if ((addr & (FLASH_SECTOR_SIZE - 1)) == 0) {
-        if (flash_sector_not_erased( addr )) {
-          #if defined(__IMXRT1062__)
-            eepromemu_flash_erase_sector( (void*)addr );
-          #else
-            error |= flash_erase_sector( addr, 0 );
-          #endif
-	}
+  return 1;
+}
+
+//******************************************************************************
+// flash_move_end()	erase buffer (optional) up to FLASH_RESERVE, then REBOOT
+//******************************************************************************
+// move is complete. if erase_buffer, erase all sectors from addr (top of new
+// program) to bottom of FLASH_RESERVE, which leaves FLASH in same state as if
+// code was loaded using TeensyDuino.
+// For KINETIS, this erase cannot include FSEC, so erase uses aFSEC=0.
+RAMFUNC void flash_move_end( uint32_t addr, int erase_buffer )
+{
+  uint32_t error = 0;
+  while (erase_buffer && error == 0
+	&& addr < (FLASH_BASE_ADDR + FLASH_SIZE - FLASH_RESERVE)) {
+    if ((addr & (FLASH_SECTOR_SIZE - 1)) == 0) {
+      if (flash_sector_not_erased( addr )) {
+        #if defined(__IMXRT1062__)
+          eepromemu_flash_erase_sector( (void*)addr );
+        #else
+          error |= flash_erase_sector( addr, 0 );
+        #endif
       }
-      offset += FLASH_WRITE_SIZE;
-    }   
-  }
+    }
+    addr += FLASH_WRITE_SIZE;
+  }   
 
   // for T3.x, at least, must REBOOT here (via macro) because original code has
   // been erased and overwritten, so return address is no longer valid
@@ -341,20 +582,38 @@ int flash_erase_block( uint32_t start, uint32_t size )
   return( error );
 }
 
+//******************************************************************************
+// flash_erase_ahead()	erase sectors up to (addr + count) before writing there
+//******************************************************************************
+// for a buffer that still holds an older image (a slot, or the previous image
+// kept for rollback). *erase_addr is where erasing continues (0 = all erased),
+// and it is erased from there, so a gap before addr is erased too.
+int flash_erase_ahead( uint32_t *erase_addr, uint32_t addr, uint32_t count )
+{
+  uint32_t end = (addr + count + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+  if (*erase_addr == 0 || end <= *erase_addr)
+    return( 0 );
+  if (flash_erase_block( *erase_addr, end - *erase_addr ))
+    return( 1 );
+  *erase_addr = end;
+  return( 0 );
+}
+
+// static (aligned) variables to guarantee 32-bit or 64-bit-aligned writes, at
+// file scope so that flash_write_flush() can write a partial unit
+#if (FLASH_WRITE_SIZE == 4)				// #if 4-byte writes
+static uint32_t write_buf __attribute__ ((aligned (4)));	//   4-byte buffer
+#elif (FLASH_WRITE_SIZE == 8)				// #elif 8-byte writes
+static uint64_t write_buf __attribute__ ((aligned (8)));	//   8-byte buffer
+#endif							//
+static uint32_t write_count = 0;			// bytes in buffer
+static uint32_t write_next = 0;				// expected address
+
 //******************************************************************************
 // take a 32-bit aligned array of 32-bit values and write it to erased flash
 //******************************************************************************
 int flash_write_block( uint32_t addr, char *data, uint32_t count )
 {
-  // static (aligned) variables to guarantee 32-bit or 64-bit-aligned writes
-  #if (FLASH_WRITE_SIZE == 4)				// #if 4-byte writes
-  static uint32_t buf __attribute__ ((aligned (4)));	//   4-byte buffer
-  #elif (FLASH_WRITE_SIZE == 8)				// #elif 8-byte writes
-  static uint64_t buf __attribute__ ((aligned (8)));	//   8-byte buffer
-  #endif						//
-  static uint32_t buf_count = 0;			// bytes in buffer
-  static uint32_t next_addr = 0;			// expected address
-  
   int ret = 0;						// return value
   uint32_t data_i = 0;					// index to data array
 
@@ -362,33 +621,49 @@ int flash_write_block( uint32_t addr, char *data, uint32_t count )
     return 1;	// "flash_block align error\n"		//   return error code 1
   }
 
-  if (buf_count > 0 && addr != next_addr) {		// if unexpected address   
+  if (write_count > 0 && addr != write_next) {		// if unexpected address   
     return 2;	// "unexpected address\n"		//   return error code 2   
   }
-  next_addr = addr + count;				//   compute next address
-  addr -= buf_count;					//   address of data[0]
+  write_next = addr + count;				//   compute next address
+  addr -= write_count;					//   address of data[0]
 
   while (data_i < count) {				// while more data
-    ((char*)&buf)[buf_count++] = data[data_i++];	//   copy a byte to buf
-    if (buf_count < FLASH_WRITE_SIZE) {			//   if buf not complete
+    ((char*)&write_buf)[write_count++] = data[data_i++];	//   copy a byte to buf
+    if (write_count < FLASH_WRITE_SIZE) {			//   if buf not complete
       continue;						//     continue while()
     }							//   
     #if defined(__IMXRT1062__)				//   #if T4.x 4-byte
-      eepromemu_flash_write((void*)addr,(void*)&buf,4);	//     flash_write()
+      eepromemu_flash_write((void*)addr,(void*)&write_buf,4);	//     flash_write()
     #elif (FLASH_WRITE_SIZE==4)				//   #elif T3.x 4-byte 
-      ret = flash_word( addr, buf, 0, 0 );		//     flash_word()
+      ret = flash_word( addr, write_buf, 0, 0 );		//     flash_word()
     #elif (FLASH_WRITE_SIZE==8)				//   #elif T3.x 8-byte
-      ret = flash_phrase( addr, buf, 0, 0 );		//     flash_phrase()
+      ret = flash_phrase( addr, write_buf, 0, 0 );		//     flash_phrase()
     #endif
     if (ret != 0) {					//   if write error
       return 3;	// "flash write error %d\n"		//     error code
     }
-    buf_count = 0;					//   re-init buf count
+    write_count = 0;					//   re-init buf count
     addr += FLASH_WRITE_SIZE;				//   advance address
   }  
   return 0;						// return success
 }
 
+//******************************************************************************
+// flash_write_flush()	write the partial unit left by flash_write_block()
+//******************************************************************************
+// An image whose size is not a multiple of FLASH_WRITE_SIZE ends with a partial
+// unit held in RAM. It is written padded with 0xFF, as erased flash, and then
+// flash_write_block() may write anywhere. Returns 0, or 3 on a write error.
+int flash_write_flush( void )
+{
+  char pad[FLASH_WRITE_SIZE];
+
+  if (write_count == 0)
+    return 0;
+  memset( pad, 0xFF, sizeof(pad) );
+  return( flash_write_block( write_next, pad, FLASH_WRITE_SIZE - write_count ) );
+}
+
 #if defined(__MK66FX1M0__) // T3.6 only
 
   // MCU Local Memory PCCCR Register Bit Definitions (request to add to kinetis.h?)
@@ -50,19 +50,29 @@
 #include <CAN.h>
 
 #include <SD.h>
-#include "FXUtil.h"		// read_ascii_line(), hex file support
+#include "FXUtil.h"		// ingest_t, hex file support
+#include "FXSession.h"		// transport_t, update session
+#include "FXFrame.h"		// frame_link_t, binary update protocol
+#include "FXSD.h"		// sd_reader_t, hex/bin/UF2 files on SD
+#include "FXDirect.h"		// direct_update() (DIRECT_MODE)
+#include "FirmwareUpdater.h"	// CAN commit of images HexTransfer received
+#include "UpdateGateway.h"	// CAN fan-out of images received here (GATEWAY_MODE)
 extern "C" {
   #include "FlashTxx.h"		// TLC/T3x/T4x/TMM flash primitives
+  #include "FXSlot.h"		// A/B slots (SLOT_MODE)
+  #include "FXSwap.h"		// swap commit and rollback (SWAP_MODE)
 }
 
-#include <FastCRC.h>
-
 const int cs = BUILTIN_SDCARD;	// SD chip select pin
 const int led = LED_BUILTIN;	// LED pin
 Stream *serial = &Serial;	// Serial (USB) or Serial1, Serial2, etc. (UART)
 
 #define FLASHERX_VERSION "FlasherX v2.3"
 #define HEX_FILE_NAME "FlasherX.ino.hex"	
+#define BIN_FILE_NAME "FlasherX.ino.bin"	// raw image, used if present
+#define UF2_FILE_NAME "FlasherX.ino.uf2"	// UF2 blocks, used if present
+#define STAGE_FILE_NAME "FXSTAGE.BIN"	// image too large for the buffer
+#define CACHE_DIR_NAME "FXCACHE"	// images flashed, for instant reflash
 
 #define LARGE_ARRAY (0)		// 1 = define large array to test large hex file
 
@@ -76,9 +86,338 @@ Stream *serial = &Serial;	// Serial (USB) or Serial1, Serial2, etc. (UART)
 
 // const variables reside in flash and get optimized out if never accessed
 // use uint8_t -> 1MB, uint16_t -> 2MB, uint32_t -> 4MB, uint64_t -> 8MB)
-PROGMEM const uint8_t a[16][16][16][16][16] = A4;
+// aligned to sectors, so it can be data partition "array" (see setup)
+PROGMEM const uint8_t a[16][16][16][16][16]
+	__attribute__ ((aligned (FLASH_SECTOR_SIZE))) = A4;
+
+// data partition "array" was written -- read it back through a pointer
+static void array_updated( const part_t *part )
+{
+  const volatile uint8_t *p = (const volatile uint8_t *)part->addr;
+  serial->printf( "array updated, first bytes %02X %02X %02X %02X\n", p[0], p[1], p[2], p[3] );
+}
+#endif
+
+//******************************************************************************
+// serial_update()	hex file via serial or SD, a bounded step per call
+//******************************************************************************
+// The update runs alongside CAN and the application: each call reads only the
+// bytes available (at most UPDATE_BYTES_PER_LOOP) and never waits for input.
+#define UPDATE_BYTES_PER_LOOP	(256)
+
+#define UPDATE_IDLE		(0)	// waiting for user to choose serial or SD
+#define UPDATE_RECEIVING	(1)	// ingesting hex file
+#define UPDATE_CONFIRM		(2)	// waiting for user to confirm line count
+#define UPDATE_FRAMED		(3)	// binary image via FXFrame protocol
+#define UPDATE_GATEWAY		(4)	// image sent on to CAN nodes (GATEWAY_MODE)
+
+#define SOURCE_SERIAL		(1)	// hex file via serial (user input 1)
+#define SOURCE_SD		(2)	// hex/bin/UF2 file via SD (user input 2)
+#define SOURCE_FRAMES		(3)	// binary image via serial (FXFrame)
+#define USER_ROLLBACK		(4)	// swap previous image back (user input 4)
+#define USER_DIRECT		(5)	// direct update via Serial1 (user input 5)
+
+static int update_state = UPDATE_IDLE;
+static void serial_update_respond( transport_t *t, int event, int status );
+static transport_t serial_transport = { "serial", NULL, serial_update_respond, NULL, 0 };
+static transport_t sd_transport = { "SD", NULL, serial_update_respond, NULL, 0 };
+static transport_t *update_transport;	// of the update in progress
+static File hexFile;
+static sd_reader_t sd_reader;		// reads hexFile in blocks
+static int sd_format;			// SD_FORMAT_xxx of hexFile
+static char line[32];			// user input
+static int line_nchar = 0;
+static frame_link_t link;		// binary update session
+#if (SD_STAGING)
+static sd_stage_t sd_stage;		// SD file for images too large for buffer
+#endif
+#if (SD_CACHE_SLOTS > 0)
+static sd_cache_t sd_cache;		// SD directory of images flashed
 #endif
 
+static void serial_update_prompt()
+{
+  serial->printf( "enter 1 for hex file via serial, 2 for hex/bin/UF2 file via SD\n" );
+  #if (SWAP_MODE)
+  int status = swap_status();
+  if (status == SWAP_DONE)
+    serial->printf( "enter 4 to roll back to the previous firmware (%08lX)\n",
+			swap_journal()->buffer_crc );
+  else if (status == SWAP_PARTIAL)
+    serial->printf( "last swap did not complete, no previous firmware\n" );
+  #endif
+  #if (DIRECT_MODE)
+  if (serial == (Stream*)&Serial1)
+    serial->printf( "enter 5 for direct update, no buffer (fxserial.py --direct)\n" );
+  #endif
+}
+
+// swap the previous image back (SWAP_MODE) -- returns only if it cannot
+static void serial_rollback()
+{
+  #if (SWAP_MODE)
+  if (session_owner() != NULL) {
+    serial->printf( "buffer in use by %s update\n", session_owner()->name );
+    return;
+  }
+  serial->printf( "calling flash_swap() to restore previous firmware...\n" );
+  serial->flush();
+  swap_rollback();
+  #endif
+  serial->printf( "no previous firmware to roll back to\n" );
+}
+
+// hand Serial1 to the updater in RAM (DIRECT_MODE) -- returns only if it cannot
+static void serial_direct()
+{
+  #if (DIRECT_MODE)
+  if (serial != (Stream*)&Serial1) {
+    serial->printf( "direct update is only via Serial1\n" );
+    return;
+  }
+  if (session_owner() != NULL) {
+    serial->printf( "buffer in use by %s update\n", session_owner()->name );
+    return;
+  }
+  serial->printf( "calling direct_update(), send image up to %1luK...\n",
+			(uint32_t)DIRECT_MAX_SIZE/1024 );
+  serial->flush();
+  direct_update( firmware_code_end() );
+  #endif
+  serial->printf( "direct update not enabled (DIRECT_MODE)\n" );
+}
+
+static void serial_update_confirm_prompt()
+{
+  #if (GATEWAY_MODE)
+  serial->printf( "enter %d to send to CAN group %d or 0 to abort\n",
+			session_ingest()->hex.lines, GATEWAY_GROUP );
+  #else
+  serial->printf( "enter %d to flash or 0 to abort\n", session_ingest()->hex.lines );
+  #endif
+}
+
+// image checked (see session_finish), ask the user to confirm it
+static void serial_update_respond( transport_t *t, int event, int status )
+{
+  if (event == SESSION_EVENT_RESULT && status == INGEST_EOF) {
+    serial_update_confirm_prompt();
+    update_state = UPDATE_CONFIRM;
+  }
+}
+
+static void serial_update_begin( int source )
+{
+  transport_t *t = (source == SOURCE_SD) ? &sd_transport : &serial_transport;
+  int status;
+
+  if (source == SOURCE_SD) {
+    if (!SD.begin( cs )) {
+      serial->println( "SD initialization failed" );
+      return;
+    }
+    serial->println( "SD initialization OK" );
+    // a raw or UF2 image needs no hex decoding, so prefer it
+    const char *name = SD.exists( BIN_FILE_NAME ) ? BIN_FILE_NAME
+			: SD.exists( UF2_FILE_NAME ) ? UF2_FILE_NAME : HEX_FILE_NAME;
+    hexFile = SD.open( name, FILE_READ );
+    if (!hexFile) {
+      serial->println( "SD file open failed" );
+      return;
+    }
+    serial->printf( "SD file %s open OK\n", name );
+    sd_format = sd_image_format( name );
+  }
+
+  // a frame from tools/fxserial.py needs no echo (see FXFrame.h)
+  if (source == SOURCE_FRAMES) {
+    t = &link.transport;
+    status = frame_begin( &link, serial );
+  }
+  else {
+    // reliability of transfer via USB is improved by echo of each line
+    t->out = serial;
+    status = session_begin( t, source == SOURCE_SERIAL && serial == (Stream*)&Serial );
+  }
+  // the buffer is shared with CAN transfers
+  if (status != SESSION_OK) {
+    if (status == SESSION_BUSY)
+      serial->printf( "buffer in use by %s update\n", session_owner()->name );
+    else
+      serial->printf( "no buffer for new code\n" );
+    if (source == SOURCE_SD)
+      hexFile.close();
+    return;
+  }
+  update_transport = t;
+
+  ingest_t *in = session_ingest();
+  if (in->ram_size > 0)
+    serial->printf( "buffer = %1luK RAM (%08lX - %08lX) + ",
+		in->ram_size/1024, in->ram_addr, in->ram_addr + in->ram_size );
+  else
+    serial->printf( "buffer = " );
+  const char *where = IN_FLASH(in->buffer_addr) ? "FLASH"
+		: IN_EXTMEM(in->buffer_addr) ? "EXTMEM" : "RAM";
+  serial->printf( "%1luK %s (%08lX - %08lX)", in->buffer_size/1024, where,
+		in->buffer_addr, in->buffer_addr + in->buffer_size );
+  if (in->nvm_size > 0)
+    serial->printf( " + %1luK FLEXNVM (%08lX - %08lX)",
+		in->nvm_size/1024, in->nvm_addr, in->nvm_addr + in->nvm_size );
+  serial->printf( "\n" );
+
+  if (source == SOURCE_FRAMES) {
+    update_state = UPDATE_FRAMED;
+    return;
+  }
+  if (source == SOURCE_SD)
+    sd_reader_begin( &sd_reader, &hexFile, sd_format, t );
+  serial->printf( "reading %s...\n",
+		source == SOURCE_SD && sd_format != SD_FORMAT_HEX ? "blocks" : "hex lines" );
+  update_state = UPDATE_RECEIVING;
+}
+
+// deliver the hex bytes serial has available, then finish at EOF or error
+static int serial_update_poll()
+{
+  char chunk[64];
+  uint32_t budget = UPDATE_BYTES_PER_LOOP;
+  int status = INGEST_MORE;
+
+  while (budget > 0 && status == INGEST_MORE) {
+    int avail = serial->available();
+    if (avail <= 0)
+      break;
+    uint32_t n = sizeof(chunk);
+    if (n > budget)
+      n = budget;
+    if (n > (uint32_t)avail)
+      n = avail;
+    n = serial->readBytes( chunk, n );
+    status = session_deliver( &serial_transport, chunk, n );
+    budget -= n;
+  }
+  if (status != INGEST_MORE)
+    status = session_finish( &serial_transport );
+  return( status );
+}
+
+// error or user abort, so clean up and reboot to ensure that static vars
+// get boot-up initialized before retry
+static void serial_update_abort()
+{
+  serial->printf( "erase FLASH buffer / clear RAM or EXTMEM buffer...\n" );
+  session_end( update_transport );
+  serial->flush();
+  REBOOT;
+}
+
+// hand the image to the gateway (GATEWAY_MODE), which ends the session
+static void serial_update_gateway( transport_t *t )
+{
+  if (!UpdateGateway::begin( t )) {
+    serial->printf( "abort - image cannot be sent on over CAN\n" );
+    serial_update_abort();
+    return;
+  }
+  serial->printf( "the host can disconnect, the image is sent from here\n" );
+  update_state = UPDATE_GATEWAY;
+}
+
+void serial_update()
+{
+  int user_input = -1;
+  int status;
+
+  switch (update_state) {
+    case UPDATE_IDLE:
+      // binary protocol starts with a frame rather than user input
+      if (line_nchar == 0 && serial->peek() == FRAME_SOF) {
+        serial_update_begin( SOURCE_FRAMES );
+        if (update_state == UPDATE_IDLE)
+          serial->read();		// buffer in use, skip the frame
+        break;
+      }
+      if (poll_ascii_line( serial, line, sizeof(line), &line_nchar )) {
+        sscanf( line, "%d", &user_input );
+        if (user_input == SOURCE_SERIAL || user_input == SOURCE_SD)
+          serial_update_begin( user_input );
+        else if (user_input == USER_ROLLBACK)
+          serial_rollback();
+        else if (user_input == USER_DIRECT)
+          serial_direct();
+        else
+          serial_update_prompt();
+      }
+      break;
+
+    case UPDATE_RECEIVING:
+      // a good image moves on to UPDATE_CONFIRM (see serial_update_respond)
+      if (update_transport == &sd_transport)
+        status = sd_reader_poll( &sd_reader );
+      else
+        status = serial_update_poll();
+      if (status != INGEST_MORE && status != INGEST_EOF)
+        serial_update_abort();
+      break;
+
+    case UPDATE_CONFIRM:
+      if (!poll_ascii_line( serial, line, sizeof(line), &line_nchar ))
+        break;
+      sscanf( line, "%d", &user_input );
+      if (user_input == 0) {
+        serial->printf( "abort - user entered 0 lines\n" );
+        serial_update_abort();
+        break;
+      }
+      else if (user_input != session_ingest()->hex.lines) {
+        serial_update_confirm_prompt();
+        break;
+      }
+      #if (GATEWAY_MODE)
+      serial_update_gateway( update_transport );
+      break;
+      #endif
+      serial->printf( "calling flash_move() to load new firmware...\n" );
+      serial->flush();
+      session_commit( update_transport );
+      break;
+
+    case UPDATE_FRAMED:
+      switch (frame_poll( &link )) {
+        case FRAME_COMMITTED:
+          #if (GATEWAY_MODE)
+          if (session_ingest()->part == NULL) {
+            serial_update_gateway( &link.transport );
+            break;
+          }
+          #endif
+          if (session_ingest()->part == NULL) {
+            serial->printf( "calling flash_move() to load new firmware...\n" );
+            serial->flush();
+          }
+          session_commit( &link.transport );
+          // returns only for a data partition, and the application goes on
+          update_state = UPDATE_IDLE;
+          serial_update_prompt();
+          break;
+        case FRAME_ABORTED:
+          serial->printf( "abort - binary update ended by host or timeout\n" );
+          serial_update_abort();
+          break;
+      }
+      break;
+
+    case UPDATE_GATEWAY:
+      // the session ends once every node has the image, or has failed
+      if (!UpdateGateway::is_active()) {
+        update_state = UPDATE_IDLE;
+        serial_update_prompt();
+      }
+      break;
+  }
+}
+
 void setup () 
 {
   if (serial == (Stream*)&Serial) {
@@ -99,66 +438,66 @@ void setup ()
   serial->printf( "target = %s (%dK flash in %dK sectors)\n",
 			FLASH_ID, FLASH_SIZE/1024, FLASH_SECTOR_SIZE/1024);
       
+  // find the buffer before CAN can begin a transfer into it
+  #if (SLOT_MODE)
+  if (session_init() == SLOT_BUFFER_TYPE) {
+    uint32_t running = slot_running();
+    uint32_t next = (running == SLOT_A_ADDR) ? SLOT_B_ADDR : SLOT_A_ADDR;
+    serial->printf( "running in slot %c (%08lX), send images linked for slot %c (%08lX)\n",
+			running == SLOT_A_ADDR ? 'A' : 'B', running,
+			next == SLOT_A_ADDR ? 'A' : 'B', next );
+  }
+  #elif (SWAP_MODE)
+  if (session_init() == NO_BUFFER_TYPE)
+    serial->printf( "code ends at %08lX, above swap buffer %08lX: no updates\n",
+			swap_code_end(), SWAP_BUFFER_ADDR );
+  #else
+  session_init();
+  #endif
+  #if (SD_STAGING || SD_CACHE_SLOTS > 0)
+  if (SD.begin( cs )) {
+    #if (SD_STAGING)
+    sd_stage_init( &sd_stage, STAGE_FILE_NAME );
+    session_stage( &sd_stage.stage );
+    serial->printf( "images too large for the buffer go to SD file %s\n", STAGE_FILE_NAME );
+    #endif
+    #if (SD_CACHE_SLOTS > 0)
+    int cached = sd_cache_init( &sd_cache, CACHE_DIR_NAME );
+    if (cached >= 0) {
+      session_cache( &sd_cache.cache );
+      serial->printf( "SD directory %s holds %d of the last %d images flashed\n",
+			CACHE_DIR_NAME, cached, SD_CACHE_SLOTS );
+    }
+    #endif
+  }
+  #endif
+
   // init can
   CAN::init();
   HexTransfer::init();
+  FirmwareUpdater::init();
+  UpdateGateway::init();
+  #if (GATEWAY_MODE)
+  serial->printf( "gateway: images received here are sent on to CAN group %d\n", GATEWAY_GROUP );
+  #endif
   
 #if (LARGE_ARRAY) // if true, access array so it doesn't get optimized out
   serial->printf( "Large Array -- %08lX\n", (uint32_t)&a[15][15][15][15][15] );
+  // its data can then be sent on its own (fxserial.py --part array)
+  if (part_add( "array", (uint32_t)a, sizeof(a), array_updated ) == 0)
+    serial->printf( "data partition array = %08lX - %08lX\n",
+			(uint32_t)a, (uint32_t)a + sizeof(a) );
 #endif
+
+  serial_update_prompt();
 }
 
 void loop ()
 {
   CAN::handleInbox();
   HexTransfer::update();
-  // uint32_t buffer_addr, buffer_size;
-
-  // // create flash buffer to hold new firmware
-  // if (firmware_buffer_init( &buffer_addr, &buffer_size ) == 0) {
-  //   serial->printf( "unable to create buffer\n" );
-  //   serial->flush();
-  //   for (;;) {}
-  // }
-  
-  // serial->printf( "created buffer = %1luK %s (%08lX - %08lX)\n",
-	// 	buffer_size/1024, IN_FLASH(buffer_addr) ? "FLASH" : "RAM",
-	// 	buffer_addr, buffer_addr + buffer_size );
-
-  // // get user input to read from serial or SD
-  // int user_input = -1;
-  // char line[32];
-  // while (user_input != 1 && user_input != 2) {
-  //   serial->printf( "enter 1 for hex file via serial, 2 for hex file via SD\n" );
-  //   read_ascii_line( serial, line, sizeof(line) );
-  //   sscanf( line, "%d", &user_input );
-  // }
-  
-  // if (user_input == 1) { // serial 
-  //   // read hex file, write new firmware to flash, clean up, reboot
-  //   update_firmware( serial, serial, buffer_addr, buffer_size );
-  // }
-  // else if (user_input == 2) { // SD
-  //   if (!SD.begin( cs )) {
-  //     serial->println( "SD initialization failed" );
-  //     return;
-  //   }
-  //   File hexFile;
-  //   serial->println( "SD initialization OK" );
-  //   hexFile = SD.open( HEX_FILE_NAME, FILE_READ );
-  //   if (!hexFile) {
-  //     serial->println( "SD file open failed" );
-  //     return;
-  //   }
-  //   serial->println( "SD file open OK" );
-  //   // read hex file, write new firmware to flash, clean up, reboot
-  //   update_firmware( &hexFile, serial, buffer_addr, buffer_size );
-  // }
-  
-  // // return from update_firmware() means error or user abort, so clean up and
-  // // reboot to ensure that static vars get boot-up initialized before retry
-  // serial->printf( "erase FLASH buffer / free RAM buffer...\n" );
-  // firmware_buffer_free( buffer_addr, buffer_size );
-  // serial->flush();
-  // REBOOT;
+  FirmwareUpdater::update();
+  UpdateGateway::update();
+  serial_update();
+  session_poll();
 }
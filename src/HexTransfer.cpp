@@ -1,17 +1,100 @@
 #include "HexTransfer.h"
+#include "CAN.h"
 
 namespace HexTransfer
 {
   // --------------------------------------------------------------------------
-  // Flash Buffer Variables
+  // Update Session Variables
   // --------------------------------------------------------------------------
-  // Info about the buffer in flash space. This is set externally by the
+  // A transfer is an update session (see FXSession.h), so the buffer is
+  // written and the image checked by the same code as Serial and SD updates.
+  // The session owns the buffer. CAN answers its own messages, and times out
+  // on its own, so it needs no respond() or session timeout.
+  transport_t can_transport = { "CAN", &Serial, NULL, NULL, 0 };
 
-  uint32_t flash_buffer_addr; // Address of the buffer in flash space
+  // --------------------------------------------------------------------------
+  // Running Firmware Variables
+  // --------------------------------------------------------------------------
+  // Identify the firmware this node is running. They are computed once in
+  // init(), before any transfer writes to the flash buffer.
+  
+  // Build ID of the running firmware (CRC32 of its code). Reported to the PC,
+  // which uses it to pick the old image to make a delta patch from.
+  uint32_t build_id;
+  
+  // Size of the running firmware's code, in bytes
+  uint32_t build_size;
+
+  // --------------------------------------------------------------------------
+  // Sector Negotiation Variables
+  // --------------------------------------------------------------------------
+  // Before a transfer, the PC can ask for a CRC32 of each sector of the
+  // running firmware, compare them with the new image, and send only the
+  // sectors that changed. It asks the node to copy the unchanged sectors from
+  // program flash into the buffer instead. Both are done one sector per
+  // update, over the range [first, end).
+  
+  // Next sector to send a SECTOR_DIGEST for, and the end of the range
+  uint16_t digest_sector;
+  uint16_t digest_end;
+  
+  // Next sector to copy into the buffer, and the range requested
+  uint16_t copy_sector;
+  uint16_t copy_end;
+  uint16_t copy_first;
+  
+
+  // --------------------------------------------------------------------------
+  // Sector Manifest Variables
+  // --------------------------------------------------------------------------
+  // During a transfer, the PC can send the CRC32 of each sector of the image
+  // (SECTOR_CRC). The buffer is then checked sector by sector at EOF, instead
+  // of with the file checksum, and a sector that fails is erased and its
+  // lines requested again, rather than aborting the whole transfer.
+  
+  // CRC32 of each sector, and which of them have been received
+  uint32_t sector_crc[MAX_MANIFEST_SECTORS];
+  uint8_t sector_crc_received[(MAX_MANIFEST_SECTORS + 7) / 8];
+  
+  // Number of sectors the manifest covers (highest sector received + 1)
+  uint16_t manifest_sectors;
+  
+  // First line that wrote to each sector, where a repair starts
+  uint16_t sector_first_line[MAX_MANIFEST_SECTORS];
+  
+  // Sector being received again, or -1, and the number of repairs so far
+  int repair_sector;
+  int repair_count;
+  
+  // CRC32 of the sectors that have passed their check so far, combined from
+  // the sector CRCs. Once all have passed, the CRC32 of the whole image.
+  uint32_t verified_crc;
+  uint16_t verified_sectors;
+
+  // --------------------------------------------------------------------------
+  // Image Cache Variables
+  // --------------------------------------------------------------------------
+  // Before the first line, the PC can offer the size and CRC32 of the image
+  // (OFFER_IMAGE). If the session has it in its SD cache (an image flashed
+  // before), session_poll() loads it, and no lines are sent at all.
+  
+  // Size and CRC32 of the image offered
+  uint32_t offered_size;
+  uint32_t offered_crc;
   
-  uint32_t flash_buffer_size; // Size of the buffer in flash space
+  // Flag to indicate the offered image is being loaded from the cache
+  bool cache_loading;
+
+  // --------------------------------------------------------------------------
+  // Data Partition Variables
+  // --------------------------------------------------------------------------
+  // Before the first line, the PC can select a data partition to send instead
+  // of the firmware (SELECT_PARTITION). Its lines are addressed at the
+  // partition, which is written in place and committed as soon as the
+  // transfer is complete, with no reboot (see FXPart.h).
   
-  bool flash_buffer_initialized; // Flag to indicate if the buffer has been initialized
+  // Number of the partition selected, answered by update()
+  uint8_t selected_part;
 
   // --------------------------------------------------------------------------
   // Hex File Info Variables
@@ -23,9 +106,10 @@ namespace HexTransfer
   // Intel HEX file information. For details, see:
   //   https://en.wikipedia.org/wiki/Intel_HEX
   //
-  // The min_address, max_address, total_lines, and file_checksum fields are used for
-  // validating the hex file and ensuring that the entire file has been
-  // received correctly.
+  // The total_lines and file_checksum fields are used for validating the hex
+  // file and ensuring that the entire file has been received correctly. The
+  // data records are written by the session, which tracks the address range
+  // and whether the image is compressed or a patch (see session_ingest()).
   // 
   // Note:
   //   - Logic for Hex records 02 (Extended Segment Address) and 03 (Start 
@@ -44,14 +128,6 @@ namespace HexTransfer
   // Unused for teensyduinos, they always set the start address to 0x0000. Leaving
   // this here for future compatibility with other platforms.
   uint32_t start_address; 
-
-  // Minimum address in the hex file in teensy's flash.
-  // Calculated while processing hex data records.
-  uint32_t min_address;   
-
-  // Maximum address in the hex file in teensy's flash
-  // Calculated while processing hex data records.
-  uint32_t max_address;   
                           
   // Flag to indicate if EOF has been reached and eof record has been received
   bool eof_received;
@@ -65,22 +141,32 @@ namespace HexTransfer
   // --------------------------------------------------------------------------
   // Current Hex Line Variables
   // --------------------------------------------------------------------------
-  // These variables are used to store information about the current hex line
-  // being received.
-  // This buffer will be eventually parsed into a ParsedHexLine struct.
+  // These variables are used to store information about the hex lines
+  // being received. Each line is received into a LineSlot, which will be
+  // eventually parsed into a ParsedHexLine struct, in line order.
   
   // Current hex line number being received. 0 indexed.
   size_t hex_line_num;                  
 
-  // Number of segments the current hex line has been split into
-  int hex_line_segment_count;
+  // Number of links the lines are striped across (SET_LINKS), 1 to CAN_LINKS
+  int link_count;
   
-  // Array to keep track of which segments have been received for the current
-  // hex line
-  bool* hex_line_segments_received;     
-
-  // The buffer the segments are copied into
-  char hex_line_buf[MAX_HEX_LINE_SIZE]; 
+  // Slot of each link, line n in slot n % link_count
+  LineSlot line_slots[CAN_LINKS];
+  
+  // --------------------------------------------------------------------------
+  // Forward Error Correction Variables
+  // --------------------------------------------------------------------------
+  // After SET_FEC, a parity frame follows each group of segments of a line,
+  // and a segment lost from a group is rebuilt from it (see
+  // TransferSegmentMsg).
+  
+  // Segments per parity frame, or 0 if the PC sends none. The parity frames
+  // of a line are kept in its LineSlot.
+  uint8_t fec_group_size;
+  
+  // Number of segments rebuilt this transfer, for the debug output
+  uint32_t fec_recovered;
   
   // --------------------------------------------------------------------------
   // Hex Transfer State Variables
@@ -93,6 +179,10 @@ namespace HexTransfer
   
   // Flag to indicate if the transfer init message was received and valid
   bool transfer_init_msg_error;     
+  
+  // Flag to indicate the transfer init message was refused because another
+  // update session holds the buffer
+  bool transfer_init_busy;
 
   // Flag to indicate if a transfer is in progress. Set when a Transfer Init
   // message is received and cleared when the transfer is complete or aborted.
@@ -102,12 +192,25 @@ namespace HexTransfer
   // been received and the checksum is valid.
   bool file_transfer_complete;      
   
+  // Session status once the received data cannot become a valid image, e.g.
+  // a patch made for another build, else INGEST_MORE. Resending lines will not
+  // help, so the transfer is aborted.
+  int image_status;
+  
+  // Control message received since the last update, to be answered in update()
+  ControlCode pending_control;
+  
+  // Flag to indicate the transfer is received from a multicast stream, so
+  // lines are not requested, only reported when the group is queried
+  bool multicast;
+  
+  // Heap calls made before the transfer started. A transfer uses only static
+  // storage, so the count should not change until it completes.
+  uint32_t heap_calls_at_start;
+  
   // Checksum of the hex file being received. This is calculated by adding the 
   // checksum of each hex line as it is received.
   uint32_t computed_file_checksum;  
-
-  // CRC32 object for calculating the checksum of the hex file
-  FastCRC32 CRC32;
   
   // --------------------------------------------------------------------------
   // Timeout Variables
@@ -125,52 +228,206 @@ namespace HexTransfer
 // Main Functions
 // --------------------------------------------------------------------------
 void HexTransfer::init(){ 
+  // Identify the running firmware. The buffer is found by session_init(),
+  // which must be called first.
+  build_id = firmware_build_id(&build_size);
+  pending_control = ControlCode::NONE;
+  digest_sector = digest_end = 0;
+
   // Initialize the hex file info variables
   clear_transfer_state();
 }
 
 void HexTransfer::update() {
+  // Answer a control message, whether or not a transfer is in progress
+  if (pending_control == ControlCode::QUERY_BUILD_ID) {
+    send_response(ResponseCode::BUILD_ID);
+  }
+  else if (pending_control == ControlCode::OFFER_IMAGE) {
+    #if not DRYRUN
+    cache_loading = session_offer(&can_transport, offered_size, offered_crc);
+    #endif
+    send_response(ResponseCode::IMAGE_OFFER);
+  }
+  else if (pending_control == ControlCode::ROLLBACK) {
+    // The previous image is swapped back, unless an update holds the buffer
+    int status = SWAP_NONE;
+    #if SWAP_MODE
+    if (session_owner() == NULL) {
+      status = swap_status();
+    }
+    #endif
+    if (status != SWAP_DONE) {
+      send_response(ResponseCode::ERROR, ErrorCode::ROLLBACK_ERROR);
+    }
+    else {
+      send_response(ResponseCode::ROLLBACK);
+      #if SWAP_MODE && not DRYRUN
+      // Returns only if the journal could not be written
+      swap_rollback();
+      send_response(ResponseCode::ERROR, ErrorCode::ROLLBACK_ERROR);
+      #endif
+    }
+  }
+  else if (pending_control == ControlCode::SELECT_PARTITION) {
+    // The session writes the lines that follow to the partition
+    const part_t *part = part_get(selected_part);
+    #if not DRYRUN
+    if (part != NULL && session_target(&can_transport, part)) {
+      part = NULL;
+    }
+    #endif
+    if (part == NULL) {
+      send_response(ResponseCode::ERROR, ErrorCode::PARTITION_ERROR);
+    }
+    else {
+      send_response(ResponseCode::PARTITION);
+    }
+  }
+  else if (pending_control == ControlCode::SET_FEC) {
+    send_response(ResponseCode::FEC);
+  }
+  else if (pending_control == ControlCode::SET_LINKS) {
+    send_response(ResponseCode::LINKS);
+  }
+  else if (pending_control == ControlCode::QUERY_MULTICAST) {
+    // The line this node needs next, or whether it has the image
+    if (transfer_in_progress) {
+      send_response(ResponseCode::SEND_LINE, ErrorCode::NONE, hex_line_num % link_count);
+    }
+    else if (file_transfer_complete) {
+      send_response(ResponseCode::TRANSFER_COMPLETE);
+    }
+    else {
+      send_response(ResponseCode::ERROR, ErrorCode::TRANSFER_NOT_IN_PROGRESS);
+    }
+  }
+  pending_control = ControlCode::NONE;
+  
+  // Stream the requested sector digests, one per update
+  if (digest_sector < digest_end) {
+    send_response(ResponseCode::SECTOR_DIGEST);
+    digest_sector++;
+  }
+  
+  // Answer a new transfer init message, valid or not
+  if (new_transfer_init_msg_received) {
+    new_transfer_init_msg_received = false;
+    if (transfer_init_msg_error) {
+      send_response(ResponseCode::ERROR, ErrorCode::TRANSFER_INIT_CHECKSUM_ERROR);
+    }
+    else if (transfer_init_busy) {
+      send_response(ResponseCode::ERROR, ErrorCode::BUFFER_BUSY);
+    }
+    else {
+      send_response(ResponseCode::SEND_LINE);
+    }
+    return;
+  }
+  
   // Return if no transfer is in progress
   if (!transfer_in_progress) return;
   
   ResponseCode res = ResponseCode::NONE;
+  ErrorCode err = ErrorCode::NONE;
+  int link = 0;
   
   // Check if the transfer has timed out
   if (has_transfer_timed_out()) {
     res = ResponseCode::ERROR;
+    err = ErrorCode::INACTIVITY_TIMEOUT;
     abort_transfer();
   }
-  // Check if the segment has timed out
-  else if (has_segment_timed_out()) {
-    // Request the a line without incrementing the line number
-    // PC will resend the same line
-    res = ResponseCode::SEND_LINE;
+  // Check if the received data can no longer become a valid image
+  else if (image_status != INGEST_MORE) {
+    res = ResponseCode::ERROR;
+    err = image_status == INGEST_ERR_PATCH ? ErrorCode::PATCH_ERROR : ErrorCode::IMAGE_ERROR;
+    abort_transfer();
   }
-  // Check if a new transfer init message has been received
-  else if (new_transfer_init_msg_received ) {
-    res = transfer_init_msg_error
-            ? ResponseCode::ERROR
-            : ResponseCode::SEND_LINE;
+  // Wait for the cached image to be loaded and checked by the session
+  else if (cache_loading) {
+    int status = session_ingest()->status;
+    if (status == INGEST_EOF) {
+      cache_loading = false;
+      transfer_in_progress = false;
+      file_transfer_complete = true;
+      verified_crc = offered_crc;
+      verified_sectors = (offered_size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+      res = ResponseCode::TRANSFER_COMPLETE;
+    }
+    else if (status != INGEST_MORE) {
+      res = ResponseCode::ERROR;
+      err = status == SESSION_ERR_CACHE ? ErrorCode::CACHE_ERROR : ErrorCode::IMAGE_ERROR;
+      abort_transfer();
+    }
+    // Loading is not inactivity
+    last_successful_can_msg_ts = millis();
+  }
+  // Copy the requested unchanged sectors, one per update
+  else if (copy_sector < copy_end) {
+    if (!copy_running_sector(copy_sector)) {
+      res = ResponseCode::ERROR;
+      err = ErrorCode::COPY_ERROR;
+      abort_transfer();
+    }
+    else if (++copy_sector == copy_end) {
+      res = ResponseCode::SECTORS_COPIED;
+    }
+    // Copying is not inactivity
+    last_successful_can_msg_ts = millis();
+  }
+  // Check if a line has timed out, or has not been requested yet
+  else if ((link = find_slot_to_request()) >= 0) {
+    // Request the line without incrementing the line number
+    // PC will resend the same line, on the link of its slot
+    res = ResponseCode::SEND_LINE;
   }
-  // Handle the received hex line if all segments have been received
-  else if (are_all_segments_received()) {
+  // Handle the next hex line if all its segments have been received
+  else if (!eof_received && are_all_segments_received(get_line_slot(hex_line_num))) {
+    link = hex_line_num % link_count;
     res = handle_received_hex_line();
   }
   // Check if the EOF record has been received
   else if (eof_received) {
-    if (!is_file_checksum_valid()) {
-      res = ResponseCode::ERROR;
+    res = handle_received_eof(err);
+    // A sector repair starts with the line it needs first
+    link = hex_line_num % link_count;
+    if (res == ResponseCode::ERROR) {
       abort_transfer();
     }
-    else {
-      res = ResponseCode::TRANSFER_COMPLETE;
+    else if (res == ResponseCode::TRANSFER_COMPLETE) {
       transfer_in_progress = false;
       file_transfer_complete = true;
+      
+      #if DEBUG && HEAP_ACCOUNTING
+      Serial.printf("Heap calls during transfer: %lu\n",
+                    heap_call_count() - heap_calls_at_start);
+      #endif
+      
+      #if DEBUG
+      if (fec_group_size > 0) {
+        Serial.printf("Segments rebuilt from parity: %lu\n", fec_recovered);
+      }
+      #endif
+      
+      #if not DRYRUN
+      // A data partition is already in place, so commit it now: the session
+      // ends and the application is told, and it keeps running
+      if (session_ingest()->part != NULL) {
+        session_commit(&can_transport);
+      }
+      #endif
     }
   }
   
+  // A multicast stream does not wait for line requests, so they are only
+  // sent when the group is queried
+  if (multicast && res == ResponseCode::SEND_LINE) {
+    res = ResponseCode::NONE;
+  }
+  
   // Send the response
-  send_response(res);
+  send_response(res, err, link);
 }
 
 // --------------------------------------------------------------------------
@@ -219,6 +476,72 @@ void HexTransfer::handle_can_msg(uint8_t (&buf)[8])
   last_successful_can_msg_ts = millis();
 }
 
+void HexTransfer::handle_multicast_msg(uint8_t (&buf)[8])
+{
+  // The same messages as handle_can_msg(), streamed once to the whole group
+  if ((buf[0] & 0x01) == 0) {
+    TransferInitMsg msg = unpack_transfer_init_msg(buf);
+    
+    // The init message is sent again for nodes that missed it. A node that
+    // has joined this transfer keeps what it has.
+    if (multicast && (transfer_in_progress || file_transfer_complete)
+        && msg.init_msg_checksum == msg.calculated_msg_checksum
+        && msg.file_checksum == received_file_checksum && msg.line_count == total_lines) {
+      last_successful_can_msg_ts = millis();
+      return;
+    }
+    
+    if (!process_transfer_init_msg(msg)) {
+      #if DEBUG
+      Serial.println("Error processing multicast init message!");
+      #endif
+      return;
+    }
+    multicast = true;
+  }
+  else if (transfer_in_progress && multicast) {
+    TransferSegmentMsg msg = unpack_transfer_segment_msg(buf);
+    
+    // Only the line this node needs is taken. The others are lines it has,
+    // sent again for another node, or lines after one it lost, which it asks
+    // for when queried. All of them show the stream is alive.
+    // The PC sends the next line right after this one, and handleInbox()
+    // reads it in the same batch, before update() runs. So a line is written
+    // as soon as it is complete, and the next one is taken. In a stream
+    // there is no line request to answer.
+    if (msg.line_num == hex_line_num) {
+      if (!process_transfer_segment_msg(msg)) {
+        #if DEBUG
+        Serial.println("Error processing multicast segment message!");
+        #endif
+      }
+      else if (!eof_received && are_all_segments_received(get_line_slot(hex_line_num))) {
+        handle_received_hex_line();
+      }
+    }
+  }
+  else {
+    return;
+  }
+  
+  // Update the last successful CAN message timestamp
+  last_successful_can_msg_ts = millis();
+}
+
+void HexTransfer::handle_control_msg(uint8_t (&buf)[8])
+{
+  // Unpack the message
+  ControlMsg msg = unpack_control_msg(buf);
+  
+  // Process and Report if the message is invalid
+  if (!process_control_msg(msg)) {
+    #if DEBUG
+    Serial.print("Error processing control message! Code: ");
+    Serial.println(buf[0]);
+    #endif
+  }
+}
+
 HexTransfer::TransferInitMsg HexTransfer::unpack_transfer_init_msg(uint8_t (&buf)[8]) {
   // Initialize the TransferInitMsg structure
   TransferInitMsg m{};
@@ -236,9 +559,8 @@ HexTransfer::TransferInitMsg HexTransfer::unpack_transfer_init_msg(uint8_t (&buf
   m.file_checksum      = (packed >> 16) & 0xFFFFFFFF; // 0xFFFFFFFF = 2^32 - 1 (32 bit mask)
   m.init_msg_checksum   = (packed >> 48) & 0xFFFF; // 0xFFFF = 2^16 - 1 (16 bit mask)
 
-  // Calculate the checksum of the message
-  const uint8_t* data = reinterpret_cast<const uint8_t*>(&m);
-  m.calculated_msg_checksum = CRC32.crc32(data, (unsigned int)(48));
+  // Calculate the checksum of the message, over the packed fields (bits 0-47)
+  m.calculated_msg_checksum = fxcrc32_update(0, buf, 6) & 0xFFFF;
   // Return the unpacked message
   return m;
 }
@@ -269,30 +591,52 @@ HexTransfer::TransferSegmentMsg HexTransfer::unpack_transfer_segment_msg(uint8_t
   return m;
 }
 
+HexTransfer::ControlMsg HexTransfer::unpack_control_msg(uint8_t (&buf)[8]) {
+  // Initialize the ControlMsg structure
+  ControlMsg m{};
+  
+  // The code is the first byte, the arguments follow it
+  m.code = static_cast<ControlCode>(buf[0]);
+  for (int i = 0; i < 7; i++) {
+    m.data[i] = buf[i + 1];
+  }
+  
+  // Return the unpacked message
+  return m;
+}
+
 bool HexTransfer::process_transfer_init_msg(TransferInitMsg &msg) {
   // Check if the message type is valid
   if (msg.msg_type != 0) {
     return false;
   }
   
-  // Log the received message
-  new_transfer_init_msg_received = true;
-
   // Check if the checksum is valid
   if (msg.init_msg_checksum != msg.calculated_msg_checksum) {
     // Checksum error, return false
+    new_transfer_init_msg_received = true;
     transfer_init_msg_error = true;
     return false;
   }
   
-  // Log the successful message
-  transfer_init_msg_error = false;
-  
   // Abort any previous transfers if any
   abort_transfer();
+  
+  // Log the successful message. This is done after abort_transfer(), which
+  // clears it, so that update() answers it.
+  new_transfer_init_msg_received = true;
+  transfer_init_msg_error = false;
+  
+  // Refuse the transfer while a Serial or SD update holds the buffer, or
+  // there is none
+  if (session_begin(&can_transport, 0) != SESSION_OK) {
+    transfer_init_busy = true;
+    return false;
+  }
 
   // Set the transfer in progress flag
   transfer_in_progress = true;
+  heap_calls_at_start = heap_call_count();
   
   // Set the file checksum
   received_file_checksum = msg.file_checksum;
@@ -305,70 +649,319 @@ bool HexTransfer::process_transfer_init_msg(TransferInitMsg &msg) {
 }
 
 bool HexTransfer::process_transfer_segment_msg(TransferSegmentMsg &msg) {
-  // Check if the line number matches the current line number
-  if (msg.line_num != hex_line_num) {
+  // Check if the line number matches the line its slot is receiving
+  LineSlot &slot = get_line_slot(msg.line_num);
+  if (msg.line_num != slot.line_num) {
     // Line number does not match, handle error or reset
     Serial.print("Line number mismatch! ");
     Serial.print(msg.line_num);
     Serial.print(" != ");
-    Serial.println(hex_line_num);
+    Serial.println(slot.line_num);
     return false;
   }
   
   // Check if the segment count matches the existing segment count
-  if (hex_line_segment_count == -1) {
-    // First segment, initialize the segment count and hex_line_segments_received list
-    hex_line_segment_count = msg.total_segments;
-    hex_line_segments_received = new bool[hex_line_segment_count];
-    for (int i = 0; i < hex_line_segment_count; i++) {
-      hex_line_segments_received[i] = false;
+  if (slot.segment_count == -1) {
+    // First segment, the segments must fit in the slot's buffer
+    if (msg.total_segments == 0 || msg.total_segments > MAX_CHUNKS_PER_HEX_LINE) {
+      #if DEBUG
+      Serial.print("Invalid segment count! ");
+      Serial.println(msg.total_segments);
+      #endif
+      return false;
     }
+    // Initialize the segment count and received mask
+    slot.segment_count = msg.total_segments;
+    slot.segments_received = 0;
   }
-  else if (msg.total_segments != hex_line_segment_count) {
+  else if (msg.total_segments != slot.segment_count) {
     // Segment count does not match that of previous messages for this hex line
     Serial.print("Segment number mismatch!");
     Serial.print(msg.segment_num);
     Serial.print(" != ");
-    Serial.println(hex_line_segment_count);
+    Serial.println(slot.segment_count);
     return false;
   }
   
+  // A parity frame is kept, to rebuild a lost segment of its group
+  if (msg.segment_num >= MAX_CHUNKS_PER_HEX_LINE) {
+    int group = msg.segment_num - MAX_CHUNKS_PER_HEX_LINE;
+    if (fec_group_size == 0 || group * fec_group_size >= slot.segment_count) {
+      #if DEBUG
+      Serial.print("Unexpected parity frame! ");
+      Serial.println(msg.segment_num);
+      #endif
+      return false;
+    }
+    memcpy(slot.fec_parity[group], msg.hex_data, MAX_HEX_CHUNK_SIZE);
+    slot.fec_parity_received |= 1 << group;
+    recover_lost_segments(slot);
+    return true;
+  }
+  
   // Check if the segment number is valid
-  if (msg.segment_num >= hex_line_segment_count) {
+  if (msg.segment_num >= slot.segment_count) {
     // Invalid segment number, handle error
     Serial.print("Invalid segment number! ");
     Serial.print(msg.segment_num);
     Serial.print(" >= ");
-    Serial.println(hex_line_segment_count);
+    Serial.println(slot.segment_count);
     return false;
   }
   
   // Copy the 5 bytes of hex data into the current hex line data
   for (int i = 0; i < MAX_HEX_CHUNK_SIZE; i++) {
-    hex_line_buf[msg.segment_num * MAX_HEX_CHUNK_SIZE + i] = msg.hex_data[i];
+    slot.buf[msg.segment_num * MAX_HEX_CHUNK_SIZE + i] = msg.hex_data[i];
   }
   
   // Mark the segment as received
-  hex_line_segments_received[msg.segment_num] = true;
+  slot.segments_received |= 1 << msg.segment_num;
+  
+  // A parity frame may have arrived before the segment after a lost one
+  if (slot.fec_parity_received) {
+    recover_lost_segments(slot);
+  }
   
   // Return true
   return true;
 }
 
-bool HexTransfer::send_response(ResponseCode res, ErrorCode err) {
+bool HexTransfer::process_control_msg(ControlMsg &msg) {
+  // Sector range arguments, used by the sector codes. The range is limited
+  // to the sectors of the running firmware, and a count of 0 means all of them.
+  uint16_t sectors = (build_size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+  uint16_t first = msg.data[0] | (msg.data[1] << 8);
+  uint16_t count = msg.data[2] | (msg.data[3] << 8);
+  if (first > sectors) {
+    first = sectors;
+  }
+  if (count == 0 || count > sectors - first) {
+    count = sectors - first;
+  }
+  
+  switch (msg.code) {
+    case ControlCode::QUERY_BUILD_ID:
+      // Answered by update()
+      pending_control = msg.code;
+      return true;
+    case ControlCode::QUERY_SECTOR_DIGESTS:
+      // Streamed by update()
+      digest_sector = first;
+      digest_end = first + count;
+      return true;
+    case ControlCode::SECTOR_CRC: {
+      // Manifest entries are accepted during a transfer, in any order
+      uint16_t sector = msg.data[0] | (msg.data[1] << 8);
+      if (!transfer_in_progress || sector >= MAX_MANIFEST_SECTORS) {
+        return false;
+      }
+      sector_crc[sector] = 0;
+      for (int i = 0; i < 4; i++) {
+        sector_crc[sector] |= static_cast<uint32_t>(msg.data[i + 2]) << (8 * i);
+      }
+      sector_crc_received[sector / 8] |= 1 << (sector % 8);
+      if (sector >= manifest_sectors) {
+        manifest_sectors = sector + 1;
+      }
+      return true;
+    }
+    case ControlCode::COPY_SECTORS:
+      // Sectors can only be copied into a plain image, while it is received.
+      // copy_running_sector() checks that they fit in the buffer.
+      if (!transfer_in_progress || session_ingest()->patch
+          || session_ingest()->buffer_offset != 0
+          || copy_sector < copy_end || count == 0) {
+        return false;
+      }
+      copy_sector = copy_first = first;
+      copy_end = first + count;
+      return true;
+    case ControlCode::OFFER_IMAGE:
+      // Only before the first line, answered by update()
+      if (!transfer_in_progress || hex_line_num != 0 || cache_loading) {
+        return false;
+      }
+      offered_crc = 0;
+      for (int i = 0; i < 4; i++) {
+        offered_crc |= static_cast<uint32_t>(msg.data[i]) << (8 * i);
+      }
+      offered_size = msg.data[4] | (msg.data[5] << 8) | (static_cast<uint32_t>(msg.data[6]) << 16);
+      pending_control = msg.code;
+      return true;
+    case ControlCode::ROLLBACK:
+      // Answered by update(), with an error if there is nothing to roll back
+      pending_control = msg.code;
+      return true;
+    case ControlCode::SELECT_PARTITION:
+      // Only before the first line, answered by update()
+      if (!transfer_in_progress || hex_line_num != 0 || cache_loading
+          || copy_sector < copy_end) {
+        return false;
+      }
+      selected_part = msg.data[0];
+      pending_control = msg.code;
+      return true;
+    case ControlCode::SET_FEC:
+      // During a transfer, from the next line on. Answered by update(), with
+      // the group size in use.
+      if (!transfer_in_progress) {
+        return false;
+      }
+      fec_group_size = msg.data[0];
+      if (fec_group_size < MIN_FEC_GROUP_SIZE || fec_group_size > MAX_CHUNKS_PER_HEX_LINE) {
+        fec_group_size = 0;
+      }
+      for (int link = 0; link < link_count; link++) {
+        line_slots[link].fec_parity_received = 0;
+      }
+      pending_control = msg.code;
+      return true;
+    case ControlCode::SET_LINKS:
+      // Only before the first line, answered by update(), with the number of
+      // links in use. A multicast stream has one.
+      if (!transfer_in_progress || hex_line_num != 0 || cache_loading || multicast) {
+        return false;
+      }
+      link_count = msg.data[0] < 1 ? 1 : msg.data[0] > CAN_LINKS ? CAN_LINKS : msg.data[0];
+      
+      // Slot 0 keeps line 0, which may be on its way. The others take the
+      // lines after it, and update() requests them.
+      for (int link = 1; link < link_count; link++) {
+        reset_line_slot(line_slots[link], link);
+      }
+      pending_control = msg.code;
+      return true;
+    case ControlCode::QUERY_MULTICAST:
+      // Answered by update(), by the nodes of the group only
+      if (msg.data[0] == MULTICAST_GROUP) {
+        pending_control = msg.code;
+      }
+      return true;
+    default:
+      // Unknown control code
+      return false;
+  }
+}
+
+bool HexTransfer::send_response(ResponseCode res, ErrorCode err, int link) {
+  // Nothing to send
+  if (res == ResponseCode::NONE) {
+    return false;
+  }
+  
   // Create a response message
+  AckMsg msg{};
+  msg.ack_msg_type = res;
+  switch (res) {
+    case ResponseCode::SEND_LINE: {
+      // Number of the line to send, little endian, asked for on the link of
+      // its slot
+      LineSlot &slot = line_slots[link];
+      msg.data[0] = slot.line_num & 0xFF;
+      msg.data[1] = (slot.line_num >> 8) & 0xFF;
+      slot.requested = true;
+      slot.request_ts = millis();
+      break;
+    }
+    case ResponseCode::TRANSFER_COMPLETE:
+      // With a sector manifest or a cached image, CRC32 of the image and its
+      // number of sectors (little endian), else zeros
+      for (int i = 0; i < 4; i++) {
+        msg.data[i] = (verified_crc >> (8 * i)) & 0xFF;
+      }
+      msg.data[4] = verified_sectors & 0xFF;
+      msg.data[5] = (verified_sectors >> 8) & 0xFF;
+      break;
+    case ResponseCode::ERROR:
+      msg.data[0] = static_cast<uint8_t>(err);
+      break;
+    case ResponseCode::BUILD_ID:
+      // Build ID, little endian, then code size in KB
+      for (int i = 0; i < 4; i++) {
+        msg.data[i] = (build_id >> (8 * i)) & 0xFF;
+      }
+      msg.data[4] = (build_size / 1024) & 0xFF;
+      msg.data[5] = ((build_size / 1024) >> 8) & 0xFF;
+      break;
+    case ResponseCode::SECTOR_DIGEST: {
+      // Sector number, then CRC32 of the sector, little endian
+      const uint8_t *sector = reinterpret_cast<const uint8_t*>(
+        FLASH_BASE_ADDR + digest_sector * FLASH_SECTOR_SIZE);
+      uint32_t crc = fxcrc32_update(0, sector, FLASH_SECTOR_SIZE);
+      msg.data[0] = digest_sector & 0xFF;
+      msg.data[1] = (digest_sector >> 8) & 0xFF;
+      for (int i = 0; i < 4; i++) {
+        msg.data[i + 2] = (crc >> (8 * i)) & 0xFF;
+      }
+      break;
+    }
+    case ResponseCode::IMAGE_OFFER:
+      // 1 if the image is loaded from the cache, else 0 (send the lines)
+      msg.data[0] = cache_loading ? 1 : 0;
+      break;
+    case ResponseCode::ROLLBACK: {
+      // Build ID of the previous image, little endian
+      #if SWAP_MODE
+      uint32_t crc = swap_journal()->buffer_crc;
+      for (int i = 0; i < 4; i++) {
+        msg.data[i] = (crc >> (8 * i)) & 0xFF;
+      }
+      #endif
+      break;
+    }
+    case ResponseCode::PARTITION: {
+      // Address of the partition, then its size in sectors, little endian
+      const part_t *part = part_get(selected_part);
+      uint16_t sectors = part->size / FLASH_SECTOR_SIZE;
+      for (int i = 0; i < 4; i++) {
+        msg.data[i] = (part->addr >> (8 * i)) & 0xFF;
+      }
+      msg.data[4] = sectors & 0xFF;
+      msg.data[5] = (sectors >> 8) & 0xFF;
+      break;
+    }
+    case ResponseCode::FEC:
+      msg.data[0] = fec_group_size;
+      break;
+    case ResponseCode::LINKS:
+      msg.data[0] = link_count;
+      break;
+    case ResponseCode::SECTORS_COPIED:
+      // Range that was copied, little endian
+      msg.data[0] = copy_first & 0xFF;
+      msg.data[1] = (copy_first >> 8) & 0xFF;
+      msg.data[2] = (copy_end - copy_first) & 0xFF;
+      msg.data[3] = ((copy_end - copy_first) >> 8) & 0xFF;
+      break;
+    default:
+      break;
+  }
+  
   uint8_t buf[8] = {0};
   // Pack the response message
-  if (!pack_response(res, buf)) {
+  if (!pack_response(msg, buf)) {
     // Error packing the response message
     return false;
   }
-  /// TODO: Send the response message over CAN bus
+  
+  // Send the response message over CAN bus
+  CAN::write(NODE_CAN_DEVICE_ID, PC_CAN_COMMAND_ID, sizeof(buf), buf, link);
   return true;
 }
 
-bool HexTransfer::pack_response(ResponseCode res, uint8_t (&buf)[8]) {
-  /// TODO: Pack the response message into the buffer
+bool HexTransfer::pack_response(AckMsg &msg, uint8_t (&buf)[8]) {
+  // Response code, then the data bytes
+  buf[0] = static_cast<uint8_t>(msg.ack_msg_type);
+  for (int i = 0; i < 6; i++) {
+    buf[i + 1] = msg.data[i];
+  }
+  
+  // Checksum byte makes all 8 bytes sum to zero (mod 256)
+  uint8_t sum = 0;
+  for (int i = 0; i < 7; i++) {
+    sum += buf[i];
+  }
+  buf[7] = static_cast<uint8_t>(-sum);
   
   // Return success
   return true;
@@ -380,11 +973,12 @@ bool HexTransfer::pack_response(ResponseCode res, uint8_t (&buf)[8]) {
 
 HexTransfer::ResponseCode HexTransfer::handle_received_hex_line() {
   // All segments have been received, parse and validate the hex line
-  ParsedHexLine hex_line = parse_and_validate_hex_line(hex_line_buf);
+  LineSlot &slot = get_line_slot(hex_line_num);
+  ParsedHexLine hex_line = parse_and_validate_hex_line(slot.buf);
   
   // Check if the hex line is valid
   if (!hex_line.valid) {
-    reset_cur_hex_line_buff();
+    reset_line_slot(slot, hex_line_num);
     // Send a line request with incremented line number
     // PC will resend the same line
     return ResponseCode::SEND_LINE;
@@ -392,7 +986,7 @@ HexTransfer::ResponseCode HexTransfer::handle_received_hex_line() {
 
   // Process the hex line
   if (!process_hex_line(hex_line)) {
-    reset_cur_hex_line_buff();
+    reset_line_slot(slot, hex_line_num);
     // Send a line request with incremented line number
     // PC will resend the same line
     return ResponseCode::SEND_LINE;
@@ -404,13 +998,76 @@ HexTransfer::ResponseCode HexTransfer::handle_received_hex_line() {
   // Increment the line number
   hex_line_num++;
   
-  // Clear the hex line buffer
-  reset_cur_hex_line_buff();
+  // Clear the slot, for the next line received on its link
+  reset_line_slot(slot, slot.line_num + link_count);
+  
+  // After EOF there is no line to request, update() answers the EOF, and
+  // with striped links there is none past the last line
+  if (eof_received || slot.line_num >= total_lines) {
+    return ResponseCode::NONE;
+  }
   
   // Return success
   return ResponseCode::SEND_LINE;
 }
 
+HexTransfer::ResponseCode HexTransfer::handle_received_eof(ErrorCode &err) {
+  // With a sector manifest, check the buffer sector by sector, starting from
+  // the sector just repaired, and receive a bad sector again. SECTOR_CRC is
+  // not acknowledged, so unless the manifest has every sector of the image
+  // (and it cannot for more than MAX_MANIFEST_SECTORS), the file checksum
+  // is checked instead.
+  bool manifest = false;
+  #if not DRYRUN
+  ingest_t *in = session_ingest();
+  uint32_t sectors = (in->hex.max - in->origin + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+  manifest = !in->patch && is_manifest_complete(sectors);
+  #endif
+  if (manifest) {
+    // The last record may have left a partial flash unit in
+    // flash_write_block(), and the RAM tier is not filled past it, so the
+    // last sector is only complete once the buffer is flushed
+    if (ingest_flush(session_ingest())) {
+      err = ErrorCode::IMAGE_ERROR;
+      return ResponseCode::ERROR;
+    }
+    int sector = find_bad_sector(repair_sector < 0 ? 0 : repair_sector);
+    if (sector >= 0 && repair_count >= MAX_SECTOR_REPAIRS) {
+      err = ErrorCode::TRANSFER_RETRY_LIMIT_EXCEEDED;
+      return ResponseCode::ERROR;
+    }
+    if (sector >= 0 && !begin_sector_repair(sector)) {
+      err = ErrorCode::SECTOR_CRC_ERROR;
+      return ResponseCode::ERROR;
+    }
+    if (sector >= 0) {
+      return ResponseCode::SEND_LINE;
+    }
+  }
+  // Without one, check the file checksum
+  else if (!is_file_checksum_valid()) {
+    err = ErrorCode::FILE_CHECKSUM_ERROR;
+    return ResponseCode::ERROR;
+  }
+  
+  #if not DRYRUN
+  // The image is complete once the session has checked it, as it checks a
+  // Serial or SD update: a patch must produce its image, and the image must
+  // have the right FSEC value and FLASH_ID
+  int status = session_finish(&can_transport);
+  if (status != INGEST_EOF) {
+    err = status == INGEST_ERR_PATCH ? ErrorCode::PATCH_ERROR : ErrorCode::IMAGE_ERROR;
+    return ResponseCode::ERROR;
+  }
+  #else
+  // Nothing was written, so there is nothing to check or commit: the buffer
+  // is released for the next session, as the transfer init began one
+  session_end(&can_transport);
+  #endif
+  
+  return ResponseCode::TRANSFER_COMPLETE;
+}
+
 HexTransfer::ParsedHexLine HexTransfer::parse_and_validate_hex_line(const char (&buf)[MAX_HEX_LINE_SIZE])
 {
   // Checks Done for Line Validation:
@@ -433,7 +1090,6 @@ HexTransfer::ParsedHexLine HexTransfer::parse_and_validate_hex_line(const char (
   // Initialize the parsed hex line
   ParsedHexLine hex_line;
   hex_line.valid = true;
-  unsigned int checksum = 0;
   
   // Find the length of the hex line. Unused bytes are filled with PAD (0xFF)
   size_t lineLen = 0;
@@ -462,26 +1118,22 @@ HexTransfer::ParsedHexLine HexTransfer::parse_and_validate_hex_line(const char (
     return hex_line;
   }
 
-  // We expect the layout to be:
-  //   : [byte_count:2 hex] [address:4 hex] [rec_type:2 hex] [data:2 * byte_count hex] [checksum:2 hex]
-  // Read more about the Intel HEX format here: https://en.wikipedia.org/wiki/Intel_HEX  
-  
-  // Create a pointer to itorate through the string
-  const char *ptr;
-  // Set the pointer to the first byte after the colon
-  ptr = buf + 1;
-  
-  // Parse 1: Byte count
-  if (!sscanf (ptr, "%02x", &hex_line.byte_count)) {
+  // The record is decoded, and its checksum checked, by the same parser as
+  // Serial and SD updates (see parse_hex_line), from a null-terminated copy.
+  // It stores only as many bytes as the line holds, at most MAX_HEX_LINE_SIZE/2.
+  char line[MAX_HEX_LINE_SIZE + 1];
+  char bytes[MAX_HEX_LINE_SIZE / 2];
+  memcpy(line, buf, lineLen);
+  line[lineLen] = 0;
+  if (!parse_hex_line(line, bytes, &hex_line.address, &hex_line.byte_count,
+                      &hex_line.record_type)) {
     #if DEBUG
-    Serial.println("Error: Unable to parse byte count!");
+    Serial.println("Error: Unable to parse hex line, or checksum is invalid!");
     #endif
     
     hex_line.valid = false;
     return hex_line;
   }
-  checksum += hex_line.byte_count;
-  ptr += 2;
   
   // Check 3: Check if the byte count is valid.
   // NOTE: The technical limit is 255, but the teensy3.5 only 
@@ -508,29 +1160,6 @@ HexTransfer::ParsedHexLine HexTransfer::parse_and_validate_hex_line(const char (
     return hex_line;
   }
   
-  // Parse 2: Address
-  if (!sscanf (ptr, "%4x", &hex_line.address)) {
-    #if DEBUG
-    Serial.println("Error: Unable to parse address!");
-    #endif
-    
-    hex_line.valid = false;
-    return hex_line;
-  }
-  checksum += (hex_line.address >> 8) & 0xFF;
-  ptr += 4;
-  
-  // Parse 3: Record type
-  if (!sscanf (ptr, "%02x", &hex_line.record_type)) {
-    #if DEBUG
-    Serial.println("Error: Unable to parse record type!");
-    #endif
-    
-    hex_line.valid = false;
-    return hex_line;
-  }
-  ptr += 2;
-
   // Check 5: Check if the record type is valid
   if (hex_line.record_type > 5) {
     #if DEBUG
@@ -541,31 +1170,12 @@ HexTransfer::ParsedHexLine HexTransfer::parse_and_validate_hex_line(const char (
     return hex_line;
   }
 
-  // Parse the data bytes
-  // Note: past this point the data is stored as raw bytes
-  //       not as hex represented in ascii like before.
+  // Past this point the data is stored as raw bytes, not as hex represented
+  // in ascii like before.
   for (size_t i = 0; i < hex_line.byte_count; i++) {
-    if (!sscanf (ptr, "%02x", &hex_line.data[i])) {
-      #if DEBUG
-      Serial.println("Error: Unable to parse data bytes!");
-      #endif
-      
-      hex_line.valid = false;
-      return hex_line;
-    }
-    // Move the pointer past the data value
-    ptr += 2;
+    hex_line.data[i] = static_cast<uint8_t>(bytes[i]);
   }
-  
-  // Parse the checksum
-  if (!sscanf (ptr, "%02x", &hex_line.checksum)) {
-    #if DEBUG
-    Serial.println("Error: Unable to parse checksum!");
-    #endif
-    
-    hex_line.valid = false;
-    return hex_line;
-  }  
+  sscanf(line + lineLen - 2, "%02x", &hex_line.checksum);
   
   // Return the parsed hex line
   return hex_line;
@@ -602,43 +1212,34 @@ bool HexTransfer::process_hex_data_record(ParsedHexLine &hex_line) {
     return false;
   }
   
-  // Update the min and max addresses
-  if (base_address + hex_line.address + hex_line.byte_count > max_address) {
-    max_address = base_address + hex_line.address + hex_line.byte_count;
-  }
-  if (base_address + hex_line.address < min_address) {
-    min_address = base_address + hex_line.address;
+  // Sector of the image the record is in
+  uint32_t sector = (base_address + hex_line.address - session_ingest()->origin) / FLASH_SECTOR_SIZE;
+  
+  // While a sector is received again, the first record past it ends the
+  // repair. It is not written, update() checks the sectors again.
+  if (repair_sector >= 0 && sector != static_cast<uint32_t>(repair_sector)) {
+    eof_received = true;
+    return true;
   }
   
-  // Check if the address is too large
-  if (max_address > (FLASH_BASE_ADDR + flash_buffer_size)) {
-    #if DEBUG
-    Serial.println("Error: Address is too large!");
-    #endif
-    
-    return false;
+  // Remember the first line of each sector, where a repair starts
+  if (sector < MAX_MANIFEST_SECTORS && sector_first_line[sector] == MANIFEST_NO_LINE) {
+    sector_first_line[sector] = hex_line_num;
   }
   
-  // #if not DRYRUN
   #if not DRYRUN
-  
-  // Calculate the address in the flash buffer we will copy the data to
-  uint32_t addr = flash_buffer_addr + base_address + hex_line.address - FLASH_BASE_ADDR;
-  
-  if (IN_FLASH(flash_buffer_addr)) {
-    char *bytePtr = reinterpret_cast<char*>(hex_line.data);
-    int error = flash_write_block( addr, bytePtr, (uint32_t)hex_line.byte_count );
-    if (error) {
-      #if DEBUG
-      Serial.printf( "abort - error %02X in flash_write_block()\n", error );
-      #endif
-      
-      return false;
-    }
+  // The session writes the record to the buffer: it places a compressed
+  // image, applies a patch (which must arrive in order) and checks the size.
+  // An error cannot be fixed by resending the line, so the line is accepted
+  // and update() reports the error and aborts.
+  char bytes[16];
+  for (size_t i = 0; i < hex_line.byte_count; i++) {
+    bytes[i] = static_cast<char>(hex_line.data[i]);
   }
-  else if (!IN_FLASH(flash_buffer_addr)) {
-    // This is to support RAM buffer transfers, not available on Teensy 3.5
-    memcpy(reinterpret_cast<void*>(addr), hex_line.data, hex_line.byte_count);
+  int status = session_deliver_block(&can_transport, base_address + hex_line.address,
+                                     bytes, hex_line.byte_count);
+  if (status != INGEST_MORE) {
+    image_status = status;
   }
   #endif
   return true;
@@ -749,27 +1350,203 @@ bool HexTransfer::process_hex_start_linear_address_record(ParsedHexLine &hex_lin
 // Helper Functions
 // --------------------------------------------------------------------------
 
-bool HexTransfer::are_all_segments_received() {
-  // Check if all segments have been received
-  for (int i = 0; i < hex_line_segment_count; i++) {
-    if (!hex_line_segments_received[i]) {
+bool HexTransfer::copy_running_sector(uint16_t sector) {
+  uint32_t offset = sector * FLASH_SECTOR_SIZE;
+  
+  // The sector must hold running code, and fit in the buffer. An image for a
+  // slot is linked for another address than the running code, so none of it
+  // can be copied.
+  ingest_t *in = session_ingest();
+  if (in->origin != FLASH_BASE_ADDR || offset >= build_size
+      || offset + FLASH_SECTOR_SIZE > in->ram_size + in->buffer_size + in->nvm_size) {
+    #if DEBUG
+    Serial.printf("Error: Cannot copy sector %u!\n", sector);
+    #endif
+    
+    return false;
+  }
+  
+  #if not DRYRUN
+  // The sector is delivered to the session as its data records would have been,
+  // but out of their order, so the partial flash unit the last record may have
+  // left in flash_write_block() is written first
+  if (flash_write_flush()) {
+    return false;
+  }
+  const char *data = reinterpret_cast<const char*>(FLASH_BASE_ADDR + offset);
+  if (session_deliver_block(&can_transport, FLASH_BASE_ADDR + offset,
+                            data, FLASH_SECTOR_SIZE) != INGEST_MORE) {
+    return false;
+  }
+  #endif
+  
+  return true;
+}
+
+bool HexTransfer::is_manifest_complete(uint32_t sectors) {
+  // Whether a SECTOR_CRC was received for each of the first sectors
+  if (sectors == 0 || sectors > MAX_MANIFEST_SECTORS) {
+    return false;
+  }
+  for (uint32_t sector = 0; sector < sectors; sector++) {
+    if (!(sector_crc_received[sector / 8] & (1 << (sector % 8)))) {
       return false;
     }
   }
   return true;
 }
 
+int HexTransfer::find_bad_sector(uint16_t first) {
+  // Return the first sector from first on whose manifest CRC does not match
+  // the buffer, or -1 if they all match. Sectors before first have passed.
+  // The CRC of each sector that passes is combined into verified_crc.
+  // Sectors are read back in chunks, since the image may be on SD (staged).
+  ingest_t *in = session_ingest();
+  static char chunk[512] __attribute__ ((aligned (4)));
+  for (uint16_t sector = first; sector < manifest_sectors; sector++) {
+    uint32_t crc = 0;
+    for (uint32_t i = 0; i < FLASH_SECTOR_SIZE; i += sizeof(chunk)) {
+      ingest_read(in, sector * FLASH_SECTOR_SIZE + i, chunk, sizeof(chunk));
+      crc = fxcrc32_update(crc, chunk, sizeof(chunk));
+    }
+    
+    if ((sector_crc_received[sector / 8] & (1 << (sector % 8)))
+        && crc != sector_crc[sector]) {
+      #if DEBUG
+      Serial.printf("Sector %u failed its manifest CRC\n", sector);
+      #endif
+      
+      return sector;
+    }
+    if (sector == verified_sectors) {
+      verified_crc = fxcrc32_combine(verified_crc, crc, FLASH_SECTOR_SIZE);
+      verified_sectors++;
+    }
+  }
+  return -1;
+}
+
+bool HexTransfer::begin_sector_repair(uint16_t sector) {
+  // Sectors not written by lines (copied or empty) cannot be received again
+  if (sector_first_line[sector] == MANIFEST_NO_LINE) {
+    return false;
+  }
+  
+  // Erase the sector, so its lines can be written again (a staged image is
+  // simply overwritten). No partial flash unit may be left to write first,
+  // as the lines start again at the sector.
+  if (flash_write_flush()) {
+    return false;
+  }
+  ingest_t *in = session_ingest();
+  uint32_t addr = ingest_addr(in, sector * FLASH_SECTOR_SIZE);
+  if (!in->staged) {
+    if (IN_FLASH(addr) || IN_FLEXNVM(addr)) {
+      if (flash_erase_block(addr, FLASH_SECTOR_SIZE)) {
+        return false;
+      }
+    }
+    else {
+      memset(reinterpret_cast<void*>(addr), 0xFF, FLASH_SECTOR_SIZE);
+    }
+  }
+  
+  // Request its lines again, from the first. Teensy hex files use linear
+  // addresses, and a sector never crosses a 64K boundary, so the base address
+  // at that line is known.
+  repair_sector = sector;
+  repair_count++;
+  hex_line_num = sector_first_line[sector];
+  base_address = (session_ingest()->origin + sector * FLASH_SECTOR_SIZE) & 0xFFFF0000;
+  eof_received = false;
+  reset_line_slots();
+  
+  return true;
+}
+
+void HexTransfer::recover_lost_segments(LineSlot &slot) {
+  // Each parity frame is the XOR of the segments of its group, so a group
+  // missing one segment has it in the XOR of the parity and the others
+  for (int group = 0; group < MAX_FEC_PARITY_FRAMES; group++) {
+    if (!(slot.fec_parity_received & (1 << group))) {
+      continue;
+    }
+    int first = group * fec_group_size;
+    int end = first + fec_group_size;
+    if (end > slot.segment_count) {
+      end = slot.segment_count;
+    }
+    uint16_t missing = (((1 << (end - first)) - 1) << first) & ~slot.segments_received;
+    if (missing == 0 || (missing & (missing - 1)) != 0) {
+      // Nothing lost, or more than the parity can rebuild
+      continue;
+    }
+    
+    int lost = first;
+    while (!(missing & (1 << lost))) {
+      lost++;
+    }
+    for (int i = 0; i < MAX_HEX_CHUNK_SIZE; i++) {
+      char byte = slot.fec_parity[group][i];
+      for (int segment = first; segment < end; segment++) {
+        if (segment != lost) {
+          byte ^= slot.buf[segment * MAX_HEX_CHUNK_SIZE + i];
+        }
+      }
+      slot.buf[lost * MAX_HEX_CHUNK_SIZE + i] = byte;
+    }
+    slot.segments_received |= missing;
+    fec_recovered++;
+  }
+}
+
+HexTransfer::LineSlot &HexTransfer::get_line_slot(uint16_t line_num) {
+  // Slot the line is received into
+  return line_slots[line_num % link_count];
+}
+
+int HexTransfer::find_slot_to_request() {
+  // Return the slot whose line must be requested, or -1: a line not
+  // requested since its slot was reset (by SET_LINKS or a sector repair), or
+  // one that has timed out. Nothing is requested after EOF or past the last
+  // line, or in a multicast stream, until the lines time out.
+  if (eof_received) {
+    return -1;
+  }
+  for (int link = 0; link < link_count; link++) {
+    LineSlot &slot = line_slots[link];
+    if (slot.line_num >= total_lines || are_all_segments_received(slot)) {
+      continue;
+    }
+    if ((!slot.requested && !multicast) || has_segment_timed_out(slot)) {
+      return link;
+    }
+  }
+  return -1;
+}
+
+bool HexTransfer::are_all_segments_received(LineSlot &slot) {
+  // No segment of the slot's line has been received yet
+  if (slot.segment_count == -1) {
+    return false;
+  }
+  
+  // Check if all segments have been received
+  return slot.segments_received == (1 << slot.segment_count) - 1;
+}
+
 void HexTransfer::add_hex_line_to_checksum() {
   // Get the length of the hex line without the padding
+  LineSlot &slot = get_line_slot(hex_line_num);
   uint16_t len = 0;
-  while (len < MAX_HEX_LINE_SIZE && hex_line_buf[len] != PAD) {
+  while (len < MAX_HEX_LINE_SIZE && slot.buf[len] != PAD) {
     len++;
   }
   
-  const uint8_t* data = reinterpret_cast<const uint8_t*>(hex_line_buf);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(slot.buf);
 
   // Add the hex line to the checksum
-  computed_file_checksum = CRC32.crc32_upd(data, len);
+  computed_file_checksum = fxcrc32_update(computed_file_checksum, data, len);
 }
 
 bool HexTransfer::is_file_checksum_valid() {
@@ -783,33 +1560,56 @@ bool HexTransfer::is_file_checksum_valid() {
 void HexTransfer::clear_transfer_state() {
   base_address = 0;
   start_address = 0;
-  min_address = 0xFFFFFFFF;
-  max_address = 0;
+  copy_sector = copy_end = copy_first = 0;
+  manifest_sectors = 0;
+  memset(sector_crc_received, 0, sizeof(sector_crc_received));
+  memset(sector_first_line, 0xFF, sizeof(sector_first_line)); // MANIFEST_NO_LINE
+  repair_sector = -1;
+  repair_count = 0;
+  verified_crc = 0;
+  verified_sectors = 0;
+  cache_loading = false;
+  image_status = INGEST_MORE;
   eof_received = false;
   total_lines = 0;
   received_file_checksum = 0;
   hex_line_num = 0;
+  link_count = 1;
   new_transfer_init_msg_received = false;
   transfer_init_msg_error = false;
+  transfer_init_busy = false;
   transfer_in_progress = false;
   file_transfer_complete = false;
-  computed_file_checksum = CRC32.crc32((uint8_t*)"", 0); // Initialize to 0
+  multicast = false;
+  fec_group_size = 0;
+  fec_recovered = 0;
+  computed_file_checksum = 0; // CRC32 of no data
   
-  reset_cur_hex_line_buff();
+  reset_line_slots();
 }
 
-void HexTransfer::reset_cur_hex_line_buff() {
-  hex_line_segment_count = -1;
-  if (hex_line_segments_received != nullptr) {
-    delete[] hex_line_segments_received;
+void HexTransfer::reset_line_slot(LineSlot &slot, uint16_t line_num) {
+  slot.line_num = line_num;
+  slot.segment_count = -1;
+  slot.segments_received = 0;
+  slot.fec_parity_received = 0;
+  slot.requested = false;
+  memset(slot.buf, PAD, sizeof(slot.buf));
+}
+
+void HexTransfer::reset_line_slots() {
+  // Each slot takes the first line from hex_line_num on that falls to it
+  for (int link = 0; link < link_count; link++) {
+    uint16_t ahead = (link + link_count - hex_line_num % link_count) % link_count;
+    reset_line_slot(line_slots[link], hex_line_num + ahead);
   }
-  hex_line_segments_received = nullptr;
-  memset(hex_line_buf, PAD, sizeof(hex_line_buf));
 }
 
 void HexTransfer::abort_transfer() {
-  // Clear the transfer state
+  // Clear the transfer state, and leave the buffer erased for the next
+  // session if this transfer held it
   clear_transfer_state();
+  session_end(&can_transport);
   
   #if DEBUG
   Serial.println("Transfer aborted!");
@@ -821,14 +1621,20 @@ bool HexTransfer::is_transfer_in_progress() {
   return transfer_in_progress;
 }
 
+uint16_t HexTransfer::get_hex_line_num() {
+  // Number of the next line to receive, so the number of lines received
+  return hex_line_num;
+}
+
 bool HexTransfer::is_file_transfer_complete() {
   // Check if the file transfer is complete
   return file_transfer_complete;
 }
 
-bool HexTransfer::has_segment_timed_out() {
-  // Check if the segment has timed out
-  return (millis() - last_successful_can_msg_ts) > HEX_LINE_TIMEOUT_LEN;
+bool HexTransfer::has_segment_timed_out(LineSlot &slot) {
+  // Check if the segment has timed out, and not already been requested again
+  return (millis() - last_successful_can_msg_ts) > HEX_LINE_TIMEOUT_LEN
+      && (millis() - slot.request_ts) > HEX_LINE_TIMEOUT_LEN;
 }
 
 bool HexTransfer::has_transfer_timed_out() {
@@ -0,0 +1,549 @@
+#include "UpdateGateway.h"
+#include "CAN.h"
+
+namespace UpdateGateway
+{
+  // --------------------------------------------------------------------------
+  // Session Variables
+  // --------------------------------------------------------------------------
+  // The gateway sends the image of a session another transport received and
+  // checked, and ends that session when it is done, so the buffer holds the
+  // image until then.
+
+  State state;
+
+  // Transport that holds the session
+  transport_t *transport;
+
+  // Flash address of the image, and its size: for an FXLZ image the stream,
+  // for a patch the image it produced, as the nodes' sessions take them
+  uint32_t image_origin;
+  uint32_t image_size;
+
+  // --------------------------------------------------------------------------
+  // Hex File Variables
+  // --------------------------------------------------------------------------
+  // The image is sent as the hex file TeensyDuino writes, made again from the
+  // buffer a line at a time: an 04 record at each 64K, GATEWAY_HEX_LINE_BYTES
+  // per data record, then the EOF record.
+
+  // Next line to make, for the checksum or the stream
+  LineCursor cursor;
+
+  // Number of lines, and the CRC32 of their text, for the init message
+  uint16_t total_lines;
+  uint32_t file_checksum;
+
+  // --------------------------------------------------------------------------
+  // Stream Variables
+  // --------------------------------------------------------------------------
+  // Frames waiting for the bus, in order, and the next of them. A frame the
+  // bus cannot take yet is sent on the next update, and nothing more is
+  // queued until they are all on the bus.
+  uint8_t outbox[GATEWAY_OUTBOX_FRAMES][8];
+  uint8_t outbox_msg_id[GATEWAY_OUTBOX_FRAMES];
+  int outbox_count;
+  int outbox_next;
+  
+  // Time the bus last took a frame, or the first was queued, in ms
+  uint32_t outbox_ts;
+
+  // Time the last line was queued, in us
+  uint32_t line_queued_us;
+
+  // Line the next query is sent after
+  uint16_t query_line;
+
+  // Time the init message or query was sent
+  uint32_t state_ts;
+
+  // Lowest line a node needed, and the number of nodes complete, at the last
+  // query, and the time either last went up
+  uint16_t lowest_line;
+  int complete_count;
+  uint32_t progress_ts;
+
+  // Times the stream went back to a line already sent, for the report
+  int rounds;
+
+  // --------------------------------------------------------------------------
+  // Node Variables
+  // --------------------------------------------------------------------------
+  Node nodes[GATEWAY_MAX_NODES];
+  int node_count;
+
+} // namespace UpdateGateway
+
+
+
+// --------------------------------------------------------------------------
+// Main Functions
+// --------------------------------------------------------------------------
+void UpdateGateway::init() {
+  state = State::IDLE;
+  transport = NULL;
+  node_count = 0;
+  outbox_count = outbox_next = 0;
+}
+
+bool UpdateGateway::begin(transport_t *t) {
+  // The image must have been received and checked by t's session. A data
+  // partition was written to this node's own flash.
+  ingest_t *in = session_ingest();
+  if (state != State::IDLE || session_owner() != t || in->status != INGEST_EOF
+      || in->part != NULL) {
+    return false;
+  }
+
+  transport = t;
+  image_origin = in->origin;
+  image_size = in->image_size;
+  node_count = 0;
+  outbox_count = outbox_next = 0;
+  rounds = 0;
+  lowest_line = 0;
+  complete_count = 0;
+  file_checksum = 0; // CRC32 of no data
+  rewind(cursor, 0);
+  state = State::PREPARING;
+  return true;
+}
+
+bool UpdateGateway::is_active() {
+  return state != State::IDLE;
+}
+
+void UpdateGateway::update() {
+  if (state == State::IDLE) return;
+
+  // Send what the bus takes of the frames queued, and wait for the rest. A
+  // bus that takes none, e.g. with no node to acknowledge them, is given up.
+  if (!send_outbox()) {
+    if (millis() - outbox_ts > GATEWAY_STALL_MS) {
+      transport->out->printf("gateway: CAN bus took no frame for %d ms, giving up\n",
+                             GATEWAY_STALL_MS);
+      outbox_count = outbox_next = 0;
+      finish();
+    }
+    return;
+  }
+
+  char line[MAX_HEX_LINE_SIZE + 1];
+  switch (state) {
+    case State::IDLE:
+      break;
+
+    case State::PREPARING:
+      // The checksum the nodes check the lines against, a few lines per update
+      for (int i = 0; i < GATEWAY_LINES_PER_UPDATE && !cursor.done; i++) {
+        int len = next_line(cursor, line, true);
+        file_checksum = fxcrc32_update(file_checksum, line, len);
+      }
+      if (!cursor.done) {
+        break;
+      }
+      // The init message has 15 bits for the line count
+      if (cursor.line > 0x7FFF) {
+        transport->out->printf("gateway: image needs %u lines, at most 32767 can be sent\n",
+                               cursor.line);
+        finish();
+        break;
+      }
+      total_lines = cursor.line;
+      transport->out->printf("gateway: sending %u lines (%lu bytes) to CAN group %d\n",
+                             total_lines, image_size, GATEWAY_GROUP);
+      progress_ts = millis();
+      queue_init();
+      break;
+
+    case State::JOINING:
+      // Each node answers the init message with SEND_LINE 0
+      if (millis() - state_ts < GATEWAY_REPLY_MS) {
+        break;
+      }
+      if (node_count == 0) {
+        if (millis() - progress_ts > GATEWAY_STALL_MS) {
+          transport->out->printf("gateway: no node of group %d answered\n", GATEWAY_GROUP);
+          finish();
+        }
+        else {
+          queue_init();
+        }
+        break;
+      }
+      rewind(cursor, 0);
+      query_line = GATEWAY_QUERY_LINES;
+      state = State::STREAMING;
+      break;
+
+    case State::STREAMING: {
+      // One line at a time, once the last one is on the bus, and no faster
+      // than the nodes take them
+      if (outbox_count > 0 || micros() - line_queued_us < GATEWAY_LINE_US) {
+        break;
+      }
+      if (cursor.done || cursor.line >= query_line) {
+        // End of the window or of the file, ask the group what it needs
+        queue_control(HexTransfer::ControlCode::QUERY_MULTICAST, GATEWAY_GROUP);
+        state = State::QUERYING;
+        state_ts = millis();
+        break;
+      }
+      uint16_t line_num = cursor.line;
+      int len = next_line(cursor, line, true);
+      queue_line(line, len, line_num);
+      line_queued_us = micros();
+      break;
+    }
+
+    case State::QUERYING:
+      if (millis() - state_ts >= GATEWAY_REPLY_MS) {
+        end_query();
+      }
+      break;
+  }
+}
+
+// --------------------------------------------------------------------------
+// Can Bus Message Handlers
+// --------------------------------------------------------------------------
+
+void UpdateGateway::handle_response(uint8_t node_id, uint8_t (&buf)[8])
+{
+  // The checksum byte makes all 8 bytes sum to zero (see pack_response)
+  uint8_t sum = 0;
+  for (int i = 0; i < 8; i++) {
+    sum += buf[i];
+  }
+  if (sum != 0 || state == State::PREPARING) {
+    return;
+  }
+
+  Node *node = find_node(node_id);
+  if (node == NULL) {
+    return;
+  }
+  node->last_heard_ts = millis();
+
+  switch (static_cast<HexTransfer::ResponseCode>(buf[0])) {
+    case HexTransfer::ResponseCode::SEND_LINE:
+      // After the init message, or a query: the line the node needs next
+      if (node->state != NodeState::FAILED) {
+        node->state = NodeState::JOINED;
+        node->next_line = buf[1] | (buf[2] << 8);
+      }
+      break;
+    case HexTransfer::ResponseCode::TRANSFER_COMPLETE:
+      node->state = NodeState::COMPLETE;
+      break;
+    case HexTransfer::ResponseCode::ERROR:
+      // A node that missed the init message is sent it again, one that
+      // refused the image or aborted is not
+      if (buf[1] == static_cast<uint8_t>(HexTransfer::ErrorCode::TRANSFER_NOT_IN_PROGRESS)) {
+        if (node->state != NodeState::FAILED && node->state != NodeState::COMPLETE) {
+          node->state = NodeState::NEEDS_INIT;
+        }
+      }
+      else {
+        node->state = NodeState::FAILED;
+        node->error = buf[1];
+      }
+      break;
+    default:
+      // FEC, and answers to control messages from elsewhere
+      break;
+  }
+}
+
+UpdateGateway::Node *UpdateGateway::find_node(uint8_t node_id) {
+  // The node, added the first time it answers, or NULL if the table is full
+  for (int i = 0; i < node_count; i++) {
+    if (nodes[i].id == node_id) {
+      return &nodes[i];
+    }
+  }
+  if (node_count == GATEWAY_MAX_NODES) {
+    return NULL;
+  }
+  Node *node = &nodes[node_count++];
+  node->id = node_id;
+  node->state = NodeState::NONE;
+  node->next_line = 0;
+  node->error = 0;
+  return node;
+}
+
+// --------------------------------------------------------------------------
+// Hex Line Functions
+// --------------------------------------------------------------------------
+
+void UpdateGateway::rewind(LineCursor &c, uint16_t line) {
+  // Start of the file, then on to line. Lines skipped are only counted.
+  c.line = 0;
+  c.offset = 0;
+  c.base = 0xFFFFFFFF; // No 04 record yet
+  c.done = false;
+  char unused[MAX_HEX_LINE_SIZE + 1];
+  while (c.line < line && !c.done) {
+    next_line(c, unused, false);
+  }
+}
+
+int UpdateGateway::next_line(LineCursor &c, char (&line)[MAX_HEX_LINE_SIZE + 1], bool format) {
+  // Make the line at c and move c past it. Returns the length of the line,
+  // 0 past EOF. Without format, the data is not read, and the length is 1.
+  if (c.done) {
+    return 0;
+  }
+
+  // Record: byte count, address (big endian), record type, then the data
+  uint8_t record[4 + GATEWAY_HEX_LINE_BYTES];
+  uint32_t addr = image_origin + c.offset;
+  uint32_t count = 0;
+  uint16_t addr16 = 0;
+  uint8_t type;
+  if (c.offset < image_size && (addr & 0xFFFF0000) != c.base) {
+    // Extended linear address, at the start and at each 64K
+    c.base = addr & 0xFFFF0000;
+    type = 4;
+    count = 2;
+    record[4] = (addr >> 24) & 0xFF;
+    record[5] = (addr >> 16) & 0xFF;
+  }
+  else if (c.offset < image_size) {
+    // Data, up to the end of the image or of the 64K
+    type = 0;
+    addr16 = addr & 0xFFFF;
+    count = image_size - c.offset;
+    if (count > GATEWAY_HEX_LINE_BYTES) {
+      count = GATEWAY_HEX_LINE_BYTES;
+    }
+    if (count > 0x10000u - addr16) {
+      count = 0x10000u - addr16;
+    }
+    if (format) {
+      ingest_read(session_ingest(), c.offset, reinterpret_cast<char*>(record + 4), count);
+    }
+    c.offset += count;
+  }
+  else {
+    type = 1;
+    c.done = true;
+  }
+  c.line++;
+  if (!format) {
+    return 1;
+  }
+
+  // Text of the record, with its checksum
+  record[0] = count;
+  record[1] = addr16 >> 8;
+  record[2] = addr16 & 0xFF;
+  record[3] = type;
+  uint8_t sum = 0;
+  int len = sprintf(line, ":");
+  for (uint32_t i = 0; i < 4 + count; i++) {
+    sum += record[i];
+    len += sprintf(line + len, "%02X", record[i]);
+  }
+  len += sprintf(line + len, "%02X", static_cast<uint8_t>(-sum));
+  return len;
+}
+
+// --------------------------------------------------------------------------
+// Frame Functions
+// --------------------------------------------------------------------------
+
+bool UpdateGateway::queue_frame(uint8_t msg_id, const uint8_t (&buf)[8]) {
+  // Returns false if the outbox is full. update() queues at most a line and
+  // its parity, once the outbox is empty, so it never is.
+  if (outbox_count >= GATEWAY_OUTBOX_FRAMES) {
+    return false;
+  }
+  if (outbox_count == 0) {
+    outbox_ts = millis();
+  }
+  memcpy(outbox[outbox_count], buf, 8);
+  outbox_msg_id[outbox_count] = msg_id;
+  outbox_count++;
+  return true;
+}
+
+void UpdateGateway::queue_segment(uint16_t line_num, uint8_t segment_num,
+                                  uint8_t total_segments, const char *data) {
+  // Packed as HexTransfer unpacks a TransferSegmentMsg
+  uint64_t packed = 1;
+  packed |= static_cast<uint64_t>(line_num & 0x7FFF) << 1;
+  packed |= static_cast<uint64_t>(segment_num & 0x0F) << 16;
+  packed |= static_cast<uint64_t>(total_segments & 0x0F) << 20;
+  for (int i = 0; i < MAX_HEX_CHUNK_SIZE; i++) {
+    packed |= static_cast<uint64_t>(static_cast<uint8_t>(data[i])) << (24 + 8 * i);
+  }
+
+  uint8_t buf[8];
+  for (int i = 0; i < 8; i++) {
+    buf[i] = (packed >> (8 * i)) & 0xFF;
+  }
+  queue_frame(MULTICAST_CAN_COMMAND_ID + GATEWAY_GROUP, buf);
+}
+
+void UpdateGateway::queue_line(const char *line, int len, uint16_t line_num) {
+  // The segments of the line, the last padded with PAD, each group of them
+  // followed by its parity frame
+  char padded[MAX_HEX_LINE_SIZE];
+  memset(padded, PAD, sizeof(padded));
+  memcpy(padded, line, len);
+  int segments = (len + MAX_HEX_CHUNK_SIZE - 1) / MAX_HEX_CHUNK_SIZE;
+
+  #if GATEWAY_FEC_GROUP_SIZE > 0
+  char parity[MAX_HEX_CHUNK_SIZE] = {0};
+  #endif
+  for (int segment = 0; segment < segments; segment++) {
+    const char *data = padded + segment * MAX_HEX_CHUNK_SIZE;
+    queue_segment(line_num, segment, segments, data);
+
+    #if GATEWAY_FEC_GROUP_SIZE > 0
+    for (int i = 0; i < MAX_HEX_CHUNK_SIZE; i++) {
+      parity[i] ^= data[i];
+    }
+    if ((segment + 1) % GATEWAY_FEC_GROUP_SIZE == 0 || segment == segments - 1) {
+      queue_segment(line_num, MAX_CHUNKS_PER_HEX_LINE + segment / GATEWAY_FEC_GROUP_SIZE,
+                    segments, parity);
+      memset(parity, 0, sizeof(parity));
+    }
+    #endif
+  }
+}
+
+void UpdateGateway::queue_init() {
+  // Packed as HexTransfer unpacks a TransferInitMsg, then the parity the
+  // stream carries. Nodes already in this transfer keep what they have.
+  uint64_t packed = static_cast<uint64_t>(total_lines & 0x7FFF) << 1;
+  packed |= static_cast<uint64_t>(file_checksum) << 16;
+  uint8_t buf[8];
+  for (int i = 0; i < 6; i++) {
+    buf[i] = (packed >> (8 * i)) & 0xFF;
+  }
+  uint16_t checksum = fxcrc32_update(0, buf, 6) & 0xFFFF;
+  buf[6] = checksum & 0xFF;
+  buf[7] = (checksum >> 8) & 0xFF;
+  queue_frame(MULTICAST_CAN_COMMAND_ID + GATEWAY_GROUP, buf);
+
+  #if GATEWAY_FEC_GROUP_SIZE > 0
+  queue_control(HexTransfer::ControlCode::SET_FEC, GATEWAY_FEC_GROUP_SIZE);
+  #endif
+
+  state = State::JOINING;
+  state_ts = millis();
+}
+
+void UpdateGateway::queue_control(HexTransfer::ControlCode code, uint8_t arg) {
+  uint8_t buf[8] = {static_cast<uint8_t>(code), arg};
+  queue_frame(CONTROL_CAN_COMMAND_ID, buf);
+}
+
+bool UpdateGateway::send_outbox() {
+  // Returns true once every frame queued is on the bus
+  while (outbox_next < outbox_count) {
+    if (!CAN::write(PC_CAN_DEVICE_ID, outbox_msg_id[outbox_next], 8, outbox[outbox_next])) {
+      return false;
+    }
+    outbox_next++;
+    outbox_ts = millis();
+  }
+  outbox_count = outbox_next = 0;
+  return true;
+}
+
+// --------------------------------------------------------------------------
+// Helper Functions
+// --------------------------------------------------------------------------
+
+void UpdateGateway::end_query() {
+  // The lowest line a node needs, from 0 if a node needs the init message.
+  // A node heard from within INACTIVITY_TIMEOUT_LEN that did not answer
+  // keeps the line it last asked for; a node quiet for longer has given up.
+  uint16_t from = total_lines;
+  bool reinit = false;
+  int pending = 0;
+  int complete = 0;
+  for (int i = 0; i < node_count; i++) {
+    Node &node = nodes[i];
+    if (node.state != NodeState::COMPLETE && node.state != NodeState::FAILED
+        && millis() - node.last_heard_ts > INACTIVITY_TIMEOUT_LEN) {
+      node.state = NodeState::FAILED;
+      node.error = static_cast<uint8_t>(HexTransfer::ErrorCode::INACTIVITY_TIMEOUT);
+    }
+    if (node.state == NodeState::COMPLETE) {
+      complete++;
+    }
+    else if (node.state == NodeState::NEEDS_INIT) {
+      reinit = true;
+      from = 0;
+      pending++;
+    }
+    else if (node.state != NodeState::FAILED) {
+      if (node.next_line < from) {
+        from = node.next_line;
+      }
+      pending++;
+    }
+  }
+  if (pending == 0) {
+    finish();
+    return;
+  }
+
+  // A node that gets no further, lines lost again and again or the image
+  // never checked, must not keep the others waiting
+  if (from > lowest_line || complete > complete_count) {
+    progress_ts = millis();
+  }
+  lowest_line = from;
+  complete_count = complete;
+  if (millis() - progress_ts > GATEWAY_STALL_MS) {
+    transport->out->printf("gateway: no progress for %d ms, giving up\n", GATEWAY_STALL_MS);
+    finish();
+    return;
+  }
+
+  // Lines lost: go back to the lowest, and send SET_FEC again in case a node
+  // lost that too. Nothing lost: the next window, or past EOF, the nodes are
+  // still checking the image, so ask again.
+  if (reinit) {
+    rounds++;
+    queue_init();
+    return;
+  }
+  if (from < cursor.line) {
+    rounds++;
+    #if GATEWAY_FEC_GROUP_SIZE > 0
+    queue_control(HexTransfer::ControlCode::SET_FEC, GATEWAY_FEC_GROUP_SIZE);
+    #endif
+    rewind(cursor, from);
+  }
+  query_line = cursor.line + GATEWAY_QUERY_LINES;
+  state = State::STREAMING;
+}
+
+void UpdateGateway::finish() {
+  // Report each node, and end the session: the image was for the others
+  if (rounds > 0) {
+    transport->out->printf("gateway: stream went back %d times\n", rounds);
+  }
+  for (int i = 0; i < node_count; i++) {
+    Node &node = nodes[i];
+    if (node.state == NodeState::COMPLETE) {
+      transport->out->printf("gateway: node %u complete\n", node.id);
+    }
+    else if (node.state == NodeState::FAILED) {
+      transport->out->printf("gateway: node %u failed, error %u\n", node.id, node.error);
+    }
+    else {
+      transport->out->printf("gateway: node %u incomplete at line %u\n", node.id, node.next_line);
+    }
+  }
+  session_end(transport);
+  transport = NULL;
+  state = State::IDLE;
+}
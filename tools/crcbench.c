@@ -0,0 +1,83 @@
+//******************************************************************************
+// CRCBENCH.C -- compare the FXCRC software backends on the host
+//******************************************************************************
+// Checks that every backend and fxcrc32_combine() agree with each other on a
+// random image, then times each backend over it. The Kinetis backend needs
+// the peripheral and is only checked on a T3.x.
+//
+//   cc -O2 -I include -o crcbench tools/crcbench.c src/FXCRC.c
+//   ./crcbench [SIZE_KB]
+//******************************************************************************
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "FXCRC.h"
+
+#define SECTOR_SIZE	(4096)
+
+static double now( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef uint32_t (*crc_fn)( uint32_t crc, const void *data, uint32_t count );
+
+static void bench( const char *name, crc_fn fn, const uint8_t *data, uint32_t size )
+{
+  double t0 = now(), t;
+  int runs = 0;
+  do {
+    fn( 0, data, size );
+    runs++;
+  } while ((t = now() - t0) < 0.5);
+  printf( "%-10s %8.1f MB/s\n", name, runs * (double)size / t / 1e6 );
+}
+
+// CRC32 of the image from its sector CRCs, as a device receiving sectors in
+// any order would compute it
+static uint32_t combined( crc_fn fn, const uint8_t *data, uint32_t size )
+{
+  uint32_t crc = 0, n;
+  for (uint32_t off=0; off < size; off += n) {
+    n = (size - off < SECTOR_SIZE) ? size - off : SECTOR_SIZE;
+    crc = fxcrc32_combine( crc, fn( 0, data + off, n ), n );
+  }
+  return crc;
+}
+
+int main( int argc, char **argv )
+{
+  uint32_t size = (argc > 1 ? atoi( argv[1] ) : 1024) * 1024 + 13;
+  uint8_t *data = malloc( size );
+  uint32_t crc, split;
+
+  srand( 1 );
+  for (uint32_t i=0; i < size; i++)
+    data[i] = rand();
+
+  // every backend, split anywhere, and combined sectors give the same CRC32
+  crc = fxcrc32_bitwise( 0, data, size );
+  split = size / 3 + 1;
+  if (fxcrc32_slice8( 0, data, size ) != crc
+	|| fxcrc32_slice8( fxcrc32_slice8( 0, data, split ), data + split, size - split ) != crc
+	|| fxcrc32_bitwise( fxcrc32_slice8( 0, data, split ), data + split, size - split ) != crc
+	|| combined( fxcrc32_slice8, data, size ) != crc
+	|| fxcrc32_bitwise( 0, "123456789", 9 ) != 0xCBF43926) {
+    printf( "FAIL: backends disagree\n" );
+    return 1;
+  }
+  printf( "CRC32 of %u bytes = %08X, all backends agree\n", size, crc );
+
+  bench( "bitwise", fxcrc32_bitwise, data, size );
+  bench( "slice8", fxcrc32_slice8, data, size );
+
+  double t0 = now();
+  for (int i=0; i<1000; i++)
+    fxcrc32_combine( crc, crc, SECTOR_SIZE );
+  printf( "%-10s %8.2f us per sector\n", "combine", (now() - t0) * 1e3 );
+
+  free( data );
+  return 0;
+}
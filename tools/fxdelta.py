@@ -0,0 +1,257 @@
+#!/usr/bin/env python3
+"""fxdelta.py -- make, apply and test FXDP delta patches for FlasherX
+
+A patch turns the image a device is running (its "old" image, identified by the
+build ID the device reports) into a new image. It is written as an Intel hex
+file whose data records hold the patch at FLASH_BASE_ADDR and up, and is sent
+with any FlasherX transfer method in place of the new hex file. The device
+applies it into its buffer as it arrives (see include/FXDelta.h).
+
+usage:
+  fxdelta.py buildid IMAGE.hex                  print build ID as the device does
+  fxdelta.py diff OLD.hex NEW.hex PATCH.hex     make a patch
+  fxdelta.py diff --archive DIR --build-id ID NEW.hex PATCH.hex
+                                                pick OLD from DIR by build ID
+  fxdelta.py apply OLD.hex PATCH.hex OUT.hex    apply a patch like the device
+  fxdelta.py test OLD.hex NEW.hex               make, apply and compare
+"""
+import argparse
+import binascii
+import glob
+import os
+import struct
+import sys
+
+from fxlz import read_hex, write_hex
+
+FXDP_MAGIC = b"FXDP"
+FXDP_HEADER_SIZE = 24
+FXDP_COPY, FXDP_INSERT, FXDP_RUN = 1, 2, 3
+
+KEY = 12          # bytes hashed to find a match in the old image
+MIN_COPY = 12     # shortest COPY worth emitting
+MIN_RUN = 8       # shortest RUN worth emitting
+MIN_RESYNC = 8    # shortest COPY that continues at the previous old offset
+
+
+def code_size(image):
+    """size of image as firmware_code_end() sees it (trailing 0xFF words cut)"""
+    n = (len(image) + 3) & ~3
+    image = image + b"\xff" * (n - len(image))
+    while n >= 4 and image[n - 4:n] == b"\xff\xff\xff\xff":
+        n -= 4
+    return n
+
+
+def build_id(image):
+    """(crc32, size) of image as firmware_build_id() computes it"""
+    n = code_size(image)
+    return binascii.crc32(image[:n] + b"\xff" * (n - len(image[:n]))), n
+
+
+def varint(n):
+    out = bytearray()
+    while True:
+        b = n & 0x7F
+        n >>= 7
+        if n:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return bytes(out)
+
+
+def zigzag(n):
+    return (n << 1) if n >= 0 else ((-n) << 1) - 1
+
+
+def match_len(a, ai, b, bi, limit):
+    n = 0
+    while n < limit and a[ai + n] == b[bi + n]:
+        n += 1
+    return n
+
+
+def diff(old, new):
+    """greedy COPY/INSERT/RUN encoding of new against old, returns commands"""
+    index = {}
+    for i in range(0, len(old) - KEY + 1, 2):     # Thumb code is 2-byte aligned
+        index.setdefault(old[i:i + KEY], i)
+
+    out = bytearray()
+    literals = bytearray()
+    cursor = 0                                     # mirrors the device cursor
+
+    def flush_literals():
+        if literals:
+            out.append(FXDP_INSERT)
+            out.extend(varint(len(literals)))
+            out.extend(literals)
+            literals.clear()
+
+    i = 0
+    while i < len(new):
+        limit = len(new) - i
+        # a run of one byte value (0xFF padding, zero tables)
+        run = 1
+        while run < limit and new[i + run] == new[i]:
+            run += 1
+        if run >= MIN_RUN:
+            flush_literals()
+            out.append(FXDP_RUN)
+            out.extend(varint(run))
+            out.append(new[i])
+            i += run
+            continue
+        # continue where the last COPY left off (code after a changed word)
+        best, best_at = 0, 0
+        if cursor + len(literals) < len(old):
+            at = cursor + len(literals)
+            n = match_len(old, at, new, i, min(limit, len(old) - at))
+            if n >= MIN_RESYNC:
+                best, best_at = n, at
+        # or anywhere in the old image
+        cand = index.get(new[i:i + KEY])
+        if cand is not None:
+            n = match_len(old, cand, new, i, min(limit, len(old) - cand))
+            if n > best and n >= MIN_COPY:
+                best, best_at = n, cand
+        if best:
+            flush_literals()
+            out.append(FXDP_COPY)
+            out.extend(varint(zigzag(best_at - cursor)))
+            out.extend(varint(best))
+            cursor = best_at + best
+            i += best
+        else:
+            literals.append(new[i])
+            i += 1
+    flush_literals()
+    return bytes(out)
+
+
+def make_patch(old, new):
+    old_id, old_size = build_id(old)
+    body = diff(old[:old_size], new)
+    header = FXDP_MAGIC + struct.pack("<IIIII", old_size, old_id, len(new),
+                                      binascii.crc32(new), FXDP_HEADER_SIZE + len(body))
+    return header + body
+
+
+def apply_patch(old, patch):
+    """apply patch to old like delta_feed()/delta_finish(), returns new image"""
+    if patch[:4] != FXDP_MAGIC:
+        raise ValueError("not an FXDP patch")
+    old_size, old_crc, new_size, new_crc, patch_size = struct.unpack_from("<IIIII", patch, 4)
+    if patch_size != len(patch):
+        raise ValueError("patch size mismatch")
+    old = old[:old_size] + b"\xff" * (old_size - len(old[:old_size]))
+    if binascii.crc32(old) != old_crc:
+        raise ValueError("patch does not apply to this image (build ID %08X, wants %08X)"
+                         % (binascii.crc32(old), old_crc))
+
+    def read_varint():
+        nonlocal pos
+        n = shift = 0
+        while True:
+            b = patch[pos]
+            pos += 1
+            n |= (b & 0x7F) << shift
+            shift += 7
+            if not b & 0x80:
+                return n
+
+    out = bytearray()
+    pos, cursor = FXDP_HEADER_SIZE, 0
+    while pos < len(patch):
+        op = patch[pos]
+        pos += 1
+        if op == FXDP_COPY:
+            z = read_varint()
+            cursor += (z >> 1) ^ -(z & 1)
+            n = read_varint()
+            if cursor < 0 or cursor + n > old_size:
+                raise ValueError("COPY outside old image")
+            out += old[cursor:cursor + n]
+            cursor += n
+        elif op == FXDP_INSERT:
+            n = read_varint()
+            out += patch[pos:pos + n]
+            pos += n
+        elif op == FXDP_RUN:
+            n = read_varint()
+            out += bytes([patch[pos]]) * n
+            pos += 1
+        else:
+            raise ValueError("bad command %02X at %d" % (op, pos - 1))
+    if len(out) != new_size or binascii.crc32(out) != new_crc:
+        raise ValueError("patched image does not match new image")
+    return bytes(out)
+
+
+def find_archived(archive, want):
+    for path in sorted(glob.glob(os.path.join(archive, "*.hex"))):
+        base, image = read_hex(path)
+        if build_id(image)[0] == want:
+            return path, base, image
+    sys.exit("no image with build ID %08X in %s" % (want, archive))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("buildid")
+    p.add_argument("image")
+    p = sub.add_parser("diff")
+    p.add_argument("--archive", help="directory of previously released hex files")
+    p.add_argument("--build-id", type=lambda s: int(s, 16), help="build ID reported by device")
+    p.add_argument("files", nargs="+", help="[OLD.hex] NEW.hex PATCH.hex")
+    p = sub.add_parser("apply")
+    p.add_argument("old")
+    p.add_argument("patch")
+    p.add_argument("output")
+    p = sub.add_parser("test")
+    p.add_argument("old")
+    p.add_argument("new")
+    args = ap.parse_args()
+
+    if args.cmd == "buildid":
+        _, image = read_hex(args.image)
+        crc, size = build_id(image)
+        print("%08X (%d bytes)" % (crc, size))
+
+    elif args.cmd == "diff":
+        if args.archive:
+            if args.build_id is None or len(args.files) != 2:
+                ap.error("--archive needs --build-id NEW.hex PATCH.hex")
+            old_path, _, old = find_archived(args.archive, args.build_id)
+            print("old image: %s" % old_path)
+            new_path, patch_path = args.files
+        else:
+            if len(args.files) != 3:
+                ap.error("diff needs OLD.hex NEW.hex PATCH.hex")
+            old_path, new_path, patch_path = args.files
+            _, old = read_hex(old_path)
+        base, new = read_hex(new_path)
+        patch = make_patch(old, new)
+        write_hex(patch_path, base, patch)
+        print("%s: %d bytes (%.1f%% of %d byte image)"
+              % (patch_path, len(patch), 100.0 * len(patch) / len(new), len(new)))
+
+    elif args.cmd == "apply":
+        _, old = read_hex(args.old)
+        base, patch = read_hex(args.patch)
+        write_hex(args.output, base, apply_patch(old, patch))
+
+    elif args.cmd == "test":
+        _, old = read_hex(args.old)
+        _, new = read_hex(args.new)
+        patch = make_patch(old, new)
+        if apply_patch(old, patch) != new:
+            sys.exit("FAIL: patched image differs from new image")
+        print("OK: %d byte patch, %.1f%% of %d byte image"
+              % (len(patch), 100.0 * len(patch) / len(new), len(new)))
+
+
+if __name__ == "__main__":
+    main()
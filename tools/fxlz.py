@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+"""fxlz.py -- compress a Teensy Intel hex file into an FXLZ image for FlasherX
+
+The output is an Intel hex file whose data records hold the FXLZ stream at
+FLASH_BASE_ADDR and up, so it can be sent with any FlasherX transfer method in
+place of the original hex file. The device keeps the stream compressed in its
+buffer and decompresses it in flash_move_lz(). See include/FXLZ.h for the format.
+
+usage: fxlz.py [-w BITS] [--check] in.hex out.hex
+"""
+import argparse
+import binascii
+import struct
+import sys
+
+FXLZ_MAGIC = b"FXLZ"
+FXLZ_HEADER_SIZE = 20
+MIN_MATCH = 3
+MAX_MATCH = 10 + 255
+MAX_LITERALS = 128
+MAX_CHAIN = 64
+
+
+def read_hex(path):
+    """return (base, bytes) for an Intel hex file, gaps filled with 0xFF"""
+    mem = {}
+    upper = 0
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            line = line.strip()
+            if not line:
+                continue
+            if line[0] != ":":
+                raise ValueError("%s:%d: missing ':'" % (path, lineno))
+            rec = bytes.fromhex(line[1:])
+            if sum(rec) & 0xFF:
+                raise ValueError("%s:%d: bad checksum" % (path, lineno))
+            count, addr, code = rec[0], (rec[1] << 8) | rec[2], rec[3]
+            data = rec[4:4 + count]
+            if code == 0:
+                for i, b in enumerate(data):
+                    mem[upper + addr + i] = b
+            elif code == 1:
+                break
+            elif code == 2:
+                upper = ((data[0] << 8) | data[1]) << 4
+            elif code == 4:
+                upper = ((data[0] << 8) | data[1]) << 16
+    if not mem:
+        raise ValueError("%s: no data records" % path)
+    lo, hi = min(mem), max(mem) + 1
+    base = lo & 0xF0000000   # FLASH_BASE_ADDR: 0 (T3.x/TLC) or 0x60000000 (T4.x)
+    image = bytearray(b"\xff" * (hi - base))
+    for a, b in mem.items():
+        image[a - base] = b
+    return base, bytes(image)
+
+
+def write_hex(path, base, data, width=16, ranges=None):
+    """write data at address base as Intel hex with extended linear records
+
+    if ranges is given, only the (offset, length) ranges of data are written
+    """
+    def record(code, addr, payload):
+        rec = bytes([len(payload), (addr >> 8) & 0xFF, addr & 0xFF, code]) + payload
+        return ":%s%02X\n" % (rec.hex().upper(), (-sum(rec)) & 0xFF)
+
+    with open(path, "w") as f:
+        upper = None
+        if ranges is None:
+            ranges = [(0, len(data))]
+        chunks = [(o, min(start + n, len(data))) for start, n in ranges
+                  for o in range(start, min(start + n, len(data)), width)]
+        for off, end in chunks:
+            addr = base + off
+            if upper != addr >> 16:
+                upper = addr >> 16
+                f.write(record(4, 0, struct.pack(">H", upper)))
+            chunk = data[off:min(off + width, end)]
+            if (addr & 0xFFFF) + len(chunk) > 0x10000:
+                raise ValueError("record crosses 64K boundary")
+            f.write(record(0, addr & 0xFFFF, chunk))
+        f.write(record(1, 0, b""))
+
+
+def compress(data, window_bits):
+    """greedy LZ77 with hash chains, returns token stream (no header)"""
+    window = 1 << window_bits
+    out = bytearray()
+    literals = bytearray()
+    head = {}
+    prev = [0] * len(data)
+
+    def flush_literals():
+        for i in range(0, len(literals), MAX_LITERALS):
+            run = literals[i:i + MAX_LITERALS]
+            out.append(len(run) - 1)
+            out.extend(run)
+        literals.clear()
+
+    def insert(i):
+        if i + MIN_MATCH <= len(data):
+            key = data[i:i + MIN_MATCH]
+            prev[i] = head.get(key, -1)
+            head[key] = i
+
+    i = 0
+    n = len(data)
+    while i < n:
+        best_len, best_dist = 0, 0
+        if i + MIN_MATCH <= n:
+            cand = head.get(data[i:i + MIN_MATCH], -1)
+            chain = 0
+            limit = min(MAX_MATCH, n - i)
+            while cand >= 0 and i - cand <= window and chain < MAX_CHAIN:
+                length = 0
+                while length < limit and data[cand + length] == data[i + length]:
+                    length += 1
+                if length > best_len:
+                    best_len, best_dist = length, i - cand
+                    if length == limit:
+                        break
+                cand = prev[cand]
+                chain += 1
+        if best_len >= MIN_MATCH:
+            flush_literals()
+            d = best_dist - 1
+            if best_len >= 10:
+                out += bytes([0xF0 | (d >> 8), d & 0xFF, best_len - 10])
+            else:
+                out += bytes([0x80 | ((best_len - 3) << 4) | (d >> 8), d & 0xFF])
+            for j in range(i, i + best_len):
+                insert(j)
+            i += best_len
+        else:
+            literals.append(data[i])
+            insert(i)
+            i += 1
+    flush_literals()
+    return bytes(out)
+
+
+def decompress(stream):
+    """decode a complete FXLZ stream (with header), mirrors lz_decode()"""
+    if stream[:4] != FXLZ_MAGIC:
+        raise ValueError("not an FXLZ stream")
+    window = 1 << stream[4]
+    raw_size, packed_size, crc = struct.unpack_from("<III", stream, 8)
+    out = bytearray()
+    i = FXLZ_HEADER_SIZE
+    while len(out) < raw_size:
+        t = stream[i]
+        i += 1
+        if t < 0x80:
+            out += stream[i:i + t + 1]
+            i += t + 1
+        else:
+            dist = (((t & 0x0F) << 8) | stream[i]) + 1
+            i += 1
+            n = ((t >> 4) & 7) + 3
+            if n == 10:
+                n += stream[i]
+                i += 1
+            if dist > len(out) or dist > window:
+                raise ValueError("match outside window")
+            for _ in range(n):
+                out.append(out[-dist])
+    if i != packed_size or len(out) != raw_size:
+        raise ValueError("stream length mismatch")
+    if binascii.crc32(out) != crc:
+        raise ValueError("CRC mismatch")
+    return bytes(out)
+
+
+def pack(image, window_bits):
+    tokens = compress(image, window_bits)
+    header = FXLZ_MAGIC + struct.pack("<B3xIII", window_bits, len(image),
+                                      FXLZ_HEADER_SIZE + len(tokens),
+                                      binascii.crc32(image))
+    return header + tokens
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("-w", "--window-bits", type=int, default=12,
+                    help="log2 of match window (12 for T3.x/T4.x, 10 for TLC)")
+    ap.add_argument("--check", action="store_true",
+                    help="decompress the result and compare with the input")
+    ap.add_argument("input")
+    ap.add_argument("output")
+    args = ap.parse_args()
+    if not 1 <= args.window_bits <= 12:
+        ap.error("window bits must be 1-12")
+
+    base, image = read_hex(args.input)
+    stream = pack(image, args.window_bits)
+    if args.check and decompress(stream) != image:
+        sys.exit("check failed: decompressed image differs")
+    write_hex(args.output, base, stream)
+    print("%s: %d bytes -> %d bytes (%.1f%%), base %08X" % (
+        args.output, len(image), len(stream), 100.0 * len(stream) / len(image), base))
+
+
+if __name__ == "__main__":
+    main()
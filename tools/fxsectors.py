@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+"""fxsectors.py -- send only the flash sectors that differ from the running image
+
+Before a transfer, the PC asks the device for a CRC32 of each sector of the
+firmware it is running (QUERY_SECTOR_DIGESTS, answered with one SECTOR_DIGEST
+per sector). This tool compares them with the sectors of the new image and
+writes an Intel hex file holding only the sectors that changed. The PC then
+starts the transfer with that file, sends a COPY_SECTORS message for each
+range printed, so the device copies those sectors from program flash into its
+buffer, and sends the lines as usual.
+
+The digest file has one "SECTOR CRC32" pair per line, in decimal and hex, as
+the SECTOR_DIGEST responses report them or as the digests command prints them.
+
+The manifest command prints the CRC32 of each sector of a hex file about to be
+sent, in the same form. The PC sends each as a SECTOR_CRC message during the
+transfer; the device then checks its buffer sector by sector at EOF and asks
+for the lines of a bad sector again instead of failing the transfer. When only
+changed sectors are sent, use the manifest of the full new image, since that
+is what the buffer holds once the copies are done.
+
+usage:
+  fxsectors.py digests [-s SIZE] IMAGE.hex        print digests as the device does
+  fxsectors.py plan [-s SIZE] NEW.hex DIGESTS OUT.hex
+                                                  write changed sectors, print copies
+  fxsectors.py manifest [-s SIZE] SEND.hex        print the manifest of a hex file
+"""
+import argparse
+import binascii
+import sys
+
+from fxlz import read_hex, write_hex
+from fxdelta import code_size
+
+# FLASH_SECTOR_SIZE: 1024 (TLC), 2048 (T3.0-3.2), 4096 (T3.5/3.6/T4.x)
+DEFAULT_SECTOR_SIZE = 4096
+
+
+def sectors(image, size):
+    """split image into sectors, the last one padded with 0xFF"""
+    n = (len(image) + size - 1) // size
+    image = image + b"\xff" * (n * size - len(image))
+    return [image[i * size:(i + 1) * size] for i in range(n)]
+
+
+def digests(image, size):
+    """{sector: crc32} for the running image, as the device reports them"""
+    running = image[:code_size(image)]
+    return {i: binascii.crc32(s) for i, s in enumerate(sectors(running, size))}
+
+
+def manifest(image, size):
+    """{sector: crc32} of every sector of image, as sent"""
+    return {i: binascii.crc32(s) for i, s in enumerate(sectors(image, size))}
+
+
+def read_digests(path):
+    """{sector: crc32} from a file of "SECTOR CRC32" lines"""
+    result = {}
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) >= 2 and not fields[0].startswith("#"):
+                result[int(fields[0], 0)] = int(fields[1], 16)
+    return result
+
+
+def plan(image, old, size):
+    """return (changed, copies), both lists of (first sector, count)"""
+    changed, copies = [], []
+    for i, s in enumerate(sectors(image, size)):
+        same = old.get(i) == binascii.crc32(s)
+        runs = copies if same else changed
+        if runs and runs[-1][0] + runs[-1][1] == i:
+            runs[-1] = (runs[-1][0], runs[-1][1] + 1)
+        else:
+            runs.append((i, 1))
+    return changed, copies
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("digests", help="print sector digests of a running image")
+    p.add_argument("-s", "--sector-size", type=int, default=DEFAULT_SECTOR_SIZE)
+    p.add_argument("image")
+    p = sub.add_parser("manifest", help="print sector CRCs of a hex file to send")
+    p.add_argument("-s", "--sector-size", type=int, default=DEFAULT_SECTOR_SIZE)
+    p.add_argument("image")
+    p = sub.add_parser("plan", help="write changed sectors, print sectors to copy")
+    p.add_argument("-s", "--sector-size", type=int, default=DEFAULT_SECTOR_SIZE)
+    p.add_argument("new")
+    p.add_argument("digests")
+    p.add_argument("out")
+    args = ap.parse_args()
+    size = args.sector_size
+
+    if args.cmd in ("digests", "manifest"):
+        _, image = read_hex(args.image)
+        crcs = digests if args.cmd == "digests" else manifest
+        for i, crc in crcs(image, size).items():
+            print("%d %08X" % (i, crc))
+        return 0
+
+    base, image = read_hex(args.new)
+    changed, copies = plan(image, read_digests(args.digests), size)
+    write_hex(args.out, base, image,
+              ranges=[(first * size, count * size) for first, count in changed])
+    for first, count in copies:
+        print("copy %d %d" % (first, count))
+    sent = sum(count for _, count in changed)
+    total = sent + sum(count for _, count in copies)
+    print("%d of %d sectors changed" % (sent, total), file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,231 @@
+#!/usr/bin/env python3
+"""fxserial.py -- send new firmware to FlasherX over USB or UART Serial, fast
+
+The image is sent in binary frames with a sequence number and CRC32 each, as
+many as the device has room for (its credits), instead of as hex lines echoed
+one at a time. See include/FXFrame.h for the protocol. Any hex file a FlasherX
+transfer accepts can be sent: plain, FXLZ (fxlz.py) or FXDP (fxdelta.py).
+
+If the device has the image in its SD cache (it keeps the images it flashed),
+it answers FRAME_START with FRAME_CACHED and loads the image from the card, and
+nothing more is sent until its FRAME_RESULT.
+
+Text the device prints during the update is shown on stderr. Once the device
+has checked the image, the update is committed if -y was given or the user
+agrees; otherwise it is aborted and the device reboots into the old firmware.
+
+With --direct (DIRECT_MODE, Serial1 only), the device is first asked for a
+direct update (menu input 5), and the image is written straight over the old
+firmware by the updater in RAM, with no buffer (see include/FXDirect.h). It is
+committed as soon as the device accepts it, since the old firmware is gone. If
+it is rejected, or the link fails, run the same command again.
+
+With --part NAME, IMAGE is instead a raw data file, sent to the device's data
+partition NAME (see include/FXPart.h): it is written in place from the start
+of the partition, and the application keeps running after the commit.
+
+usage: fxserial.py [-b BAUD] [-y] [--direct | --part NAME] PORT IMAGE
+
+Requires pyserial (pip install pyserial).
+"""
+import argparse
+import binascii
+import struct
+import sys
+import time
+
+from fxlz import FXLZ_MAGIC, read_hex
+from fxdelta import FXDP_MAGIC
+
+SOF = 0xA5
+MAX_PAYLOAD = 512
+START, DATA, END, COMMIT, ABORT = 0x01, 0x02, 0x03, 0x04, 0x05
+ACK, NAK, RESULT, CACHED = 0x81, 0x82, 0x83, 0x84
+INGEST_EOF = 1
+DIRECT_INPUT = b"5\n"  # FlasherX menu: direct update (USER_DIRECT)
+RESEND_TIMEOUT = 0.5    # seconds without an ACK before going back
+RESULT_TIMEOUT = 60     # seconds for the device to check the image
+
+STATUS = {
+    2: "invalid hex record", 3: "image too large for buffer",
+    4: "flash write error", 5: "patch out of order or failed",
+    6: "image failed FSEC/FLASH_ID/compressed check",
+    7: "cached image failed its CRC32 check, send it again",
+    16: "image size mismatch", 17: "image CRC32 mismatch",
+    18: "frames out of sequence", 19: "no such data partition, or it is in use",
+}
+
+
+def frame(ftype, seq, payload=b""):
+    body = struct.pack("<BHH", ftype, seq & 0xFFFF, len(payload)) + payload
+    return bytes([SOF]) + body + struct.pack("<I", binascii.crc32(body))
+
+
+class Reader:
+    """split device output into frames and text lines"""
+
+    def __init__(self, port):
+        self.port = port
+        self.buf = bytearray()
+        self.text = bytearray()
+
+    def _text(self, b):
+        self.text += b
+        while b"\n" in self.text:
+            line, _, self.text = self.text.partition(b"\n")
+            print("device: " + line.decode("ascii", "replace").rstrip(), file=sys.stderr)
+
+    def frames(self):
+        """return the complete frames received so far, as (type, seq, payload)"""
+        self.buf += self.port.read(self.port.in_waiting or 1)
+        out = []
+        while self.buf:
+            i = self.buf.find(SOF)
+            if i < 0:
+                self._text(bytes(self.buf))
+                self.buf.clear()
+                break
+            if i > 0:
+                self._text(bytes(self.buf[:i]))
+                del self.buf[:i]
+            if len(self.buf) < 6:
+                break
+            ftype, seq, n = struct.unpack_from("<BHH", self.buf, 1)
+            if n > 8:                   # device frames are short
+                self._text(bytes(self.buf[:1]))
+                del self.buf[:1]
+                continue
+            if len(self.buf) < 10 + n:
+                break
+            body = bytes(self.buf[1:6 + n])
+            crc, = struct.unpack_from("<I", self.buf, 6 + n)
+            if crc != binascii.crc32(body):
+                self._text(bytes(self.buf[:1]))
+                del self.buf[:1]
+                continue
+            out.append((ftype, seq, body[5:]))
+            del self.buf[:10 + n]
+        return out
+
+
+def send(port, frames):
+    """send frames as the device's credits allow; return the FRAME_RESULT status
+
+    frames is cut to FRAME_START if the device has the image cached, so the
+    frame after them is numbered len(frames) either way.
+    """
+    reader = Reader(port)
+    acked, sent, credits = 0, 0, 1     # room for FRAME_START until the first ACK
+    t0 = last_ack = shown = time.monotonic()
+    result = None
+    while True:
+        while sent < len(frames) and sent < acked + credits:
+            port.write(frames[sent])
+            sent += 1
+        for ftype, seq, payload in reader.frames():
+            if ftype in (ACK, NAK):
+                # seq is the next frame expected, as 16 bits of our index
+                ahead = (seq - acked) & 0xFFFF
+                if ahead <= sent - acked:
+                    acked += ahead
+                credits, = struct.unpack("<H", payload)
+                if ahead:
+                    last_ack = time.monotonic()
+                if ftype == NAK:
+                    sent = acked
+            elif ftype == RESULT:
+                result = payload[0]
+            elif ftype == CACHED and len(frames) > 1:
+                # the device ignores any frames after START sent already
+                del frames[1:]
+                sent = min(sent, 1)
+                print("device has the image cached, loading it from SD", file=sys.stderr)
+        now = time.monotonic()
+        if result is not None:
+            break
+        if acked < len(frames) and now - last_ack > RESEND_TIMEOUT:
+            sent = acked                # no ACK, go back
+            last_ack = now
+        elif acked == len(frames) and now - last_ack > RESULT_TIMEOUT:
+            raise TimeoutError("no FRAME_RESULT from device")
+        if now - shown > 0.5:
+            print("\r%d/%d frames" % (acked, len(frames)), end="", file=sys.stderr)
+            shown = now
+    print("\rsent %d frames in %.1f s" % (len(frames), time.monotonic() - t0),
+          file=sys.stderr)
+    return result
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    ap.add_argument("-b", "--baud", type=int, default=115200,
+                    help="UART baud rate (ignored for USB)")
+    ap.add_argument("-y", "--yes", action="store_true",
+                    help="commit without asking once the device accepts the image")
+    ap.add_argument("--direct", action="store_true",
+                    help="stream over the old firmware, no buffer (DIRECT_MODE)")
+    ap.add_argument("--part", metavar="NAME",
+                    help="send raw data file IMAGE to data partition NAME")
+    ap.add_argument("port")
+    ap.add_argument("image")
+    args = ap.parse_args()
+
+    import serial
+
+    if args.direct and args.part:
+        print("--direct and --part cannot both be given", file=sys.stderr)
+        return 1
+    if args.part:
+        # data, not an image: stored as it is, so never taken for FXLZ or FXDP
+        with open(args.image, "rb") as f:
+            image = bytearray(f.read())
+        image += b"\xff" * (-len(image) % 8)
+    else:
+        _, image = read_hex(args.image)
+        # flash_write_block() writes whole 8-byte units, so pad like erased flash;
+        # a patch is consumed exactly and must not be padded
+        if image[:4] != FXDP_MAGIC:
+            image += b"\xff" * (-len(image) % 8)
+    if args.direct and image[:4] in (FXLZ_MAGIC, FXDP_MAGIC):
+        print("only a plain image can be sent with --direct", file=sys.stderr)
+        return 1
+
+    start = struct.pack("<II", len(image), binascii.crc32(image))
+    if args.part:
+        start += args.part.encode()
+    frames = [frame(START, 0, start)]
+    for off in range(0, len(image), MAX_PAYLOAD):
+        frames.append(frame(DATA, len(frames), image[off:off + MAX_PAYLOAD]))
+    frames.append(frame(END, len(frames)))
+
+    port = serial.Serial(args.port, args.baud, timeout=0.05)
+    if args.direct:
+        # FRAME_START is sent again until the updater answers
+        port.write(DIRECT_INPUT)
+        time.sleep(0.2)
+    status = send(port, frames)
+    if status != INGEST_EOF and args.direct:
+        print("device rejected image: %s" % STATUS.get(status, status), file=sys.stderr)
+        print("if its updater erased any of the old firmware, it is still waiting: "
+              "send the image again", file=sys.stderr)
+        return 1
+    if status != INGEST_EOF:
+        print("device rejected image: %s" % STATUS.get(status, status), file=sys.stderr)
+        port.write(frame(ABORT, len(frames)))
+        return 1
+    what = "partition %s" % args.part if args.part else "firmware"
+    if not args.yes and not args.direct and input("device accepted image, flash %s? [y/N] " % what).lower() != "y":
+        port.write(frame(ABORT, len(frames)))
+        print("aborted", file=sys.stderr)
+        return 1
+    port.write(frame(COMMIT, len(frames)))
+    port.flush()
+    if args.part:
+        print("committed, partition %s updated, device keeps running" % args.part, file=sys.stderr)
+    else:
+        print("committed, device is flashing and will reboot", file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())